@@ -283,7 +283,8 @@ event_wait(struct event_base *evb, int timeout)
         }
 
         if (errno == EINTR) {
-            continue;
+            /* return to the caller to act on the signal, like a reload */
+            return 0;
         }
 
         log_error("epoll wait on e %d with %d events failed: %s", ep, nevent,
@@ -298,7 +299,7 @@ void
 event_loop_stats(event_stats_cb_t cb, void *arg)
 {
     struct stats *st = arg;
-    int status, ep;
+    int status, ep, sd;
     struct epoll_event ev;
 
     ep = epoll_create(1);
@@ -307,12 +308,13 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         return;
     }
 
-    ev.data.fd = st->sd;
+    sd = st->sd;
+    ev.data.fd = sd;
     ev.events = EPOLLIN;
 
-    status = epoll_ctl(ep, EPOLL_CTL_ADD, st->sd, &ev);
+    status = epoll_ctl(ep, EPOLL_CTL_ADD, sd, &ev);
     if (status < 0) {
-        log_error("epoll ctl on e %d sd %d failed: %s", ep, st->sd,
+        log_error("epoll ctl on e %d sd %d failed: %s", ep, sd,
                   strerror(errno));
         goto error;
     }
@@ -320,7 +322,33 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
     for (;;) {
         int n;
 
-        n = epoll_wait(ep, &ev, 1, st->interval);
+        /*
+         * switch between st->sd and an http client being read; a client
+         * leaves the epoll instance when it is closed
+         */
+        if (stats_loop_sd(st) != sd) {
+            if (sd == st->sd) {
+                status = epoll_ctl(ep, EPOLL_CTL_DEL, sd, NULL);
+                if (status < 0) {
+                    log_error("epoll ctl on e %d sd %d failed: %s", ep, sd,
+                              strerror(errno));
+                    goto error;
+                }
+            }
+
+            sd = stats_loop_sd(st);
+            ev.data.fd = sd;
+            ev.events = EPOLLIN;
+
+            status = epoll_ctl(ep, EPOLL_CTL_ADD, sd, &ev);
+            if (status < 0) {
+                log_error("epoll ctl on e %d sd %d failed: %s", ep, sd,
+                          strerror(errno));
+                goto error;
+            }
+        }
+
+        n = epoll_wait(ep, &ev, 1, stats_loop_timeout(st));
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -330,6 +358,11 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
             break;
         }
 
+        /* the new process of an upgrade accepts on st->sd */
+        if (st->handoff) {
+            break;
+        }
+
         cb(st, &n);
     }
 
@@ -29,7 +29,63 @@
 typedef int (*event_cb_t)(void *, uint32_t);
 typedef void (*event_stats_cb_t)(void *, void *);
 
-#ifdef NC_HAVE_KQUEUE
+#ifdef NC_HAVE_IO_URING
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct event_conn {
+    struct conn         *c;           /* connection (ref) */
+    uint32_t            gen;          /* poll generation */
+    uint32_t            events;       /* poll events armed */
+
+    uint32_t            rgen;         /* recv generation */
+    int                 rhead;        /* first buffer id queued, or -1 */
+    int                 rtail;        /* last buffer id queued, or -1 */
+    uint32_t            roff;         /* offset of the data left in rhead */
+    int                 rerr;         /* errno the recv failed with */
+    unsigned            urecv:1;      /* recv completes on the ring? */
+    unsigned            reof:1;       /* recv hit eof? */
+};
+
+struct event_rbuf {
+    uint32_t            len;          /* # bytes received */
+    int                 next;         /* next buffer id queued, or -1 */
+};
+
+struct event_base {
+    int                 ring;         /* io_uring descriptor */
+
+    void                *sq_ring;     /* submission ring mapping */
+    size_t              sq_ring_size; /* submission ring mapping size */
+    uint32_t            *sq_head;     /* submission ring head (kernel) */
+    uint32_t            *sq_tail;     /* submission ring tail */
+    uint32_t            sq_mask;      /* submission ring mask */
+    uint32_t            sq_entries;   /* # submission ring entries */
+    struct io_uring_sqe *sqe;         /* sqe[] - submission entries */
+    size_t              sqe_size;     /* sqe[] mapping size */
+    uint32_t            nsubmit;      /* # sqe queued but not submitted */
+
+    void                *cq_ring;     /* completion ring mapping */
+    size_t              cq_ring_size; /* completion ring mapping size */
+    uint32_t            *cq_head;     /* completion ring head */
+    uint32_t            *cq_tail;     /* completion ring tail (kernel) */
+    uint32_t            cq_mask;      /* completion ring mask */
+    struct io_uring_cqe *cqe;         /* cqe[] - completion entries */
+
+    struct event_conn   *conn;        /* conn[] - indexed by descriptor */
+    int                 nconn;        /* # conn */
+
+    void                *rbuf_ring;   /* provided buffer ring of rbuf[] */
+    uint16_t            rbuf_tail;    /* provided buffer ring tail */
+    uint8_t             *rbuf;        /* rbuf[] - recv buffers */
+    struct event_rbuf   *rbuf_info;   /* rbuf_info[] - indexed by buffer id */
+    unsigned            urecv:1;      /* recv completes on the ring? */
+
+    event_cb_t          cb;           /* event callback */
+};
+
+#elif NC_HAVE_KQUEUE
 
 struct event_base {
     int           kq;          /* kernel event queue descriptor */
@@ -83,6 +139,9 @@ int event_del_out(struct event_base *evb, struct conn *c);
 int event_add_conn(struct event_base *evb, struct conn *c);
 int event_del_conn(struct event_base *evb, struct conn *c);
 int event_wait(struct event_base *evb, int timeout);
+#ifdef NC_HAVE_IO_URING
+ssize_t event_recv(struct event_base *evb, struct conn *c, void *buf, size_t size);
+#endif
 void event_loop_stats(event_stats_cb_t cb, void *arg);
 
 #endif /* _NC_EVENT_H */
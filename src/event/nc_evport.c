@@ -273,7 +273,12 @@ event_wait(struct event_base *evb, int timeout)
          */
         status = port_getn(evp, event, nevent, &nreturned, tsp);
         if (status < 0) {
-            if (errno == EINTR || errno == EAGAIN) {
+            if (errno == EINTR) {
+                /* return to the caller to act on the signal, like a reload */
+                return 0;
+            }
+
+            if (errno == EAGAIN) {
                 continue;
             }
 
@@ -352,7 +357,7 @@ void
 event_loop_stats(event_stats_cb_t cb, void *arg)
 {
     struct stats *st = arg;
-    int status, evp;
+    int status, evp, sd;
     port_event_t event;
     struct timespec ts, *tsp;
 
@@ -362,25 +367,49 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         return;
     }
 
-    status = port_associate(evp, PORT_SOURCE_FD, st->sd, POLLIN, NULL);
+    sd = st->sd;
+    status = port_associate(evp, PORT_SOURCE_FD, sd, POLLIN, NULL);
     if (status < 0) {
-        log_error("port associate on evp %d sd %d failed: %s", evp, st->sd,
+        log_error("port associate on evp %d sd %d failed: %s", evp, sd,
                   strerror(errno));
         goto error;
     }
 
-    /* port_getn should block indefinitely if st->interval < 0 */
-    if (st->interval < 0) {
-        tsp = NULL;
-    } else {
-        tsp = &ts;
-        tsp->tv_sec = st->interval / 1000LL;
-        tsp->tv_nsec = (st->interval % 1000LL) * 1000000LL;
-    }
-
-
     for (;;) {
         unsigned int nreturned = 1;
+        int timeout;
+
+        /*
+         * switch between st->sd and an http client being read; a client
+         * is dissociated from the port when it is closed
+         */
+        if (stats_loop_sd(st) != sd) {
+            if (sd == st->sd) {
+                status = port_dissociate(evp, PORT_SOURCE_FD, sd);
+                if (status < 0) {
+                    log_error("port dissociate evp %d sd %d failed: %s", evp,
+                              sd, strerror(errno));
+                }
+            }
+
+            sd = stats_loop_sd(st);
+            status = port_associate(evp, PORT_SOURCE_FD, sd, POLLIN, NULL);
+            if (status < 0) {
+                log_error("port associate on evp %d sd %d failed: %s", evp,
+                          sd, strerror(errno));
+                goto error;
+            }
+        }
+
+        /* port_getn should block indefinitely if the timeout < 0 */
+        timeout = stats_loop_timeout(st);
+        if (timeout < 0) {
+            tsp = NULL;
+        } else {
+            tsp = &ts;
+            tsp->tv_sec = timeout / 1000LL;
+            tsp->tv_nsec = (timeout % 1000LL) * 1000000LL;
+        }
 
         status = port_getn(evp, &event, 1, &nreturned, tsp);
         if (status != NC_OK) {
@@ -399,13 +428,18 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
 
         if (nreturned == 1) {
             /* re-associate monitoring descriptor with the port */
-            status = port_associate(evp, PORT_SOURCE_FD, st->sd, POLLIN, NULL);
+            status = port_associate(evp, PORT_SOURCE_FD, sd, POLLIN, NULL);
             if (status < 0) {
-                log_error("port associate on evp %d sd %d failed: %s", evp, st->sd,
+                log_error("port associate on evp %d sd %d failed: %s", evp, sd,
                           strerror(errno));
             }
         }
 
+        /* the new process of an upgrade accepts on st->sd */
+        if (st->handoff) {
+            break;
+        }
+
         cb(st, &nreturned);
     }
 
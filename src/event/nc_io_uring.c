@@ -0,0 +1,1112 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+
+#ifdef NC_HAVE_IO_URING
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring backend receives on client and server connections through
+ * completions, and drives the remaining readiness notification through
+ * multishot IORING_OP_POLL_ADD requests.
+ *
+ * Every client and server connection has a multishot IORING_OP_RECV
+ * armed, which receives into buffers the kernel picks from a provided
+ * buffer ring registered with the io_uring. A completion appends its
+ * buffer to the queue of the connection and is reported as EVENT_READ;
+ * conn_recv() then copies the queued data out with event_recv() and
+ * hands each drained buffer back to the ring. So, the readiness poll and
+ * the read() per recv are replaced by completions that are reaped in the
+ * same loop. Writes remain writev() on the connection and are driven by
+ * a POLLOUT poll, as are the proxy listeners and the channels, which
+ * keep their own read path.
+ *
+ * Poll, recv and cancel requests are only queued in the submission ring
+ * by event_add_* and event_del_*, and are submitted together with the
+ * wait for completions in a single io_uring_enter() call per
+ * event_wait(). So, a loop iteration that touches hundreds of
+ * connections costs one syscall for event handling, instead of one
+ * epoll_ctl() per state change plus the epoll_wait() and the reads.
+ *
+ * Every request carries the descriptor and a per-descriptor generation in
+ * its user_data. Disarming a request bumps its generation, so that
+ * completions of requests that were removed (or whose descriptor was
+ * closed and reused) in the same iteration are recognized as stale and
+ * dropped; a stale recv completion still returns its buffer to the ring.
+ *
+ * When the buffer ring cannot be registered (kernels before 5.19) or the
+ * kernel rejects the multishot recv (before 6.0), the backend falls back
+ * to a POLLIN poll and read() on the connection.
+ */
+
+#define EVENT_GEN_MASK          0x7fffffff
+#define EVENT_UD_RECV_FLAG      ((uint64_t)1 << 63)
+
+#define EVENT_UD(_fd, _gen)     \
+    ((((uint64_t)(_gen) & EVENT_GEN_MASK) << 32) | (uint32_t)(_fd))
+#define EVENT_UD_RECV(_fd, _gen) (EVENT_UD(_fd, _gen) | EVENT_UD_RECV_FLAG)
+#define EVENT_UD_IS_RECV(_ud)   (((_ud) & EVENT_UD_RECV_FLAG) != 0)
+#define EVENT_UD_FD(_ud)        ((int)((_ud) & 0xffffffff))
+#define EVENT_UD_GEN(_ud)       ((uint32_t)((_ud) >> 32) & EVENT_GEN_MASK)
+#define EVENT_UD_NONE           0
+
+#define EVENT_NRBUF             256     /* # recv buffers, a power of 2 */
+#define EVENT_RBUF_SIZE         8192    /* recv buffer size */
+#define EVENT_RBUF_GROUP        0       /* recv buffer group id */
+
+#define EVENT_POLL_IN           (POLLIN)
+#define EVENT_POLL_INOUT        (POLLIN | POLLOUT)
+
+static int
+io_uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int ring, uint32_t to_submit, uint32_t min_complete,
+               uint32_t flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ring, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int
+io_uring_register(int ring, uint32_t opcode, void *arg, uint32_t nargs)
+{
+    return (int)syscall(__NR_io_uring_register, ring, opcode, arg, nargs);
+}
+
+static void
+event_unmap(struct event_base *evb)
+{
+    if (evb->sqe != NULL) {
+        munmap(evb->sqe, evb->sqe_size);
+        evb->sqe = NULL;
+    }
+
+    if (evb->cq_ring != NULL && evb->cq_ring != evb->sq_ring) {
+        munmap(evb->cq_ring, evb->cq_ring_size);
+    }
+    evb->cq_ring = NULL;
+
+    if (evb->sq_ring != NULL) {
+        munmap(evb->sq_ring, evb->sq_ring_size);
+        evb->sq_ring = NULL;
+    }
+}
+
+static int
+event_map(struct event_base *evb, const struct io_uring_params *p)
+{
+    uint8_t *sq, *cq;
+    uint32_t *sq_array, i;
+
+    evb->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    evb->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        evb->sq_ring_size = MAX(evb->sq_ring_size, evb->cq_ring_size);
+        evb->cq_ring_size = evb->sq_ring_size;
+    }
+
+    sq = mmap(NULL, evb->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, evb->ring, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        log_error("mmap of sq ring on u %d failed: %s", evb->ring,
+                  strerror(errno));
+        return -1;
+    }
+    evb->sq_ring = sq;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, evb->cq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, evb->ring, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            log_error("mmap of cq ring on u %d failed: %s", evb->ring,
+                      strerror(errno));
+            return -1;
+        }
+    }
+    evb->cq_ring = cq;
+
+    evb->sqe_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    evb->sqe = mmap(NULL, evb->sqe_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, evb->ring, IORING_OFF_SQES);
+    if (evb->sqe == MAP_FAILED) {
+        evb->sqe = NULL;
+        log_error("mmap of sqes on u %d failed: %s", evb->ring,
+                  strerror(errno));
+        return -1;
+    }
+
+    evb->sq_head = (uint32_t *)(sq + p->sq_off.head);
+    evb->sq_tail = (uint32_t *)(sq + p->sq_off.tail);
+    evb->sq_mask = *(uint32_t *)(sq + p->sq_off.ring_mask);
+    evb->sq_entries = p->sq_entries;
+
+    /* sqe are always consumed in order, so the index array is an identity */
+    sq_array = (uint32_t *)(sq + p->sq_off.array);
+    for (i = 0; i < p->sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    evb->cq_head = (uint32_t *)(cq + p->cq_off.head);
+    evb->cq_tail = (uint32_t *)(cq + p->cq_off.tail);
+    evb->cq_mask = *(uint32_t *)(cq + p->cq_off.ring_mask);
+    evb->cqe = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    return 0;
+}
+
+/* Hand recv buffer bid back to the kernel through the provided buffer ring */
+static void
+event_rbuf_put(struct event_base *evb, int bid)
+{
+    struct io_uring_buf_ring *br = evb->rbuf_ring;
+    struct io_uring_buf *buf;
+
+    ASSERT(bid >= 0 && bid < EVENT_NRBUF);
+
+    buf = &br->bufs[evb->rbuf_tail & (EVENT_NRBUF - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(evb->rbuf + (size_t)bid * EVENT_RBUF_SIZE);
+    buf->len = EVENT_RBUF_SIZE;
+    buf->bid = (uint16_t)bid;
+
+    evb->rbuf_tail++;
+    __atomic_store_n(&br->tail, evb->rbuf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Free the recv buffers; they must not be registered with the ring, which
+ * is the case once the ring is closed
+ */
+static void
+event_rbuf_deinit(struct event_base *evb)
+{
+    evb->urecv = 0;
+
+    if (evb->rbuf_ring != NULL) {
+        munmap(evb->rbuf_ring, EVENT_NRBUF * sizeof(struct io_uring_buf));
+        evb->rbuf_ring = NULL;
+    }
+
+    if (evb->rbuf != NULL) {
+        nc_free(evb->rbuf);
+    }
+
+    if (evb->rbuf_info != NULL) {
+        nc_free(evb->rbuf_info);
+    }
+}
+
+/*
+ * Register the provided buffer ring that recv completions pick their
+ * buffers from. On failure, connections are received through a POLLIN
+ * poll and read() instead
+ */
+static void
+event_rbuf_init(struct event_base *evb)
+{
+    struct io_uring_buf_reg reg;
+    void *ring;
+    int status, bid;
+
+    ring = mmap(NULL, EVENT_NRBUF * sizeof(struct io_uring_buf),
+                PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        log_warn("mmap of buffer ring on u %d failed, recv falls back to "
+                 "poll: %s", evb->ring, strerror(errno));
+        return;
+    }
+    evb->rbuf_ring = ring;
+    evb->rbuf_tail = 0;
+
+    evb->rbuf = nc_alloc((size_t)EVENT_NRBUF * EVENT_RBUF_SIZE);
+    evb->rbuf_info = nc_alloc(EVENT_NRBUF * sizeof(*evb->rbuf_info));
+    if (evb->rbuf == NULL || evb->rbuf_info == NULL) {
+        event_rbuf_deinit(evb);
+        return;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = EVENT_NRBUF;
+    reg.bgid = EVENT_RBUF_GROUP;
+
+    status = io_uring_register(evb->ring, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (status < 0) {
+        log_warn("io_uring register of buffer ring on u %d failed, recv "
+                 "falls back to poll: %s", evb->ring, strerror(errno));
+        event_rbuf_deinit(evb);
+        return;
+    }
+    evb->urecv = 1;
+
+    for (bid = 0; bid < EVENT_NRBUF; bid++) {
+        event_rbuf_put(evb, bid);
+    }
+}
+
+struct event_base *
+event_base_create(int nevent, event_cb_t cb)
+{
+    struct event_base *evb;
+    struct io_uring_params p;
+    int status, ring;
+
+    ASSERT(nevent > 0);
+
+    memset(&p, 0, sizeof(p));
+
+    ring = io_uring_setup((uint32_t)nevent, &p);
+    if (ring < 0) {
+        log_error("io_uring setup of size %d failed: %s", nevent,
+                  strerror(errno));
+        return NULL;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        log_error("io_uring u %d lacks ext arg or nodrop support", ring);
+        status = close(ring);
+        if (status < 0) {
+            log_error("close u %d failed, ignored: %s", ring, strerror(errno));
+        }
+        return NULL;
+    }
+
+    evb = nc_zalloc(sizeof(*evb));
+    if (evb == NULL) {
+        status = close(ring);
+        if (status < 0) {
+            log_error("close u %d failed, ignored: %s", ring, strerror(errno));
+        }
+        return NULL;
+    }
+
+    evb->ring = ring;
+    evb->nsubmit = 0;
+    evb->conn = NULL;
+    evb->nconn = 0;
+    evb->rbuf_ring = NULL;
+    evb->rbuf = NULL;
+    evb->rbuf_info = NULL;
+    evb->urecv = 0;
+    evb->cb = cb;
+
+    status = event_map(evb, &p);
+    if (status < 0) {
+        event_base_destroy(evb);
+        return NULL;
+    }
+
+    event_rbuf_init(evb);
+
+    log_debug(LOG_INFO, "u %d with sq entries %"PRIu32" cq entries %"PRIu32" "
+              "recv %s", evb->ring, p.sq_entries, p.cq_entries,
+              evb->urecv ? "on completion" : "on poll");
+
+    return evb;
+}
+
+void
+event_base_destroy(struct event_base *evb)
+{
+    int status;
+
+    if (evb == NULL) {
+        return;
+    }
+
+    ASSERT(evb->ring > 0);
+
+    event_unmap(evb);
+
+    if (evb->conn != NULL) {
+        nc_free(evb->conn);
+    }
+
+    status = close(evb->ring);
+    if (status < 0) {
+        log_error("close u %d failed, ignored: %s", evb->ring, strerror(errno));
+    }
+    evb->ring = -1;
+
+    event_rbuf_deinit(evb);
+
+    nc_free(evb);
+}
+
+static int
+event_submit(struct event_base *evb, uint32_t min_complete, uint32_t flags,
+             void *arg, size_t argsz)
+{
+    int n;
+
+    for (;;) {
+        n = io_uring_enter(evb->ring, evb->nsubmit, min_complete, flags, arg,
+                           argsz);
+        if (n >= 0) {
+            ASSERT((uint32_t)n <= evb->nsubmit);
+            evb->nsubmit -= (uint32_t)n;
+            return n;
+        }
+
+        if (errno == EINTR && min_complete == 0) {
+            continue;
+        }
+
+        return -1;
+    }
+}
+
+static struct io_uring_sqe *
+event_get_sqe(struct event_base *evb)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t head, tail;
+    int status;
+
+    tail = *evb->sq_tail;
+    head = __atomic_load_n(evb->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= evb->sq_entries) {
+        /* submission ring is full; hand queued entries to the kernel */
+        status = event_submit(evb, 0, 0, NULL, 0);
+        if (status < 0) {
+            log_error("io_uring submit on u %d failed: %s", evb->ring,
+                      strerror(errno));
+            return NULL;
+        }
+        head = __atomic_load_n(evb->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= evb->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    sqe = &evb->sqe[tail & evb->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    __atomic_store_n(evb->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    evb->nsubmit++;
+
+    return sqe;
+}
+
+/*
+ * Return the events polled for on ec; POLLIN is not polled for when the
+ * connection receives on completions
+ */
+static uint32_t
+event_poll_events(const struct event_conn *ec)
+{
+    if (ec->urecv) {
+        return ec->events & ~(uint32_t)POLLIN;
+    }
+
+    return ec->events;
+}
+
+static int
+event_poll_arm(struct event_base *evb, int fd, const struct event_conn *ec)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t events = event_poll_events(ec);
+
+    if (events == 0) {
+        return 0;
+    }
+
+    sqe = event_get_sqe(evb);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+#ifndef NC_LITTLE_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = EVENT_UD(fd, ec->gen);
+
+    return 0;
+}
+
+static int
+event_poll_disarm(struct event_base *evb, int fd, const struct event_conn *ec)
+{
+    struct io_uring_sqe *sqe;
+
+    if (event_poll_events(ec) == 0) {
+        return 0;
+    }
+
+    sqe = event_get_sqe(evb);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = EVENT_UD(fd, ec->gen);
+    sqe->user_data = EVENT_UD_NONE;
+
+    return 0;
+}
+
+static int
+event_recv_arm(struct event_base *evb, int fd, const struct event_conn *ec)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = event_get_sqe(evb);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = EVENT_RBUF_GROUP;
+    sqe->user_data = EVENT_UD_RECV(fd, ec->rgen);
+
+    return 0;
+}
+
+static int
+event_recv_disarm(struct event_base *evb, int fd, const struct event_conn *ec)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = event_get_sqe(evb);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = EVENT_UD_RECV(fd, ec->rgen);
+    sqe->user_data = EVENT_UD_NONE;
+
+    return 0;
+}
+
+/*
+ * Stop receiving on completions for descriptor fd; buffers still queued
+ * on it are handed back to the ring, unread
+ */
+static void
+event_recv_stop(struct event_base *evb, int fd, struct event_conn *ec)
+{
+    int status;
+
+    if (!ec->urecv) {
+        return;
+    }
+
+    status = event_recv_disarm(evb, fd, ec);
+    if (status < 0) {
+        log_error("io_uring recv cancel on u %d sd %d failed, ignored: %s",
+                  evb->ring, fd, strerror(errno));
+    }
+
+    while (ec->rhead >= 0) {
+        int bid = ec->rhead;
+
+        ec->rhead = evb->rbuf_info[bid].next;
+        event_rbuf_put(evb, bid);
+    }
+    ec->rtail = -1;
+    ec->roff = 0;
+    ec->rerr = 0;
+    ec->reof = 0;
+    ec->urecv = 0;
+    ec->rgen++;
+}
+
+static struct event_conn *
+event_get_conn(struct event_base *evb, int fd)
+{
+    struct event_conn *conn;
+    int nconn;
+
+    if (fd < evb->nconn) {
+        return &evb->conn[fd];
+    }
+
+    nconn = MAX(fd + 1, 2 * evb->nconn);
+    nconn = MAX(nconn, EVENT_SIZE);
+
+    conn = nc_realloc(evb->conn, (size_t)nconn * sizeof(*conn));
+    if (conn == NULL) {
+        return NULL;
+    }
+    memset(&conn[evb->nconn], 0, (size_t)(nconn - evb->nconn) * sizeof(*conn));
+
+    evb->conn = conn;
+    evb->nconn = nconn;
+
+    return &evb->conn[fd];
+}
+
+/*
+ * Change the poll events armed on connection c to events; zero events
+ * disarms the poll
+ */
+static int
+event_set(struct event_base *evb, struct conn *c, uint32_t events)
+{
+    struct event_conn *ec;
+    int status;
+
+    ec = event_get_conn(evb, c->sd);
+    if (ec == NULL) {
+        return -1;
+    }
+
+    if (ec->events == events) {
+        return 0;
+    }
+
+    if (ec->events != 0) {
+        status = event_poll_disarm(evb, c->sd, ec);
+        if (status < 0) {
+            return status;
+        }
+        ec->gen++;
+        ec->events = 0;
+    }
+
+    if (events != 0) {
+        ec->events = events;
+        status = event_poll_arm(evb, c->sd, ec);
+        if (status < 0) {
+            ec->events = 0;
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+int
+event_add_in(struct event_base *evb, struct conn *c)
+{
+    int status;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+
+    if (c->recv_active) {
+        return 0;
+    }
+
+    status = event_set(evb, c, EVENT_POLL_IN);
+    if (status < 0) {
+        log_error("io_uring poll on u %d sd %d failed: %s", evb->ring, c->sd,
+                  strerror(errno));
+    } else {
+        c->recv_active = 1;
+    }
+
+    return status;
+}
+
+int
+event_del_in(struct event_base *evb, struct conn *c)
+{
+    return 0;
+}
+
+int
+event_add_out(struct event_base *evb, struct conn *c)
+{
+    int status;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+    ASSERT(c->recv_active);
+
+    if (c->send_active) {
+        return 0;
+    }
+
+    status = event_set(evb, c, EVENT_POLL_INOUT);
+    if (status < 0) {
+        log_error("io_uring poll on u %d sd %d failed: %s", evb->ring, c->sd,
+                  strerror(errno));
+    } else {
+        c->send_active = 1;
+    }
+
+    return status;
+}
+
+int
+event_del_out(struct event_base *evb, struct conn *c)
+{
+    int status;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+    ASSERT(c->recv_active);
+
+    if (!c->send_active) {
+        return 0;
+    }
+
+    status = event_set(evb, c, EVENT_POLL_IN);
+    if (status < 0) {
+        log_error("io_uring poll on u %d sd %d failed: %s", evb->ring, c->sd,
+                  strerror(errno));
+    } else {
+        c->send_active = 0;
+    }
+
+    return status;
+}
+
+int
+event_add_conn(struct event_base *evb, struct conn *c)
+{
+    int status;
+    struct event_conn *ec;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+
+    ec = event_get_conn(evb, c->sd);
+    if (ec == NULL) {
+        log_error("io_uring conn on u %d sd %d failed: %s", evb->ring, c->sd,
+                  strerror(errno));
+        return -1;
+    }
+    ec->c = c;
+    ec->rhead = -1;
+    ec->rtail = -1;
+    ec->roff = 0;
+    ec->rerr = 0;
+    ec->reof = 0;
+    ec->urecv = 0;
+
+    if (evb->urecv && !c->proxy) {
+        status = event_recv_arm(evb, c->sd, ec);
+        if (status < 0) {
+            log_error("io_uring recv on u %d sd %d failed: %s", evb->ring,
+                      c->sd, strerror(errno));
+            ec->c = NULL;
+            return status;
+        }
+        ec->urecv = 1;
+    }
+
+    status = event_set(evb, c, EVENT_POLL_INOUT);
+    if (status < 0) {
+        log_error("io_uring poll on u %d sd %d failed: %s", evb->ring, c->sd,
+                  strerror(errno));
+        event_recv_stop(evb, c->sd, ec);
+        ec->c = NULL;
+    } else {
+        c->send_active = 1;
+        c->recv_active = 1;
+    }
+
+    return status;
+}
+
+int
+event_del_conn(struct event_base *evb, struct conn *c)
+{
+    int status;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+
+    status = event_set(evb, c, 0);
+    if (status < 0) {
+        log_error("io_uring poll remove on u %d sd %d failed: %s", evb->ring,
+                  c->sd, strerror(errno));
+    }
+
+    if (c->sd < evb->nconn) {
+        event_recv_stop(evb, c->sd, &evb->conn[c->sd]);
+    }
+
+    if (status == 0) {
+        evb->conn[c->sd].c = NULL;
+        c->recv_active = 0;
+        c->send_active = 0;
+    }
+
+    return status;
+}
+
+/*
+ * Queue the data of the recv completion cqe on its connection. Returns
+ * the connection, or NULL if the completion is stale or carries no events
+ */
+static struct conn *
+event_complete_recv(struct event_base *evb, const struct io_uring_cqe *cqe,
+                    uint32_t *events)
+{
+    struct event_conn *ec;
+    uint64_t ud = cqe->user_data;
+    int fd, bid, status;
+
+    fd = EVENT_UD_FD(ud);
+    bid = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    ec = fd < evb->nconn ? &evb->conn[fd] : NULL;
+
+    if (ec == NULL || ec->c == NULL || !ec->urecv ||
+        (ec->rgen & EVENT_GEN_MASK) != EVENT_UD_GEN(ud)) {
+        log_debug(LOG_VVERB, "io_uring stale recv completion on u %d sd %d",
+                  evb->ring, fd);
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            event_rbuf_put(evb, bid);
+        }
+        return NULL;
+    }
+
+    *events = EVENT_READ;
+
+    if (cqe->res > 0) {
+        ASSERT(cqe->flags & IORING_CQE_F_BUFFER);
+
+        evb->rbuf_info[bid].len = (uint32_t)cqe->res;
+        evb->rbuf_info[bid].next = -1;
+        if (ec->rtail < 0) {
+            ec->rhead = bid;
+            ec->roff = 0;
+        } else {
+            evb->rbuf_info[ec->rtail].next = bid;
+        }
+        ec->rtail = bid;
+    } else if (cqe->res == 0) {
+        ec->reof = 1;
+        return ec->c;
+    } else if (cqe->res == -ENOBUFS) {
+        /* ring ran out of buffers; recv again once they are handed back */
+        *events = 0;
+    } else if (cqe->res == -EINVAL && ec->rhead < 0) {
+        /* multishot recv is not supported; poll and read() instead */
+        if (evb->urecv) {
+            log_warn("io_uring recv on u %d sd %d not supported, recv falls "
+                     "back to poll", evb->ring, fd);
+            evb->urecv = 0;
+        }
+        status = event_poll_disarm(evb, fd, ec);
+        ec->urecv = 0;
+        ec->rgen++;
+        if (status == 0) {
+            ec->gen++;
+            status = event_poll_arm(evb, fd, ec);
+        }
+        if (status < 0) {
+            log_error("io_uring poll on u %d sd %d failed: %s", evb->ring, fd,
+                      strerror(errno));
+            ec->events = 0;
+            *events = EVENT_ERR;
+            return ec->c;
+        }
+        return NULL;
+    } else {
+        ec->rerr = -cqe->res;
+        return ec->c;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* multishot recv was terminated by the kernel; re-arm it */
+        ec->rgen++;
+        status = event_recv_arm(evb, fd, ec);
+        if (status < 0) {
+            log_error("io_uring recv re-arm on u %d sd %d failed: %s",
+                      evb->ring, fd, strerror(errno));
+            ec->rerr = errno;
+            *events = EVENT_READ;
+        }
+    }
+
+    return *events != 0 ? ec->c : NULL;
+}
+
+/*
+ * Translate the completion cqe into events for its connection. Returns
+ * the connection, or NULL if the completion is stale or carries no events
+ */
+static struct conn *
+event_complete(struct event_base *evb, const struct io_uring_cqe *cqe,
+               uint32_t *events)
+{
+    struct event_conn *ec;
+    uint64_t ud = cqe->user_data;
+    int fd, status;
+
+    if (ud == EVENT_UD_NONE) {
+        return NULL;
+    }
+
+    if (EVENT_UD_IS_RECV(ud)) {
+        return event_complete_recv(evb, cqe, events);
+    }
+
+    fd = EVENT_UD_FD(ud);
+    if (fd >= evb->nconn) {
+        return NULL;
+    }
+
+    ec = &evb->conn[fd];
+    if (ec->c == NULL || ec->events == 0 ||
+        (ec->gen & EVENT_GEN_MASK) != EVENT_UD_GEN(ud)) {
+        log_debug(LOG_VVERB, "io_uring stale completion on u %d sd %d",
+                  evb->ring, fd);
+        return NULL;
+    }
+
+    if (cqe->res < 0) {
+        /*
+         * poll failed and is no longer armed; report the error instead of
+         * re-arming, so that the connection is closed
+         */
+        ec->gen++;
+        ec->events = 0;
+        *events = EVENT_ERR;
+        return ec->c;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* multishot poll was terminated by the kernel; re-arm it */
+        ec->gen++;
+        status = event_poll_arm(evb, fd, ec);
+        if (status < 0) {
+            log_error("io_uring re-arm on u %d sd %d failed: %s", evb->ring,
+                      fd, strerror(errno));
+            ec->events = 0;
+            *events = EVENT_ERR;
+            return ec->c;
+        }
+    }
+
+    *events = 0;
+
+    if (cqe->res & POLLERR) {
+        *events |= EVENT_ERR;
+    }
+
+    if (cqe->res & (POLLIN | POLLHUP)) {
+        *events |= EVENT_READ;
+    }
+
+    if (cqe->res & POLLOUT) {
+        *events |= EVENT_WRITE;
+    }
+
+    return ec->c;
+}
+
+int
+event_wait(struct event_base *evb, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(evb->cqe != NULL);
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    for (;;) {
+        uint32_t head, tail;
+        int status, nsd;
+
+        head = *evb->cq_head;
+        tail = __atomic_load_n(evb->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head != tail && evb->nsubmit != 0) {
+            status = event_submit(evb, 0, 0, NULL, 0);
+            if (status < 0) {
+                log_error("io_uring submit on u %d failed: %s", evb->ring,
+                          strerror(errno));
+                return -1;
+            }
+        }
+
+        if (head == tail) {
+            status = event_submit(evb, 1,
+                                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                  &arg, sizeof(arg));
+            if (status < 0) {
+                if (errno == ETIME) {
+                    return 0;
+                }
+
+                if (errno == EINTR) {
+                    /* return to the caller to act on the signal, like a reload */
+                    return 0;
+                }
+
+                log_error("io_uring wait on u %d with %d timeout failed: %s",
+                          evb->ring, timeout, strerror(errno));
+                return -1;
+            }
+
+            head = *evb->cq_head;
+            tail = __atomic_load_n(evb->cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                continue;
+            }
+        }
+
+        for (nsd = 0; head != tail; head++) {
+            struct io_uring_cqe cqe = evb->cqe[head & evb->cq_mask];
+            struct conn *c;
+            uint32_t events;
+
+            /* release the cqe slot before the callback queues new sqes */
+            __atomic_store_n(evb->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            c = event_complete(evb, &cqe, &events);
+            if (c == NULL) {
+                continue;
+            }
+
+            log_debug(LOG_VVERB, "io_uring %04"PRIX32" triggered on conn %p",
+                      (uint32_t)cqe.res, c);
+
+            nsd++;
+            if (evb->cb != NULL) {
+                evb->cb(c, events);
+            }
+        }
+
+        return nsd;
+    }
+
+    NOT_REACHED();
+}
+
+/*
+ * Receive up to size bytes on connection c into buf, like read(). Data
+ * that completed on the ring is copied out of its recv buffers; returns 0
+ * on eof, and -1 with errno set to EAGAIN when nothing was received yet
+ */
+ssize_t
+event_recv(struct event_base *evb, struct conn *c, void *buf, size_t size)
+{
+    struct event_conn *ec;
+    uint8_t *pos = buf;
+    size_t copied = 0;
+
+    ASSERT(c->sd > 0);
+
+    ec = c->sd < evb->nconn ? &evb->conn[c->sd] : NULL;
+    if (ec == NULL || !ec->urecv) {
+        return nc_read(c->sd, buf, size);
+    }
+
+    ASSERT(ec->c == c);
+
+    while (ec->rhead >= 0 && copied < size) {
+        struct event_rbuf *rb = &evb->rbuf_info[ec->rhead];
+        size_t n = MIN(size - copied, (size_t)(rb->len - ec->roff));
+
+        nc_memcpy(pos + copied,
+                  evb->rbuf + (size_t)ec->rhead * EVENT_RBUF_SIZE + ec->roff, n);
+        copied += n;
+        ec->roff += (uint32_t)n;
+
+        if (ec->roff == rb->len) {
+            int bid = ec->rhead;
+
+            ec->rhead = rb->next;
+            if (ec->rhead < 0) {
+                ec->rtail = -1;
+            }
+            ec->roff = 0;
+            event_rbuf_put(evb, bid);
+        }
+    }
+
+    if (copied > 0) {
+        return (ssize_t)copied;
+    }
+
+    if (ec->rerr != 0) {
+        errno = ec->rerr;
+        return -1;
+    }
+
+    if (ec->reof) {
+        return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+void
+event_loop_stats(event_stats_cb_t cb, void *arg)
+{
+    struct stats *st = arg;
+    struct pollfd pfd;
+
+    for (;;) {
+        int n;
+
+        pfd.fd = stats_loop_sd(st);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        n = poll(&pfd, 1, stats_loop_timeout(st));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("poll on m %d failed: %s", pfd.fd, strerror(errno));
+            break;
+        }
+
+        /* the new process of an upgrade accepts on st->sd */
+        if (st->handoff) {
+            break;
+        }
+
+        cb(st, &n);
+    }
+}
+
+#endif /* NC_HAVE_IO_URING */
@@ -334,7 +334,8 @@ event_wait(struct event_base *evb, int timeout)
         }
 
         if (errno == EINTR) {
-            continue;
+            /* return to the caller to act on the signal, like a reload */
+            return 0;
         }
 
         log_error("kevent on kq %d with %d events failed: %s", kq, evb->nevent,
@@ -349,8 +350,8 @@ void
 event_loop_stats(event_stats_cb_t cb, void *arg)
 {
     struct stats *st = arg;
-    int status, kq;
-    struct kevent change, event;
+    int status, kq, sd, nchange;
+    struct kevent change[2], event;
     struct timespec ts, *tsp;
 
     kq = kqueue();
@@ -359,21 +360,44 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         return;
     }
 
-    EV_SET(&change, st->sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-
-    /* kevent should block indefinitely if st->interval < 0 */
-    if (st->interval < 0) {
-        tsp = NULL;
-    } else {
-        tsp = &ts;
-        tsp->tv_sec = st->interval / 1000LL;
-        tsp->tv_nsec = (st->interval % 1000LL) * 1000000LL;
-    }
+    sd = st->sd;
+    EV_SET(&change[0], sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    nchange = 1;
 
     for (;;) {
-        int nreturned;
+        int nreturned, timeout;
+
+        /*
+         * switch between st->sd and an http client being read; a client
+         * leaves the kqueue when it is closed
+         */
+        if (stats_loop_sd(st) != sd) {
+            nchange = 0;
+            if (sd == st->sd) {
+                EV_SET(&change[nchange++], sd, EVFILT_READ, EV_DELETE, 0, 0,
+                       NULL);
+            }
+            sd = stats_loop_sd(st);
+            EV_SET(&change[nchange++], sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0,
+                   0, NULL);
+        }
+
+        /* kevent should block indefinitely if the timeout < 0 */
+        timeout = stats_loop_timeout(st);
+        if (timeout < 0) {
+            tsp = NULL;
+        } else {
+            tsp = &ts;
+            tsp->tv_sec = timeout / 1000LL;
+            tsp->tv_nsec = (timeout % 1000LL) * 1000000LL;
+        }
+
+        nreturned = kevent(kq, change, nchange, &event, 1, tsp);
+
+        /* adding sd again is harmless, unlike deleting it again */
+        EV_SET(&change[0], sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        nchange = 1;
 
-        nreturned = kevent(kq, &change, 1, &event, 1, tsp);
         if (nreturned < 0) {
             if (errno == EINTR) {
                 continue;
@@ -398,6 +422,11 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
             }
         }
 
+        /* the new process of an upgrade accepts on st->sd */
+        if (st->handoff) {
+            break;
+        }
+
         cb(st, &nreturned);
     }
 
@@ -0,0 +1,93 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_hashkit.h>
+
+/*
+ * The redis_cluster distribution keeps one continuum point per hash slot of
+ * the cluster. The point of a slot holds the index of the server that owns
+ * it, as learned from 'CLUSTER SLOTS' and from MOVED redirects.
+ */
+
+rstatus_t
+cluster_update(struct server_pool *pool)
+{
+    uint32_t nserver;  /* # server */
+    uint32_t slot;     /* hash slot */
+
+    nserver = array_n(&pool->server);
+
+    /* cluster nodes fail over by themselves and are never ejected */
+    pool->nlive_server = nserver;
+    pool->next_rebuild = 0LL;
+
+    if (pool->continuum != NULL) {
+        /* keep the slot map learned from the cluster */
+        return NC_OK;
+    }
+
+    pool->continuum = nc_alloc(sizeof(*pool->continuum) * CLUSTER_NSLOT);
+    if (pool->continuum == NULL) {
+        return NC_ENOMEM;
+    }
+    pool->ncontinuum = CLUSTER_NSLOT;
+    pool->nserver_continuum = nserver;
+
+    /*
+     * Until the slot map is loaded from the cluster, assume that the slots
+     * are split evenly between the servers in the order in which they are
+     * configured, which is how redis-cli creates a cluster. Requests for a
+     * slot that is owned elsewhere are redirected with MOVED.
+     */
+    for (slot = 0; slot < CLUSTER_NSLOT; slot++) {
+        pool->continuum[slot].index = (uint32_t)((uint64_t)slot * nserver /
+                                                 CLUSTER_NSLOT);
+        pool->continuum[slot].value = slot;
+    }
+
+    log_debug(LOG_VERB, "updated pool %"PRIu32" '%.*s' with %"PRIu32" slots "
+              "over %"PRIu32" servers", pool->idx, pool->name.len,
+              pool->name.data, pool->ncontinuum, nserver);
+
+    return NC_OK;
+}
+
+void
+cluster_assign(struct server_pool *pool, uint32_t first, uint32_t last,
+               uint32_t server_index)
+{
+    uint32_t slot;
+
+    ASSERT(pool->continuum != NULL);
+    ASSERT(first <= last && last < pool->ncontinuum);
+    ASSERT(server_index < array_n(&pool->server));
+
+    for (slot = first; slot <= last; slot++) {
+        pool->continuum[slot].index = server_index;
+    }
+}
+
+uint32_t
+cluster_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+{
+    ASSERT(continuum != NULL);
+    ASSERT(ncontinuum == CLUSTER_NSLOT);
+
+    return continuum[hash % CLUSTER_NSLOT].index;
+}
@@ -34,11 +34,21 @@
     ACTION( HASH_HSIEH,         hsieh         ) \
     ACTION( HASH_MURMUR,        murmur        ) \
     ACTION( HASH_JENKINS,       jenkins       ) \
+    ACTION( HASH_XXH3,          xxh3          ) \
+    ACTION( HASH_WYHASH,        wyhash        ) \
+    ACTION( HASH_CRC32C,        crc32c        ) \
 
 #define DIST_CODEC(ACTION)                      \
     ACTION( DIST_KETAMA,        ketama        ) \
     ACTION( DIST_MODULA,        modula        ) \
     ACTION( DIST_RANDOM,        random        ) \
+    ACTION( DIST_REDIS_CLUSTER, redis_cluster ) \
+    ACTION( DIST_JUMP,          jump          ) \
+    ACTION( DIST_MAGLEV,        maglev        ) \
+    ACTION( DIST_RENDEZVOUS,    rendezvous    ) \
+
+#define CLUSTER_NSLOT 16384 /* # hash slots in a redis cluster */
+#define CLUSTER_NSERVER 128 /* max # servers in a redis_cluster pool */
 
 #define DEFINE_ACTION(_hash, _name) _hash,
 typedef enum hash_type {
@@ -67,13 +77,30 @@ uint32_t hash_fnv1a_32(const char *key, size_t key_length);
 uint32_t hash_hsieh(const char *key, size_t key_length);
 uint32_t hash_jenkins(const char *key, size_t length);
 uint32_t hash_murmur(const char *key, size_t length);
+uint32_t hash_xxh3(const char *key, size_t key_length);
+uint64_t wyhash(const char *key, size_t len, uint64_t seed);
+uint32_t hash_wyhash(const char *key, size_t key_length);
+uint32_t hash_crc32c(const char *key, size_t key_length);
 
 rstatus_t ketama_update(struct server_pool *pool);
+void ketama_free(void *dist_data);
 uint32_t ketama_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
+uint32_t ketama_lookup(const void *dist_data, uint32_t hash);
+uint32_t ketama_point(const void *dist_data, uint32_t hash);
+uint32_t ketama_point_index(const void *dist_data, uint32_t point, uint32_t n);
 rstatus_t modula_update(struct server_pool *pool);
 uint32_t modula_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
 rstatus_t random_update(struct server_pool *pool);
 uint32_t random_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
+rstatus_t cluster_update(struct server_pool *pool);
+void cluster_assign(struct server_pool *pool, uint32_t first, uint32_t last, uint32_t server_index);
+uint32_t cluster_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
+rstatus_t jump_update(struct server_pool *pool);
+uint32_t jump_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
+rstatus_t maglev_update(struct server_pool *pool);
+uint32_t maglev_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
+rstatus_t rendezvous_update(struct server_pool *pool);
+uint32_t rendezvous_dispatch(const void *dist_data, uint32_t hash);
 uint32_t ketama_hash(const char *key, size_t key_length, uint32_t alignment);
 
 #endif
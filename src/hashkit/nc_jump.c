@@ -0,0 +1,207 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_hashkit.h>
+
+#define JUMP_CONTINUUM_ADDITION     10  /* # extra slots to build into continuum */
+#define JUMP_MAX_PROBE              32  /* # rehashes before a linear probe */
+
+/*
+ * Jump consistent hash (Lamping and Veach, https://arxiv.org/abs/1406.2294)
+ * maps a key to one of nbucket buckets with O(ln nbucket) arithmetic and
+ * no lookups. When a bucket is appended, only 1/(nbucket + 1) of the keys
+ * move, all of them to the new bucket.
+ *
+ * Every server owns as many consecutive buckets as its weight, in the order
+ * servers are listed in the configuration. So, appending servers to the
+ * end of the list moves the least keys, while inserting a server in the
+ * middle, removing one or changing its weight also moves the keys of the
+ * buckets that follow it.
+ *
+ * Buckets of ejected servers stay on the continuum but are marked dead,
+ * and a key that lands on a dead bucket is rehashed until it lands on a
+ * live one. Ejecting a server thus only moves the keys it owned and its
+ * keys move back to it once it is live again.
+ */
+static uint32_t
+jump_bucket(uint64_t key, uint32_t nbucket)
+{
+    int64_t b, j;
+
+    b = -1;
+    j = 0;
+    while (j < (int64_t)nbucket) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((double)(b + 1) *
+                      ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+
+    return (uint32_t)b;
+}
+
+/* 64-bit finalizer of splitmix64, to rehash keys that land on dead buckets */
+static uint64_t
+jump_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+rstatus_t
+jump_update(struct server_pool *pool)
+{
+    uint32_t nserver;             /* # server - live and dead */
+    uint32_t nlive_server;        /* # live server */
+    uint32_t continuum_index;     /* continuum index */
+    uint32_t server_index;        /* server index */
+    uint32_t weight_index;        /* weight index */
+    uint32_t total_weight;        /* total server weight - live and dead */
+    int64_t now;                  /* current timestamp in usec */
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return NC_ERROR;
+    }
+
+    nserver = array_n(&pool->server);
+    nlive_server = 0;
+    total_weight = 0;
+    pool->next_rebuild = 0LL;
+
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+
+        if (pool->auto_eject_hosts) {
+            if (server->next_retry <= now) {
+                server->next_retry = 0LL;
+                nlive_server++;
+            } else if (pool->next_rebuild == 0LL ||
+                       server->next_retry < pool->next_rebuild) {
+                pool->next_rebuild = server->next_retry;
+            }
+        } else {
+            nlive_server++;
+        }
+
+        ASSERT(server->weight > 0);
+
+        /* dead servers keep their buckets */
+        total_weight += server->weight;
+    }
+
+    pool->nlive_server = nlive_server;
+
+    if (nlive_server == 0) {
+        ASSERT(pool->continuum != NULL);
+        ASSERT(pool->ncontinuum != 0);
+
+        log_debug(LOG_DEBUG, "no live servers for pool %"PRIu32" '%.*s'",
+                  pool->idx, pool->name.len, pool->name.data);
+
+        return NC_OK;
+    }
+    log_debug(LOG_DEBUG, "%"PRIu32" of %"PRIu32" servers are live for pool "
+              "%"PRIu32" '%.*s'", nlive_server, nserver, pool->idx,
+              pool->name.len, pool->name.data);
+
+    /*
+     * Allocate the continuum for the pool, the first time, and every time we
+     * add a new server to the pool
+     */
+    if (total_weight > pool->nserver_continuum) {
+        struct continuum *continuum;
+        uint32_t nserver_continuum = total_weight + JUMP_CONTINUUM_ADDITION;
+
+        continuum = nc_realloc(pool->continuum,
+                               sizeof(*continuum) * nserver_continuum);
+        if (continuum == NULL) {
+            return NC_ENOMEM;
+        }
+
+        pool->continuum = continuum;
+        pool->nserver_continuum = nserver_continuum;
+    }
+
+    /* one bucket per unit of weight, with value marking live buckets */
+    continuum_index = 0;
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+        uint32_t live;
+
+        live = (!pool->auto_eject_hosts || server->next_retry <= now) ? 1 : 0;
+
+        for (weight_index = 0; weight_index < server->weight; weight_index++) {
+            pool->continuum[continuum_index].index = server_index;
+            pool->continuum[continuum_index++].value = live;
+        }
+    }
+    pool->ncontinuum = continuum_index;
+
+    log_debug(LOG_VERB, "updated pool %"PRIu32" '%.*s' with %"PRIu32" of "
+              "%"PRIu32" servers live in %"PRIu32" buckets", pool->idx,
+              pool->name.len, pool->name.data, nlive_server, nserver,
+              pool->ncontinuum);
+
+    return NC_OK;
+}
+
+uint32_t
+jump_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+{
+    const struct continuum *c;
+    uint64_t key;
+    uint32_t probe, idx;
+
+    ASSERT(continuum != NULL);
+    ASSERT(ncontinuum != 0);
+
+    key = hash;
+    idx = jump_bucket(key, ncontinuum);
+    c = continuum + idx;
+    if (c->value != 0) {
+        return c->index;
+    }
+
+    for (probe = 1; probe < JUMP_MAX_PROBE; probe++) {
+        key = jump_mix(key + probe);
+        c = continuum + jump_bucket(key, ncontinuum);
+        if (c->value != 0) {
+            return c->index;
+        }
+    }
+
+    /* mostly dead pool, take the first live bucket after the original one */
+    for (probe = 1; probe < ncontinuum; probe++) {
+        c = continuum + (idx + probe) % ncontinuum;
+        if (c->value != 0) {
+            return c->index;
+        }
+    }
+
+    return continuum[idx].index;
+}
@@ -26,6 +26,96 @@
 #define KETAMA_CONTINUUM_ADDITION   10  /* # extra slots to build into continuum */
 #define KETAMA_POINTS_PER_SERVER    160 /* 40 points per hash */
 #define KETAMA_MAX_HOSTLEN          273 /* 273 is 255(domain or ip)+1(:)+5(port)+1(-)+10(uint32)+1(\0) */
+#define KETAMA_POINTS_PER_PREFIX    4   /* avg # points per prefix of a full continuum */
+#define KETAMA_MAX_PREFIX_BITS      16  /* max # hash bits in a prefix */
+#define KETAMA_MAX_MERGE            16  /* max # servers merged into the continuum in place */
+
+/*
+ * Search index over the sorted continuum, which avoids the ~log2(npoint)
+ * dependent cache misses of a binary search over the continuum itself.
+ * The prefix table maps the top bits of a hash to the first point with the
+ * same or a larger prefix, which narrows the search down to the few points
+ * that share the prefix of the hash. These are then scanned in an array of
+ * values only, which is packed twice as densely as the continuum.
+ */
+struct ketama_index {
+    uint32_t             npoint;   /* # points */
+    uint32_t             shift;    /* hash >> shift is the prefix of a hash */
+    uint32_t             *prefix;  /* first point of each prefix, nprefix + 1 entries */
+    uint32_t             *value;   /* value of each point, sorted */
+    uint32_t             *index;   /* server index of each point */
+    uint32_t             nserver;  /* # servers */
+    struct ketama_server *server;  /* points of every server */
+};
+
+/*
+ * The points of every server are cached, sorted, so that ejecting or
+ * reviving a server only has to take its points out of the continuum or
+ * merge them in, in linear time, instead of hashing all the servers again
+ * and sorting the whole continuum. This works as long as the number of
+ * points of the other servers stays the same, which it does when servers
+ * have the same weight. Otherwise the continuum is rebuilt from the cached
+ * points of the servers whose number of points did not change.
+ */
+struct ketama_server {
+    uint32_t npoint;   /* # points */
+    uint32_t *value;   /* point values, sorted */
+    unsigned live:1;   /* points on the continuum? */
+};
+
+static struct ketama_index *
+ketama_index_create(uint32_t npoint)
+{
+    struct ketama_index *ki;
+    uint32_t bits, nprefix;
+
+    for (bits = 1; bits < KETAMA_MAX_PREFIX_BITS; bits++) {
+        if ((1U << (bits + 1)) * KETAMA_POINTS_PER_PREFIX > npoint) {
+            break;
+        }
+    }
+    nprefix = 1U << bits;
+
+    ki = nc_alloc(sizeof(*ki) + sizeof(uint32_t) * (nprefix + 1 + 2 * npoint));
+    if (ki == NULL) {
+        return NULL;
+    }
+
+    ki->npoint = 0;
+    ki->nserver = 0;
+    ki->server = NULL;
+    ki->shift = 32 - bits;
+    ki->prefix = (uint32_t *)(ki + 1);
+    ki->value = ki->prefix + nprefix + 1;
+    ki->index = ki->value + npoint;
+
+    return ki;
+}
+
+static void
+ketama_index_build(struct ketama_index *ki, const struct continuum *continuum,
+                   uint32_t ncontinuum)
+{
+    uint32_t nprefix, prefix, point;
+
+    nprefix = 1U << (32 - ki->shift);
+
+    point = 0;
+    for (prefix = 0; prefix < nprefix; prefix++) {
+        while (point < ncontinuum &&
+               (continuum[point].value >> ki->shift) < prefix) {
+            point++;
+        }
+        ki->prefix[prefix] = point;
+    }
+    ki->prefix[nprefix] = ncontinuum;
+
+    for (point = 0; point < ncontinuum; point++) {
+        ki->value[point] = continuum[point].value;
+        ki->index[point] = continuum[point].index;
+    }
+    ki->npoint = ncontinuum;
+}
 
 uint32_t
 ketama_hash(const char *key, size_t key_length, uint32_t alignment)
@@ -40,35 +130,175 @@ ketama_hash(const char *key, size_t key_length, uint32_t alignment)
         | (results[0 + alignment * 4] & 0xFF);
 }
 
+/* order points by value, and points of the same value by server index */
 static int
 ketama_item_cmp(const void *t1, const void *t2)
 {
     const struct continuum *ct1 = t1, *ct2 = t2;
 
-    if (ct1->value == ct2->value) {
+    if (ct1->value != ct2->value) {
+        return ct1->value > ct2->value ? 1 : -1;
+    } else if (ct1->index != ct2->index) {
+        return ct1->index > ct2->index ? 1 : -1;
+    } else {
         return 0;
-    } else if (ct1->value > ct2->value) {
+    }
+}
+
+static int
+ketama_value_cmp(const void *t1, const void *t2)
+{
+    uint32_t v1 = *(const uint32_t *)t1, v2 = *(const uint32_t *)t2;
+
+    if (v1 == v2) {
+        return 0;
+    } else if (v1 > v2) {
         return 1;
     } else {
         return -1;
     }
 }
 
+void
+ketama_free(void *dist_data)
+{
+    struct ketama_index *ki = dist_data;
+    uint32_t i;
+
+    for (i = 0; i < ki->nserver; i++) {
+        if (ki->server[i].value != NULL) {
+            nc_free(ki->server[i].value);
+        }
+    }
+    if (ki->server != NULL) {
+        nc_free(ki->server);
+    }
+    nc_free(ki);
+}
+
+/*
+ * Hash the npoint points of server and cache them, sorted, in ks
+ */
+static rstatus_t
+ketama_server_points(const struct server *server, uint32_t npoint,
+                     struct ketama_server *ks)
+{
+    uint32_t pointer_per_hash;    /* pointers per hash */
+    uint32_t pointer_index;       /* pointer index */
+    uint32_t *value, nvalue;
+
+    if (npoint != ks->npoint || ks->value == NULL) {
+        value = nc_realloc(ks->value, sizeof(*value) * MAX(npoint, 1));
+        if (value == NULL) {
+            return NC_ENOMEM;
+        }
+        ks->value = value;
+        ks->npoint = npoint;
+    }
+
+    pointer_per_hash = 4;
+    nvalue = 0;
+
+    for (pointer_index = 1;
+         pointer_index <= npoint / pointer_per_hash;
+         pointer_index++) {
+
+        char host[KETAMA_MAX_HOSTLEN]= "";
+        size_t hostlen;
+        uint32_t x;
+
+        hostlen = snprintf(host, KETAMA_MAX_HOSTLEN, "%.*s-%u",
+                           server->name.len, server->name.data,
+                           pointer_index - 1);
+        if (hostlen >= KETAMA_MAX_HOSTLEN) {
+            // > The generated string has a length of at most n-1, leaving space for the additional terminating null character.
+            // Not really important since this should never get hit in practice according to https://devblogs.microsoft.com/oldnewthing/20120412-00/?p=7873
+            hostlen = KETAMA_MAX_HOSTLEN - 1;
+            log_error("Unexpectedly forced to truncate a hostname in ketama pool to %d characters for %.*s", KETAMA_MAX_HOSTLEN - 1, KETAMA_MAX_HOSTLEN - 1, host);
+        }
+
+        for (x = 0; x < pointer_per_hash; x++) {
+            ks->value[nvalue++] = ketama_hash(host, hostlen, x);
+        }
+    }
+    ASSERT(nvalue == npoint);
+
+    qsort(ks->value, npoint, sizeof(*ks->value), ketama_value_cmp);
+
+    return NC_OK;
+}
+
+/*
+ * Take the points of the servers that are on the continuum but not live
+ * anymore out of the continuum
+ */
+static uint32_t
+ketama_remove(struct continuum *continuum, uint32_t ncontinuum,
+              const struct ketama_server *ks, const uint8_t *live)
+{
+    uint32_t point, npoint;
+
+    npoint = 0;
+    for (point = 0; point < ncontinuum; point++) {
+        uint32_t server_index = continuum[point].index;
+
+        if (ks[server_index].live && !live[server_index]) {
+            continue;
+        }
+        continuum[npoint++] = continuum[point];
+    }
+
+    return npoint;
+}
+
+/*
+ * Merge the cached points of server server_index into the continuum of
+ * ncontinuum points, which has room for them, from the back
+ */
+static uint32_t
+ketama_merge(struct continuum *continuum, uint32_t ncontinuum,
+             const struct ketama_server *ks, uint32_t server_index)
+{
+    uint32_t i, j, k;
+
+    i = ncontinuum;
+    j = ks->npoint;
+    k = ncontinuum + ks->npoint;
+
+    while (j > 0) {
+        if (i > 0 && (continuum[i - 1].value > ks->value[j - 1] ||
+                      (continuum[i - 1].value == ks->value[j - 1] &&
+                       continuum[i - 1].index > server_index))) {
+            continuum[--k] = continuum[--i];
+        } else {
+            k--;
+            j--;
+            continuum[k].index = server_index;
+            continuum[k].value = ks->value[j];
+        }
+    }
+
+    return ncontinuum + ks->npoint;
+}
+
 rstatus_t
 ketama_update(struct server_pool *pool)
 {
     uint32_t nserver;             /* # server - live and dead */
     uint32_t nlive_server;        /* # live server */
     uint32_t pointer_per_server;  /* pointers per server proportional to weight */
-    uint32_t pointer_per_hash;    /* pointers per hash */
     uint32_t pointer_counter;     /* # pointers on continuum */
     uint32_t pointer_index;       /* pointer index */
     uint32_t points_per_server;   /* points per server */
-    uint32_t continuum_index;     /* continuum index */
     uint32_t continuum_addition;  /* extra space in the continuum */
     uint32_t server_index;        /* server index */
-    uint32_t value;               /* continuum value */
     uint32_t total_weight;        /* total live server weight */
+    uint32_t nremove, nmerge;     /* # servers taken out of and merged into the continuum */
+    uint8_t *live;                /* live servers */
+    struct ketama_index *ki;      /* search index and server points */
+    struct ketama_server *ks;     /* server points */
+    bool rebuild;                 /* rebuild continuum from scratch? */
+    rstatus_t status;             /* return status */
     int64_t now;                  /* current timestamp in usec */
 
     ASSERT(array_n(&pool->server) > 0);
@@ -78,17 +308,25 @@ ketama_update(struct server_pool *pool)
         return NC_ERROR;
     }
 
+    nserver = array_n(&pool->server);
+
+    live = nc_alloc(nserver);
+    if (live == NULL) {
+        return NC_ENOMEM;
+    }
+
     /*
      * Count live servers and total weight, and also update the next time to
      * rebuild the distribution
      */
-    nserver = array_n(&pool->server);
     nlive_server = 0;
     total_weight = 0;
     pool->next_rebuild = 0LL;
     for (server_index = 0; server_index < nserver; server_index++) {
         struct server *server = array_get(&pool->server, server_index);
 
+        live[server_index] = 0;
+
         if (pool->auto_eject_hosts) {
             if (server->next_retry <= now) {
                 server->next_retry = 0LL;
@@ -105,6 +343,7 @@ ketama_update(struct server_pool *pool)
 
         /* count weight only for live servers */
         if (!pool->auto_eject_hosts || server->next_retry <= now) {
+            live[server_index] = 1;
             total_weight += server->weight;
         }
     }
@@ -115,6 +354,7 @@ ketama_update(struct server_pool *pool)
         log_debug(LOG_DEBUG, "no live servers for pool %"PRIu32" '%.*s'",
                   pool->idx, pool->name.len, pool->name.data);
 
+        nc_free(live);
         return NC_OK;
     }
     log_debug(LOG_DEBUG, "%"PRIu32" of %"PRIu32" servers are live for pool "
@@ -134,69 +374,130 @@ ketama_update(struct server_pool *pool)
 
         continuum = nc_realloc(pool->continuum, sizeof(*continuum) * ncontinuum);
         if (continuum == NULL) {
+            nc_free(live);
             return NC_ENOMEM;
         }
-
         pool->continuum = continuum;
+
+        /*
+         * The search index is sized along with the continuum, and takes over
+         * the server points of the previous one
+         */
+        ki = ketama_index_create(ncontinuum);
+        if (ki == NULL) {
+            nc_free(live);
+            return NC_ENOMEM;
+        }
+        if (pool->dist_data != NULL) {
+            struct ketama_index *oki = pool->dist_data;
+
+            ki->nserver = oki->nserver;
+            ki->server = oki->server;
+            nc_free(oki);
+        } else {
+            ki->server = nc_zalloc(sizeof(*ki->server) * nserver);
+            if (ki->server == NULL) {
+                nc_free(ki);
+                nc_free(live);
+                return NC_ENOMEM;
+            }
+            ki->nserver = nserver;
+            pool->ncontinuum = 0;
+        }
+        pool->dist_data = ki;
+
         pool->nserver_continuum = nserver_continuum;
         /* pool->ncontinuum is initialized later as it could be <= ncontinuum */
     }
+    ki = pool->dist_data;
+    ks = ki->server;
+    ASSERT(ki->nserver == nserver);
 
     /*
-     * Build a continuum with the servers that are live and points from
-     * these servers that are proportial to their weight
+     * Cache the points of the live servers, in numbers that are proportional
+     * to their weight. A server that stays on the continuum with a different
+     * number of points calls for a rebuild from scratch, and so do too many
+     * servers to merge in, as merging them one by one would be slower.
      */
-    continuum_index = 0;
-    pointer_counter = 0;
+    rebuild = false;
+    nmerge = 0;
     for (server_index = 0; server_index < nserver; server_index++) {
         struct server *server;
         float pct;
 
-        server = array_get(&pool->server, server_index);
-
-        if (pool->auto_eject_hosts && server->next_retry > now) {
+        if (!live[server_index]) {
             continue;
         }
 
+        if (!ks[server_index].live && ++nmerge > KETAMA_MAX_MERGE) {
+            rebuild = true;
+        }
+
+        server = array_get(&pool->server, server_index);
+
         pct = (float)server->weight / (float)total_weight;
         pointer_per_server = (uint32_t) ((floorf((float) (pct * KETAMA_POINTS_PER_SERVER / 4 * (float)nlive_server + 0.0000000001))) * 4);
-        pointer_per_hash = 4;
 
         log_debug(LOG_VERB, "%.*s weight %"PRIu32" of %"PRIu32" "
                   "pct %0.5f points per server %"PRIu32"",
                   server->name.len, server->name.data, server->weight,
                   total_weight, pct, pointer_per_server);
 
-        for (pointer_index = 1;
-             pointer_index <= pointer_per_server / pointer_per_hash;
-             pointer_index++) {
-
-            char host[KETAMA_MAX_HOSTLEN]= "";
-            size_t hostlen;
-            uint32_t x;
-
-            hostlen = snprintf(host, KETAMA_MAX_HOSTLEN, "%.*s-%u",
-                               server->name.len, server->name.data,
-                               pointer_index - 1);
-            if (hostlen >= KETAMA_MAX_HOSTLEN) {
-                // > The generated string has a length of at most n-1, leaving space for the additional terminating null character.
-                // Not really important since this should never get hit in practice according to https://devblogs.microsoft.com/oldnewthing/20120412-00/?p=7873
-                hostlen = KETAMA_MAX_HOSTLEN - 1;
-                log_error("Unexpectedly forced to truncate a hostname in ketama pool to %d characters for %.*s", KETAMA_MAX_HOSTLEN - 1, KETAMA_MAX_HOSTLEN - 1, host);
+        if (ks[server_index].value != NULL &&
+            ks[server_index].npoint == pointer_per_server) {
+            continue;
+        }
+
+        status = ketama_server_points(server, pointer_per_server, &ks[server_index]);
+        if (status != NC_OK) {
+            nc_free(live);
+            return status;
+        }
+        if (ks[server_index].live) {
+            rebuild = true;
+        }
+    }
+
+    nremove = nmerge = 0;
+    if (rebuild) {
+        /* build the continuum from the cached points of the live servers */
+        pointer_counter = 0;
+        for (server_index = 0; server_index < nserver; server_index++) {
+            ks[server_index].live = live[server_index];
+            if (!live[server_index]) {
+                continue;
             }
+            for (pointer_index = 0; pointer_index < ks[server_index].npoint;
+                 pointer_index++) {
+                pool->continuum[pointer_counter].index = server_index;
+                pool->continuum[pointer_counter++].value =
+                    ks[server_index].value[pointer_index];
+            }
+        }
+
+        qsort(pool->continuum, pointer_counter, sizeof(*pool->continuum),
+              ketama_item_cmp);
+    } else {
+        /* take the points of ejected servers out and merge revived ones in */
+        pointer_counter = pool->ncontinuum;
+        for (server_index = 0; server_index < nserver; server_index++) {
+            nremove += (ks[server_index].live && !live[server_index]) ? 1 : 0;
+        }
+        if (nremove > 0) {
+            pointer_counter = ketama_remove(pool->continuum, pointer_counter,
+                                            ks, live);
+        }
 
-            for (x = 0; x < pointer_per_hash; x++) {
-                value = ketama_hash(host, hostlen, x);
-                pool->continuum[continuum_index].index = server_index;
-                pool->continuum[continuum_index++].value = value;
+        for (server_index = 0; server_index < nserver; server_index++) {
+            if (!ks[server_index].live && live[server_index]) {
+                pointer_counter = ketama_merge(pool->continuum, pointer_counter,
+                                               &ks[server_index], server_index);
+                nmerge++;
             }
+            ks[server_index].live = live[server_index];
         }
-        pointer_counter += pointer_per_server;
     }
-
     pool->ncontinuum = pointer_counter;
-    qsort(pool->continuum, pool->ncontinuum, sizeof(*pool->continuum),
-          ketama_item_cmp);
 
     for (pointer_index = 0;
          pointer_index < ((nlive_server * KETAMA_POINTS_PER_SERVER) - 1);
@@ -204,16 +505,23 @@ ketama_update(struct server_pool *pool)
         if (pointer_index + 1 >= pointer_counter) {
             break;
         }
-        ASSERT(pool->continuum[pointer_index].value <=
-               pool->continuum[pointer_index + 1].value);
+        ASSERT(ketama_item_cmp(&pool->continuum[pointer_index],
+                               &pool->continuum[pointer_index + 1]) <= 0);
     }
 
+    ketama_index_build(pool->dist_data, pool->continuum, pool->ncontinuum);
+
     log_debug(LOG_VERB, "updated pool %"PRIu32" '%.*s' with %"PRIu32" of "
               "%"PRIu32" servers live in %"PRIu32" slots and %"PRIu32" "
-              "active points in %"PRIu32" slots", pool->idx,
+              "active points in %"PRIu32" slots, %s", pool->idx,
               pool->name.len, pool->name.data, nlive_server, nserver,
               pool->nserver_continuum, pool->ncontinuum,
-              (pool->nserver_continuum + continuum_addition) * points_per_server);
+              (pool->nserver_continuum + continuum_addition) * points_per_server,
+              rebuild ? "rebuilt" : "updated in place");
+    log_debug(LOG_VERB, "%"PRIu32" servers taken out of and %"PRIu32" merged "
+              "into the continuum", nremove, nmerge);
+
+    nc_free(live);
 
     return NC_OK;
 }
@@ -244,3 +552,57 @@ ketama_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t
 
     return right->index;
 }
+
+/*
+ * Return the point of the continuum that hash maps to, using the search
+ * index of the continuum
+ */
+uint32_t
+ketama_point(const void *dist_data, uint32_t hash)
+{
+    const struct ketama_index *ki = dist_data;
+    uint32_t point, last;
+
+    ASSERT(ki != NULL);
+    ASSERT(ki->npoint != 0);
+
+    point = ki->prefix[hash >> ki->shift];
+    last = ki->prefix[(hash >> ki->shift) + 1];
+
+    while (point < last && ki->value[point] < hash) {
+        point++;
+    }
+
+    if (point == ki->npoint) {
+        point = 0;
+    }
+
+    return point;
+}
+
+/*
+ * Return the server index of the point of the continuum that is n points
+ * after point, wrapping around the end of the continuum
+ */
+uint32_t
+ketama_point_index(const void *dist_data, uint32_t point, uint32_t n)
+{
+    const struct ketama_index *ki = dist_data;
+
+    ASSERT(ki != NULL);
+    ASSERT(point < ki->npoint);
+
+    return ki->index[(uint32_t)(((uint64_t)point + n) % ki->npoint)];
+}
+
+/*
+ * Same as ketama_dispatch(), only faster, using the search index of the
+ * continuum
+ */
+uint32_t
+ketama_lookup(const void *dist_data, uint32_t hash)
+{
+    const struct ketama_index *ki = dist_data;
+
+    return ki->index[ketama_point(dist_data, hash)];
+}
@@ -0,0 +1,321 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_hashkit.h>
+
+#define MAGLEV_ENTRIES_PER_SERVER   100         /* min table entries per server */
+#define MAGLEV_EMPTY                UINT32_MAX  /* unassigned table entry */
+
+/*
+ * Maglev hashing (Eisenbud et al., NSDI 2016) fills a lookup table of prime
+ * size with the servers taking turns, each one claiming the next free entry
+ * along its own permutation of the table. Dispatch is a single lookup and
+ * every server ends up with a share of the table that is proportional to
+ * its weight, within a fraction of a percent.
+ *
+ * The table is first filled as if all the servers were live. Ejecting a
+ * server only frees its own entries, which the remaining live servers then
+ * claim by resuming their permutations where they left off. So, ejection
+ * moves no key that was not on the ejected server. When an ejected server
+ * is live again, the table is rebuilt from scratch, which gives it back
+ * the same entries it had before.
+ */
+
+static const uint32_t maglev_sizes[] = {
+    65537, 131101, 262147, 524309, 1048583
+};
+
+struct maglev_server {
+    uint32_t offset;  /* first entry of the permutation */
+    uint32_t skip;    /* stride of the permutation */
+    uint32_t next;    /* # permutation entries claimed or skipped */
+    uint32_t credit;  /* weight earned towards claiming an entry */
+    unsigned live:1;  /* live on the table? */
+};
+
+static uint32_t
+maglev_size(uint32_t nserver)
+{
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(maglev_sizes) - 1; i++) {
+        if (maglev_sizes[i] / MAGLEV_ENTRIES_PER_SERVER >= nserver) {
+            break;
+        }
+    }
+
+    return maglev_sizes[i];
+}
+
+/*
+ * Let the servers that are live on the table take turns in claiming the
+ * free entries along their permutations, until there are no free entries
+ * left. In every turn, a server earns its weight in credit and claims an
+ * entry for every max weight worth of credit it has.
+ */
+static void
+maglev_fill(struct server_pool *pool, struct maglev_server *ms,
+            uint32_t nfree)
+{
+    uint32_t nserver, server_index, max_weight, size;
+
+    nserver = array_n(&pool->server);
+    size = pool->ncontinuum;
+
+    max_weight = 0;
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+
+        if (ms[server_index].live) {
+            max_weight = MAX(max_weight, server->weight);
+        }
+    }
+    ASSERT(max_weight > 0);
+
+    while (nfree > 0) {
+        for (server_index = 0; server_index < nserver && nfree > 0;
+             server_index++) {
+            struct server *server = array_get(&pool->server, server_index);
+            struct maglev_server *m = &ms[server_index];
+
+            if (!m->live) {
+                continue;
+            }
+
+            m->credit += server->weight;
+            while (m->credit >= max_weight && nfree > 0) {
+                uint32_t entry;
+
+                m->credit -= max_weight;
+
+                /*
+                 * Entries freed by ejection may lie before next, so the
+                 * permutation wraps around
+                 */
+                do {
+                    entry = (uint32_t)(((uint64_t)(m->next % size) * m->skip +
+                                        m->offset) % size);
+                    m->next++;
+                } while (pool->continuum[entry].index != MAGLEV_EMPTY);
+
+                pool->continuum[entry].index = server_index;
+                nfree--;
+            }
+        }
+    }
+}
+
+/*
+ * Free the entries of servers that are live on the table but not live
+ * anymore, and have the others claim them
+ */
+static void
+maglev_eject(struct server_pool *pool, struct maglev_server *ms,
+             const uint8_t *live)
+{
+    uint32_t nserver, server_index, entry, nfree, neject;
+
+    nserver = array_n(&pool->server);
+
+    neject = 0;
+    for (server_index = 0; server_index < nserver; server_index++) {
+        if (ms[server_index].live && !live[server_index]) {
+            ms[server_index].live = 0;
+            neject++;
+        }
+        ms[server_index].credit = 0;
+    }
+
+    if (neject == 0) {
+        return;
+    }
+
+    nfree = 0;
+    for (entry = 0; entry < pool->ncontinuum; entry++) {
+        struct continuum *c = &pool->continuum[entry];
+
+        if (!ms[c->index].live) {
+            c->index = MAGLEV_EMPTY;
+            nfree++;
+        }
+    }
+
+    maglev_fill(pool, ms, nfree);
+
+    log_debug(LOG_VERB, "ejected %"PRIu32" servers of pool %"PRIu32" '%.*s' "
+              "moving %"PRIu32" entries", neject, pool->idx, pool->name.len,
+              pool->name.data, nfree);
+}
+
+/*
+ * Fill the table from scratch as if all the servers were live
+ */
+static void
+maglev_build(struct server_pool *pool, struct maglev_server *ms)
+{
+    uint32_t nserver, server_index, entry;
+
+    nserver = array_n(&pool->server);
+
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+        struct maglev_server *m = &ms[server_index];
+
+        m->offset = ketama_hash((const char *)server->name.data,
+                                server->name.len, 0) % pool->ncontinuum;
+        m->skip = ketama_hash((const char *)server->name.data,
+                              server->name.len, 1) % (pool->ncontinuum - 1) + 1;
+        m->next = 0;
+        m->credit = 0;
+        m->live = 1;
+    }
+
+    for (entry = 0; entry < pool->ncontinuum; entry++) {
+        pool->continuum[entry].index = MAGLEV_EMPTY;
+        pool->continuum[entry].value = 0;
+    }
+
+    maglev_fill(pool, ms, pool->ncontinuum);
+}
+
+rstatus_t
+maglev_update(struct server_pool *pool)
+{
+    uint32_t nserver;             /* # server - live and dead */
+    uint32_t nlive_server;        /* # live server */
+    uint32_t server_index;        /* server index */
+    uint8_t *live;                /* live servers */
+    struct maglev_server *ms;     /* per server table state */
+    bool rebuild;                 /* rebuild table from scratch? */
+    int64_t now;                  /* current timestamp in usec */
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return NC_ERROR;
+    }
+
+    nserver = array_n(&pool->server);
+
+    live = nc_alloc(nserver);
+    if (live == NULL) {
+        return NC_ENOMEM;
+    }
+
+    nlive_server = 0;
+    pool->next_rebuild = 0LL;
+
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+
+        live[server_index] = 0;
+
+        if (pool->auto_eject_hosts) {
+            if (server->next_retry <= now) {
+                server->next_retry = 0LL;
+                live[server_index] = 1;
+                nlive_server++;
+            } else if (pool->next_rebuild == 0LL ||
+                       server->next_retry < pool->next_rebuild) {
+                pool->next_rebuild = server->next_retry;
+            }
+        } else {
+            live[server_index] = 1;
+            nlive_server++;
+        }
+
+        ASSERT(server->weight > 0);
+    }
+
+    pool->nlive_server = nlive_server;
+
+    if (nlive_server == 0) {
+        ASSERT(pool->continuum != NULL);
+        ASSERT(pool->ncontinuum != 0);
+
+        log_debug(LOG_DEBUG, "no live servers for pool %"PRIu32" '%.*s'",
+                  pool->idx, pool->name.len, pool->name.data);
+
+        nc_free(live);
+        return NC_OK;
+    }
+    log_debug(LOG_DEBUG, "%"PRIu32" of %"PRIu32" servers are live for pool "
+              "%"PRIu32" '%.*s'", nlive_server, nserver, pool->idx,
+              pool->name.len, pool->name.data);
+
+    /* allocate the table and the per server state, the first time */
+    rebuild = false;
+    if (pool->continuum == NULL) {
+        uint32_t size = maglev_size(nserver);
+
+        pool->continuum = nc_alloc(sizeof(*pool->continuum) * size);
+        if (pool->continuum == NULL) {
+            nc_free(live);
+            return NC_ENOMEM;
+        }
+        pool->ncontinuum = size;
+        pool->nserver_continuum = nserver;
+
+        ASSERT(pool->dist_data == NULL);
+        pool->dist_data = nc_alloc(sizeof(struct maglev_server) * nserver);
+        if (pool->dist_data == NULL) {
+            nc_free(pool->continuum);
+            pool->continuum = NULL;
+            pool->ncontinuum = 0;
+            nc_free(live);
+            return NC_ENOMEM;
+        }
+
+        rebuild = true;
+    }
+    ASSERT(pool->nserver_continuum == nserver);
+    ms = pool->dist_data;
+
+    /* a server that is back needs its entries back */
+    for (server_index = 0; server_index < nserver && !rebuild; server_index++) {
+        if (live[server_index] && !ms[server_index].live) {
+            rebuild = true;
+        }
+    }
+
+    if (rebuild) {
+        maglev_build(pool, ms);
+    }
+    maglev_eject(pool, ms, live);
+
+    log_debug(LOG_VERB, "updated pool %"PRIu32" '%.*s' with %"PRIu32" of "
+              "%"PRIu32" servers live in %"PRIu32" entries%s", pool->idx,
+              pool->name.len, pool->name.data, nlive_server, nserver,
+              pool->ncontinuum, rebuild ? " rebuilt" : "");
+
+    nc_free(live);
+
+    return NC_OK;
+}
+
+uint32_t
+maglev_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+{
+    ASSERT(continuum != NULL);
+    ASSERT(ncontinuum != 0);
+
+    return continuum[hash % ncontinuum].index;
+}
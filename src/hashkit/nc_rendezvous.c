@@ -0,0 +1,200 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_hashkit.h>
+
+/*
+ * Rendezvous or highest random weight hashing (Thaler and Ravishankar)
+ * scores every live server for a key and picks the server with the highest
+ * score. Keys spread over servers in proportion to their weight with no
+ * more unevenness than the key hash itself has, which is what small pools
+ * want, at the cost of dispatch time linear in the number of servers.
+ * Ejecting a server only moves the keys it owned.
+ *
+ * The score mixes the key hash with a per server seed using the 64-bit
+ * finalizer of splitmix64. With weights, the mixed value u in (0, 1) is
+ * turned into a score of -weight / ln(u), as in "Weighted distributed hash
+ * tables" (Schindelhauer and Schomaker), so that a server wins with the
+ * probability of weight / total weight.
+ */
+
+struct rendezvous_server {
+    uint64_t seed;    /* server seed */
+    double   weight;  /* server weight */
+    uint32_t index;   /* server index */
+};
+
+struct rendezvous {
+    uint32_t                 nserver;   /* # live servers */
+    unsigned                 weighted;  /* servers of different weights? */
+    struct rendezvous_server *server;   /* live servers */
+};
+
+static inline uint64_t
+rendezvous_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+rstatus_t
+rendezvous_update(struct server_pool *pool)
+{
+    uint32_t nserver;             /* # server - live and dead */
+    uint32_t nlive_server;        /* # live server */
+    uint32_t server_index;        /* server index */
+    uint32_t weight;              /* weight of the first live server */
+    struct rendezvous *rv;        /* live servers */
+    int64_t now;                  /* current timestamp in usec */
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return NC_ERROR;
+    }
+
+    nserver = array_n(&pool->server);
+    nlive_server = 0;
+    pool->next_rebuild = 0LL;
+
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+
+        if (pool->auto_eject_hosts) {
+            if (server->next_retry <= now) {
+                server->next_retry = 0LL;
+                nlive_server++;
+            } else if (pool->next_rebuild == 0LL ||
+                       server->next_retry < pool->next_rebuild) {
+                pool->next_rebuild = server->next_retry;
+            }
+        } else {
+            nlive_server++;
+        }
+
+        ASSERT(server->weight > 0);
+    }
+
+    pool->nlive_server = nlive_server;
+
+    if (nlive_server == 0) {
+        ASSERT(pool->dist_data != NULL);
+
+        log_debug(LOG_DEBUG, "no live servers for pool %"PRIu32" '%.*s'",
+                  pool->idx, pool->name.len, pool->name.data);
+
+        return NC_OK;
+    }
+    log_debug(LOG_DEBUG, "%"PRIu32" of %"PRIu32" servers are live for pool "
+              "%"PRIu32" '%.*s'", nlive_server, nserver, pool->idx,
+              pool->name.len, pool->name.data);
+
+    /* allocate room for all the servers, the first time */
+    if (pool->dist_data == NULL) {
+        rv = nc_alloc(sizeof(*rv) + sizeof(*rv->server) * nserver);
+        if (rv == NULL) {
+            return NC_ENOMEM;
+        }
+        rv->server = (struct rendezvous_server *)(rv + 1);
+        pool->dist_data = rv;
+    }
+    rv = pool->dist_data;
+
+    rv->nserver = 0;
+    rv->weighted = 0;
+    weight = 0;
+    for (server_index = 0; server_index < nserver; server_index++) {
+        struct server *server = array_get(&pool->server, server_index);
+        struct rendezvous_server *rs;
+
+        if (pool->auto_eject_hosts && server->next_retry > now) {
+            continue;
+        }
+
+        if (weight == 0) {
+            weight = server->weight;
+        } else if (weight != server->weight) {
+            rv->weighted = 1;
+        }
+
+        rs = &rv->server[rv->nserver++];
+        rs->seed = (uint64_t)ketama_hash((const char *)server->name.data,
+                                         server->name.len, 0) << 32 |
+                   ketama_hash((const char *)server->name.data,
+                               server->name.len, 1);
+        rs->weight = (double)server->weight;
+        rs->index = server_index;
+    }
+
+    log_debug(LOG_VERB, "updated pool %"PRIu32" '%.*s' with %"PRIu32" of "
+              "%"PRIu32" servers live%s", pool->idx, pool->name.len,
+              pool->name.data, nlive_server, nserver,
+              rv->weighted ? " with weights" : "");
+
+    return NC_OK;
+}
+
+uint32_t
+rendezvous_dispatch(const void *dist_data, uint32_t hash)
+{
+    const struct rendezvous *rv = dist_data;
+    const struct rendezvous_server *rs, *end, *best;
+    uint64_t x, max;
+    double score, max_score;
+
+    ASSERT(rv != NULL);
+    ASSERT(rv->nserver != 0);
+
+    best = rv->server;
+    end = rv->server + rv->nserver;
+
+    if (!rv->weighted) {
+        max = 0;
+        for (rs = rv->server; rs < end; rs++) {
+            x = rendezvous_mix(rs->seed ^ hash);
+            if (x >= max) {
+                max = x;
+                best = rs;
+            }
+        }
+
+        return best->index;
+    }
+
+    max_score = 0.0;
+    for (rs = rv->server; rs < end; rs++) {
+        x = rendezvous_mix(rs->seed ^ hash);
+        /* top 53 bits as a double in (0, 1) */
+        score = -rs->weight / log(((double)(x >> 11) + 0.5) / 9007199254740992.0);
+        if (score >= max_score) {
+            max_score = score;
+            best = rs;
+        }
+    }
+
+    return best->index;
+}
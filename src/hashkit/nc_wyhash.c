@@ -0,0 +1,145 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * wyhash final version 4 by Wang Yi, https://github.com/wangyi-fudan/wyhash
+ * (public domain), with the default secret. Every 16 bytes of the key cost
+ * one 64x64 to 128-bit multiply. The 64-bit result is truncated to its low
+ * 32 bits.
+ */
+
+#include <nc_core.h>
+
+static const uint64_t wyhash_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void
+wyhash_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), lo, hi;
+    uint64_t c = t < rl;
+
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t
+wyhash_mix(uint64_t a, uint64_t b)
+{
+    wyhash_mum(&a, &b);
+
+    return a ^ b;
+}
+
+static inline uint64_t
+wyhash_read8(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+           (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t
+wyhash_read4(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24;
+}
+
+static inline uint64_t
+wyhash_read3(const uint8_t *p, size_t k)
+{
+    return (uint64_t)p[0] << 16 | (uint64_t)p[k >> 1] << 8 | p[k - 1];
+}
+
+uint64_t
+wyhash(const char *key, size_t len, uint64_t seed)
+{
+    const uint64_t *secret = wyhash_secret;
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t a, b;
+
+    seed ^= wyhash_mix(seed ^ secret[0], secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyhash_read4(p) << 32) | wyhash_read4(p + ((len >> 3) << 2));
+            b = (wyhash_read4(p + len - 4) << 32) |
+                wyhash_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyhash_read3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+
+        if (i >= 48) {
+            uint64_t see1 = seed, see2 = seed;
+
+            do {
+                seed = wyhash_mix(wyhash_read8(p) ^ secret[1],
+                                  wyhash_read8(p + 8) ^ seed);
+                see1 = wyhash_mix(wyhash_read8(p + 16) ^ secret[2],
+                                  wyhash_read8(p + 24) ^ see1);
+                see2 = wyhash_mix(wyhash_read8(p + 32) ^ secret[3],
+                                  wyhash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = wyhash_mix(wyhash_read8(p) ^ secret[1],
+                              wyhash_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        a = wyhash_read8(p + i - 16);
+        b = wyhash_read8(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    wyhash_mum(&a, &b);
+
+    return wyhash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+uint32_t
+hash_wyhash(const char *key, size_t key_length)
+{
+    return (uint32_t)wyhash(key, key_length, 0);
+}
@@ -0,0 +1,330 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * XXH3 64-bit hash with the default secret and a seed of 0, as specified
+ * in https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md and
+ * written by Yann Collet. This is the scalar version; keys of up to 240
+ * bytes, which is all that a proxy normally sees, never reach the striped
+ * loop. The 64-bit result is truncated to its low 32 bits.
+ */
+
+#include <nc_core.h>
+
+#define XXH_PRIME32_1   0x9E3779B1U
+#define XXH_PRIME32_2   0x85EBCA77U
+#define XXH_PRIME32_3   0xC2B2AE3DU
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+
+#define XXH_PRIME_MX1   0x165667919E3779F9ULL
+#define XXH_PRIME_MX2   0x9FB21C651E98DF25ULL
+
+#define XXH_SECRET_SIZE         192 /* default secret length */
+#define XXH_STRIPE_LEN          64  /* bytes consumed by an accumulation */
+#define XXH_SECRET_CONSUME_RATE 8   /* secret advance between stripes */
+#define XXH_ACC_NB              8   /* # 64-bit accumulators */
+#define XXH_MIDSIZE_MAX         240 /* longest key not hashed in stripes */
+
+static const uint8_t xxh3_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint32_t
+xxh_read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t
+xxh_read64(const uint8_t *p)
+{
+    return (uint64_t)xxh_read32(p) | (uint64_t)xxh_read32(p + 4) << 32;
+}
+
+static inline uint64_t
+xxh_swap64(uint64_t x)
+{
+    return ((x << 56) & 0xff00000000000000ULL) |
+           ((x << 40) & 0x00ff000000000000ULL) |
+           ((x << 24) & 0x0000ff0000000000ULL) |
+           ((x << 8)  & 0x000000ff00000000ULL) |
+           ((x >> 8)  & 0x00000000ff000000ULL) |
+           ((x >> 24) & 0x0000000000ff0000ULL) |
+           ((x >> 40) & 0x000000000000ff00ULL) |
+           ((x >> 56) & 0x00000000000000ffULL);
+}
+
+static inline uint64_t
+xxh_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* 64x64 to 128-bit multiply, folded to 64 bits by xor'ing the halves */
+static inline uint64_t
+xxh_mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)lhs * rhs;
+
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+
+    return lower ^ upper;
+#endif
+}
+
+static inline uint64_t
+xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static inline uint64_t
+xxh3_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static inline uint64_t
+xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+    h ^= xxh_rotl64(h, 49) ^ xxh_rotl64(h, 24);
+    h *= XXH_PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= XXH_PRIME_MX2;
+    h ^= h >> 28;
+
+    return h;
+}
+
+static inline uint64_t
+xxh3_mix16(const uint8_t *p, const uint8_t *secret)
+{
+    return xxh_mul128_fold64(xxh_read64(p) ^ xxh_read64(secret),
+                             xxh_read64(p + 8) ^ xxh_read64(secret + 8));
+}
+
+static uint64_t
+xxh3_len_0to16(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+
+    if (len > 8) {
+        uint64_t lo, hi, acc;
+
+        lo = xxh_read64(p) ^ (xxh_read64(secret + 24) ^ xxh_read64(secret + 32));
+        hi = xxh_read64(p + len - 8) ^ (xxh_read64(secret + 40) ^ xxh_read64(secret + 48));
+        acc = len + xxh_swap64(lo) + hi + xxh_mul128_fold64(lo, hi);
+
+        return xxh3_avalanche(acc);
+    }
+
+    if (len >= 4) {
+        uint64_t input, bitflip;
+
+        input = xxh_read32(p + len - 4) + ((uint64_t)xxh_read32(p) << 32);
+        bitflip = xxh_read64(secret + 8) ^ xxh_read64(secret + 16);
+
+        return xxh3_rrmxmx(input ^ bitflip, len);
+    }
+
+    if (len > 0) {
+        uint32_t combined, bitflip;
+
+        combined = (uint32_t)p[0] << 16 | (uint32_t)p[len >> 1] << 24 |
+                   (uint32_t)p[len - 1] | (uint32_t)len << 8;
+        bitflip = xxh_read32(secret) ^ xxh_read32(secret + 4);
+
+        return xxh64_avalanche((uint64_t)(combined ^ bitflip));
+    }
+
+    return xxh64_avalanche(xxh_read64(secret + 56) ^ xxh_read64(secret + 64));
+}
+
+static uint64_t
+xxh3_len_17to128(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+    uint64_t acc;
+
+    acc = len * XXH_PRIME64_1;
+
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                acc += xxh3_mix16(p + 48, secret + 96);
+                acc += xxh3_mix16(p + len - 64, secret + 112);
+            }
+            acc += xxh3_mix16(p + 32, secret + 64);
+            acc += xxh3_mix16(p + len - 48, secret + 80);
+        }
+        acc += xxh3_mix16(p + 16, secret + 32);
+        acc += xxh3_mix16(p + len - 32, secret + 48);
+    }
+    acc += xxh3_mix16(p, secret);
+    acc += xxh3_mix16(p + len - 16, secret + 16);
+
+    return xxh3_avalanche(acc);
+}
+
+static uint64_t
+xxh3_len_129to240(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+    uint64_t acc;
+    size_t i, nround;
+
+    acc = len * XXH_PRIME64_1;
+    nround = len / 16;
+
+    for (i = 0; i < 8; i++) {
+        acc += xxh3_mix16(p + 16 * i, secret + 16 * i);
+    }
+    acc = xxh3_avalanche(acc);
+
+    for (i = 8; i < nround; i++) {
+        acc += xxh3_mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += xxh3_mix16(p + len - 16, secret + 136 - 17);
+
+    return xxh3_avalanche(acc);
+}
+
+static inline void
+xxh3_accumulate512(uint64_t *acc, const uint8_t *p, const uint8_t *secret)
+{
+    size_t i;
+
+    for (i = 0; i < XXH_ACC_NB; i++) {
+        uint64_t value = xxh_read64(p + 8 * i);
+        uint64_t key = value ^ xxh_read64(secret + 8 * i);
+
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static inline void
+xxh3_scramble(uint64_t *acc, const uint8_t *secret)
+{
+    size_t i;
+
+    for (i = 0; i < XXH_ACC_NB; i++) {
+        uint64_t a = acc[i];
+
+        a ^= a >> 47;
+        a ^= xxh_read64(secret + 8 * i);
+        a *= XXH_PRIME32_1;
+        acc[i] = a;
+    }
+}
+
+static uint64_t
+xxh3_len_long(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+    uint64_t acc[XXH_ACC_NB] = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    };
+    size_t nstripe_per_block, block_len, nblock, nstripe, n, s;
+    uint64_t result;
+
+    nstripe_per_block = (XXH_SECRET_SIZE - XXH_STRIPE_LEN) / XXH_SECRET_CONSUME_RATE;
+    block_len = XXH_STRIPE_LEN * nstripe_per_block;
+    nblock = (len - 1) / block_len;
+
+    for (n = 0; n < nblock; n++) {
+        for (s = 0; s < nstripe_per_block; s++) {
+            xxh3_accumulate512(acc, p + n * block_len + s * XXH_STRIPE_LEN,
+                               secret + s * XXH_SECRET_CONSUME_RATE);
+        }
+        xxh3_scramble(acc, secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+    }
+
+    /* last partial block and last stripe */
+    nstripe = ((len - 1) - block_len * nblock) / XXH_STRIPE_LEN;
+    for (s = 0; s < nstripe; s++) {
+        xxh3_accumulate512(acc, p + nblock * block_len + s * XXH_STRIPE_LEN,
+                           secret + s * XXH_SECRET_CONSUME_RATE);
+    }
+    xxh3_accumulate512(acc, p + len - XXH_STRIPE_LEN,
+                       secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+
+    /* merge the accumulators */
+    result = len * XXH_PRIME64_1;
+    for (n = 0; n < XXH_ACC_NB / 2; n++) {
+        result += xxh_mul128_fold64(acc[2 * n] ^ xxh_read64(secret + 11 + 16 * n),
+                                    acc[2 * n + 1] ^ xxh_read64(secret + 11 + 16 * n + 8));
+    }
+
+    return xxh3_avalanche(result);
+}
+
+uint32_t
+hash_xxh3(const char *key, size_t key_length)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t h;
+
+    if (key_length <= 16) {
+        h = xxh3_len_0to16(p, key_length);
+    } else if (key_length <= 128) {
+        h = xxh3_len_17to128(p, key_length);
+    } else if (key_length <= XXH_MIDSIZE_MAX) {
+        h = xxh3_len_129to240(p, key_length);
+    } else {
+        h = xxh3_len_long(p, key_length);
+    }
+
+    return (uint32_t)h;
+}
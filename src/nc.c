@@ -27,6 +27,7 @@
 #include <nc_core.h>
 #include <nc_conf.h>
 #include <nc_signal.h>
+#include <nc_upgrade.h>
 
 #define NC_CONF_PATH        "conf/nutcracker.yml"
 
@@ -38,6 +39,7 @@
 #define NC_STATS_PORT       STATS_PORT
 #define NC_STATS_ADDR       STATS_ADDR
 #define NC_STATS_INTERVAL   STATS_INTERVAL
+#define NC_STATS_FORMAT     STATS_FORMAT
 
 #define NC_PID_FILE         NULL
 
@@ -45,6 +47,9 @@
 #define NC_MBUF_MIN_SIZE    MBUF_MIN_SIZE
 #define NC_MBUF_MAX_SIZE    MBUF_MAX_SIZE
 
+#define NC_WORKER_THREADS   1
+#define NC_WORKER_MAX       1024
+
 static int show_help;
 static int show_version;
 static int test_conf;
@@ -63,12 +68,14 @@ static const struct option long_options[] = {
     { "stats-port",     required_argument,  NULL,   's' },
     { "stats-interval", required_argument,  NULL,   'i' },
     { "stats-addr",     required_argument,  NULL,   'a' },
+    { "stats-format",   required_argument,  NULL,   'f' },
     { "pid-file",       required_argument,  NULL,   'p' },
     { "mbuf-size",      required_argument,  NULL,   'm' },
+    { "worker-threads", required_argument,  NULL,   'w' },
     { NULL,             0,                  NULL,    0  }
 };
 
-static const char short_options[] = "hVtdDv:o:c:s:i:a:p:m:";
+static const char short_options[] = "hVtdDv:o:c:s:i:a:f:p:m:w:";
 
 static rstatus_t
 nc_daemonize(int dump_core)
@@ -204,7 +211,8 @@ nc_show_usage(void)
     log_stderr(
         "Usage: nutcracker [-?hVdDt] [-v verbosity level] [-o output file]" CRLF
         "                  [-c conf file] [-s stats port] [-a stats addr]" CRLF
-        "                  [-i stats interval] [-p pid file] [-m mbuf size]" CRLF
+        "                  [-i stats interval] [-f stats format] [-p pid file]" CRLF
+        "                  [-m mbuf size] [-w worker threads]" CRLF
         "");
     log_stderr(
         "Options:" CRLF
@@ -220,15 +228,17 @@ nc_show_usage(void)
         "  -s, --stats-port=N     : set stats monitoring port (default: %d)" CRLF
         "  -a, --stats-addr=S     : set stats monitoring ip (default: %s)" CRLF
         "  -i, --stats-interval=N : set stats aggregation interval in msec (default: %d msec)" CRLF
+        "  -f, --stats-format=S   : set stats format, json or prometheus (default: json)" CRLF
         "  -p, --pid-file=S       : set pid file (default: %s)" CRLF
         "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
+        "  -w, --worker-threads=N : set number of worker threads (default: %d)" CRLF
         "",
         NC_LOG_DEFAULT, NC_LOG_MIN, NC_LOG_MAX,
         NC_LOG_PATH != NULL ? NC_LOG_PATH : "stderr",
         NC_CONF_PATH,
         NC_STATS_PORT, NC_STATS_ADDR, NC_STATS_INTERVAL,
         NC_PID_FILE != NULL ? NC_PID_FILE : "off",
-        NC_MBUF_SIZE);
+        NC_MBUF_SIZE, NC_WORKER_THREADS);
 }
 
 static rstatus_t
@@ -287,6 +297,7 @@ nc_set_default_options(struct instance *nci)
     nci->stats_port = NC_STATS_PORT;
     nci->stats_addr = NC_STATS_ADDR;
     nci->stats_interval = NC_STATS_INTERVAL;
+    nci->stats_format = NC_STATS_FORMAT;
 
     status = nc_gethostname(nci->hostname, NC_MAXHOSTNAMELEN);
     if (status < 0) {
@@ -297,9 +308,13 @@ nc_set_default_options(struct instance *nci)
 
     nci->mbuf_chunk_size = NC_MBUF_SIZE;
 
+    nci->worker_threads = NC_WORKER_THREADS;
+
     nci->pid = (pid_t)-1;
     nci->pid_filename = NULL;
     nci->pidfile = 0;
+
+    nci->argv = NULL;
 }
 
 static rstatus_t
@@ -385,6 +400,14 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->stats_addr = optarg;
             break;
 
+        case 'f':
+            if (stats_format_parse(optarg, &nci->stats_format) != NC_OK) {
+                log_stderr("nutcracker: option -f value '%s' is not a valid "
+                           "stats format", optarg);
+                return NC_ERROR;
+            }
+            break;
+
         case 'p':
             nci->pid_filename = optarg;
             break;
@@ -405,6 +428,22 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->mbuf_chunk_size = (size_t)value;
             break;
 
+        case 'w':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("nutcracker: option -w requires a non-zero number");
+                return NC_ERROR;
+            }
+
+            if (value > NC_WORKER_MAX) {
+                log_stderr("nutcracker: worker threads must be at most %d",
+                           NC_WORKER_MAX);
+                return NC_ERROR;
+            }
+
+            nci->worker_threads = value;
+            break;
+
         case '?':
             switch (optopt) {
             case 'o':
@@ -415,6 +454,7 @@ nc_get_options(int argc, char **argv, struct instance *nci)
                 break;
 
             case 'm':
+            case 'w':
             case 'v':
             case 's':
             case 'i':
@@ -488,7 +528,13 @@ nc_pre_run(struct instance *nci)
         return status;
     }
 
-    if (nci->pid_filename) {
+    status = upgrade_init();
+    if (status != NC_OK) {
+        return status;
+    }
+
+    /* the pid file is the old process's until we take over from it */
+    if (nci->pid_filename && !upgrade_taking_over()) {
         status = nc_create_pidfile(nci);
         if (status != NC_OK) {
             return status;
@@ -525,8 +571,20 @@ nc_run(struct instance *nci)
         return;
     }
 
+    /* let the process we were upgraded from know that we took over */
+    if (upgrade_taking_over()) {
+        status = upgrade_done();
+        if (status == NC_OK && nci->pid_filename) {
+            status = nc_create_pidfile(nci);
+        }
+        if (status != NC_OK) {
+            core_stop(ctx);
+            return;
+        }
+    }
+
     /* run rabbit run */
-    for (;;) {
+    while (!ctx->quit) {
         status = core_loop(ctx);
         if (status != NC_OK) {
             break;
@@ -543,6 +601,7 @@ main(int argc, char **argv)
     struct instance nci;
 
     nc_set_default_options(&nci);
+    nci.argv = argv;
 
     status = nc_get_options(argc, argv, &nci);
     if (status != NC_OK) {
@@ -552,7 +611,9 @@ main(int argc, char **argv)
 
     if (show_version) {
         log_stderr("This is nutcracker-%s", NC_VERSION_STRING);
-#if NC_HAVE_EPOLL
+#if NC_HAVE_IO_URING
+        log_stderr("async event backend: io_uring");
+#elif NC_HAVE_EPOLL
         log_stderr("async event backend: epoll");
 #elif NC_HAVE_KQUEUE
         log_stderr("async event backend: kqueue");
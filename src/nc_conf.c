@@ -58,6 +58,10 @@ static const struct command conf_commands[] = {
       conf_set_distribution,
       offsetof(struct conf_pool, distribution) },
 
+    { string("hash_load_bound"),
+      conf_set_ratio,
+      offsetof(struct conf_pool, hash_load_bound) },
+
     { string("timeout"),
       conf_set_num,
       offsetof(struct conf_pool, timeout) },
@@ -110,6 +114,58 @@ static const struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, server_failure_limit) },
 
+    { string("hedge_delay"),
+      conf_set_delay,
+      offsetof(struct conf_pool, hedge_delay) },
+
+    { string("hedge_budget"),
+      conf_set_num,
+      offsetof(struct conf_pool, hedge_budget) },
+
+    { string("hotkey_sample"),
+      conf_set_num,
+      offsetof(struct conf_pool, hotkey_sample) },
+
+    { string("near_cache_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, near_cache_size) },
+
+    { string("near_cache_ttl_ms"),
+      conf_set_num,
+      offsetof(struct conf_pool, near_cache_ttl) },
+
+    { string("near_cache_pattern"),
+      conf_set_string,
+      offsetof(struct conf_pool, near_cache_pattern) },
+
+    { string("coalesce_reads"),
+      conf_set_bool,
+      offsetof(struct conf_pool, coalesce_reads) },
+
+    { string("batch_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, batch_size) },
+
+    { string("batch_delay"),
+      conf_set_num,
+      offsetof(struct conf_pool, batch_delay) },
+
+    { string("mirror"),
+      conf_set_string,
+      offsetof(struct conf_pool, mirror) },
+
+    { string("mirror_sample_rate"),
+      conf_set_num,
+      offsetof(struct conf_pool, mirror_sample_rate) },
+
+    { string("mirror_commands"),
+      conf_set_mirror_commands,
+      offsetof(struct conf_pool, mirror_writes) },
+
+    { string("mirror_queue_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, mirror_queue_size) },
+
     { string("servers"),
       conf_add_server,
       offsetof(struct conf_pool, server) },
@@ -119,6 +175,8 @@ static const struct command conf_commands[] = {
 
 static const struct string true_str = string("true");
 static const struct string false_str = string("false");
+static const struct string reads_str = string("reads");
+static const struct string all_str = string("all");
 
 static void
 conf_server_init(struct conf_server *cs)
@@ -131,6 +189,8 @@ conf_server_init(struct conf_server *cs)
 
     memset(&cs->info, 0, sizeof(cs->info));
 
+    array_null(&cs->replica);
+
     cs->valid = 0;
 
     log_debug(LOG_VVERB, "init conf server %p", cs);
@@ -142,6 +202,10 @@ conf_server_deinit(struct conf_server *cs)
     string_deinit(&cs->pname);
     string_deinit(&cs->name);
     string_deinit(&cs->addrstr);
+    while (array_n(&cs->replica) != 0) {
+        conf_server_deinit(array_pop(&cs->replica));
+    }
+    array_deinit(&cs->replica);
     cs->valid = 0;
     log_debug(LOG_VVERB, "deinit conf server %p", cs);
 }
@@ -174,6 +238,16 @@ conf_server_each_transform(void *elem, void *data)
 
     s->next_retry = 0LL;
     s->failure_count = 0;
+    s->nqueue = 0;
+    s->latency = 0LL;
+    s->score = 0LL;
+
+    s->replica = NULL;
+    s->nreplica = 0;
+
+    s->is_replica = 0;
+    s->retired = 0;
+    s->discovered = 0;
 
     log_debug(LOG_VERB, "transform to server %"PRIu32" '%.*s'",
               s->idx, s->pname.len, s->pname.data);
@@ -191,6 +265,8 @@ conf_pool_init(struct conf_pool *cp, const struct string *name)
     string_init(&cp->listen.pname);
     string_init(&cp->listen.name);
     string_init(&cp->redis_auth);
+    string_init(&cp->near_cache_pattern);
+    string_init(&cp->mirror);
     cp->listen.port = 0;
     memset(&cp->listen.info, 0, sizeof(cp->listen.info));
     cp->listen.valid = 0;
@@ -198,6 +274,7 @@ conf_pool_init(struct conf_pool *cp, const struct string *name)
     cp->hash = CONF_UNSET_HASH;
     string_init(&cp->hash_tag);
     cp->distribution = CONF_UNSET_DIST;
+    cp->hash_load_bound = CONF_UNSET_NUM;
 
     cp->timeout = CONF_UNSET_NUM;
     cp->backlog = CONF_UNSET_NUM;
@@ -213,6 +290,18 @@ conf_pool_init(struct conf_pool *cp, const struct string *name)
     cp->server_connections = CONF_UNSET_NUM;
     cp->server_retry_timeout = CONF_UNSET_NUM;
     cp->server_failure_limit = CONF_UNSET_NUM;
+    cp->hedge_delay.msec = CONF_UNSET_NUM;
+    cp->hedge_delay.permille = CONF_UNSET_NUM;
+    cp->hedge_budget = CONF_UNSET_NUM;
+    cp->hotkey_sample = CONF_UNSET_NUM;
+    cp->near_cache_size = CONF_UNSET_NUM;
+    cp->near_cache_ttl = CONF_UNSET_NUM;
+    cp->coalesce_reads = CONF_UNSET_NUM;
+    cp->batch_size = CONF_UNSET_NUM;
+    cp->batch_delay = CONF_UNSET_NUM;
+    cp->mirror_sample_rate = CONF_UNSET_NUM;
+    cp->mirror_writes = CONF_UNSET_NUM;
+    cp->mirror_queue_size = CONF_UNSET_NUM;
 
     array_null(&cp->server);
 
@@ -247,6 +336,14 @@ conf_pool_deinit(struct conf_pool *cp)
         string_deinit(&cp->redis_auth);
     }
 
+    if (cp->near_cache_pattern.len > 0) {
+        string_deinit(&cp->near_cache_pattern);
+    }
+
+    if (cp->mirror.len > 0) {
+        string_deinit(&cp->mirror);
+    }
+
     while (array_n(&cp->server) != 0) {
         conf_server_deinit(array_pop(&cp->server));
     }
@@ -276,11 +373,16 @@ conf_pool_each_transform(void *elem, void *data)
     TAILQ_INIT(&sp->c_conn_q);
 
     array_null(&sp->server);
+    array_null(&sp->replica);
     sp->ncontinuum = 0;
     sp->nserver_continuum = 0;
     sp->continuum = NULL;
+    sp->dist_data = NULL;
     sp->nlive_server = 0;
     sp->next_rebuild = 0LL;
+    sp->next_slots_refresh = 0LL;
+    sp->nqueue = 0;
+    sp->nqueue_bytes = 0;
 
     sp->name = cp->name;
     sp->addrstr = cp->listen.pname;
@@ -293,6 +395,10 @@ conf_pool_each_transform(void *elem, void *data)
     sp->key_hash = hash_algos[cp->hash];
     sp->dist_type = cp->distribution;
     sp->hash_tag = cp->hash_tag;
+    sp->load_bound = (uint32_t)cp->hash_load_bound;
+    if (sp->dist_type == DIST_REDIS_CLUSTER) {
+        string_set_text(&sp->hash_tag, "{}");
+    }
 
     sp->tcpkeepalive = cp->tcpkeepalive ? 1 : 0;
     sp->reuseport = cp->reuseport ? 1 : 0;
@@ -312,6 +418,57 @@ conf_pool_each_transform(void *elem, void *data)
     sp->auto_eject_hosts = cp->auto_eject_hosts ? 1 : 0;
     sp->preconnect = cp->preconnect ? 1 : 0;
 
+    sp->hedge_delay = (uint32_t)cp->hedge_delay.msec;
+    sp->hedge_permille = (uint32_t)cp->hedge_delay.permille;
+    sp->hedge_budget = (uint32_t)cp->hedge_budget;
+    sp->hedge_tokens = 0;
+    sp->hedge_latency = NULL;
+    sp->hotkey = NULL;
+    sp->near_cache = NULL;
+    sp->near_cache_pattern = cp->near_cache_pattern;
+    sp->coalesce_q = NULL;
+    sp->batch_size = (uint32_t)cp->batch_size;
+    sp->batch_delay = (uint32_t)cp->batch_delay;
+    sp->mirror = NULL;
+    sp->mirror_name = cp->mirror;
+    sp->mirror_rate = (uint32_t)cp->mirror_sample_rate;
+    sp->mirror_writes = cp->mirror_writes ? 1 : 0;
+    sp->mirror_queue_size = (size_t)cp->mirror_queue_size;
+    if (sp->hedge_permille != 0) {
+        sp->hedge_latency = nc_zalloc(sizeof(*sp->hedge_latency));
+        if (sp->hedge_latency == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    if (cp->hotkey_sample != 0) {
+        sp->hotkey = hotkey_create((uint32_t)cp->hotkey_sample);
+        if (sp->hotkey == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    if (cp->near_cache_size != 0) {
+        sp->near_cache = nearcache_create((size_t)cp->near_cache_size,
+                                          cp->near_cache_ttl);
+        if (sp->near_cache == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    if (cp->coalesce_reads) {
+        uint32_t i;
+
+        sp->coalesce_q = nc_alloc(sizeof(*sp->coalesce_q) * COALESCE_NBUCKET);
+        if (sp->coalesce_q == NULL) {
+            return NC_ENOMEM;
+        }
+
+        for (i = 0; i < COALESCE_NBUCKET; i++) {
+            TAILQ_INIT(&sp->coalesce_q[i]);
+        }
+    }
+
     status = server_init(&sp->server, &cp->server, sp);
     if (status != NC_OK) {
         return status;
@@ -350,6 +507,7 @@ conf_dump(const struct conf *cf)
         log_debug(LOG_VVERB, "  hash_tag: \"%.*s\"", cp->hash_tag.len,
                   cp->hash_tag.data);
         log_debug(LOG_VVERB, "  distribution: %d", cp->distribution);
+        log_debug(LOG_VVERB, "  hash_load_bound: %d", cp->hash_load_bound);
         log_debug(LOG_VVERB, "  client_connections: %d",
                   cp->client_connections);
         log_debug(LOG_VVERB, "  redis: %d", cp->redis);
@@ -361,6 +519,25 @@ conf_dump(const struct conf *cf)
                   cp->server_retry_timeout);
         log_debug(LOG_VVERB, "  server_failure_limit: %d",
                   cp->server_failure_limit);
+        log_debug(LOG_VVERB, "  hedge_delay: %d msec, p%d.%d",
+                  cp->hedge_delay.msec, cp->hedge_delay.permille / 10,
+                  cp->hedge_delay.permille % 10);
+        log_debug(LOG_VVERB, "  hedge_budget: %d", cp->hedge_budget);
+        log_debug(LOG_VVERB, "  hotkey_sample: %d", cp->hotkey_sample);
+        log_debug(LOG_VVERB, "  near_cache_size: %d", cp->near_cache_size);
+        log_debug(LOG_VVERB, "  near_cache_ttl_ms: %d", cp->near_cache_ttl);
+        log_debug(LOG_VVERB, "  near_cache_pattern: \"%.*s\"",
+                  cp->near_cache_pattern.len, cp->near_cache_pattern.data);
+        log_debug(LOG_VVERB, "  coalesce_reads: %d", cp->coalesce_reads);
+        log_debug(LOG_VVERB, "  batch_size: %d", cp->batch_size);
+        log_debug(LOG_VVERB, "  batch_delay: %d", cp->batch_delay);
+        log_debug(LOG_VVERB, "  mirror: \"%.*s\"", cp->mirror.len,
+                  cp->mirror.data);
+        log_debug(LOG_VVERB, "  mirror_sample_rate: %d",
+                  cp->mirror_sample_rate);
+        log_debug(LOG_VVERB, "  mirror_commands: %s",
+                  cp->mirror_writes ? "all" : "reads");
+        log_debug(LOG_VVERB, "  mirror_queue_size: %d", cp->mirror_queue_size);
 
         nserver = array_n(&cp->server);
         log_debug(LOG_VVERB, "  servers: %"PRIu32"", nserver);
@@ -796,6 +973,7 @@ conf_open(const char *filename)
     cf->fname = filename;
     cf->fh = fh;
     cf->depth = 0;
+    cf->nref = 1;
     /* parser, event, and token are initialized later */
     cf->seq = 0;
     cf->valid_parser = 0;
@@ -1188,6 +1366,28 @@ conf_validate_server(struct conf *cf, struct conf_pool *cp)
      * is configured, we only check for duplicate "name" and not for duplicate
      * "host:port:weight"
      */
+    for (i = 0; i < nserver; i++) {
+        struct conf_server *cs = array_get(&cp->server, i);
+
+        if (array_n(&cs->replica) == 0) {
+            continue;
+        }
+
+        if (!cp->redis) {
+            log_error("conf: pool '%.*s' has replicas of server '%.*s', which "
+                      "are only valid for a redis pool", cp->name.len,
+                      cp->name.data, cs->name.len, cs->name.data);
+            return NC_ERROR;
+        }
+
+        if (cp->distribution == DIST_REDIS_CLUSTER) {
+            log_error("conf: pool '%.*s' has replicas of server '%.*s', which "
+                      "cannot be used with distribution \"redis_cluster\"",
+                      cp->name.len, cp->name.data, cs->name.len, cs->name.data);
+            return NC_ERROR;
+        }
+    }
+
     array_sort(&cp->server, conf_server_name_cmp);
     for (valid = true, i = 0; i < nserver - 1; i++) {
         struct conf_server *cs1, *cs2;
@@ -1210,6 +1410,48 @@ conf_validate_server(struct conf *cf, struct conf_pool *cp)
     return NC_OK;
 }
 
+/*
+ * A redis_cluster pool maps keys to slots the way redis cluster does, so
+ * directives that would change that mapping or make it server dependent
+ * are rejected
+ */
+static rstatus_t
+conf_validate_cluster(struct conf_pool *cp)
+{
+    ASSERT(cp->distribution == DIST_REDIS_CLUSTER);
+
+    if (cp->redis != 1) {
+        log_error("conf: distribution \"redis_cluster\" is only valid for a redis pool");
+        return NC_ERROR;
+    }
+
+    if (cp->hash != CONF_UNSET_HASH && cp->hash != HASH_CRC16) {
+        log_error("conf: distribution \"redis_cluster\" requires hash \"crc16\"");
+        return NC_ERROR;
+    }
+
+    if (!string_empty(&cp->hash_tag) &&
+        (cp->hash_tag.data[0] != '{' || cp->hash_tag.data[1] != '}')) {
+        log_error("conf: distribution \"redis_cluster\" requires hash_tag \"{}\"");
+        return NC_ERROR;
+    }
+
+    if (cp->redis_db > 0) {
+        log_error("conf: distribution \"redis_cluster\" requires redis_db 0");
+        return NC_ERROR;
+    }
+
+    if (cp->auto_eject_hosts == 1) {
+        log_error("conf: distribution \"redis_cluster\" cannot be used with "
+                  "auto_eject_hosts");
+        return NC_ERROR;
+    }
+
+    cp->hash = HASH_CRC16;
+
+    return NC_OK;
+}
+
 static rstatus_t
 conf_validate_pool(struct conf *cf, struct conf_pool *cp)
 {
@@ -1223,6 +1465,13 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         return NC_ERROR;
     }
 
+    if (cp->distribution == DIST_REDIS_CLUSTER) {
+        status = conf_validate_cluster(cp);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     /* set default values for unset directives */
 
     if (cp->distribution == CONF_UNSET_DIST) {
@@ -1282,6 +1531,131 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->server_failure_limit = CONF_DEFAULT_SERVER_FAILURE_LIMIT;
     }
 
+    if (cp->hash_load_bound == CONF_UNSET_NUM) {
+        cp->hash_load_bound = CONF_DEFAULT_HASH_LOAD_BOUND;
+    } else if (cp->distribution != DIST_KETAMA) {
+        log_error("conf: directive \"hash_load_bound:\" is only valid for "
+                  "the ketama distribution");
+        return NC_ERROR;
+    } else if (cp->hash_load_bound < 100) {
+        log_error("conf: directive \"hash_load_bound:\" cannot be less than 1");
+        return NC_ERROR;
+    }
+
+    if (cp->hedge_delay.msec == CONF_UNSET_NUM &&
+        cp->hedge_delay.permille == CONF_UNSET_NUM) {
+        cp->hedge_delay.msec = CONF_DEFAULT_HEDGE_DELAY;
+        cp->hedge_delay.permille = 0;
+    } else if (!cp->redis || cp->distribution == DIST_REDIS_CLUSTER) {
+        log_error("conf: directive \"hedge_delay:\" is only valid for a redis "
+                  "pool with replicas");
+        return NC_ERROR;
+    }
+
+    if (cp->hedge_budget == CONF_UNSET_NUM) {
+        cp->hedge_budget = CONF_DEFAULT_HEDGE_BUDGET;
+    } else if (cp->hedge_delay.msec == 0 && cp->hedge_delay.permille == 0) {
+        log_error("conf: directive \"hedge_budget:\" requires \"hedge_delay:\"");
+        return NC_ERROR;
+    } else if (cp->hedge_budget == 0 || cp->hedge_budget > 100) {
+        log_error("conf: directive \"hedge_budget:\" must be between 1 and 100");
+        return NC_ERROR;
+    }
+
+    if (cp->hotkey_sample == CONF_UNSET_NUM) {
+        cp->hotkey_sample = CONF_DEFAULT_HOTKEY_SAMPLE;
+    }
+
+    if (cp->near_cache_size == CONF_UNSET_NUM) {
+        cp->near_cache_size = CONF_DEFAULT_NEAR_CACHE_SIZE;
+    }
+
+    if (cp->near_cache_ttl == CONF_UNSET_NUM) {
+        cp->near_cache_ttl = CONF_DEFAULT_NEAR_CACHE_TTL;
+    } else if (cp->near_cache_size == 0) {
+        log_error("conf: directive \"near_cache_ttl_ms:\" requires "
+                  "\"near_cache_size:\"");
+        return NC_ERROR;
+    } else if (cp->near_cache_ttl == 0) {
+        log_error("conf: directive \"near_cache_ttl_ms:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->near_cache_pattern.len > 0 && cp->near_cache_size == 0) {
+        log_error("conf: directive \"near_cache_pattern:\" requires "
+                  "\"near_cache_size:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->coalesce_reads == CONF_UNSET_NUM) {
+        cp->coalesce_reads = CONF_DEFAULT_COALESCE_READS;
+    }
+
+    if (cp->batch_size == CONF_UNSET_NUM) {
+        cp->batch_size = CONF_DEFAULT_BATCH_SIZE;
+    } else if (cp->batch_size == 1) {
+        log_error("conf: directive \"batch_size:\" must be 0 or at least 2");
+        return NC_ERROR;
+    } else if (cp->batch_size > CONF_MAX_BATCH_SIZE) {
+        log_error("conf: directive \"batch_size:\" cannot be more than %d",
+                  CONF_MAX_BATCH_SIZE);
+        return NC_ERROR;
+    } else if (cp->batch_size != 0 &&
+               cp->distribution == DIST_REDIS_CLUSTER) {
+        log_error("conf: directive \"batch_size:\" is not valid for the "
+                  "redis_cluster distribution");
+        return NC_ERROR;
+    }
+
+    if (cp->batch_delay == CONF_UNSET_NUM) {
+        cp->batch_delay = CONF_DEFAULT_BATCH_DELAY;
+    } else if (cp->batch_size == 0) {
+        log_error("conf: directive \"batch_delay:\" requires \"batch_size:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->mirror_sample_rate == CONF_UNSET_NUM) {
+        cp->mirror_sample_rate = CONF_DEFAULT_MIRROR_SAMPLE_RATE;
+    } else if (cp->mirror.len == 0) {
+        log_error("conf: directive \"mirror_sample_rate:\" requires \"mirror:\"");
+        return NC_ERROR;
+    } else if (cp->mirror_sample_rate == 0 || cp->mirror_sample_rate > 100) {
+        log_error("conf: directive \"mirror_sample_rate:\" must be between 1 "
+                  "and 100");
+        return NC_ERROR;
+    }
+
+    if (cp->mirror_writes == CONF_UNSET_NUM) {
+        cp->mirror_writes = CONF_DEFAULT_MIRROR_WRITES;
+    } else if (cp->mirror.len == 0) {
+        log_error("conf: directive \"mirror_commands:\" requires \"mirror:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->mirror_queue_size == CONF_UNSET_NUM) {
+        cp->mirror_queue_size = CONF_DEFAULT_MIRROR_QUEUE_SIZE;
+    } else if (cp->mirror.len == 0) {
+        log_error("conf: directive \"mirror_queue_size:\" requires \"mirror:\"");
+        return NC_ERROR;
+    } else if (cp->mirror_queue_size == 0) {
+        log_error("conf: directive \"mirror_queue_size:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->mirror.len > 0 && string_compare(&cp->mirror, &cp->name) == 0) {
+        log_error("conf: pool '%.*s' cannot mirror to itself", cp->name.len,
+                  cp->name.data);
+        return NC_ERROR;
+    }
+
+    if (cp->near_cache_size != 0 && cp->near_cache_pattern.len == 0 &&
+        cp->hotkey_sample == 0) {
+        log_error("conf: directive \"near_cache_size:\" requires "
+                  "\"near_cache_pattern:\" or \"hotkey_sample:\" to pick the "
+                  "keys to cache");
+        return NC_ERROR;
+    }
+
     if (!cp->redis && cp->redis_auth.len > 0) {
         log_error("conf: directive \"redis_auth:\" is only valid for a redis pool");
         return NC_ERROR;
@@ -1363,6 +1737,38 @@ conf_post_validate(struct conf *cf)
         return NC_ERROR;
     }
 
+    /* a pool mirrors to another pool that speaks the same protocol */
+    for (i = 0; i < npool; i++) {
+        struct conf_pool *cp, *mp;
+        uint32_t j;
+
+        cp = array_get(&cf->pool, i);
+        if (cp->mirror.len == 0) {
+            continue;
+        }
+
+        for (mp = NULL, j = 0; j < npool && mp == NULL; j++) {
+            mp = array_get(&cf->pool, j);
+            if (string_compare(&mp->name, &cp->mirror) != 0) {
+                mp = NULL;
+            }
+        }
+
+        if (mp == NULL) {
+            log_error("conf: pool '%.*s' mirrors to pool '%.*s' that does not "
+                      "exist", cp->name.len, cp->name.data, cp->mirror.len,
+                      cp->mirror.data);
+            return NC_ERROR;
+        }
+
+        if (mp->redis != cp->redis) {
+            log_error("conf: pool '%.*s' mirrors to pool '%.*s' of another "
+                      "protocol", cp->name.len, cp->name.data, mp->name.len,
+                      mp->name.data);
+            return NC_ERROR;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -1411,9 +1817,29 @@ error:
     return NULL;
 }
 
+/*
+ * Share cf with one more context. The worker contexts share the conf that
+ * the main context parsed, as their pools refer to its strings
+ */
+struct conf *
+conf_ref(struct conf *cf)
+{
+    __sync_add_and_fetch(&cf->nref, 1);
+    return cf;
+}
+
+/* Drop a reference to cf and destroy it once no context shares it */
 void
 conf_destroy(struct conf *cf)
 {
+    if (__sync_sub_and_fetch(&cf->nref, 1) != 0) {
+        return;
+    }
+
+    /* a parse that failed midway leaves its event and parser behind */
+    conf_event_done(cf);
+    conf_yaml_deinit(cf);
+
     while (array_n(&cf->arg) != 0) {
         conf_pop_scalar(cf);
     }
@@ -1541,6 +1967,78 @@ conf_set_listen(struct conf *cf, const struct command *cmd, void *conf)
     return CONF_OK;
 }
 
+/*
+ * Parse the space separated "hostname:port" or "/path/unix_socket" replicas
+ * in [p, end) of a "hostname:port:weight name replica..." server into the
+ * replicas of cs
+ */
+static const char *
+conf_add_replicas(struct conf_server *cs, uint8_t *p, uint8_t *end)
+{
+    rstatus_t status;
+    struct conf_server *field;
+    uint8_t *q, *colon;
+
+    for (; p < end; p = q + 1) {
+        q = nc_strchr(p, end, ' ');
+        if (q == NULL) {
+            q = end;
+        }
+        if (q == p) {
+            continue;
+        }
+
+        if (cs->replica.elem == NULL &&
+            array_init(&cs->replica, CONF_DEFAULT_REPLICAS,
+                       sizeof(struct conf_server)) != NC_OK) {
+            return CONF_ERROR;
+        }
+
+        field = array_push(&cs->replica);
+        if (field == NULL) {
+            return CONF_ERROR;
+        }
+
+        conf_server_init(field);
+
+        status = string_copy(&field->pname, p, (uint32_t)(q - p));
+        if (status != NC_OK) {
+            return CONF_ERROR;
+        }
+
+        status = string_copy(&field->name, p, (uint32_t)(q - p));
+        if (status != NC_OK) {
+            return CONF_ERROR;
+        }
+
+        if (*p == '/') {
+            colon = q;
+        } else {
+            colon = nc_strrchr(q - 1, p, ':');
+            if (colon == NULL || colon == p) {
+                return "has an invalid replica in \"hostname:port:weight name "
+                       "hostname:port...\" format string";
+            }
+
+            field->port = nc_atoi(colon + 1, (q - colon - 1));
+            if (field->port < 0 || !nc_valid_port(field->port)) {
+                return "has an invalid replica port in \"hostname:port:weight "
+                       "name hostname:port...\" format string";
+            }
+        }
+
+        status = string_copy(&field->addrstr, p, (uint32_t)(colon - p));
+        if (status != NC_OK) {
+            return CONF_ERROR;
+        }
+
+        field->weight = 1;
+        field->valid = 1;
+    }
+
+    return CONF_OK;
+}
+
 const char *
 conf_add_server(struct conf *cf, const struct command *cmd, void *conf)
 {
@@ -1548,10 +2046,11 @@ conf_add_server(struct conf *cf, const struct command *cmd, void *conf)
     struct array *a;
     struct string *value;
     struct conf_server *field;
-    uint8_t *p, *q, *start;
+    uint8_t *p, *q, *start, *end;
     uint8_t *pname, *addr, *port, *weight, *name;
     uint32_t k, delimlen, pnamelen, addrlen, portlen, weightlen, namelen;
     const char *const delim = " ::";
+    const char *err;
 
     p = conf;
     a = (struct array *)(p + cmd->offset);
@@ -1565,8 +2064,22 @@ conf_add_server(struct conf *cf, const struct command *cmd, void *conf)
 
     value = array_top(&cf->arg);
 
+    /* the replicas of a server follow its name, separated by spaces */
+    end = value->data + value->len;
+    q = nc_strchr(value->data, end, ' ');
+    if (q != NULL) {
+        q = nc_strchr(q + 1, end, ' ');
+    }
+    if (q != NULL) {
+        err = conf_add_replicas(field, q + 1, end);
+        if (err != CONF_OK) {
+            return err;
+        }
+        end = q;
+    }
+
     /* parse "hostname:port:weight [name]" or "/path/unix_socket:weight [name]" from the end */
-    p = value->data + value->len - 1;
+    p = end - 1;
     start = value->data;
     addr = NULL;
     addrlen = 0;
@@ -1620,7 +2133,8 @@ conf_add_server(struct conf *cf, const struct command *cmd, void *conf)
     }
 
     pname = value->data;
-    pnamelen = namelen > 0 ? value->len - (namelen + 1) : value->len;
+    pnamelen = (uint32_t)(end - value->data);
+    pnamelen = namelen > 0 ? pnamelen - (namelen + 1) : pnamelen;
     status = string_copy(&field->pname, pname, pnamelen);
     if (status != NC_OK) {
         array_pop(a);
@@ -1707,6 +2221,104 @@ conf_set_num(struct conf *cf, const struct command *cmd, void *conf)
     return CONF_OK;
 }
 
+/*
+ * Set a non-negative decimal with up to two fractional digits, like "1.25",
+ * in 1/100ths
+ */
+const char *
+conf_set_ratio(struct conf *cf, const struct command *cmd, void *conf)
+{
+    uint8_t *p, *dot;
+    int num, frac, *np;
+    uint32_t fraclen;
+    const struct string *value;
+
+    p = conf;
+    np = (int *)(p + cmd->offset);
+
+    if (*np != CONF_UNSET_NUM) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    dot = nc_strchr(value->data, value->data + value->len, '.');
+    if (dot == NULL) {
+        num = nc_atoi(value->data, value->len);
+        frac = 0;
+    } else {
+        num = nc_atoi(value->data, (uint32_t)(dot - value->data));
+        fraclen = (uint32_t)(value->data + value->len - dot - 1);
+        if (fraclen == 0 || fraclen > 2) {
+            return "is not a number with up to two decimals";
+        }
+        frac = nc_atoi(dot + 1, fraclen);
+        if (frac >= 0 && fraclen == 1) {
+            frac *= 10;
+        }
+    }
+    if (num < 0 || frac < 0 || num > INT_MAX / 100 - 1) {
+        return "is not a number with up to two decimals";
+    }
+
+    *np = num * 100 + frac;
+
+    return CONF_OK;
+}
+
+/*
+ * Set a delay, given either in msec as in "10" or as a percentile of the
+ * latency with up to one decimal as in "p95" or "p99.9"
+ */
+const char *
+conf_set_delay(struct conf *cf, const struct command *cmd, void *conf)
+{
+    uint8_t *p, *dot;
+    int num, frac;
+    struct conf_delay *field;
+    const struct string *value;
+
+    p = conf;
+    field = (struct conf_delay *)(p + cmd->offset);
+
+    if (field->msec != CONF_UNSET_NUM || field->permille != CONF_UNSET_NUM) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    if (value->len == 0 || value->data[0] != 'p') {
+        num = nc_atoi(value->data, value->len);
+        if (num <= 0) {
+            return "is not a positive number or a percentile";
+        }
+
+        field->msec = num;
+        field->permille = 0;
+
+        return CONF_OK;
+    }
+
+    dot = nc_strchr(value->data + 1, value->data + value->len, '.');
+    if (dot == NULL) {
+        num = nc_atoi(value->data + 1, value->len - 1);
+        frac = 0;
+    } else if (value->data + value->len - dot != 2) {
+        return "is not a percentile with up to one decimal";
+    } else {
+        num = nc_atoi(value->data + 1, (uint32_t)(dot - value->data - 1));
+        frac = nc_atoi(dot + 1, 1);
+    }
+    if (num < 0 || num > 99 || frac < 0 || num * 10 + frac == 0) {
+        return "is not a percentile with up to one decimal";
+    }
+
+    field->msec = 0;
+    field->permille = num * 10 + frac;
+
+    return CONF_OK;
+}
+
 const char *
 conf_set_bool(struct conf *cf, const struct command *cmd, void *conf)
 {
@@ -1792,6 +2404,33 @@ conf_set_distribution(struct conf *cf, const struct command *cmd, void *conf)
     return "is not a valid distribution";
 }
 
+const char *
+conf_set_mirror_commands(struct conf *cf, const struct command *cmd, void *conf)
+{
+    uint8_t *p;
+    int *bp;
+    const struct string *value;
+
+    p = conf;
+    bp = (int *)(p + cmd->offset);
+
+    if (*bp != CONF_UNSET_NUM) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    if (string_compare(value, &all_str) == 0) {
+        *bp = 1;
+    } else if (string_compare(value, &reads_str) == 0) {
+        *bp = 0;
+    } else {
+        return "is not \"reads\" or \"all\"";
+    }
+
+    return CONF_OK;
+}
+
 const char *
 conf_set_hashtag(struct conf *cf, const struct command *cmd, void *conf)
 {
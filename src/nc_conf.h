@@ -35,6 +35,9 @@
 #define CONF_DEFAULT_ARGS       3
 #define CONF_DEFAULT_POOL       8
 #define CONF_DEFAULT_SERVERS    8
+#define CONF_DEFAULT_REPLICAS   2
+
+#define CONF_MAX_BATCH_SIZE     1024
 
 #define CONF_UNSET_NUM  -1
 #define CONF_UNSET_PTR  NULL
@@ -43,6 +46,18 @@
 
 #define CONF_DEFAULT_HASH                    HASH_FNV1A_64
 #define CONF_DEFAULT_DIST                    DIST_KETAMA
+#define CONF_DEFAULT_HASH_LOAD_BOUND         0              /* disabled */
+#define CONF_DEFAULT_HEDGE_DELAY             0              /* disabled */
+#define CONF_DEFAULT_HEDGE_BUDGET            10             /* in % of reads */
+#define CONF_DEFAULT_HOTKEY_SAMPLE           64             /* one in 64 requests */
+#define CONF_DEFAULT_NEAR_CACHE_SIZE         0              /* disabled */
+#define CONF_DEFAULT_NEAR_CACHE_TTL          1000           /* in msec */
+#define CONF_DEFAULT_COALESCE_READS          false
+#define CONF_DEFAULT_BATCH_SIZE              0              /* disabled */
+#define CONF_DEFAULT_BATCH_DELAY             0              /* in msec */
+#define CONF_DEFAULT_MIRROR_SAMPLE_RATE      100            /* in % of requests */
+#define CONF_DEFAULT_MIRROR_WRITES           false          /* reads only */
+#define CONF_DEFAULT_MIRROR_QUEUE_SIZE       (8 * 1024 * 1024) /* in bytes */
 #define CONF_DEFAULT_TIMEOUT                 -1
 #define CONF_DEFAULT_LISTEN_BACKLOG          512
 #define CONF_DEFAULT_CLIENT_CONNECTIONS      0
@@ -66,6 +81,11 @@ struct conf_listen {
     unsigned        valid:1; /* valid? */
 };
 
+struct conf_delay {
+    int             msec;       /* delay in msec */
+    int             permille;   /* or delay as a latency percentile, in per mille */
+};
+
 struct conf_server {
     struct string   pname;      /* server: as "hostname:port:weight" */
     struct string   name;       /* hostname:port or [name] */
@@ -73,6 +93,7 @@ struct conf_server {
     int             port;       /* port */
     int             weight;     /* weight */
     struct sockinfo info;       /* connect socket info */
+    struct array    replica;    /* replicas: conf_server[] */
     unsigned        valid:1;    /* valid? */
 };
 
@@ -82,6 +103,7 @@ struct conf_pool {
     hash_type_t        hash;                  /* hash: */
     struct string      hash_tag;              /* hash_tag: */
     dist_type_t        distribution;          /* distribution: */
+    int                hash_load_bound;       /* hash_load_bound: in 1/100ths */
     int                timeout;               /* timeout: */
     int                backlog;               /* backlog: */
     int                client_connections;    /* client_connections: */
@@ -94,6 +116,19 @@ struct conf_pool {
     int                server_connections;    /* server_connections: */
     int                server_retry_timeout;  /* server_retry_timeout: in msec */
     int                server_failure_limit;  /* server_failure_limit: */
+    struct conf_delay  hedge_delay;           /* hedge_delay: */
+    int                hedge_budget;          /* hedge_budget: in % of reads */
+    int                hotkey_sample;         /* hotkey_sample: */
+    int                near_cache_size;       /* near_cache_size: in bytes */
+    int                near_cache_ttl;        /* near_cache_ttl_ms: in msec */
+    struct string      near_cache_pattern;    /* near_cache_pattern: */
+    int                coalesce_reads;        /* coalesce_reads: */
+    int                batch_size;            /* batch_size: */
+    int                batch_delay;           /* batch_delay: in msec */
+    struct string      mirror;                /* mirror: pool name */
+    int                mirror_sample_rate;    /* mirror_sample_rate: in % of requests */
+    int                mirror_writes;         /* mirror_commands: all? */
+    int                mirror_queue_size;     /* mirror_queue_size: in bytes */
     struct array       server;                /* servers: conf_server[] */
     unsigned           valid:1;               /* valid? */
     int                reuseport;             /* set SO_REUSEPORT to socket */
@@ -105,6 +140,7 @@ struct conf {
     struct array  arg;              /* string[] (parsed {key, value} pairs) */
     struct array  pool;             /* conf_pool[] (parsed pools) */
     uint32_t      depth;            /* parsed tree depth */
+    uint32_t      nref;             /* # contexts sharing conf */
     yaml_parser_t parser;           /* yaml parser */
     yaml_event_t  event;            /* yaml event */
     yaml_token_t  token;            /* yaml token */
@@ -129,15 +165,19 @@ const char *conf_set_string(struct conf *cf, const struct command *cmd, void *co
 const char *conf_set_listen(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_add_server(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_num(struct conf *cf, const struct command *cmd, void *conf);
+const char *conf_set_ratio(struct conf *cf, const struct command *cmd, void *conf);
+const char *conf_set_delay(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_bool(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_hash(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_distribution(struct conf *cf, const struct command *cmd, void *conf);
+const char *conf_set_mirror_commands(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_hashtag(struct conf *cf, const struct command *cmd, void *conf);
 
 rstatus_t conf_server_each_transform(void *elem, void *data);
 rstatus_t conf_pool_each_transform(void *elem, void *data);
 
 struct conf *conf_create(const char *filename);
+struct conf *conf_ref(struct conf *cf);
 void conf_destroy(struct conf *cf);
 
 #endif
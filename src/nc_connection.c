@@ -81,11 +81,16 @@
  * the queue.
  */
 
-static uint32_t nfree_connq;       /* # free conn q */
-static struct conn_tqh free_connq; /* free conn q */
-static uint64_t ntotal_conn;       /* total # connections counter from start */
-static uint32_t ncurr_conn;        /* current # connections */
-static uint32_t ncurr_cconn;       /* current # client connections */
+/*
+ * Free connection q is private to each worker thread, while the connection
+ * counters are shared by all the worker threads and the stats aggregator
+ * and hence are updated atomically.
+ */
+static __thread uint32_t nfree_connq;       /* # free conn q */
+static __thread struct conn_tqh free_connq; /* free conn q */
+static uint64_t ntotal_conn;                /* total # connections counter from start */
+static uint32_t ncurr_conn;                 /* current # connections */
+static uint32_t ncurr_cconn;                /* current # client connections */
 
 /*
  * Return the context associated with this connection.
@@ -132,6 +137,7 @@ _conn_get(void)
     TAILQ_INIT(&conn->omsg_q);
     conn->rmsg = NULL;
     conn->smsg = NULL;
+    conn->bmsg = NULL;
 
     /*
      * Callbacks {recv, recv_next, recv_done}, {send, send_next, send_done},
@@ -158,8 +164,8 @@ _conn_get(void)
     conn->redis = 0;
     conn->authenticated = 0;
 
-    ntotal_conn++;
-    ncurr_conn++;
+    __sync_add_and_fetch(&ntotal_conn, 1);
+    __sync_add_and_fetch(&ncurr_conn, 1);
 
     return conn;
 }
@@ -204,8 +210,9 @@ conn_get(void *owner, bool client, bool redis)
         conn->dequeue_outq = req_client_dequeue_omsgq;
         conn->post_connect = NULL;
         conn->swallow_msg = NULL;
+        conn->redirect = NULL;
 
-        ncurr_cconn++;
+        __sync_add_and_fetch(&ncurr_cconn, 1);
     } else {
         /*
          * server receives a response, possibly parsing it, and sends a
@@ -232,9 +239,11 @@ conn_get(void *owner, bool client, bool redis)
         if (redis) {
           conn->post_connect = redis_post_connect;
           conn->swallow_msg = redis_swallow_msg;
+          conn->redirect = redis_redirect;
         } else {
           conn->post_connect = memcache_post_connect;
           conn->swallow_msg = memcache_swallow_msg;
+          conn->redirect = memcache_redirect;
         }
     }
 
@@ -284,6 +293,59 @@ conn_get_proxy(struct server_pool *pool)
     return conn;
 }
 
+/*
+ * Return a connection that has the event loop of the context of pool call
+ * recv when descriptor sd is readable, and close when it is done with it.
+ * The descriptor is not a client, server or proxy socket, like the channel
+ * of an upgrade.
+ */
+struct conn *
+conn_get_channel(struct server_pool *pool, int sd, conn_recv_t recv,
+                 conn_close_t close)
+{
+    struct conn *conn;
+
+    conn = _conn_get();
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    /* owned by pool as a proxy, to be found in the context of pool */
+    conn->owner = pool;
+    conn->proxy = 1;
+
+    conn->sd = sd;
+    conn->family = AF_UNIX;
+    conn->addrlen = 0;
+    conn->addr = NULL;
+
+    conn->recv = recv;
+    conn->recv_next = NULL;
+    conn->recv_done = NULL;
+
+    conn->send = NULL;
+    conn->send_next = NULL;
+    conn->send_done = NULL;
+
+    conn->close = close;
+    conn->active = NULL;
+
+    conn->ref = NULL;
+    conn->unref = NULL;
+
+    conn->enqueue_inq = NULL;
+    conn->dequeue_inq = NULL;
+    conn->enqueue_outq = NULL;
+    conn->dequeue_outq = NULL;
+    conn->post_connect = NULL;
+    conn->swallow_msg = NULL;
+    conn->redirect = NULL;
+
+    log_debug(LOG_VVERB, "get conn %p channel %d", conn, conn->sd);
+
+    return conn;
+}
+
 static void
 conn_free(struct conn *conn)
 {
@@ -303,9 +365,9 @@ conn_put(struct conn *conn)
     TAILQ_INSERT_HEAD(&free_connq, conn, conn_tqe);
 
     if (conn->client) {
-        ncurr_cconn--;
+        __sync_sub_and_fetch(&ncurr_cconn, 1);
     }
-    ncurr_conn--;
+    __sync_sub_and_fetch(&ncurr_conn, 1);
 }
 
 void
@@ -340,7 +402,11 @@ conn_recv(struct conn *conn, void *buf, size_t size)
     ASSERT(conn->recv_ready);
 
     for (;;) {
+#ifdef NC_HAVE_IO_URING
+        n = event_recv(conn_to_ctx(conn)->evb, conn, buf, size);
+#else
         n = nc_read(conn->sd, buf, size);
+#endif
 
         log_debug(LOG_VERB, "recv on sd %d %zd of %zu", conn->sd, n, size);
 
@@ -432,19 +498,19 @@ conn_sendv(struct conn *conn, const struct array *sendv, size_t nsend)
 uint32_t
 conn_ncurr_conn(void)
 {
-    return ncurr_conn;
+    return __sync_add_and_fetch(&ncurr_conn, 0);
 }
 
 uint64_t
 conn_ntotal_conn(void)
 {
-    return ntotal_conn;
+    return __sync_add_and_fetch(&ntotal_conn, 0);
 }
 
 uint32_t
 conn_ncurr_cconn(void)
 {
-    return ncurr_cconn;
+    return __sync_add_and_fetch(&ncurr_cconn, 0);
 }
 
 /*
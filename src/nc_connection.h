@@ -37,6 +37,7 @@ typedef void (*conn_unref_t)(struct conn *);
 typedef void (*conn_msgq_t)(struct context *, struct conn *, struct msg *);
 typedef void (*conn_post_connect_t)(struct context *ctx, struct conn *, struct server *server);
 typedef void (*conn_swallow_msg_t)(struct conn *, struct msg *, struct msg *);
+typedef bool (*conn_redirect_t)(struct context *, struct conn *, struct msg *, struct msg *);
 
 struct conn {
     TAILQ_ENTRY(conn)   conn_tqe;        /* link in server_pool / server / free q */
@@ -51,6 +52,7 @@ struct conn {
     struct msg_tqh      omsg_q;          /* outstanding request Q */
     struct msg          *rmsg;           /* current message being rcvd */
     struct msg          *smsg;           /* current message being sent */
+    struct msg          *bmsg;           /* current batch of reads being collected */
 
     conn_recv_t         recv;            /* recv (read) handler */
     conn_recv_next_t    recv_next;       /* recv next message handler */
@@ -62,6 +64,7 @@ struct conn {
     conn_active_t       active;          /* active? handler */
     conn_post_connect_t post_connect;    /* post connect handler */
     conn_swallow_msg_t  swallow_msg;     /* react on messages to be swallowed */
+    conn_redirect_t     redirect;        /* follow redirect responses */
 
     conn_ref_t          ref;             /* connection reference handler */
     conn_unref_t        unref;           /* connection unreference handler */
@@ -96,6 +99,7 @@ TAILQ_HEAD(conn_tqh, conn);
 struct context *conn_to_ctx(const struct conn *conn);
 struct conn *conn_get(void *owner, bool client, bool redis);
 struct conn *conn_get_proxy(struct server_pool *pool);
+struct conn *conn_get_channel(struct server_pool *pool, int sd, conn_recv_t recv, conn_close_t close);
 void conn_put(struct conn *conn);
 ssize_t conn_recv(struct conn *conn, void *buf, size_t size);
 ssize_t conn_sendv(struct conn *conn, const struct array *sendv, size_t nsend);
@@ -17,15 +17,23 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <nc_core.h>
 #include <nc_conf.h>
 #include <nc_server.h>
 #include <nc_proxy.h>
+#include <nc_client.h>
+#include <nc_upgrade.h>
+#include <proto/nc_proto.h>
 
 static uint32_t ctx_id; /* context generation */
+static volatile sig_atomic_t nreload; /* # configuration reloads requested */
+static volatile sig_atomic_t nupgrade; /* # binary upgrades requested */
+static volatile int upgrading; /* new process of an upgrade starting? */
+static volatile int handoff; /* listeners handed off to a new process? */
 
 static rstatus_t
-core_calc_connections(struct context *ctx)
+core_calc_connections(struct context *ctx, int worker_threads)
 {
     int status;
     struct rlimit limit;
@@ -36,8 +44,13 @@ core_calc_connections(struct context *ctx)
         return NC_ERROR;
     }
 
+    /*
+     * All the worker threads share the same fd limit and each of them
+     * owns its own set of server connections
+     */
     ctx->max_nfd = (uint32_t)limit.rlim_cur;
-    ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn - RESERVED_FDS;
+    ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn * (uint32_t)worker_threads -
+                      RESERVED_FDS;
     log_debug(LOG_NOTICE, "max fds %"PRIu32" max client conns %"PRIu32" "
               "max server conns %"PRIu32"", ctx->max_nfd, ctx->max_ncconn,
               ctx->max_nsconn);
@@ -45,8 +58,39 @@ core_calc_connections(struct context *ctx)
     return NC_OK;
 }
 
+/*
+ * With more than one worker thread, every worker listens on the same
+ * address and relies on SO_REUSEPORT to have the kernel spread client
+ * connections across the listeners
+ */
+static rstatus_t
+core_worker_reuseport(struct array *server_pool, int worker_threads)
+{
+    uint32_t i;
+
+    if (worker_threads <= 1) {
+        return NC_OK;
+    }
+
+    for (i = 0; i < array_n(server_pool); i++) {
+        struct server_pool *pool = array_get(server_pool, i);
+
+        if (pool->info.family == AF_UNIX) {
+            log_error("pool '%.*s' listening on unix socket '%.*s' cannot be "
+                      "shared by %d worker threads", pool->name.len,
+                      pool->name.data, pool->addrstr.len, pool->addrstr.data,
+                      worker_threads);
+            return NC_ERROR;
+        }
+
+        pool->reuseport = 1;
+    }
+
+    return NC_OK;
+}
+
 static struct context *
-core_ctx_create(struct instance *nci)
+core_ctx_create(struct instance *nci, struct conf *cf)
 {
     rstatus_t status;
     struct context *ctx;
@@ -56,6 +100,7 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
     ctx->id = ++ctx_id;
+    ctx->nci = nci;
     ctx->cf = NULL;
     ctx->stats = NULL;
     ctx->evb = NULL;
@@ -65,9 +110,22 @@ core_ctx_create(struct instance *nci)
     ctx->max_nfd = 0;
     ctx->max_ncconn = 0;
     ctx->max_nsconn = 0;
+    array_null(&ctx->worker);
+    ctx->tid = (pthread_t) -1;
+    ctx->quit = 0;
+    ctx->wake[0] = -1;
+    ctx->wake[1] = -1;
+    ctx->wake_conn = NULL;
+    ctx->reload = nreload;
+    ctx->reload_cf = NULL;
+    array_null(&ctx->reload_pool);
+    array_null(&ctx->drain);
+    ctx->upgrade = nupgrade;
+    ctx->handoff = 0;
+    ctx->drained = 0;
 
-    /* parse and create configuration */
-    ctx->cf = conf_create(nci->conf_filename);
+    /* parse and create configuration, unless shared by the main context */
+    ctx->cf = cf != NULL ? conf_ref(cf) : conf_create(nci->conf_filename);
     if (ctx->cf == NULL) {
         nc_free(ctx);
         return NULL;
@@ -85,7 +143,10 @@ core_ctx_create(struct instance *nci)
      * Get rlimit and calculate max client connections after we have
      * calculated max server connections
      */
-    status = core_calc_connections(ctx);
+    status = core_calc_connections(ctx, nci->worker_threads);
+    if (status == NC_OK) {
+        status = core_worker_reuseport(&ctx->pool, nci->worker_threads);
+    }
     if (status != NC_OK) {
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
@@ -95,7 +156,7 @@ core_ctx_create(struct instance *nci)
 
     /* create stats per server pool */
     ctx->stats = stats_create(nci->stats_port, nci->stats_addr, nci->stats_interval,
-                              nci->hostname, &ctx->pool);
+                              nci->stats_format, nci->hostname, &ctx->pool);
     if (ctx->stats == NULL) {
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
@@ -142,32 +203,516 @@ core_ctx_create(struct instance *nci)
     return ctx;
 }
 
+/*
+ * Prepare the pools of ctx from the reloaded configuration cf. Everything
+ * that can fail is done here, before touching the running pools, and the
+ * main context prepares the worker contexts too, so that either all of
+ * them or none of them reload.
+ */
+static rstatus_t
+core_reload_prepare(struct context *ctx, struct conf *cf)
+{
+    rstatus_t status;
+    uint32_t max_nsconn;
+
+    ASSERT(array_n(&ctx->reload_pool) == 0);
+
+    max_nsconn = ctx->max_nsconn;
+
+    status = server_pool_init(&ctx->reload_pool, &cf->pool, ctx);
+    if (status != NC_OK) {
+        array_null(&ctx->reload_pool);
+        ctx->max_nsconn = max_nsconn;
+        return status;
+    }
+
+    status = core_worker_reuseport(&ctx->reload_pool, ctx->nci->worker_threads);
+    if (status == NC_OK) {
+        status = stats_reload(ctx->stats, &ctx->reload_pool);
+    }
+    if (status != NC_OK) {
+        server_pool_deinit(&ctx->reload_pool);
+        array_null(&ctx->reload_pool);
+        ctx->max_nsconn = max_nsconn;
+        return status;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Drop the pools prepared for ctx. The max server connections of ctx are
+ * left as prepared, as they are only read once pools are applied
+ */
+static void
+core_reload_cancel(struct context *ctx)
+{
+    server_pool_deinit(&ctx->reload_pool);
+    array_null(&ctx->reload_pool);
+    stats_reload_done(ctx->stats, false);
+
+    if (ctx->reload_cf != NULL) {
+        conf_destroy(ctx->reload_cf);
+        ctx->reload_cf = NULL;
+    }
+}
+
 static void
 core_ctx_destroy(struct context *ctx)
 {
     log_debug(LOG_VVERB, "destroy ctx %p id %"PRIu32"", ctx, ctx->id);
     proxy_deinit(ctx);
+    server_drain(ctx, true);
+    array_deinit(&ctx->drain);
+    if (ctx->reload_cf != NULL) {
+        core_reload_cancel(ctx);
+    }
     server_pool_disconnect(ctx);
     event_base_destroy(ctx->evb);
     stats_destroy(ctx->stats);
     server_pool_deinit(&ctx->pool);
     conf_destroy(ctx->cf);
+    if (ctx->wake[0] >= 0) {
+        close(ctx->wake[0]);
+    }
+    if (ctx->wake[1] >= 0) {
+        close(ctx->wake[1]);
+    }
     nc_free(ctx);
 }
 
+/*
+ * Request a reload of the configuration, which the main context carries
+ * out for itself and the worker contexts on its next loop iteration.
+ * Called from the SIGHUP handler.
+ */
+void
+core_reload_request(void)
+{
+    nreload++;
+}
+
+/*
+ * Request a binary upgrade, which the main context carries out on its
+ * next loop iteration. Called from the SIGUSR2 handler.
+ */
+void
+core_upgrade_request(void)
+{
+    nupgrade++;
+}
+
+/* Drain the wake up pipe of a worker, which is then back in its loop */
+static rstatus_t
+core_wake_recv(struct context *ctx, struct conn *conn)
+{
+    char buf[64];
+    ssize_t n;
+
+    for (;;) {
+        n = nc_read(conn->sd, buf, sizeof(buf));
+        if (n > 0) {
+            continue;
+        }
+
+        if (n == 0) {
+            conn->eof = 1;
+            conn->done = 1;
+            return NC_OK;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return NC_OK;
+        }
+
+        conn->err = errno;
+        return NC_ERROR;
+    }
+}
+
+static void
+core_wake_close(struct context *ctx, struct conn *conn)
+{
+    ASSERT(conn == ctx->wake_conn);
+
+    close(conn->sd);
+    conn->sd = -1;
+    conn->owner = NULL;
+    conn_put(conn);
+
+    ctx->wake[0] = -1;
+    ctx->wake_conn = NULL;
+}
+
+/*
+ * Watch the read end of the wake up pipe of worker ctx in its event loop,
+ * so that a write to the pipe makes the worker return from event_wait
+ */
+static rstatus_t
+core_wake_watch(struct context *ctx)
+{
+    rstatus_t status;
+    struct conn *conn;
+
+    conn = conn_get_channel(array_get(&ctx->pool, 0), ctx->wake[0],
+                            core_wake_recv, core_wake_close);
+    if (conn == NULL) {
+        return NC_ENOMEM;
+    }
+
+    status = event_add_conn(ctx->evb, conn);
+    if (status == NC_OK) {
+        status = event_del_out(ctx->evb, conn);
+    }
+    if (status != NC_OK) {
+        log_error("event add conn on %d failed: %s", conn->sd,
+                  strerror(errno));
+        event_del_conn(ctx->evb, conn);
+        conn->sd = -1;
+        conn->owner = NULL;
+        conn_put(conn);
+        return NC_ERROR;
+    }
+
+    ctx->wake_conn = conn;
+
+    return NC_OK;
+}
+
+/*
+ * Wake up the worker threads of the main context ctx, which otherwise only
+ * notice a reload or their quit flag when their event_wait times out
+ */
+static void
+core_worker_wake(struct context *ctx)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(&ctx->worker); i++) {
+        struct context **wctx = array_get(&ctx->worker, i);
+        struct context *worker = *wctx;
+        ssize_t n;
+
+        if (worker->wake[1] < 0) {
+            continue;
+        }
+
+        n = nc_write(worker->wake[1], "", 1);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("wake up of worker ctx %"PRIu32" failed, ignored: %s",
+                     worker->id, strerror(errno));
+        }
+    }
+}
+
+/*
+ * Apply the pools prepared for ctx to the running pools. The listeners,
+ * client connections and server connections that the reloaded pools still
+ * have a use for are carried over, so clients of the pools that did not
+ * change do not notice the reload. Runs in the thread of ctx.
+ */
+static void
+core_reload_apply(struct context *ctx)
+{
+    rstatus_t status;
+    struct instance *nci = ctx->nci;
+    uint32_t i;
+
+    server_pool_reload(ctx, &ctx->reload_pool);
+    stats_reload_done(ctx->stats, true);
+
+    /* the wake up channel is owned by the first pool, which may be gone */
+    if (ctx->wake_conn != NULL) {
+        ctx->wake_conn->owner = array_get(&ctx->pool, 0);
+    }
+
+    conf_destroy(ctx->cf);
+    ctx->cf = ctx->reload_cf;
+
+    status = core_calc_connections(ctx, nci->worker_threads);
+    if (status != NC_OK) {
+        log_warn("recalculating max connections in ctx %"PRIu32" failed, "
+                 "ignored", ctx->id);
+    }
+
+    /* listen on the pools that are new or had their listener closed */
+    for (i = 0; i < array_n(&ctx->pool); i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        if (sp->p_conn != NULL) {
+            continue;
+        }
+
+        status = proxy_each_init(sp, NULL);
+        if (status != NC_OK) {
+            log_error("pool '%.*s' is not listening after reload of conf "
+                      "'%s'", sp->name.len, sp->name.data, nci->conf_filename);
+        }
+    }
+
+    status = server_pool_preconnect(ctx);
+    if (status != NC_OK) {
+        log_warn("preconnect after reload in ctx %"PRIu32" failed, ignored",
+                 ctx->id);
+    }
+
+    log_debug(LOG_NOTICE, "reloaded conf '%s' in ctx %"PRIu32" with %"PRIu32
+              " pools and %"PRIu32" servers draining", nci->conf_filename,
+              ctx->id, array_n(&ctx->pool), array_n(&ctx->drain));
+
+    /* main context may hand over the next reload from here on */
+    __atomic_store_n(&ctx->reload_cf, NULL, __ATOMIC_RELEASE);
+}
+
+/* Is a reload handed over to a worker of main context ctx yet to apply? */
+static bool
+core_reload_pending(struct context *ctx)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(&ctx->worker); i++) {
+        struct context **wctx = array_get(&ctx->worker, i);
+
+        if (__atomic_load_n(&(*wctx)->reload_cf, __ATOMIC_ACQUIRE) != NULL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Reload the configuration in main context ctx. The configuration is
+ * parsed and the pools of every context prepared once here, after which
+ * ctx applies its own pools and hands the others over to the workers,
+ * each of which applies them on its next loop iteration. On error, all
+ * contexts keep running with the configuration they have.
+ */
+static void
+core_reload(struct context *ctx)
+{
+    rstatus_t status;
+    struct instance *nci = ctx->nci;
+    struct conf *cf;
+    uint32_t i, nprepared;
+
+    log_debug(LOG_NOTICE, "reloading conf '%s' in %"PRIu32" contexts",
+              nci->conf_filename, array_n(&ctx->worker) + 1);
+
+    cf = conf_create(nci->conf_filename);
+    if (cf == NULL) {
+        log_error("reload of conf '%s' failed, keeping the running conf",
+                  nci->conf_filename);
+        return;
+    }
+
+    status = core_reload_prepare(ctx, cf);
+    nprepared = 0;
+    while (status == NC_OK && nprepared < array_n(&ctx->worker)) {
+        struct context **wctx = array_get(&ctx->worker, nprepared);
+
+        status = core_reload_prepare(*wctx, cf);
+        if (status == NC_OK) {
+            nprepared++;
+        }
+    }
+    if (status != NC_OK) {
+        if (array_n(&ctx->reload_pool) != 0) {
+            core_reload_cancel(ctx);
+        }
+        for (i = 0; i < nprepared; i++) {
+            struct context **wctx = array_get(&ctx->worker, i);
+
+            core_reload_cancel(*wctx);
+        }
+        log_error("reload of conf '%s' failed, keeping the running conf",
+                  nci->conf_filename);
+        conf_destroy(cf);
+        return;
+    }
+
+    for (i = 0; i < array_n(&ctx->worker); i++) {
+        struct context **wctx = array_get(&ctx->worker, i);
+
+        __atomic_store_n(&(*wctx)->reload_cf, conf_ref(cf), __ATOMIC_RELEASE);
+    }
+    core_worker_wake(ctx);
+
+    ctx->reload_cf = cf;
+    core_reload_apply(ctx);
+}
+
+static void *
+core_worker_loop(void *arg)
+{
+    rstatus_t status;
+    struct context *ctx = arg;
+
+    /* free lists are private to each worker thread */
+    mbuf_init(ctx->nci);
+    msg_init();
+    conn_init();
+
+    status = core_wake_watch(ctx);
+    if (status != NC_OK) {
+        log_warn("worker ctx %"PRIu32" can not be woken up, reloads wait "
+                 "for its timeout", ctx->id);
+    }
+
+    log_debug(LOG_NOTICE, "worker ctx %"PRIu32" running", ctx->id);
+
+    while (!ctx->quit) {
+        status = core_loop(ctx);
+        if (status != NC_OK) {
+            log_error("worker ctx %"PRIu32" loop failed, stopping", ctx->id);
+            break;
+        }
+    }
+
+    if (ctx->wake_conn != NULL) {
+        event_del_conn(ctx->evb, ctx->wake_conn);
+        core_wake_close(ctx, ctx->wake_conn);
+    }
+
+    conn_deinit();
+    msg_deinit();
+    mbuf_deinit();
+
+    return NULL;
+}
+
+static void
+core_worker_stop(struct context *ctx)
+{
+    while (array_n(&ctx->worker) != 0) {
+        struct context **wctx = array_pop(&ctx->worker);
+        struct context *worker = *wctx;
+
+        /* worker notices the quit flag on the loop iteration it wakes to */
+        if (worker->tid != (pthread_t) -1) {
+            worker->quit = 1;
+            if (worker->wake[1] >= 0) {
+                nc_write(worker->wake[1], "", 1);
+            }
+            pthread_join(worker->tid, NULL);
+        }
+
+        core_ctx_destroy(worker);
+    }
+    array_deinit(&ctx->worker);
+}
+
+/*
+ * Create nci->worker_threads - 1 additional contexts, each with its own
+ * event base, server connections and reuseport listeners, and run each
+ * of them in its own thread. The main context acts as the first worker
+ * and its stats aggregator sums up the stats of all workers.
+ */
+static rstatus_t
+core_worker_start(struct context *ctx, struct instance *nci)
+{
+    rstatus_t status;
+    sigset_t set, oset;
+    uint32_t i, nworker;
+
+    if (nci->worker_threads <= 1) {
+        return NC_OK;
+    }
+
+    nworker = (uint32_t)(nci->worker_threads - 1);
+
+    status = array_init(&ctx->worker, nworker, sizeof(struct context *));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < nworker; i++) {
+        struct context *worker, **wctx;
+
+        worker = core_ctx_create(nci, ctx->cf);
+        if (worker == NULL) {
+            return NC_ERROR;
+        }
+
+        wctx = array_push(&ctx->worker);
+        *wctx = worker;
+
+        status = pipe(worker->wake);
+        if (status < 0) {
+            log_error("pipe for worker ctx %"PRIu32" failed: %s", worker->id,
+                      strerror(errno));
+            return NC_ERROR;
+        }
+        if (nc_set_nonblocking(worker->wake[0]) < 0 ||
+            nc_set_nonblocking(worker->wake[1]) < 0) {
+            log_error("set nonblock on pipe of worker ctx %"PRIu32" failed: "
+                      "%s", worker->id, strerror(errno));
+            return NC_ERROR;
+        }
+
+        status = stats_add_worker(ctx->stats, worker->stats);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    /* signals are only delivered to the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+    for (i = 0; i < nworker; i++) {
+        struct context **wctx = array_get(&ctx->worker, i);
+        struct context *worker = *wctx;
+
+        status = pthread_create(&worker->tid, NULL, core_worker_loop, worker);
+        if (status != 0) {
+            log_error("worker ctx %"PRIu32" create failed: %s", worker->id,
+                      strerror(status));
+            worker->tid = (pthread_t) -1;
+            pthread_sigmask(SIG_SETMASK, &oset, NULL);
+            return NC_ERROR;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    log_debug(LOG_NOTICE, "started %"PRIu32" worker threads", nworker);
+
+    return NC_OK;
+}
+
 struct context *
 core_start(struct instance *nci)
 {
+    rstatus_t status;
     struct context *ctx;
 
+    status = redis_init();
+    if (status != NC_OK) {
+        return NULL;
+    }
+
     mbuf_init(nci);
     msg_init();
     conn_init();
 
-    ctx = core_ctx_create(nci);
+    ctx = core_ctx_create(nci, NULL);
     if (ctx != NULL) {
-        nci->ctx = ctx;
-        return ctx;
+        status = core_worker_start(ctx, nci);
+        if (status == NC_OK) {
+            status = stats_start_aggregator(ctx->stats);
+        }
+        if (status == NC_OK) {
+            nci->ctx = ctx;
+            return ctx;
+        }
+
+        core_worker_stop(ctx);
+        core_ctx_destroy(ctx);
     }
 
     conn_deinit();
@@ -180,6 +725,7 @@ core_start(struct instance *nci)
 void
 core_stop(struct context *ctx)
 {
+    core_worker_stop(ctx);
     conn_deinit();
     msg_deinit();
     mbuf_deinit();
@@ -265,15 +811,17 @@ core_error(struct context *ctx, struct conn *conn)
 static void
 core_timeout(struct context *ctx)
 {
+    int64_t now, then, hedge, batch;
+
+    now = nc_msec_now();
+
     for (;;) {
         struct msg *msg;
         struct conn *conn;
-        int64_t now, then;
 
-        msg = msg_tmo_min();
+        msg = msg_tmo_expired(now);
         if (msg == NULL) {
-            ctx->timeout = ctx->max_timeout;
-            return;
+            break;
         }
 
         /* skip over req that are in-error or done */
@@ -288,15 +836,7 @@ core_timeout(struct context *ctx)
          * out server
          */
 
-        conn = msg->tmo_rbe.data;
-        then = msg->tmo_rbe.key;
-
-        now = nc_msec_now();
-        if (now < then) {
-            int delta = (int)(then - now);
-            ctx->timeout = MIN(delta, ctx->max_timeout);
-            return;
-        }
+        conn = msg->tmo_node.data;
 
         log_debug(LOG_INFO, "req %"PRIu64" on s %d timedout", msg->id, conn->sd);
 
@@ -305,6 +845,55 @@ core_timeout(struct context *ctx)
 
         core_close(ctx, conn);
     }
+
+    for (;;) {
+        struct msg *msg;
+        struct conn *conn;
+
+        msg = msg_hedge_expired(now);
+        if (msg == NULL) {
+            break;
+        }
+
+        conn = msg->hedge_node.data;
+        msg_hedge_delete(msg);
+
+        req_hedge(ctx, conn, msg);
+    }
+
+    for (;;) {
+        struct msg *msg;
+
+        msg = msg_batch_expired(now);
+        if (msg == NULL) {
+            break;
+        }
+
+        /* send the batch that waited long enough for more reads */
+
+        req_batch_send(ctx, msg->batch_node.data);
+    }
+
+    then = msg_tmo_next();
+    hedge = msg_hedge_next();
+    if (hedge >= 0 && (then < 0 || hedge < then)) {
+        then = hedge;
+    }
+    batch = msg_batch_next();
+    if (batch >= 0 && (then < 0 || batch < then)) {
+        then = batch;
+    }
+    if (then < 0) {
+        ctx->timeout = ctx->max_timeout;
+        return;
+    }
+
+    if (then <= now) {
+        ctx->timeout = 0;
+        return;
+    }
+
+    ctx->timeout = (int)MIN(then - now, (int64_t)ctx->max_timeout);
 }
 
 rstatus_t
@@ -352,9 +941,74 @@ core_core(void *arg, uint32_t events)
     return NC_OK;
 }
 
+/*
+ * Once the listeners are handed off to a new process, stop accepting and
+ * close every client connection as soon as it has no requests in flight.
+ * Clients accepted just before the handoff get a grace period to send
+ * their first request. The main context quits when it and all the
+ * workers are drained.
+ */
+static void
+core_drain(struct context *ctx)
+{
+    uint32_t i, nclient;
+    bool grace;
+
+    if (ctx->handoff == 0) {
+        proxy_deinit(ctx);
+        if (ctx == ctx->nci->ctx) {
+            stats_handoff(ctx->stats);
+        }
+        ctx->handoff = nc_msec_now();
+        log_debug(LOG_NOTICE, "ctx %"PRIu32" stopped accepting, draining "
+                  "clients", ctx->id);
+    }
+
+    grace = nc_msec_now() - ctx->handoff < UPGRADE_GRACE;
+
+    nclient = 0;
+    for (i = 0; i < array_n(&ctx->pool); i++) {
+        struct server_pool *pool = array_get(&ctx->pool, i);
+        struct conn *conn, *nconn;
+
+        for (conn = TAILQ_FIRST(&pool->c_conn_q); conn != NULL; conn = nconn) {
+            nconn = TAILQ_NEXT(conn, conn_tqe);
+
+            if (client_active(conn) || (grace && conn->recv_bytes == 0)) {
+                nclient++;
+                continue;
+            }
+
+            core_close(ctx, conn);
+        }
+    }
+
+    if (nclient == 0 && !ctx->drained) {
+        ctx->drained = 1;
+        log_debug(LOG_NOTICE, "ctx %"PRIu32" drained", ctx->id);
+    }
+
+    if (ctx->drained && ctx == ctx->nci->ctx) {
+        for (i = 0; i < array_n(&ctx->worker); i++) {
+            struct context **wctx = array_get(&ctx->worker, i);
+
+            if (!(*wctx)->drained) {
+                break;
+            }
+        }
+        if (i == array_n(&ctx->worker)) {
+            ctx->quit = 1;
+            return;
+        }
+    }
+
+    ctx->timeout = MIN(ctx->timeout, UPGRADE_INTERVAL);
+}
+
 rstatus_t
 core_loop(struct context *ctx)
 {
+    rstatus_t status;
     int nsd;
 
     nsd = event_wait(ctx->evb, ctx->timeout);
@@ -364,6 +1018,52 @@ core_loop(struct context *ctx)
 
     core_timeout(ctx);
 
+    /*
+     * A reload waits for the new process of an upgrade to take over, and
+     * for the workers to have applied the reload handed over before
+     */
+    if (ctx == ctx->nci->ctx) {
+        if (ctx->reload != nreload && !upgrading) {
+            if (core_reload_pending(ctx)) {
+                ctx->timeout = MIN(ctx->timeout, RELOAD_INTERVAL);
+            } else {
+                ctx->reload = nreload;
+                if (ctx->handoff == 0) {
+                    core_reload(ctx);
+                }
+            }
+        }
+    } else if (__atomic_load_n(&ctx->reload_cf, __ATOMIC_ACQUIRE) != NULL) {
+        if (ctx->handoff == 0) {
+            core_reload_apply(ctx);
+        } else {
+            core_reload_cancel(ctx);
+        }
+    }
+
+    if (ctx->upgrade != nupgrade && ctx == ctx->nci->ctx) {
+        ctx->upgrade = nupgrade;
+        if (!handoff && !upgrading && upgrade_start(ctx) == NC_OK) {
+            upgrading = 1;
+        }
+    }
+
+    if (upgrading && ctx == ctx->nci->ctx) {
+        status = upgrade_wait(ctx);
+        if (status != NC_EAGAIN) {
+            upgrading = 0;
+            handoff = (status == NC_OK);
+        }
+    }
+
+    if (handoff) {
+        core_drain(ctx);
+    }
+
+    if (array_n(&ctx->drain) != 0) {
+        server_drain(ctx, false);
+    }
+
     stats_swap(ctx->stats);
 
     return NC_OK;
@@ -40,7 +40,9 @@
 # define NC_STATS 0
 #endif
 
-#ifdef HAVE_EPOLL
+#ifdef HAVE_IO_URING
+# define NC_HAVE_IO_URING 1
+#elif HAVE_EPOLL
 # define NC_HAVE_EPOLL 1
 #elif HAVE_KQUEUE
 # define NC_HAVE_KQUEUE 1
@@ -66,6 +68,8 @@
 /* reserved fds for std streams, log, stats fd, epoll etc. */
 #define RESERVED_FDS 32
 
+#define RELOAD_INTERVAL 10 /* pending reload check interval in msec */
+
 typedef int rstatus_t; /* return type */
 typedef int err_t;     /* error type */
 
@@ -82,6 +86,8 @@ struct mbuf;
 struct mhdr;
 struct conf;
 struct stats;
+struct hotkey;
+struct nearcache;
 struct instance;
 struct event_base;
 
@@ -109,10 +115,13 @@ struct event_base;
 #include <nc_string.h>
 #include <nc_queue.h>
 #include <nc_rbtree.h>
+#include <nc_wheel.h>
 #include <nc_log.h>
 #include <nc_util.h>
 #include <event/nc_event.h>
 #include <nc_stats.h>
+#include <nc_hotkey.h>
+#include <nc_nearcache.h>
 #include <nc_mbuf.h>
 #include <nc_message.h>
 #include <nc_connection.h>
@@ -120,6 +129,7 @@ struct event_base;
 
 struct context {
     uint32_t           id;          /* unique context id */
+    struct instance    *nci;        /* instance (ref) */
     struct conf        *cf;         /* configuration */
     struct stats       *stats;      /* stats */
 
@@ -131,6 +141,21 @@ struct context {
     uint32_t           max_nfd;     /* max # files */
     uint32_t           max_ncconn;  /* max # client connections */
     uint32_t           max_nsconn;  /* max # server connections */
+
+    struct array       worker;      /* context *[] of worker threads */
+    pthread_t          tid;         /* worker thread id */
+    volatile int       quit;        /* worker thread quit? */
+    int                wake[2];     /* pipe that wakes up the worker thread */
+    struct conn        *wake_conn;  /* read end of wake in the event loop */
+
+    int                reload;      /* # configuration reloads done */
+    struct conf        *reload_cf;  /* conf handed over to reload with */
+    struct array       reload_pool; /* server_pool[] prepared from it */
+    struct array       drain;       /* server *[] retired by reload */
+
+    int                upgrade;     /* # binary upgrades done */
+    int64_t            handoff;     /* listeners handed off by upgrade in msec */
+    volatile int       drained;     /* clients drained after handoff? */
 };
 
 
@@ -142,13 +167,18 @@ struct instance {
     uint16_t        stats_port;                  /* stats monitoring port */
     int             stats_interval;              /* stats aggregation interval */
     const char      *stats_addr;                 /* stats monitoring addr */
+    stats_format_t  stats_format;                /* stats output format */
     char            hostname[NC_MAXHOSTNAMELEN]; /* hostname */
     size_t          mbuf_chunk_size;             /* mbuf chunk size */
+    int             worker_threads;              /* # worker threads */
     pid_t           pid;                         /* process id */
     const char      *pid_filename;               /* pid filename */
     unsigned        pidfile:1;                   /* pid file created? */
+    char            **argv;                      /* command line, for upgrade */
 };
 
+void core_reload_request(void);
+void core_upgrade_request(void);
 struct context *core_start(struct instance *nci);
 void core_stop(struct context *ctx);
 rstatus_t core_core(void *arg, uint32_t events);
@@ -0,0 +1,223 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_hotkey.h>
+#include <hashkit/nc_hashkit.h>
+
+struct hotkey *
+hotkey_create(uint32_t sample)
+{
+    struct hotkey *hk;
+
+    ASSERT(sample != 0);
+
+    hk = nc_zalloc(sizeof(*hk));
+    if (hk == NULL) {
+        return NULL;
+    }
+
+    hk->sample = sample;
+    hk->countdown = hotkey_countdown(hk);
+    hk->next_decay = nc_msec_now() + HOTKEY_DECAY;
+    hk->nentry = 0;
+
+    return hk;
+}
+
+void
+hotkey_destroy(struct hotkey *hk)
+{
+    nc_free(hk);
+}
+
+/*
+ * Return the # requests to the next sample, drawn uniformly from 1 to
+ * 2 * sample - 1 so that one in sample requests is sampled on average, and
+ * keys requested in a cycle of a multiple of sample are not always missed
+ */
+uint32_t
+hotkey_countdown(const struct hotkey *hk)
+{
+    return 1 + nc_random() % (2 * hk->sample - 1);
+}
+
+/*
+ * Count a sample of key, which was sent to the server at idx server or
+ * answered by the proxy if server is HOTKEY_NOSERVER, and keep it as a
+ * heavy hitter if its estimate beats the coldest of them.
+ *
+ * The sketch is updated conservatively: only the counters that are at the
+ * estimate of key are raised, as the others already overestimate it.
+ */
+void
+hotkey_record(struct hotkey *hk, const uint8_t *key, uint32_t keylen,
+              uint32_t server)
+{
+    struct hotkey_entry *e, *min;
+    uint32_t *counter[HOTKEY_DEPTH];
+    uint64_t hash;
+    uint32_t i, h1, h2, count;
+
+    hash = wyhash((const char *)key, keylen, 0);
+    h1 = (uint32_t)hash;
+    h2 = (uint32_t)(hash >> 32) | 1;
+
+    count = UINT32_MAX;
+    for (i = 0; i < HOTKEY_DEPTH; i++) {
+        counter[i] = &hk->sketch[i][(h1 + i * h2) & (HOTKEY_WIDTH - 1)];
+        count = MIN(count, *counter[i]);
+    }
+    if (count != UINT32_MAX) {
+        count++;
+    }
+    for (i = 0; i < HOTKEY_DEPTH; i++) {
+        *counter[i] = MAX(*counter[i], count);
+    }
+
+    min = NULL;
+    for (i = 0; i < hk->nentry; i++) {
+        e = &hk->entry[i];
+
+        if (e->hash == hash) {
+            e->count = count;
+            if (server != HOTKEY_NOSERVER) {
+                e->server = server;
+            }
+            return;
+        }
+
+        if (min == NULL || e->count < min->count) {
+            min = e;
+        }
+    }
+
+    if (hk->nentry < HOTKEY_NENTRY) {
+        e = &hk->entry[hk->nentry++];
+    } else if (count > min->count) {
+        e = min;
+    } else {
+        return;
+    }
+
+    e->hash = hash;
+    e->count = count;
+    e->server = server;
+    e->keylen = MIN(keylen, STATS_HOTKEY_KEYLEN);
+    nc_memcpy(e->key, key, e->keylen);
+}
+
+/*
+ * Halve the counts once for every HOTKEY_DECAY msec that passed since the
+ * last halving, dropping the heavy hitters whose count drops to zero
+ */
+void
+hotkey_decay(struct hotkey *hk, int64_t now)
+{
+    uint32_t i, j, n, shift;
+
+    if (now < hk->next_decay) {
+        return;
+    }
+
+    n = (uint32_t)MIN((now - hk->next_decay) / HOTKEY_DECAY + 1, 32LL);
+    hk->next_decay += (int64_t)n * HOTKEY_DECAY;
+    if (hk->next_decay <= now) {
+        hk->next_decay = now + HOTKEY_DECAY;
+    }
+
+    if (n == 32) {
+        memset(hk->sketch, 0, sizeof(hk->sketch));
+        hk->nentry = 0;
+        return;
+    }
+    shift = n;
+
+    for (i = 0; i < HOTKEY_DEPTH; i++) {
+        for (j = 0; j < HOTKEY_WIDTH; j++) {
+            hk->sketch[i][j] >>= shift;
+        }
+    }
+
+    for (i = 0, j = 0; i < hk->nentry; i++) {
+        struct hotkey_entry *e = &hk->entry[i];
+
+        e->count >>= shift;
+        if (e->count == 0) {
+            continue;
+        }
+        if (i != j) {
+            hk->entry[j] = *e;
+        }
+        j++;
+    }
+    hk->nentry = j;
+}
+
+/*
+ * Return true if key is a heavy hitter with a count of at least HOTKEY_HOT,
+ * which is sampled about twice a second or more
+ */
+bool
+hotkey_hot(const struct hotkey *hk, const uint8_t *key, uint32_t keylen)
+{
+    uint64_t hash;
+    uint32_t i;
+
+    hash = wyhash((const char *)key, keylen, 0);
+
+    for (i = 0; i < hk->nentry; i++) {
+        if (hk->entry[i].hash == hash) {
+            return hk->entry[i].count >= HOTKEY_HOT;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Fill top with up to n of the heavy hitters, hottest first, and return
+ * how many. Just before a halving, the count of a key that is requested
+ * at a steady rate adds up its samples of the last interval, half of those
+ * of the one before and so on, which is twice the samples of an interval.
+ */
+uint32_t
+hotkey_top(const struct hotkey *hk, struct stats_hotkey *top, uint32_t n)
+{
+    const struct hotkey_entry *sorted[HOTKEY_NENTRY];
+    uint32_t i, j;
+
+    for (i = 0; i < hk->nentry; i++) {
+        const struct hotkey_entry *e = &hk->entry[i];
+
+        for (j = i; j > 0 && sorted[j - 1]->count < e->count; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = e;
+    }
+
+    n = MIN(n, hk->nentry);
+    for (i = 0; i < n; i++) {
+        top[i].rate = (int64_t)sorted[i]->count * hk->sample * 1000 /
+                      (2 * HOTKEY_DECAY);
+        top[i].server = sorted[i]->server;
+        top[i].keylen = sorted[i]->keylen;
+        nc_memcpy(top[i].key, sorted[i]->key, sorted[i]->keylen);
+    }
+
+    return n;
+}
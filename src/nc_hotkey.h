@@ -0,0 +1,63 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_HOTKEY_H_
+#define _NC_HOTKEY_H_
+
+#include <nc_core.h>
+
+/*
+ * Hot key detector of a pool. One in every sample requests on average is
+ * counted in a count-min sketch of HOTKEY_DEPTH rows of HOTKEY_WIDTH
+ * counters, which overestimates the count of a key by at most a small
+ * fraction of all the counts with high probability. The HOTKEY_NENTRY keys with the highest
+ * estimates are kept as the heavy hitters. All counts are halved every
+ * HOTKEY_DECAY msec, so that keys that cool down make room for new ones.
+ */
+#define HOTKEY_DEPTH    4
+#define HOTKEY_WIDTH    2048                    /* a power of two */
+#define HOTKEY_NENTRY   (2 * STATS_NHOTKEY)
+#define HOTKEY_DECAY    1000                    /* in msec */
+#define HOTKEY_HOT      4                       /* min count of a hot key */
+#define HOTKEY_NOSERVER UINT32_MAX              /* server of a key is not known */
+
+struct hotkey_entry {
+    uint64_t hash;                      /* hash of key */
+    uint32_t count;                     /* estimated # samples of key */
+    uint32_t server;                    /* idx of the server key was last sent to */
+    uint32_t keylen;                    /* key length, up to STATS_HOTKEY_KEYLEN */
+    uint8_t  key[STATS_HOTKEY_KEYLEN];  /* key, truncated */
+};
+
+struct hotkey {
+    uint32_t            sample;                             /* sample one in sample requests */
+    uint32_t            countdown;                          /* # requests to the next sample */
+    int64_t             next_decay;                         /* next halving of the counts in msec */
+    uint32_t            nentry;                             /* # heavy hitters */
+    struct hotkey_entry entry[HOTKEY_NENTRY];               /* heavy hitters */
+    uint32_t            sketch[HOTKEY_DEPTH][HOTKEY_WIDTH]; /* count-min sketch */
+};
+
+struct hotkey *hotkey_create(uint32_t sample);
+void hotkey_destroy(struct hotkey *hk);
+uint32_t hotkey_countdown(const struct hotkey *hk);
+void hotkey_record(struct hotkey *hk, const uint8_t *key, uint32_t keylen, uint32_t server);
+void hotkey_decay(struct hotkey *hk, int64_t now);
+bool hotkey_hot(const struct hotkey *hk, const uint8_t *key, uint32_t keylen);
+uint32_t hotkey_top(const struct hotkey *hk, struct stats_hotkey *top, uint32_t n);
+
+#endif
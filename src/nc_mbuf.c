@@ -20,8 +20,10 @@
 
 #include <nc_core.h>
 
-static uint32_t nfree_mbufq;   /* # free mbuf */
-static struct mhdr free_mbufq; /* free mbuf q */
+static __thread uint32_t nfree_mbufq;   /* # free mbuf (per worker) */
+static __thread struct mhdr free_mbufq; /* free mbuf q (per worker) */
+static __thread uint32_t nfree_smbufq;   /* # free shared mbuf (per worker) */
+static __thread struct mhdr free_smbufq; /* free shared mbuf q (per worker) */
 
 static size_t mbuf_chunk_size; /* mbuf chunk size - header + data (const) */
 static size_t mbuf_offset;     /* mbuf offset in chunk (const) */
@@ -95,6 +97,8 @@ mbuf_get(void)
 
     mbuf->pos = mbuf->start;
     mbuf->last = mbuf->start;
+    mbuf->shared = NULL;
+    mbuf->refcount = 1;
 
     log_debug(LOG_VVERB, "get mbuf %p", mbuf);
 
@@ -118,15 +122,80 @@ mbuf_free(struct mbuf *mbuf)
 void
 mbuf_put(struct mbuf *mbuf)
 {
+    struct mbuf *base = mbuf->shared;
+
     log_debug(LOG_VVERB, "put mbuf %p len %d", mbuf, (int)(mbuf->last - mbuf->pos));
 
     ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
     ASSERT(mbuf->magic == MBUF_MAGIC);
 
+    if (base != NULL) {
+        /* a shared mbuf is only a header; its data belongs to base */
+        mbuf->shared = NULL;
+        nfree_smbufq++;
+        STAILQ_INSERT_HEAD(&free_smbufq, mbuf, next);
+        mbuf = base;
+    }
+
+    ASSERT(mbuf->refcount > 0);
+    if (--mbuf->refcount != 0) {
+        return;
+    }
+
     nfree_mbufq++;
     STAILQ_INSERT_HEAD(&free_mbufq, mbuf, next);
 }
 
+/*
+ * Return an mbuf with the unread data of mbuf, which it shares instead of
+ * copying, or NULL on failure. The shared data must not be modified from
+ * then on; both mbufs are full, so nothing is ever appended to the shared
+ * mbuf. The data is recycled once every mbuf that holds it is put.
+ *
+ * A shared mbuf is a header of its own, without data, that points into
+ * the data of the mbuf that was shared first.
+ */
+struct mbuf *
+mbuf_share(struct mbuf *mbuf)
+{
+    struct mbuf *smbuf, *base;
+
+    ASSERT(mbuf->magic == MBUF_MAGIC);
+
+    base = mbuf->shared != NULL ? mbuf->shared : mbuf;
+
+    if (!STAILQ_EMPTY(&free_smbufq)) {
+        ASSERT(nfree_smbufq > 0);
+
+        smbuf = STAILQ_FIRST(&free_smbufq);
+        nfree_smbufq--;
+        STAILQ_REMOVE_HEAD(&free_smbufq, next);
+
+        ASSERT(smbuf->magic == MBUF_MAGIC);
+    } else {
+        smbuf = nc_alloc(MBUF_HSIZE);
+        if (smbuf == NULL) {
+            return NULL;
+        }
+        smbuf->magic = MBUF_MAGIC;
+    }
+
+    STAILQ_NEXT(smbuf, next) = NULL;
+    smbuf->start = mbuf->pos;
+    smbuf->end = mbuf->last;
+    smbuf->pos = mbuf->pos;
+    smbuf->last = mbuf->last;
+    smbuf->shared = base;
+    smbuf->refcount = 0;
+
+    base->refcount++;
+
+    log_debug(LOG_VVERB, "share mbuf %p len %d as mbuf %p", base,
+              (int)(smbuf->last - smbuf->pos), smbuf);
+
+    return smbuf;
+}
+
 /*
  * Rewind the mbuf by discarding any of the read or unread data that it
  * might hold.
@@ -266,6 +335,8 @@ mbuf_init(const struct instance *nci)
 {
     nfree_mbufq = 0;
     STAILQ_INIT(&free_mbufq);
+    nfree_smbufq = 0;
+    STAILQ_INIT(&free_smbufq);
 
     mbuf_chunk_size = nci->mbuf_chunk_size;
     mbuf_offset = mbuf_chunk_size - MBUF_HSIZE;
@@ -284,4 +355,12 @@ mbuf_deinit(void)
         nfree_mbufq--;
     }
     ASSERT(nfree_mbufq == 0);
+
+    while (!STAILQ_EMPTY(&free_smbufq)) {
+        struct mbuf *mbuf = STAILQ_FIRST(&free_smbufq);
+        mbuf_remove(&free_smbufq, mbuf);
+        nc_free(mbuf);
+        nfree_smbufq--;
+    }
+    ASSERT(nfree_smbufq == 0);
 }
@@ -29,6 +29,8 @@ struct mbuf {
     uint8_t            *last;   /* write marker */
     uint8_t            *start;  /* start of buffer (const) */
     uint8_t            *end;    /* end of buffer (const) */
+    struct mbuf        *shared; /* mbuf whose data this one shares, or NULL */
+    uint32_t           refcount; /* # mbufs holding the data of this one */
 };
 
 STAILQ_HEAD(mhdr, mbuf);
@@ -55,6 +57,7 @@ void mbuf_init(const struct instance *nci);
 void mbuf_deinit(void);
 struct mbuf *mbuf_get(void);
 void mbuf_put(struct mbuf *mbuf);
+struct mbuf *mbuf_share(struct mbuf *mbuf);
 void mbuf_rewind(struct mbuf *mbuf);
 uint32_t mbuf_length(const struct mbuf *mbuf);
 uint32_t mbuf_size(const struct mbuf *mbuf);
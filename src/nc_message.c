@@ -109,12 +109,17 @@
  * server.
  */
 
-static uint64_t msg_id;          /* message id counter */
-static uint64_t frag_id;         /* fragment id counter */
-static uint32_t nfree_msgq;      /* # free msg q */
-static struct msg_tqh free_msgq; /* free msg q */
-static struct rbtree tmo_rbt;    /* timeout rbtree */
-static struct rbnode tmo_rbs;    /* timeout rbtree sentinel */
+/*
+ * Message free q and timeout wheel are private to each worker thread, so
+ * that worker threads never contend on the request / response hot path
+ */
+static __thread uint64_t msg_id;          /* message id counter */
+static __thread uint64_t frag_id;         /* fragment id counter */
+static __thread uint32_t nfree_msgq;      /* # free msg q */
+static __thread struct msg_tqh free_msgq; /* free msg q */
+static __thread struct wheel tmo_wheel;   /* timeout wheel */
+static __thread struct wheel hedge_wheel; /* hedge wheel */
+static __thread struct wheel batch_wheel; /* batch wheel */
 
 #define DEFINE_ACTION(_name) string(#_name),
 static const struct string msg_type_strings[] = {
@@ -124,34 +129,46 @@ static const struct string msg_type_strings[] = {
 #undef DEFINE_ACTION
 
 static struct msg *
-msg_from_rbe(struct rbnode *node)
+msg_from_node(struct wheel_node *node, size_t offset)
 {
     struct msg *msg;
-    int offset;
 
-    offset = offsetof(struct msg, tmo_rbe);
     msg = (struct msg *)((char *)node - offset);
 
     return msg;
 }
 
+/*
+ * Return a msg whose timeout expired at or before now, or NULL if there
+ * are none. The msg stays in the timeout wheel until msg_tmo_delete()
+ */
 struct msg *
-msg_tmo_min(void)
+msg_tmo_expired(int64_t now)
 {
-    struct rbnode *node;
+    struct wheel_node *node;
 
-    node = rbtree_min(&tmo_rbt);
+    node = wheel_expire(&tmo_wheel, now);
     if (node == NULL) {
         return NULL;
     }
 
-    return msg_from_rbe(node);
+    return msg_from_node(node, offsetof(struct msg, tmo_node));
+}
+
+/*
+ * Return the time in msec at which the next msg might time out, or -1
+ * if there are no msgs with a timeout
+ */
+int64_t
+msg_tmo_next(void)
+{
+    return wheel_next(&tmo_wheel);
 }
 
 void
 msg_tmo_insert(struct msg *msg, struct conn *conn)
 {
-    struct rbnode *node;
+    struct wheel_node *node;
     int timeout;
 
     ASSERT(msg->request);
@@ -162,32 +179,166 @@ msg_tmo_insert(struct msg *msg, struct conn *conn)
         return;
     }
 
-    node = &msg->tmo_rbe;
+    node = &msg->tmo_node;
     node->key = nc_msec_now() + timeout;
     node->data = conn;
 
-    rbtree_insert(&tmo_rbt, node);
+    wheel_insert(&tmo_wheel, node);
 
-    log_debug(LOG_VERB, "insert msg %"PRIu64" into tmo rbt with expiry of "
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into tmo wheel with expiry of "
               "%d msec", msg->id, timeout);
 }
 
 void
 msg_tmo_delete(struct msg *msg)
 {
-    struct rbnode *node;
+    struct wheel_node *node;
+
+    node = &msg->tmo_node;
+
+    /* already deleted */
+
+    if (node->slot == NULL) {
+        return;
+    }
+
+    wheel_delete(&tmo_wheel, node);
+
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo wheel", msg->id);
+}
+
+/*
+ * Return a msg whose hedge delay expired at or before now, or NULL if there
+ * are none. The msg stays in the hedge wheel until msg_hedge_delete()
+ */
+struct msg *
+msg_hedge_expired(int64_t now)
+{
+    struct wheel_node *node;
+
+    node = wheel_expire(&hedge_wheel, now);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return msg_from_node(node, offsetof(struct msg, hedge_node));
+}
+
+/*
+ * Return the time in msec at which the next msg might be hedged, or -1
+ * if there are no msgs to hedge
+ */
+int64_t
+msg_hedge_next(void)
+{
+    return wheel_next(&hedge_wheel);
+}
+
+/*
+ * Schedule a hedge of msg, which was forwarded on server connection conn,
+ * in delay msec
+ */
+void
+msg_hedge_insert(struct msg *msg, struct conn *conn, uint32_t delay)
+{
+    struct wheel_node *node;
+
+    ASSERT(msg->request && !msg->is_hedge);
+    ASSERT(delay > 0);
+
+    node = &msg->hedge_node;
+    node->key = nc_msec_now() + delay;
+    node->data = conn;
+
+    wheel_insert(&hedge_wheel, node);
+
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into hedge wheel with delay of "
+              "%"PRIu32" msec", msg->id, delay);
+}
+
+void
+msg_hedge_delete(struct msg *msg)
+{
+    struct wheel_node *node;
+
+    node = &msg->hedge_node;
+
+    /* already deleted */
+
+    if (node->slot == NULL) {
+        return;
+    }
+
+    wheel_delete(&hedge_wheel, node);
+
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from hedge wheel", msg->id);
+}
+
+/*
+ * Return a batch whose delay expired at or before now, or NULL if there
+ * are none. The batch stays in the batch wheel until msg_batch_delete()
+ */
+struct msg *
+msg_batch_expired(int64_t now)
+{
+    struct wheel_node *node;
+
+    node = wheel_expire(&batch_wheel, now);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return msg_from_node(node, offsetof(struct msg, batch_node));
+}
+
+/*
+ * Return the time in msec at which the next batch is due, or -1 if there
+ * are no batches
+ */
+int64_t
+msg_batch_next(void)
+{
+    return wheel_next(&batch_wheel);
+}
+
+/*
+ * Schedule the send of batch msg, which collects reads for server
+ * connection conn, in delay msec, or at the end of this event loop
+ * iteration if delay is 0
+ */
+void
+msg_batch_insert(struct msg *msg, struct conn *conn, uint32_t delay)
+{
+    struct wheel_node *node;
 
-    node = &msg->tmo_rbe;
+    ASSERT(msg->request && msg->is_batch);
+
+    node = &msg->batch_node;
+    node->key = nc_msec_now() + delay;
+    node->data = conn;
+
+    wheel_insert(&batch_wheel, node);
+
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into batch wheel with delay of "
+              "%"PRIu32" msec", msg->id, delay);
+}
+
+void
+msg_batch_delete(struct msg *msg)
+{
+    struct wheel_node *node;
+
+    node = &msg->batch_node;
 
     /* already deleted */
 
-    if (node->data == NULL) {
+    if (node->slot == NULL) {
         return;
     }
 
-    rbtree_delete(&tmo_rbt, node);
+    wheel_delete(&batch_wheel, node);
 
-    log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo rbt", msg->id);
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from batch wheel", msg->id);
 }
 
 static struct msg *
@@ -215,7 +366,11 @@ done:
     msg->peer = NULL;
     msg->owner = NULL;
 
-    rbtree_node_init(&msg->tmo_rbe);
+    wheel_node_init(&msg->tmo_node);
+    wheel_node_init(&msg->hedge_node);
+    wheel_node_init(&msg->batch_node);
+    msg->hedge = NULL;
+    msg->waiter = NULL;
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
@@ -233,6 +388,10 @@ done:
     msg->reply = NULL;
     msg->pre_coalesce = NULL;
     msg->post_coalesce = NULL;
+    msg->batch = NULL;
+    msg->unbatch = NULL;
+    msg->readonly = NULL;
+    msg->family = NULL;
 
     msg->type = MSG_UNKNOWN;
 
@@ -250,6 +409,7 @@ done:
     msg->nfrag = 0;
     msg->nfrag_done = 0;
     msg->frag_id = 0;
+    msg->batch_size = 0;
 
     msg->narg_start = NULL;
     msg->narg_end = NULL;
@@ -261,6 +421,8 @@ done:
      * and as a counter for coalescing responses such as DEL
      */
     msg->integer = 0;
+    msg->nredirect = 0;
+    msg->near_cache_version = 0;
 
     msg->err = 0;
     msg->error = 0;
@@ -273,6 +435,12 @@ done:
     msg->fdone = 0;
     msg->swallow = 0;
     msg->redis = 0;
+    msg->is_hedge = 0;
+    msg->near_cache = 0;
+    msg->leader = 0;
+    msg->stale = 0;
+    msg->is_batch = 0;
+    msg->is_mirror = 0;
 
     return msg;
 }
@@ -301,8 +469,12 @@ msg_get(struct conn *conn, bool request, bool redis)
         msg->fragment = redis_fragment;
         msg->reply = redis_reply;
         msg->failure = redis_failure;
+        msg->readonly = redis_readonly;
+        msg->family = redis_family;
         msg->pre_coalesce = redis_pre_coalesce;
         msg->post_coalesce = redis_post_coalesce;
+        msg->batch = redis_batch;
+        msg->unbatch = redis_unbatch;
     } else {
         if (request) {
             msg->parser = memcache_parse_req;
@@ -312,11 +484,16 @@ msg_get(struct conn *conn, bool request, bool redis)
         msg->add_auth = memcache_add_auth;
         msg->fragment = memcache_fragment;
         msg->failure = memcache_failure;
+        msg->readonly = memcache_readonly;
+        msg->family = memcache_family;
         msg->pre_coalesce = memcache_pre_coalesce;
         msg->post_coalesce = memcache_post_coalesce;
+        msg->batch = memcache_batch;
+        msg->unbatch = memcache_unbatch;
     }
 
-    if (log_loggable(LOG_NOTICE) != 0) {
+    /* requests are timed for the latency stats and the request log */
+    if ((request && stats_enabled) || log_loggable(LOG_NOTICE) != 0) {
         msg->start_ts = nc_usec_now();
     }
 
@@ -428,7 +605,9 @@ msg_init(void)
     frag_id = 0;
     nfree_msgq = 0;
     TAILQ_INIT(&free_msgq);
-    rbtree_init(&tmo_rbt, &tmo_rbs);
+    wheel_init(&tmo_wheel, nc_msec_now());
+    wheel_init(&hedge_wheel, nc_msec_now());
+    wheel_init(&batch_wheel, nc_msec_now());
 }
 
 void
@@ -566,6 +745,32 @@ msg_prepend_format(struct msg *msg, const char *fmt, ...)
     return NC_OK;
 }
 
+/*
+ * Append the data of msg src to msg by sharing the mbufs of src instead of
+ * copying them. Neither msg may modify the shared data afterwards.
+ */
+rstatus_t
+msg_share_msg(struct msg *msg, const struct msg *src)
+{
+    struct mbuf *mbuf, *nbuf;
+
+    STAILQ_FOREACH(mbuf, &src->mhdr, next) {
+        if (mbuf_empty(mbuf)) {
+            continue;
+        }
+
+        nbuf = mbuf_share(mbuf);
+        if (nbuf == NULL) {
+            return NC_ENOMEM;
+        }
+
+        mbuf_insert(&msg->mhdr, nbuf);
+        msg->mlen += mbuf_length(nbuf);
+    }
+
+    return NC_OK;
+}
+
 inline uint64_t
 msg_gen_frag_id(void)
 {
@@ -25,8 +25,12 @@ typedef void (*msg_parse_t)(struct msg *);
 typedef rstatus_t (*msg_add_auth_t)(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
 typedef rstatus_t (*msg_fragment_t)(struct msg *, uint32_t, struct msg_tqh *);
 typedef void (*msg_coalesce_t)(struct msg *r);
+typedef rstatus_t (*msg_batch_t)(struct msg *r);
+typedef rstatus_t (*msg_unbatch_t)(struct msg *r, uint32_t idx, struct msg *rsp);
 typedef rstatus_t (*msg_reply_t)(struct msg *r);
 typedef bool (*msg_failure_t)(const struct msg *r);
+typedef bool (*msg_readonly_t)(const struct msg *r);
+typedef msg_family_t (*msg_classify_t)(const struct msg *r);
 
 typedef enum msg_parse_result {
     MSG_PARSE_OK,                         /* parsing ok */
@@ -200,6 +204,8 @@ typedef enum msg_parse_result {
     ACTION( REQ_REDIS_QUIT)                                                                         \
     ACTION( REQ_REDIS_AUTH)                                                                         \
     ACTION( REQ_REDIS_SELECT)                  /* only during init */                               \
+    ACTION( REQ_REDIS_ASKING )                 /* only internally, redis_cluster */                 \
+    ACTION( REQ_REDIS_CLUSTER )                                                                     \
     ACTION( REQ_REDIS_COMMAND)                 /* Sent to random server for redis-cli completions*/ \
     ACTION( REQ_REDIS_LOLWUT)                  /* Vitally important */                              \
     ACTION( RSP_REDIS_STATUS )                 /* redis response */                                 \
@@ -217,6 +223,8 @@ typedef enum msg_parse_result {
     ACTION( RSP_REDIS_ERROR_EXECABORT )                                                             \
     ACTION( RSP_REDIS_ERROR_MASTERDOWN )                                                            \
     ACTION( RSP_REDIS_ERROR_NOREPLICAS )                                                            \
+    ACTION( RSP_REDIS_ERROR_MOVED )                                                                 \
+    ACTION( RSP_REDIS_ERROR_ASK )                                                                   \
     ACTION( RSP_REDIS_INTEGER )                                                                     \
     ACTION( RSP_REDIS_BULK )                                                                        \
     ACTION( RSP_REDIS_MULTIBULK )                                                                   \
@@ -247,7 +255,12 @@ struct msg {
     struct msg           *peer;           /* message peer */
     struct conn          *owner;          /* message owner - client | server */
 
-    struct rbnode        tmo_rbe;         /* entry in rbtree */
+    struct wheel_node    tmo_node;        /* entry in timeout wheel */
+    struct wheel_node    hedge_node;      /* entry in hedge wheel */
+    struct wheel_node    batch_node;      /* entry in batch wheel */
+    struct msg           *hedge;          /* hedge of a request, or the request it hedges */
+    TAILQ_ENTRY(msg)     co_tqe;          /* link in coalesce q of pool */
+    struct msg           *waiter;         /* first read waiting on this one, or next one waiting on the same */
 
     struct mhdr          mhdr;            /* message mbuf header */
     uint32_t             mlen;            /* message length */
@@ -264,10 +277,15 @@ struct msg {
     msg_reply_t          reply;           /* generate message reply (example: ping) */
     msg_add_auth_t       add_auth;        /* add auth message when we forward msg */
     msg_failure_t        failure;         /* transient failure response? */
+    msg_readonly_t       readonly;        /* read only request? */
+    msg_classify_t       family;          /* command family of request */
 
     msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
     msg_coalesce_t       post_coalesce;   /* message post-coalesce */
 
+    msg_batch_t          batch;           /* build batch of single key reads */
+    msg_unbatch_t        unbatch;         /* split response to batch by read */
+
     msg_type_t           type;            /* message type */
 
     struct array         *keys;           /* array of keypos, for req */
@@ -282,12 +300,15 @@ struct msg {
     uint32_t             rlen;            /* running length in parsing fsa (redis) */
     uint32_t             integer;         /* integer reply value (redis) */
     uint8_t              is_top_level;     /* is this top level (redis) */
+    uint32_t             nredirect;       /* # redirects followed (redis) */
+    uint32_t             near_cache_version; /* version of the key when it missed the near cache */
 
     struct msg           *frag_owner;     /* owner of fragment message */
-    uint32_t             nfrag;           /* # fragment */
+    uint32_t             nfrag;           /* # fragment, or # reads of batch */
     uint32_t             nfrag_done;      /* # fragment done */
     uint64_t             frag_id;         /* id of fragmented message */
-    struct msg           **frag_seq;      /* sequence of fragment message, map from keys to fragments*/
+    struct msg           **frag_seq;      /* sequence of fragment message, map from keys to fragments, or reads of batch */
+    uint32_t             batch_size;      /* # reads batch has room for */
 
     err_t                err;             /* errno on error? */
     unsigned             error:1;         /* error? */
@@ -300,13 +321,28 @@ struct msg {
     unsigned             fdone:1;         /* all fragments are done? */
     unsigned             swallow:1;       /* swallow response? */
     unsigned             redis:1;         /* redis? */
+    unsigned             is_hedge:1;      /* hedge of another request? */
+    unsigned             near_cache:1;    /* cache response in the near cache? */
+    unsigned             leader:1;        /* in coalesce q, for identical reads to wait on? */
+    unsigned             stale:1;         /* leader sent before a write to its key? */
+    unsigned             is_batch:1;      /* batch of single key reads? */
+    unsigned             is_mirror:1;     /* mirror copy of another request? */
 };
 
 TAILQ_HEAD(msg_tqh, msg);
 
-struct msg *msg_tmo_min(void);
+struct msg *msg_tmo_expired(int64_t now);
+int64_t msg_tmo_next(void);
 void msg_tmo_insert(struct msg *msg, struct conn *conn);
 void msg_tmo_delete(struct msg *msg);
+struct msg *msg_hedge_expired(int64_t now);
+int64_t msg_hedge_next(void);
+void msg_hedge_insert(struct msg *msg, struct conn *conn, uint32_t delay);
+void msg_hedge_delete(struct msg *msg);
+struct msg *msg_batch_expired(int64_t now);
+int64_t msg_batch_next(void);
+void msg_batch_insert(struct msg *msg, struct conn *conn, uint32_t delay);
+void msg_batch_delete(struct msg *msg);
 
 void msg_init(void);
 void msg_deinit(void);
@@ -324,6 +360,7 @@ struct mbuf *msg_ensure_mbuf(struct msg *msg, size_t len);
 rstatus_t msg_append(struct msg *msg, const uint8_t *pos, size_t n);
 rstatus_t msg_prepend(struct msg *msg, const uint8_t *pos, size_t n);
 rstatus_t msg_prepend_format(struct msg *msg, const char *fmt, ...);
+rstatus_t msg_share_msg(struct msg *msg, const struct msg *src);
 bool msg_set_placeholder_key(struct msg *r);
 
 struct msg *req_get(struct conn *conn);
@@ -342,6 +379,15 @@ void req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, stru
 struct msg *req_fake(struct context *ctx, struct conn *conn);
 struct msg *req_send_next(struct context *ctx, struct conn *conn);
 void req_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
+void req_redirect(struct context *ctx, struct msg *msg, struct server *server, struct msg *prefix);
+void req_hedge(struct context *ctx, struct conn *s_conn, struct msg *msg);
+bool req_same(const struct msg *msg1, const struct msg *msg2);
+void req_coalesce_done(struct context *ctx, struct server_pool *pool, struct msg *msg, const struct msg *rsp, err_t err);
+void req_coalesce_move(struct server_pool *pool, struct msg *msg, struct msg *nmsg);
+void req_coalesce_reload(struct context *ctx, struct server_pool *op, struct server_pool *np);
+void req_batch_send(struct context *ctx, struct conn *s_conn);
+void req_batch_error(struct context *ctx, struct server_pool *pool, struct msg *msg, err_t err);
+void req_batch_done(struct context *ctx, struct server_pool *pool, struct msg *msg, err_t err);
 
 struct msg *rsp_get(struct conn *conn);
 void rsp_put(struct msg *msg);
@@ -0,0 +1,280 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_nearcache.h>
+#include <hashkit/nc_hashkit.h>
+
+struct nearcache *
+nearcache_create(size_t size, int64_t ttl)
+{
+    struct nearcache *cache;
+    uint32_t i, nbucket;
+
+    ASSERT(size != 0 && ttl > 0);
+
+    for (nbucket = 16; nbucket < (1U << 20); nbucket <<= 1) {
+        if ((size_t)nbucket * NEARCACHE_ENTRYSIZE >= size) {
+            break;
+        }
+    }
+
+    cache = nc_zalloc(sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->bucket = nc_alloc(sizeof(*cache->bucket) * nbucket);
+    if (cache->bucket == NULL) {
+        nc_free(cache);
+        return NULL;
+    }
+
+    for (i = 0; i < nbucket; i++) {
+        TAILQ_INIT(&cache->bucket[i]);
+    }
+    TAILQ_INIT(&cache->lru);
+
+    cache->size = size;
+    cache->used = 0;
+    cache->ttl = ttl;
+    cache->nbucket = nbucket;
+
+    return cache;
+}
+
+static void
+nearcache_delete(struct nearcache *cache, struct nearcache_entry *e)
+{
+    TAILQ_REMOVE(&cache->bucket[e->hash & (cache->nbucket - 1)], e, h_tqe);
+    TAILQ_REMOVE(&cache->lru, e, l_tqe);
+
+    cache->used -= sizeof(*e) + e->keylen + e->vlen;
+
+    nc_free(e);
+}
+
+void
+nearcache_destroy(struct nearcache *cache)
+{
+    while (!TAILQ_EMPTY(&cache->lru)) {
+        nearcache_delete(cache, TAILQ_FIRST(&cache->lru));
+    }
+    ASSERT(cache->used == 0);
+
+    nc_free(cache->bucket);
+    nc_free(cache);
+}
+
+/*
+ * Return true if key matches the glob-style pattern, in which '*' matches
+ * any run of bytes and '?' matches any single byte
+ */
+bool
+nearcache_match(const struct string *pattern, const uint8_t *key,
+                uint32_t keylen)
+{
+    uint32_t p, k, star, mark;
+
+    p = 0;
+    k = 0;
+    star = UINT32_MAX;
+    mark = 0;
+
+    while (k < keylen) {
+        if (p < pattern->len && pattern->data[p] == '*') {
+            star = p++;
+            mark = k;
+        } else if (p < pattern->len &&
+                   (pattern->data[p] == '?' || pattern->data[p] == key[k])) {
+            p++;
+            k++;
+        } else if (star != UINT32_MAX) {
+            /* let the last '*' match one more byte */
+            p = star + 1;
+            k = ++mark;
+        } else {
+            return false;
+        }
+    }
+
+    while (p < pattern->len && pattern->data[p] == '*') {
+        p++;
+    }
+
+    return p == pattern->len;
+}
+
+static struct nearcache_entry *
+nearcache_lookup(const struct nearcache *cache, uint64_t hash,
+                 const uint8_t *key, uint32_t keylen)
+{
+    struct nearcache_entry *e;
+
+    TAILQ_FOREACH(e, &cache->bucket[hash & (cache->nbucket - 1)], h_tqe) {
+        if (e->hash == hash && e->keylen == keylen &&
+            memcmp(e->key, key, keylen) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the entry of key if it has not expired by now, or NULL
+ */
+struct nearcache_entry *
+nearcache_get(struct nearcache *cache, const uint8_t *key, uint32_t keylen,
+              int64_t now)
+{
+    struct nearcache_entry *e;
+
+    e = nearcache_lookup(cache, wyhash((const char *)key, keylen, 0), key,
+                         keylen);
+    if (e == NULL) {
+        return NULL;
+    }
+
+    if (now >= e->expire) {
+        nearcache_delete(cache, e);
+        return NULL;
+    }
+
+    TAILQ_REMOVE(&cache->lru, e, l_tqe);
+    TAILQ_INSERT_TAIL(&cache->lru, e, l_tqe);
+
+    return e;
+}
+
+uint32_t
+nearcache_version(const struct nearcache *cache, const uint8_t *key,
+                  uint32_t keylen)
+{
+    uint64_t hash = wyhash((const char *)key, keylen, 0);
+
+    return cache->version[(hash >> 32) & (NEARCACHE_NVERSION - 1)];
+}
+
+/*
+ * Cache response rsp of key, unless a write changed the version of key
+ * since the read of rsp missed or rsp is too large, and return the # of
+ * entries evicted to make room for it
+ */
+uint32_t
+nearcache_set(struct nearcache *cache, const uint8_t *key, uint32_t keylen,
+              uint32_t version, const struct msg *rsp, int64_t now)
+{
+    struct nearcache_entry *e;
+    struct mbuf *mbuf;
+    uint64_t hash;
+    uint8_t *p;
+    size_t size;
+    uint32_t nevict;
+
+    hash = wyhash((const char *)key, keylen, 0);
+    if (cache->version[(hash >> 32) & (NEARCACHE_NVERSION - 1)] != version) {
+        return 0;
+    }
+
+    size = sizeof(*e) + keylen + rsp->mlen;
+    if (size > cache->size / NEARCACHE_MAXFRAC) {
+        return 0;
+    }
+
+    e = nearcache_lookup(cache, hash, key, keylen);
+    if (e != NULL) {
+        nearcache_delete(cache, e);
+    }
+
+    for (nevict = 0; cache->used + size > cache->size; nevict++) {
+        nearcache_delete(cache, TAILQ_FIRST(&cache->lru));
+    }
+
+    e = nc_alloc(size);
+    if (e == NULL) {
+        return nevict;
+    }
+
+    e->hash = hash;
+    e->expire = now + cache->ttl;
+    e->keylen = keylen;
+    e->vlen = rsp->mlen;
+    e->key = (uint8_t *)(e + 1);
+    e->value = e->key + keylen;
+
+    nc_memcpy(e->key, key, keylen);
+    p = e->value;
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        size_t n = (size_t)(mbuf->last - mbuf->pos);
+
+        nc_memcpy(p, mbuf->pos, n);
+        p += n;
+    }
+    ASSERT(p == e->value + e->vlen);
+
+    TAILQ_INSERT_HEAD(&cache->bucket[hash & (cache->nbucket - 1)], e, h_tqe);
+    TAILQ_INSERT_TAIL(&cache->lru, e, l_tqe);
+    cache->used += size;
+
+    return nevict;
+}
+
+/*
+ * Bump the version of key, as a write to it is on its way, and drop its
+ * entry. Return true if there was one.
+ */
+bool
+nearcache_invalidate(struct nearcache *cache, const uint8_t *key,
+                     uint32_t keylen)
+{
+    struct nearcache_entry *e;
+    uint64_t hash;
+
+    hash = wyhash((const char *)key, keylen, 0);
+    cache->version[(hash >> 32) & (NEARCACHE_NVERSION - 1)]++;
+
+    e = nearcache_lookup(cache, hash, key, keylen);
+    if (e == NULL) {
+        return false;
+    }
+
+    nearcache_delete(cache, e);
+
+    return true;
+}
+
+/*
+ * Fill response rsp with the cached response of entry e
+ */
+rstatus_t
+nearcache_reply(const struct nearcache_entry *e, struct msg *rsp)
+{
+    rstatus_t status;
+    uint32_t off, n;
+
+    for (off = 0; off < e->vlen; off += n) {
+        n = MIN(e->vlen - off, (uint32_t)mbuf_data_size());
+
+        status = msg_append(rsp, e->value + off, n);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
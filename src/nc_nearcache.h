@@ -0,0 +1,71 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_NEARCACHE_H_
+#define _NC_NEARCACHE_H_
+
+#include <nc_core.h>
+
+/*
+ * Near cache of a pool: the responses to single key reads, keyed by the
+ * key, which expire ttl msec after they were cached. The least recently
+ * used responses are evicted to keep the cache within size bytes, and an
+ * entry cannot take more than 1/NEARCACHE_MAXFRAC of them.
+ *
+ * A write bumps the version of its key, which is kept in one of
+ * NEARCACHE_NVERSION slots picked by the hash of the key. A read records
+ * the version of its key when it misses, and its response is only cached
+ * if that version did not change while the read was outstanding, so that
+ * a read that raced with a write cannot cache the value from before it.
+ */
+#define NEARCACHE_NVERSION  1024                /* a power of two */
+#define NEARCACHE_MAXFRAC   8
+#define NEARCACHE_ENTRYSIZE 256                 /* # bytes per bucket */
+
+struct nearcache_entry {
+    TAILQ_ENTRY(nearcache_entry) h_tqe;   /* link in hash bucket */
+    TAILQ_ENTRY(nearcache_entry) l_tqe;   /* link in lru q */
+    uint64_t                     hash;    /* hash of key */
+    int64_t                      expire;  /* expiry in msec */
+    uint32_t                     keylen;  /* key length */
+    uint32_t                     vlen;    /* response length */
+    uint8_t                      *key;    /* key */
+    uint8_t                      *value;  /* response */
+};
+
+TAILQ_HEAD(nearcache_tqh, nearcache_entry);
+
+struct nearcache {
+    size_t               size;                         /* max # bytes */
+    size_t               used;                         /* # bytes in use */
+    int64_t              ttl;                          /* entry ttl in msec */
+    uint32_t             nbucket;                      /* # hash buckets, a power of two */
+    struct nearcache_tqh *bucket;                      /* hash buckets */
+    struct nearcache_tqh lru;                          /* entries, least recently used first */
+    uint32_t             version[NEARCACHE_NVERSION];  /* versions of the keys */
+};
+
+struct nearcache *nearcache_create(size_t size, int64_t ttl);
+void nearcache_destroy(struct nearcache *cache);
+bool nearcache_match(const struct string *pattern, const uint8_t *key, uint32_t keylen);
+struct nearcache_entry *nearcache_get(struct nearcache *cache, const uint8_t *key, uint32_t keylen, int64_t now);
+uint32_t nearcache_version(const struct nearcache *cache, const uint8_t *key, uint32_t keylen);
+uint32_t nearcache_set(struct nearcache *cache, const uint8_t *key, uint32_t keylen, uint32_t version, const struct msg *rsp, int64_t now);
+bool nearcache_invalidate(struct nearcache *cache, const uint8_t *key, uint32_t keylen);
+rstatus_t nearcache_reply(const struct nearcache_entry *e, struct msg *rsp);
+
+#endif
@@ -21,6 +21,7 @@
 #include <nc_core.h>
 #include <nc_server.h>
 #include <nc_proxy.h>
+#include <nc_upgrade.h>
 
 void
 proxy_ref(struct conn *conn, void *owner)
@@ -121,13 +122,11 @@ proxy_reuse(struct conn *p)
 }
 
 static rstatus_t
-proxy_listen(struct context *ctx, struct conn *p)
+proxy_bind(struct conn *p)
 {
     rstatus_t status;
     struct server_pool *pool = p->owner;
 
-    ASSERT(p->proxy);
-
     p->sd = socket(p->family, SOCK_STREAM, 0);
     if (p->sd < 0) {
         log_error("socket failed: %s", strerror(errno));
@@ -176,6 +175,32 @@ proxy_listen(struct context *ctx, struct conn *p)
         return NC_ERROR;
     }
 
+    return NC_OK;
+}
+
+static rstatus_t
+proxy_listen(struct context *ctx, struct conn *p)
+{
+    rstatus_t status;
+    struct server_pool *pool = p->owner;
+    char name[UPGRADE_NAMELEN];
+
+    ASSERT(p->proxy);
+
+    /* skip bind and listen on a socket handed over by an upgrade */
+    nc_snprintf(name, sizeof(name), "pool %.*s", pool->addrstr.len,
+                pool->addrstr.data);
+    p->sd = upgrade_listener(name);
+    if (p->sd < 0) {
+        status = proxy_bind(p);
+        if (status != NC_OK) {
+            return status;
+        }
+    } else {
+        log_debug(LOG_NOTICE, "p %d inherited listening on '%.*s'", p->sd,
+                  pool->addrstr.len, pool->addrstr.data);
+    }
+
     status = nc_set_nonblocking(p->sd);
     if (status < 0) {
         log_error("set nonblock on p %d on addr '%.*s' failed: %s", p->sd,
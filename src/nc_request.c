@@ -15,8 +15,14 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+
 #include <nc_core.h>
 #include <nc_server.h>
+#include <hashkit/nc_hashkit.h>
+
+static void req_mirror(struct context *ctx, struct conn *c_conn,
+                       const struct msg *msg);
 
 struct msg *
 req_get(struct conn *conn)
@@ -51,6 +57,21 @@ req_log(const struct msg *req)
         return;
     }
 
+    /* a hedge? */
+    if (req->is_hedge) {
+        return;
+    }
+
+    /* a batch? */
+    if (req->is_batch) {
+        return;
+    }
+
+    /* a mirror copy? */
+    if (req->is_mirror) {
+        return;
+    }
+
     /* conn close normally? */
     if (req->mlen == 0) {
         return;
@@ -111,7 +132,17 @@ req_put(struct msg *msg)
         rsp_put(pmsg);
     }
 
+    ASSERT(!msg->leader && msg->waiter == NULL);
+
     msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
+    msg_batch_delete(msg);
+
+    if (msg->hedge != NULL) {
+        ASSERT(msg->hedge->hedge == msg);
+        msg->hedge->hedge = NULL;
+        msg->hedge = NULL;
+    }
 
     msg_put(msg);
 }
@@ -291,6 +322,31 @@ ferror:
     return true;
 }
 
+/*
+ * Account for request msg entering or leaving the queues of a server
+ * connection. The # requests is what hash_load_bound: compares against
+ * the pool average, and the # bytes is what mirror_queue_size: bounds.
+ */
+static void
+req_server_queued(struct conn *conn, const struct msg *msg, int delta)
+{
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+
+    server->nqueue += (uint32_t)delta;
+    if (!server->is_replica) {
+        /* hash_load_bound only balances the shards */
+        pool->nqueue += (uint32_t)delta;
+    }
+
+    if (delta > 0) {
+        pool->nqueue_bytes += msg->mlen;
+    } else {
+        ASSERT(pool->nqueue_bytes >= msg->mlen);
+        pool->nqueue_bytes -= msg->mlen;
+    }
+}
+
 void
 req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -313,6 +369,8 @@ req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_incr(ctx, conn->owner, in_queue);
     stats_server_incr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
+
+    req_server_queued(conn, msg, 1);
 }
 
 void
@@ -337,6 +395,8 @@ req_server_enqueue_imsgq_head(struct context *ctx, struct conn *conn, struct msg
 
     stats_server_incr(ctx, conn->owner, in_queue);
     stats_server_incr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
+
+    req_server_queued(conn, msg, 1);
 }
 
 void
@@ -349,6 +409,8 @@ req_server_dequeue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_decr(ctx, conn->owner, in_queue);
     stats_server_decr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
+
+    req_server_queued(conn, msg, -1);
 }
 
 void
@@ -370,6 +432,8 @@ req_server_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_incr(ctx, conn->owner, out_queue);
     stats_server_incr_by(ctx, conn->owner, out_queue_bytes, msg->mlen);
+
+    req_server_queued(conn, msg, 1);
 }
 
 void
@@ -393,6 +457,8 @@ req_server_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_decr(ctx, conn->owner, out_queue);
     stats_server_decr_by(ctx, conn->owner, out_queue_bytes, msg->mlen);
+
+    req_server_queued(conn, msg, -1);
 }
 
 struct msg *
@@ -514,6 +580,207 @@ req_filter(struct conn *conn, struct msg *msg)
     return false;
 }
 
+/*
+ * Return true if request msg is a read of a single key, which identical
+ * reads can wait on instead of being forwarded themselves
+ */
+static bool
+req_coalescable(struct msg *msg)
+{
+    return msg->frag_id == 0 && !msg->noreply && array_n(msg->keys) == 1 &&
+           msg->readonly(msg);
+}
+
+static struct msg_tqh *
+req_coalesce_bucket(struct server_pool *pool, const struct keypos *kpos)
+{
+    uint64_t hash;
+
+    hash = wyhash((const char *)kpos->start, (size_t)(kpos->end - kpos->start),
+                  0);
+
+    return &pool->coalesce_q[hash & (COALESCE_NBUCKET - 1)];
+}
+
+/*
+ * Return true if requests msg1 and msg2 are made of the same bytes
+ */
+bool
+req_same(const struct msg *msg1, const struct msg *msg2)
+{
+    const struct mbuf *mbuf1, *mbuf2;
+    const uint8_t *p1, *p2;
+    size_t n;
+
+    if (msg1->mlen != msg2->mlen || msg1->type != msg2->type) {
+        return false;
+    }
+
+    mbuf1 = STAILQ_FIRST(&msg1->mhdr);
+    mbuf2 = STAILQ_FIRST(&msg2->mhdr);
+    p1 = mbuf1 != NULL ? mbuf1->start : NULL;
+    p2 = mbuf2 != NULL ? mbuf2->start : NULL;
+
+    while (mbuf1 != NULL && mbuf2 != NULL) {
+        if (p1 == mbuf1->last) {
+            mbuf1 = STAILQ_NEXT(mbuf1, next);
+            p1 = mbuf1 != NULL ? mbuf1->start : NULL;
+            continue;
+        }
+
+        if (p2 == mbuf2->last) {
+            mbuf2 = STAILQ_NEXT(mbuf2, next);
+            p2 = mbuf2 != NULL ? mbuf2->start : NULL;
+            continue;
+        }
+
+        n = (size_t)MIN(mbuf1->last - p1, mbuf2->last - p2);
+        if (memcmp(p1, p2, n) != 0) {
+            return false;
+        }
+        p1 += n;
+        p2 += n;
+    }
+
+    return true;
+}
+
+/*
+ * Give read msg, which waited on an identical read, the response rsp to
+ * that read. The response shares the mbufs of rsp, so a hot key read by
+ * many clients at once is held in memory once.
+ */
+static rstatus_t
+req_coalesce_copy(struct conn *c_conn, struct msg *msg, const struct msg *rsp)
+{
+    rstatus_t status;
+    struct msg *pmsg;
+
+    pmsg = msg_get(c_conn, false, c_conn->redis);
+    if (pmsg == NULL) {
+        return NC_ENOMEM;
+    }
+
+    status = msg_share_msg(pmsg, rsp);
+    if (status != NC_OK) {
+        msg_put(pmsg);
+        return status;
+    }
+
+    msg->peer = pmsg;
+    pmsg->peer = msg;
+
+    return NC_OK;
+}
+
+/*
+ * Answer the reads waiting on read msg, which is done, with its response
+ * rsp, or with error err if there is none, and take msg off the reads in
+ * flight of pool
+ */
+void
+req_coalesce_done(struct context *ctx, struct server_pool *pool,
+                  struct msg *msg, const struct msg *rsp, err_t err)
+{
+    rstatus_t status;
+    struct msg *wmsg, *nmsg; /* waiting and next waiting message */
+    struct conn *c_conn;
+
+    ASSERT(msg->request && msg->leader);
+
+    TAILQ_REMOVE(req_coalesce_bucket(pool, array_get(msg->keys, 0)), msg,
+                 co_tqe);
+    msg->leader = 0;
+    msg->stale = 0;
+
+    for (wmsg = msg->waiter; wmsg != NULL; wmsg = nmsg) {
+        nmsg = wmsg->waiter;
+        wmsg->waiter = NULL;
+
+        ASSERT(wmsg->request && !wmsg->done);
+
+        /* the client of wmsg has closed its connection */
+        if (wmsg->swallow) {
+            req_put(wmsg);
+            continue;
+        }
+
+        c_conn = wmsg->owner;
+        ASSERT(c_conn->client && !c_conn->proxy);
+
+        wmsg->done = 1;
+        if (rsp == NULL) {
+            wmsg->error = 1;
+            wmsg->err = err;
+        } else if (req_coalesce_copy(c_conn, wmsg, rsp) != NC_OK) {
+            wmsg->error = 1;
+            wmsg->err = ENOMEM;
+        }
+
+        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+            status = event_add_out(ctx->evb, c_conn);
+            if (status != NC_OK) {
+                c_conn->err = errno;
+            }
+        }
+
+        log_debug(LOG_VERB, "answer req %"PRIu64" from c %d with %s of req "
+                  "%"PRIu64, wmsg->id, c_conn->sd, wmsg->error ? "error" :
+                  "response", msg->id);
+    }
+    msg->waiter = NULL;
+}
+
+/*
+ * Have read nmsg take the place of read msg in the reads in flight of
+ * pool, along with the reads waiting on msg
+ */
+void
+req_coalesce_move(struct server_pool *pool, struct msg *msg, struct msg *nmsg)
+{
+    ASSERT(msg->leader && !nmsg->leader);
+
+    TAILQ_INSERT_BEFORE(msg, nmsg, co_tqe);
+    TAILQ_REMOVE(req_coalesce_bucket(pool, array_get(msg->keys, 0)), msg,
+                 co_tqe);
+
+    nmsg->leader = 1;
+    nmsg->stale = msg->stale;
+    nmsg->waiter = msg->waiter;
+    msg->leader = 0;
+    msg->stale = 0;
+    msg->waiter = NULL;
+}
+
+/*
+ * Hand the reads in flight of pool op over to pool np, which replaces it
+ * on reload, along with the reads waiting on them. If np does not coalesce
+ * reads, the waiting reads fail, as there is nowhere left to wait.
+ */
+void
+req_coalesce_reload(struct context *ctx, struct server_pool *op,
+                    struct server_pool *np)
+{
+    uint32_t i;
+
+    if (op->coalesce_q == NULL) {
+        return;
+    }
+
+    for (i = 0; i < COALESCE_NBUCKET; i++) {
+        if (np != NULL && np->coalesce_q != NULL) {
+            /* a key hashes to the same bucket in every pool */
+            TAILQ_CONCAT(&np->coalesce_q[i], &op->coalesce_q[i], co_tqe);
+            continue;
+        }
+
+        while (!TAILQ_EMPTY(&op->coalesce_q[i])) {
+            req_coalesce_done(ctx, op, TAILQ_FIRST(&op->coalesce_q[i]), NULL,
+                              ECANCELED);
+        }
+    }
+}
+
 static void
 req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -529,6 +796,10 @@ req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
     msg->error = 1;
     msg->err = errno;
 
+    if (msg->leader) {
+        req_coalesce_done(ctx, conn->owner, msg, NULL, msg->err);
+    }
+
     /* noreply request don't expect any response */
     if (msg->noreply) {
         req_put(msg);
@@ -552,11 +823,263 @@ req_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
     stats_server_incr_by(ctx, server, request_bytes, msg->mlen);
 }
 
+/*
+ * Count key, forwarded to the server at idx server or answered from the
+ * near cache if server is HOTKEY_NOSERVER, in the hot key detector of pool
+ * if the request is sampled. The hot keys are reported to the stats right before
+ * their counts are halved, when they add up to about twice the samples of
+ * a HOTKEY_DECAY interval.
+ */
+static void
+req_hotkey(struct context *ctx, struct server_pool *pool, uint32_t server,
+           const uint8_t *key, uint32_t keylen)
+{
+    struct hotkey *hk = pool->hotkey;
+    int64_t now;
+
+    if (hk == NULL || --hk->countdown != 0) {
+        return;
+    }
+    hk->countdown = hotkey_countdown(hk);
+
+    now = nc_msec_now();
+    if (now >= hk->next_decay) {
+        stats_pool_set_hotkeys(ctx, pool, hot_keys, hk);
+        hotkey_decay(hk, now);
+    }
+
+    hotkey_record(hk, key, keylen, server);
+
+    stats_pool_incr(ctx, pool, hotkey_samples);
+}
+
+/*
+ * Schedule a hedge of a read only request msg that was forwarded on server
+ * connection s_conn to a shard with replicas, if pool hedges reads. Every
+ * such read adds hedge_budget hundredths of a hedge to the budget of pool,
+ * which bounds the hedges to hedge_budget % of the reads.
+ */
+static void
+req_hedge_schedule(struct server_pool *pool, struct conn *s_conn,
+                   struct msg *msg)
+{
+    struct server *server = s_conn->owner;
+
+    if (pool->hedge_delay == 0 || msg->noreply || msg->frag_id != 0) {
+        return;
+    }
+
+    if (server->nreplica == 0 && !server->is_replica) {
+        return;
+    }
+
+    if (!msg->readonly(msg)) {
+        return;
+    }
+
+    pool->hedge_tokens = MIN(pool->hedge_tokens + pool->hedge_budget,
+                             HEDGE_BURST * 100);
+
+    msg_hedge_insert(msg, s_conn, pool->hedge_delay);
+}
+
+/*
+ * Return true if request msg is a single key read that can be sent along
+ * with other reads in a batch, which is a mget or a multi key get
+ */
+static bool
+req_batchable(const struct server_pool *pool, const struct msg *msg)
+{
+    if (pool->batch_size == 0 || msg->noreply || msg->frag_id != 0) {
+        return false;
+    }
+
+    if (array_n(msg->keys) != 1) {
+        return false;
+    }
+
+    return msg->type == MSG_REQ_REDIS_GET || msg->type == MSG_REQ_MC_GET;
+}
+
+/*
+ * Mark read msg of a batch done, with its response msg->peer if it has one
+ * or with error err if not, and answer its client
+ */
+void
+req_batch_done(struct context *ctx, struct server_pool *pool, struct msg *msg,
+               err_t err)
+{
+    rstatus_t status;
+    struct conn *c_conn;
+
+    ASSERT(msg->request && !msg->is_batch && !msg->done);
+
+    msg->done = 1;
+    if (msg->peer == NULL) {
+        msg->error = 1;
+        msg->err = err;
+    }
+
+    if (msg->leader) {
+        req_coalesce_done(ctx, pool, msg, msg->peer, err);
+    }
+
+    /* the client of msg has closed its connection */
+    if (msg->swallow) {
+        req_put(msg);
+        return;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        status = event_add_out(ctx->evb, c_conn);
+        if (status != NC_OK) {
+            c_conn->err = errno;
+        }
+    }
+}
+
+/*
+ * Fail every read of batch msg with error err, and free msg
+ */
+void
+req_batch_error(struct context *ctx, struct server_pool *pool, struct msg *msg,
+                err_t err)
+{
+    uint32_t i;
+
+    ASSERT(msg->request && msg->is_batch);
+
+    log_debug(LOG_INFO, "fail batch req %"PRIu64" of %"PRIu32" reads: %s",
+              msg->id, msg->nfrag, strerror(err));
+
+    for (i = 0; i < msg->nfrag; i++) {
+        req_batch_done(ctx, pool, msg->frag_seq[i], err);
+    }
+
+    req_put(msg);
+}
+
+/*
+ * Send the batch of reads collected on server connection s_conn. A batch
+ * of one read is sent as that read.
+ */
+void
+req_batch_send(struct context *ctx, struct conn *s_conn)
+{
+    rstatus_t status;
+    struct server *server = s_conn->owner;
+    struct server_pool *pool = server->owner;
+    struct msg *msg, *bmsg;
+    err_t err;
+
+    bmsg = s_conn->bmsg;
+    ASSERT(bmsg != NULL && bmsg->is_batch && bmsg->nfrag != 0);
+
+    s_conn->bmsg = NULL;
+    msg_batch_delete(bmsg);
+
+    if (bmsg->nfrag == 1) {
+        msg = bmsg->frag_seq[0];
+        bmsg->nfrag = 0;
+        req_put(bmsg);
+    } else {
+        msg = bmsg;
+        status = msg->batch(msg);
+        if (status != NC_OK) {
+            err = errno;
+            goto error;
+        }
+    }
+
+    if (TAILQ_EMPTY(&s_conn->imsg_q)) {
+        status = event_add_out(ctx->evb, s_conn);
+        if (status != NC_OK) {
+            err = errno;
+            s_conn->err = err;
+            goto error;
+        }
+    }
+
+    s_conn->enqueue_inq(ctx, s_conn, msg);
+
+    req_forward_stats(ctx, server, msg);
+
+    if (msg->is_batch) {
+        stats_pool_incr(ctx, pool, batches);
+        stats_pool_incr_by(ctx, pool, batched_reads, msg->nfrag);
+    } else {
+        req_hedge_schedule(pool, s_conn, msg);
+    }
+
+    log_debug(LOG_VERB, "send batch req %"PRIu64" len %"PRIu32" of %"PRIu32
+              " reads on s %d", msg->id, msg->mlen,
+              msg->is_batch ? msg->nfrag : 1, s_conn->sd);
+
+    return;
+
+error:
+    if (msg->is_batch) {
+        req_batch_error(ctx, pool, msg, err);
+    } else {
+        req_batch_done(ctx, pool, msg, err);
+    }
+}
+
+/*
+ * Add read msg from client connection c_conn to the batch of server
+ * connection s_conn. A new batch is sent batch_delay msec after its first
+ * read, or as soon as it has batch_size reads. The batch keeps the
+ * batch_size it was made for, as s_conn may move to a reloaded pool.
+ */
+static rstatus_t
+req_batch(struct context *ctx, struct conn *c_conn, struct conn *s_conn,
+          struct msg *msg)
+{
+    struct server_pool *pool = c_conn->owner;
+    struct msg *bmsg = s_conn->bmsg;
+
+    if (bmsg == NULL) {
+        bmsg = msg_get(c_conn, true, c_conn->redis);
+        if (bmsg == NULL) {
+            return NC_ENOMEM;
+        }
+
+        bmsg->frag_seq = nc_alloc(pool->batch_size * sizeof(*bmsg->frag_seq));
+        if (bmsg->frag_seq == NULL) {
+            req_put(bmsg);
+            return NC_ENOMEM;
+        }
+
+        bmsg->batch_size = pool->batch_size;
+        bmsg->is_batch = 1;
+        bmsg->type = c_conn->redis ? MSG_REQ_REDIS_MGET : MSG_REQ_MC_GET;
+
+        s_conn->bmsg = bmsg;
+        msg_batch_insert(bmsg, s_conn, pool->batch_delay);
+    }
+
+    bmsg->frag_seq[bmsg->nfrag++] = msg;
+
+    log_debug(LOG_VERB, "batch req %"PRIu64" from c %d as read %"PRIu32" of "
+              "req %"PRIu64, msg->id, c_conn->sd, bmsg->nfrag, bmsg->id);
+
+    if (bmsg->nfrag == bmsg->batch_size) {
+        req_batch_send(ctx, s_conn);
+    }
+
+    return NC_OK;
+}
+
 static void
 req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
 {
     rstatus_t status;
+    struct server_pool *pool;
     struct conn *s_conn;
+    struct server *server;
     uint8_t *key;
     uint32_t keylen;
     struct keypos *kpos;
@@ -573,7 +1096,7 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
     key = kpos->start;
     keylen = (uint32_t)(kpos->end - kpos->start);
 
-    s_conn = server_pool_conn(ctx, c_conn->owner, key, keylen);
+    s_conn = server_pool_conn(ctx, c_conn->owner, msg, key, keylen);
     if (s_conn == NULL) {
         /*
          * Handle a failure to establish a new connection to a server,
@@ -595,6 +1118,27 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
     }
     ASSERT(!s_conn->client && !s_conn->proxy);
 
+    pool = c_conn->owner;
+    if (pool->coalesce_q != NULL && req_coalescable(msg)) {
+        TAILQ_INSERT_TAIL(req_coalesce_bucket(pool, array_get(msg->keys, 0)),
+                          msg, co_tqe);
+        msg->leader = 1;
+    }
+
+    server = s_conn->owner;
+    req_hotkey(ctx, pool, server->idx, key, keylen);
+
+    if (req_batchable(pool, msg) && conn_authenticated(s_conn) &&
+        req_batch(ctx, c_conn, s_conn, msg) == NC_OK) {
+        req_mirror(ctx, c_conn, msg);
+        return;
+    }
+
+    /* the reads batched so far go first, to keep the order on s_conn */
+    if (s_conn->bmsg != NULL) {
+        req_batch_send(ctx, s_conn);
+    }
+
     /* enqueue the message (request) into server inq */
     if (TAILQ_EMPTY(&s_conn->imsg_q)) {
         status = event_add_out(ctx->evb, s_conn);
@@ -616,13 +1160,472 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
 
     s_conn->enqueue_inq(ctx, s_conn, msg);
 
-    req_forward_stats(ctx, s_conn->owner, msg);
+    req_forward_stats(ctx, server, msg);
+
+    req_hedge_schedule(pool, s_conn, msg);
+
+    req_mirror(ctx, c_conn, msg);
 
     log_debug(LOG_VERB, "forward from c %d to s %d req %"PRIu64" len %"PRIu32
               " type %d with key '%.*s'", c_conn->sd, s_conn->sd, msg->id,
               msg->mlen, msg->type, keylen, key);
 }
 
+/*
+ * Forward a request that was already sent to one server on to another
+ * server, as redis cluster asks us to do with MOVED and ASK responses.
+ * The optional prefix request is sent right ahead of it on the same
+ * server connection. The request is still in the client outq.
+ */
+void
+req_redirect(struct context *ctx, struct msg *msg, struct server *server,
+             struct msg *prefix)
+{
+    rstatus_t status;
+    struct conn *c_conn, *s_conn;
+    struct mbuf *mbuf;
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+    ASSERT(msg->request && !msg->done);
+
+    /* rewind the request, so that it is sent again from the start */
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        mbuf->pos = mbuf->start;
+    }
+
+    s_conn = server_conn(server);
+    if (s_conn == NULL) {
+        goto error;
+    }
+
+    status = server_connect(ctx, server, s_conn);
+    if (status != NC_OK) {
+        server_close(ctx, s_conn);
+        goto error;
+    }
+
+    if (TAILQ_EMPTY(&s_conn->imsg_q)) {
+        status = event_add_out(ctx->evb, s_conn);
+        if (status != NC_OK) {
+            s_conn->err = errno;
+            goto error;
+        }
+    }
+
+    if (!conn_authenticated(s_conn)) {
+        status = msg->add_auth(ctx, c_conn, s_conn);
+        if (status != NC_OK) {
+            s_conn->err = errno;
+            goto error;
+        }
+    }
+
+    if (prefix != NULL) {
+        s_conn->enqueue_inq(ctx, s_conn, prefix);
+    }
+    s_conn->enqueue_inq(ctx, s_conn, msg);
+
+    req_forward_stats(ctx, s_conn->owner, msg);
+
+    log_debug(LOG_VERB, "redirect from c %d to s %d req %"PRIu64" len %"PRIu32
+              " type %d", c_conn->sd, s_conn->sd, msg->id, msg->mlen,
+              msg->type);
+
+    return;
+
+error:
+    if (prefix != NULL) {
+        req_put(prefix);
+    }
+    if (msg->frag_owner != NULL) {
+        msg->frag_owner->nfrag_done++;
+    }
+    req_forward_error(ctx, c_conn, msg);
+}
+
+/*
+ * Return a copy of request msg for client connection c_conn, or NULL on
+ * failure. The keys of the copy point into its own mbufs.
+ */
+static struct msg *
+req_copy(struct conn *c_conn, const struct msg *msg)
+{
+    struct msg *nmsg;
+    struct mbuf *mbuf, *nbuf;
+    struct keypos *kpos, *nkpos;
+    uint32_t i, nkey;
+
+    nmsg = msg_get(c_conn, true, msg->redis);
+    if (nmsg == NULL) {
+        return NULL;
+    }
+
+    nkey = array_n(msg->keys);
+
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        nbuf = mbuf_get();
+        if (nbuf == NULL) {
+            req_put(nmsg);
+            return NULL;
+        }
+
+        mbuf_copy(nbuf, mbuf->start, (size_t)(mbuf->last - mbuf->start));
+        mbuf_insert(&nmsg->mhdr, nbuf);
+
+        for (i = 0; i < nkey; i++) {
+            kpos = array_get(msg->keys, i);
+            if (kpos->start < mbuf->start || kpos->start >= mbuf->last) {
+                continue;
+            }
+
+            nkpos = array_push(nmsg->keys);
+            if (nkpos == NULL) {
+                req_put(nmsg);
+                return NULL;
+            }
+            nkpos->start = nbuf->start + (kpos->start - mbuf->start);
+            nkpos->end = nbuf->start + (kpos->end - mbuf->start);
+        }
+    }
+
+    nmsg->mlen = msg->mlen;
+    nmsg->type = msg->type;
+    nmsg->narg = msg->narg;
+    nmsg->start_ts = msg->start_ts;
+    nmsg->near_cache = msg->near_cache;
+    nmsg->near_cache_version = msg->near_cache_version;
+
+    return nmsg;
+}
+
+/*
+ * Mirror request msg from client connection c_conn to the mirror pool of
+ * its pool, if msg has a single key and is sampled. The copy has its response swallowed, and it
+ * is dropped when it cannot be sent right away or the queues of the mirror
+ * pool are full, so that mirroring never fails or holds up msg.
+ */
+static void
+req_mirror(struct context *ctx, struct conn *c_conn, const struct msg *msg)
+{
+    rstatus_t status;
+    struct server_pool *pool = c_conn->owner;
+    struct server_pool *mpool = pool->mirror;
+    struct conn *m_conn;
+    struct msg *mmsg;
+    struct keypos *kpos;
+
+    if (mpool == NULL) {
+        return;
+    }
+
+    if (!pool->mirror_writes && !msg->readonly(msg)) {
+        return;
+    }
+
+    /*
+     * The copy is sent whole to the mirror server of its first key, which
+     * need not own its other keys when the mirror pool is sharded apart
+     * from pool, so only requests of a single key are mirrored
+     */
+    if (array_n(msg->keys) != 1) {
+        return;
+    }
+
+    if (pool->mirror_rate < 100 && nc_random() % 100 >= pool->mirror_rate) {
+        return;
+    }
+
+    if (mpool->nqueue_bytes + msg->mlen > pool->mirror_queue_size) {
+        stats_pool_incr(ctx, pool, mirror_drops);
+        return;
+    }
+
+    mmsg = req_copy(c_conn, msg);
+    if (mmsg == NULL || array_n(mmsg->keys) == 0) {
+        goto drop;
+    }
+    mmsg->is_mirror = 1;
+    mmsg->noreply = msg->noreply;
+    mmsg->swallow = 1;
+
+    kpos = array_get(mmsg->keys, 0);
+    m_conn = server_pool_conn(ctx, mpool, mmsg, kpos->start,
+                              (uint32_t)(kpos->end - kpos->start));
+    if (m_conn == NULL) {
+        goto drop;
+    }
+
+    if (m_conn->bmsg != NULL) {
+        req_batch_send(ctx, m_conn);
+    }
+
+    if (TAILQ_EMPTY(&m_conn->imsg_q)) {
+        status = event_add_out(ctx->evb, m_conn);
+        if (status != NC_OK) {
+            m_conn->err = errno;
+            goto drop;
+        }
+    }
+
+    if (!conn_authenticated(m_conn)) {
+        status = mmsg->add_auth(ctx, c_conn, m_conn);
+        if (status != NC_OK) {
+            m_conn->err = errno;
+            goto drop;
+        }
+    }
+
+    m_conn->enqueue_inq(ctx, m_conn, mmsg);
+
+    req_forward_stats(ctx, m_conn->owner, mmsg);
+
+    stats_pool_incr(ctx, pool, mirrored_requests);
+
+    log_debug(LOG_VERB, "mirror req %"PRIu64" from c %d to s %d of pool "
+              "'%.*s' as req %"PRIu64, msg->id, c_conn->sd, m_conn->sd,
+              mpool->name.len, mpool->name.data, mmsg->id);
+
+    return;
+
+drop:
+    if (mmsg != NULL) {
+        req_put(mmsg);
+    }
+    stats_pool_incr(ctx, pool, mirror_drops);
+}
+
+/*
+ * Hedge request msg, which is outstanding on server connection s_conn for
+ * longer than the hedge delay of its pool, by sending a copy of it to
+ * another server of its shard. Whichever of the two is answered first is
+ * answered to the client, and the response to the other is swallowed.
+ */
+void
+req_hedge(struct context *ctx, struct conn *s_conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct server *server;
+    struct server_pool *pool;
+    struct conn *c_conn, *h_conn;
+    struct msg *hmsg;
+
+    ASSERT(msg->request && !msg->is_hedge);
+
+    /* skip over req that are in-error, done or no longer wanted */
+    if (msg->error || msg->done || msg->swallow || msg->hedge != NULL) {
+        return;
+    }
+
+    server = s_conn->owner;
+    if (server->retired) {
+        return;
+    }
+    pool = server->owner;
+
+    if (pool->hedge_tokens < 100) {
+        stats_pool_incr(ctx, pool, hedges_over_budget);
+        return;
+    }
+
+    server = server_hedge(pool, server);
+    if (server == NULL) {
+        return;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    hmsg = req_copy(c_conn, msg);
+    if (hmsg == NULL) {
+        return;
+    }
+    hmsg->is_hedge = 1;
+    hmsg->swallow = 1;
+
+    h_conn = server_conn(server);
+    if (h_conn == NULL) {
+        req_put(hmsg);
+        return;
+    }
+
+    status = server_connect(ctx, server, h_conn);
+    if (status != NC_OK) {
+        server_close(ctx, h_conn);
+        req_put(hmsg);
+        return;
+    }
+
+    if (TAILQ_EMPTY(&h_conn->imsg_q)) {
+        status = event_add_out(ctx->evb, h_conn);
+        if (status != NC_OK) {
+            h_conn->err = errno;
+            req_put(hmsg);
+            return;
+        }
+    }
+
+    if (!conn_authenticated(h_conn)) {
+        status = hmsg->add_auth(ctx, c_conn, h_conn);
+        if (status != NC_OK) {
+            h_conn->err = errno;
+            req_put(hmsg);
+            return;
+        }
+    }
+
+    h_conn->enqueue_inq(ctx, h_conn, hmsg);
+
+    req_forward_stats(ctx, server, hmsg);
+
+    msg->hedge = hmsg;
+    hmsg->hedge = msg;
+
+    pool->hedge_tokens -= 100;
+    stats_pool_incr(ctx, pool, hedges);
+
+    log_debug(LOG_VERB, "hedge req %"PRIu64" on s %d with req %"PRIu64" on "
+              "s %d", msg->id, s_conn->sd, hmsg->id, h_conn->sd);
+}
+
+/*
+ * Answer read msg from the near cache of its pool if it has the key, or
+ * mark msg to have its response cached if its key is hot or matches the
+ * near_cache_pattern of the pool. A write drops its keys from the cache
+ * instead. Return true if msg was answered.
+ */
+static bool
+req_near_cache(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct server_pool *pool = conn->owner;
+    struct nearcache *cache = pool->near_cache;
+    struct nearcache_entry *e;
+    struct keypos *kpos;
+    uint8_t *key;
+    uint32_t i, keylen;
+
+    if (!msg->readonly(msg)) {
+        for (i = 0; i < array_n(msg->keys); i++) {
+            kpos = array_get(msg->keys, i);
+            keylen = (uint32_t)(kpos->end - kpos->start);
+
+            if (nearcache_invalidate(cache, kpos->start, keylen)) {
+                stats_pool_incr(ctx, pool, near_cache_invalidations);
+            }
+        }
+        return false;
+    }
+
+    if ((msg->type != MSG_REQ_MC_GET && msg->type != MSG_REQ_REDIS_GET) ||
+        array_n(msg->keys) != 1) {
+        return false;
+    }
+
+    kpos = array_get(msg->keys, 0);
+    key = kpos->start;
+    keylen = (uint32_t)(kpos->end - kpos->start);
+
+    e = nearcache_get(cache, key, keylen, nc_msec_now());
+    if (e == NULL) {
+        if (!(pool->near_cache_pattern.len > 0 &&
+              nearcache_match(&pool->near_cache_pattern, key, keylen)) &&
+            !(pool->hotkey != NULL && hotkey_hot(pool->hotkey, key, keylen))) {
+            return false;
+        }
+
+        msg->near_cache = 1;
+        msg->near_cache_version = nearcache_version(cache, key, keylen);
+        stats_pool_incr(ctx, pool, near_cache_misses);
+
+        return false;
+    }
+
+    stats_pool_incr(ctx, pool, near_cache_hits);
+
+    req_hotkey(ctx, pool, HOTKEY_NOSERVER, key, keylen);
+
+    status = req_make_reply(ctx, conn, msg);
+    if (status != NC_OK) {
+        conn->err = errno;
+        return true;
+    }
+
+    status = nearcache_reply(e, msg->peer);
+    if (status != NC_OK) {
+        conn->err = errno;
+        return true;
+    }
+
+    status = event_add_out(ctx->evb, conn);
+    if (status != NC_OK) {
+        conn->err = errno;
+    }
+
+    log_debug(LOG_VERB, "near cache hit req %"PRIu64" from c %d with key "
+              "'%.*s'", msg->id, conn->sd, keylen, key);
+
+    return true;
+}
+
+/*
+ * Have read msg wait on an identical read in flight on its pool, if there
+ * is one, instead of forwarding it. Return true if msg waits.
+ *
+ * A write msg never waits, but the reads in flight of its keys may miss it,
+ * so the reads that come after it must not wait on them.
+ */
+static bool
+req_coalesce(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool = conn->owner;
+    struct msg *lmsg; /* leader message */
+    struct keypos *kpos, *lkpos;
+    uint32_t i;
+
+    if (!msg->readonly(msg)) {
+        for (i = 0; i < array_n(msg->keys); i++) {
+            kpos = array_get(msg->keys, i);
+
+            TAILQ_FOREACH(lmsg, req_coalesce_bucket(pool, kpos), co_tqe) {
+                lkpos = array_get(lmsg->keys, 0);
+                if (lkpos->end - lkpos->start == kpos->end - kpos->start &&
+                    memcmp(lkpos->start, kpos->start,
+                           (size_t)(kpos->end - kpos->start)) == 0) {
+                    lmsg->stale = 1;
+                }
+            }
+        }
+        return false;
+    }
+
+    if (!req_coalescable(msg)) {
+        return false;
+    }
+
+    TAILQ_FOREACH(lmsg, req_coalesce_bucket(pool, array_get(msg->keys, 0)),
+                  co_tqe) {
+        if (!lmsg->stale && req_same(lmsg, msg)) {
+            break;
+        }
+    }
+    if (lmsg == NULL) {
+        return false;
+    }
+
+    conn->enqueue_outq(ctx, conn, msg);
+
+    msg->waiter = lmsg->waiter;
+    lmsg->waiter = msg;
+
+    stats_pool_incr(ctx, pool, coalesced_reads);
+
+    log_debug(LOG_VERB, "coalesce req %"PRIu64" from c %d with req %"PRIu64,
+              msg->id, conn->sd, lmsg->id);
+
+    return true;
+}
+
 void
 req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
               struct msg *nmsg)
@@ -667,8 +1670,16 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
         return;
     }
 
-    /* do fragment */
     pool = conn->owner;
+    if (pool->near_cache != NULL && req_near_cache(ctx, conn, msg)) {
+        return;
+    }
+
+    if (pool->coalesce_q != NULL && req_coalesce(ctx, conn, msg)) {
+        return;
+    }
+
+    /* do fragment */
     TAILQ_INIT(&frag_msgq);
     status = msg->fragment(msg, array_n(&pool->server), &frag_msgq);
     if (status != NC_OK) {
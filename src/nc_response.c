@@ -18,6 +18,9 @@
 #include <nc_core.h>
 #include <nc_server.h>
 
+static void rsp_forward_stats(struct context *ctx, struct server *server,
+                              struct msg *msg, uint32_t msgsize);
+
 struct msg *
 rsp_get(struct conn *conn)
 {
@@ -138,6 +141,48 @@ rsp_recv_next(struct context *ctx, struct conn *conn, bool alloc)
     return msg;
 }
 
+/*
+ * Answer the client with the response to hedge pmsg, which arrived ahead of
+ * the response to the request it hedges, if that request is still wanted.
+ * The hedge takes the place of the request in the client outq, and the
+ * request turns into a hedge whose response is swallowed.
+ */
+static void
+rsp_hedge(struct context *ctx, struct msg *pmsg)
+{
+    struct msg *msg = pmsg->hedge;
+    struct conn *c_conn;
+
+    ASSERT(pmsg->is_hedge && pmsg->swallow);
+    ASSERT(msg->hedge == pmsg);
+
+    if (msg->done || msg->swallow) {
+        return;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    TAILQ_INSERT_BEFORE(msg, pmsg, c_tqe);
+    TAILQ_REMOVE(&c_conn->omsg_q, msg, c_tqe);
+
+    pmsg->is_hedge = 0;
+    pmsg->swallow = 0;
+    pmsg->hedge = NULL;
+    msg->is_hedge = 1;
+    msg->swallow = 1;
+    msg->hedge = NULL;
+
+    if (msg->leader) {
+        req_coalesce_move(c_conn->owner, msg, pmsg);
+    }
+
+    stats_pool_incr(ctx, c_conn->owner, hedges_won);
+
+    log_debug(LOG_VERB, "hedge req %"PRIu64" won over req %"PRIu64, pmsg->id,
+              msg->id);
+}
+
 static bool
 rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -203,6 +248,10 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
         return true;
     }
 
+    if (pmsg->is_hedge && pmsg->hedge != NULL) {
+        rsp_hedge(ctx, pmsg);
+    }
+
     if (pmsg->swallow) {
         conn->swallow_msg(conn, pmsg, msg);
 
@@ -213,21 +262,199 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
                   "%"PRIu64" on s %d", msg->id, msg->mlen, pmsg->id,
                   conn->sd);
 
+        if (pmsg->leader) {
+            struct server *server = conn->owner;
+
+            req_coalesce_done(ctx, server->owner, pmsg, msg, 0);
+        }
+
+        /* a mirror copy is only sent for the stats of the mirror pool */
+        if (pmsg->is_mirror) {
+            msg->peer = pmsg;
+            rsp_forward_stats(ctx, conn->owner, msg, msg->mlen);
+            msg->peer = NULL;
+        }
+
         rsp_put(msg);
         req_put(pmsg);
         return true;
     }
 
+    /*
+     * If the response redirects the request to another server, as redis
+     * cluster does with MOVED and ASK, the request is forwarded there and
+     * the response is discarded
+     */
+    if (conn->redirect(ctx, conn, pmsg, msg)) {
+        return true;
+    }
+
     return false;
 }
 
+/*
+ * Record the latency of request pmsg in the histogram of its command family
+ * in pool, if it has one
+ */
+static void
+rsp_family_stats(struct context *ctx, struct server_pool *pool,
+                 const struct msg *pmsg, int64_t latency)
+{
+    switch (pmsg->family(pmsg)) {
+    case MSG_FAMILY_KEY:
+        stats_pool_record(ctx, pool, key_latency, latency);
+        break;
+
+    case MSG_FAMILY_STRING:
+        stats_pool_record(ctx, pool, string_latency, latency);
+        break;
+
+    case MSG_FAMILY_HASH:
+        stats_pool_record(ctx, pool, hash_latency, latency);
+        break;
+
+    case MSG_FAMILY_LIST:
+        stats_pool_record(ctx, pool, list_latency, latency);
+        break;
+
+    case MSG_FAMILY_SET:
+        stats_pool_record(ctx, pool, set_latency, latency);
+        break;
+
+    case MSG_FAMILY_ZSET:
+        stats_pool_record(ctx, pool, zset_latency, latency);
+        break;
+
+    case MSG_FAMILY_SCRIPT:
+        stats_pool_record(ctx, pool, script_latency, latency);
+        break;
+
+    case MSG_FAMILY_NONE:
+        break;
+    }
+}
+
 static void
 rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg, uint32_t msgsize)
 {
+    struct msg *pmsg = msg->peer;
+    int64_t latency;
+
     ASSERT(!msg->request);
+    ASSERT(pmsg != NULL && pmsg->request);
 
     stats_server_incr(ctx, server, responses);
     stats_server_incr_by(ctx, server, response_bytes, msgsize);
+
+    if (pmsg->start_ts == 0) {
+        return;
+    }
+
+    latency = nc_usec_now() - pmsg->start_ts;
+
+    stats_server_record(ctx, server, latency, latency);
+    server_latency(ctx, server, latency);
+    if (pmsg->readonly(pmsg)) {
+        stats_pool_record(ctx, server->owner, read_latency, latency);
+        server_pool_hedge_latency(server->owner, latency);
+    } else {
+        stats_pool_record(ctx, server->owner, write_latency, latency);
+    }
+    rsp_family_stats(ctx, server->owner, pmsg, latency);
+}
+
+/*
+ * Cache response msg to read pmsg in the near cache of pool, unless it is
+ * an error
+ */
+static void
+rsp_near_cache(struct context *ctx, struct server_pool *pool,
+               const struct msg *pmsg, const struct msg *msg)
+{
+    struct keypos *kpos;
+    uint32_t nevict;
+
+    if (msg->type != MSG_RSP_MC_END && msg->type != MSG_RSP_REDIS_BULK) {
+        return;
+    }
+
+    ASSERT(array_n(pmsg->keys) == 1);
+    kpos = array_get(pmsg->keys, 0);
+
+    nevict = nearcache_set(pool->near_cache, kpos->start,
+                           (uint32_t)(kpos->end - kpos->start),
+                           pmsg->near_cache_version, msg, nc_msec_now());
+    if (nevict != 0) {
+        stats_pool_incr_by(ctx, pool, near_cache_evictions, nevict);
+    }
+}
+
+/*
+ * Split response msg to batch pmsg into a response for each of its reads,
+ * and answer them. If msg is not a response for every read, like an error
+ * reply, every read is answered with msg, whose mbufs they share.
+ */
+static void
+rsp_unbatch(struct context *ctx, struct server_pool *pool, struct conn *s_conn,
+            struct msg *pmsg, struct msg *msg)
+{
+    rstatus_t status;
+    struct msg *rmsg, *m;
+    bool whole;
+    uint32_t i;
+    err_t err;
+
+    ASSERT(pmsg->is_batch && pmsg->peer == msg);
+
+    whole = false;
+    for (i = 0; i < pmsg->nfrag; i++) {
+        m = pmsg->frag_seq[i];
+        err = 0;
+
+        rmsg = msg_get(s_conn, false, s_conn->redis);
+        if (rmsg == NULL) {
+            req_batch_done(ctx, pool, m, ENOMEM);
+            continue;
+        }
+
+        if (!whole) {
+            status = pmsg->unbatch(pmsg, i, rmsg);
+            if (status == NC_ERROR && i == 0) {
+                whole = true;
+            } else if (status != NC_OK) {
+                err = (status == NC_ENOMEM) ? ENOMEM : EINVAL;
+            }
+        }
+
+        if (whole) {
+            status = msg_share_msg(rmsg, msg);
+            if (status != NC_OK) {
+                err = ENOMEM;
+            }
+            rmsg->type = msg->type;
+        }
+
+        if (err != 0) {
+            rsp_put(rmsg);
+            req_batch_done(ctx, pool, m, err);
+            continue;
+        }
+
+        m->peer = rmsg;
+        rmsg->peer = m;
+
+        if (m->near_cache) {
+            rsp_near_cache(ctx, pool, m, rmsg);
+        }
+
+        req_batch_done(ctx, pool, m, 0);
+    }
+
+    log_debug(LOG_VERB, "split rsp %"PRIu64" len %"PRIu32" of batch req "
+              "%"PRIu64" into %"PRIu32" rsp%s", msg->id, msg->mlen, pmsg->id,
+              pmsg->nfrag, whole ? " copies" : "s");
+
+    req_put(pmsg);
 }
 
 static void
@@ -256,11 +483,34 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
     pmsg->peer = msg;
     msg->peer = pmsg;
 
-    msg->pre_coalesce(msg);
+    if (pmsg->is_batch) {
+        struct server *server = s_conn->owner;
+
+        rsp_forward_stats(ctx, server, msg, msgsize);
+        rsp_unbatch(ctx, server->owner, s_conn, pmsg, msg);
+        return;
+    }
+
+    /* the hedge of pmsg, if any, lost and has its response swallowed */
+    if (pmsg->hedge != NULL) {
+        ASSERT(pmsg->hedge->is_hedge && pmsg->hedge->swallow);
+        pmsg->hedge->hedge = NULL;
+        pmsg->hedge = NULL;
+    }
 
     c_conn = pmsg->owner;
     ASSERT(c_conn->client && !c_conn->proxy);
 
+    if (pmsg->near_cache) {
+        rsp_near_cache(ctx, c_conn->owner, pmsg, msg);
+    }
+
+    if (pmsg->leader) {
+        req_coalesce_done(ctx, c_conn->owner, pmsg, msg, 0);
+    }
+
+    msg->pre_coalesce(msg);
+
     if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
         status = event_add_out(ctx->evb, c_conn);
         if (status != NC_OK) {
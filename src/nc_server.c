@@ -22,6 +22,9 @@
 #include <nc_server.h>
 #include <nc_conf.h>
 
+static struct server_pool *server_pool_lookup(struct array *server_pool,
+                                              const struct string *name);
+
 static void
 server_resolve(struct server *server, struct conn *conn)
 {
@@ -116,6 +119,11 @@ server_active(const struct conn *conn)
         return true;
     }
 
+    if (conn->bmsg != NULL) {
+        log_debug(LOG_VVERB, "s %d is active", conn->sd);
+        return true;
+    }
+
     log_debug(LOG_VVERB, "s %d is inactive", conn->sd);
 
     return false;
@@ -132,18 +140,89 @@ server_each_set_owner(void *elem, void *data)
     return NC_OK;
 }
 
+/*
+ * Transform the replicas of the conf servers of sp into sp->replica, after
+ * sp->server. A replica gets the stats slot after those of the servers and
+ * the replicas before it.
+ */
+static rstatus_t
+server_replica_init(struct server_pool *sp, struct array *conf_server)
+{
+    rstatus_t status;
+    uint32_t i, nserver, nreplica;
+
+    nserver = array_n(conf_server);
+
+    for (nreplica = 0, i = 0; i < nserver; i++) {
+        struct conf_server *cs = array_get(conf_server, i);
+
+        nreplica += array_n(&cs->replica);
+    }
+    if (nreplica == 0) {
+        return NC_OK;
+    }
+
+    status = array_init(&sp->replica, nreplica, sizeof(struct server));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < nserver; i++) {
+        struct conf_server *cs = array_get(conf_server, i);
+        struct server *s = array_get(&sp->server, i);
+        uint32_t j, first;
+
+        if (array_n(&cs->replica) == 0) {
+            continue;
+        }
+
+        first = array_n(&sp->replica);
+        status = array_each(&cs->replica, conf_server_each_transform,
+                            &sp->replica);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        s->replica = array_get(&sp->replica, first);
+        s->nreplica = array_n(&cs->replica);
+
+        for (j = 0; j < s->nreplica; j++) {
+            struct server *r = &s->replica[j];
+
+            r->idx = nserver + first + j;
+            r->owner = sp;
+            r->is_replica = 1;
+        }
+    }
+    ASSERT(array_n(&sp->replica) == nreplica);
+
+    log_debug(LOG_DEBUG, "init %"PRIu32" replicas in pool %"PRIu32" '%.*s'",
+              nreplica, sp->idx, sp->name.len, sp->name.data);
+
+    return NC_OK;
+}
+
 rstatus_t
 server_init(struct array *server, struct array *conf_server,
             struct server_pool *sp)
 {
     rstatus_t status;
-    uint32_t nserver;
+    uint32_t nserver, nalloc;
 
     nserver = array_n(conf_server);
     ASSERT(nserver != 0);
     ASSERT(array_n(server) == 0);
 
-    status = array_init(server, nserver, sizeof(struct server));
+    /*
+     * A redis_cluster pool adds the nodes it learns of to its servers, which
+     * connections and requests point to, so room for them is made up front
+     */
+    nalloc = nserver;
+    if (sp->dist_type == DIST_REDIS_CLUSTER) {
+        nalloc = MAX(nserver, CLUSTER_NSERVER);
+    }
+
+    status = array_init(server, nalloc, sizeof(struct server));
     if (status != NC_OK) {
         return status;
     }
@@ -163,6 +242,14 @@ server_init(struct array *server, struct array *conf_server,
         return status;
     }
 
+    ASSERT(server == &sp->server);
+    status = server_replica_init(sp, conf_server);
+    if (status != NC_OK) {
+        server_deinit(&sp->replica);
+        server_deinit(server);
+        return status;
+    }
+
     log_debug(LOG_DEBUG, "init %"PRIu32" servers in pool %"PRIu32" '%.*s'",
               nserver, sp->idx, sp->name.len, sp->name.data);
 
@@ -179,6 +266,12 @@ server_deinit(struct array *server)
 
         s = array_pop(server);
         ASSERT(TAILQ_EMPTY(&s->s_conn_q) && s->ns_conn_q == 0);
+
+        if (s->discovered) {
+            string_deinit(&s->pname);
+            string_deinit(&s->name);
+            string_deinit(&s->addrstr);
+        }
     }
     array_deinit(server);
 }
@@ -262,6 +355,27 @@ server_each_disconnect(void *elem, void *data)
     return NC_OK;
 }
 
+/*
+ * Update the distribution of pool after servers were ejected or are due
+ * to be live again, and record how long this stalled the event loop
+ */
+static rstatus_t
+server_pool_rebuild(struct context *ctx, struct server_pool *pool)
+{
+    rstatus_t status;
+    int64_t start;
+
+    start = nc_usec_now();
+
+    status = server_pool_run(pool);
+
+    if (start > 0) {
+        stats_pool_record(ctx, pool, rebuild_stall, nc_usec_now() - start);
+    }
+
+    return status;
+}
+
 static void
 server_failure(struct context *ctx, struct server *server)
 {
@@ -269,7 +383,7 @@ server_failure(struct context *ctx, struct server *server)
     int64_t now, next;
     rstatus_t status;
 
-    if (!pool->auto_eject_hosts) {
+    if (!pool->auto_eject_hosts || server->retired) {
         return;
     }
 
@@ -302,7 +416,12 @@ server_failure(struct context *ctx, struct server *server)
     server->failure_count = 0;
     server->next_retry = next;
 
-    status = server_pool_run(pool);
+    if (server->is_replica) {
+        /* replicas are off the continuum; server_pool_read() skips them */
+        return;
+    }
+
+    status = server_pool_rebuild(ctx, pool);
     if (status != NC_OK) {
         log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
                   pool->name.len, pool->name.data, strerror(errno));
@@ -347,6 +466,7 @@ server_close(struct context *ctx, struct conn *conn)
     rstatus_t status;
     struct msg *msg, *nmsg; /* current and next message */
     struct conn *c_conn;    /* peer client connection */
+    struct server *server = conn->owner;
 
     ASSERT(!conn->client && !conn->proxy);
 
@@ -355,6 +475,13 @@ server_close(struct context *ctx, struct conn *conn)
 
     conn->connected = false;
 
+    /* fail the reads of the batch that was not sent yet, if any */
+    msg = conn->bmsg;
+    if (msg != NULL) {
+        conn->bmsg = NULL;
+        req_batch_error(ctx, server->owner, msg, conn->err);
+    }
+
     if (conn->sd < 0) {
         server_failure(ctx, conn->owner);
         conn->unref(conn);
@@ -368,6 +495,15 @@ server_close(struct context *ctx, struct conn *conn)
         /* dequeue the message (request) from server inq */
         conn->dequeue_inq(ctx, conn, msg);
 
+        if (msg->is_batch) {
+            req_batch_error(ctx, server->owner, msg, conn->err);
+            continue;
+        }
+
+        if (msg->leader) {
+            req_coalesce_done(ctx, server->owner, msg, NULL, conn->err);
+        }
+
         /*
          * Don't send any error response, if
          * 1. request is tagged as noreply or,
@@ -407,6 +543,15 @@ server_close(struct context *ctx, struct conn *conn)
         /* dequeue the message (request) from server outq */
         conn->dequeue_outq(ctx, conn, msg);
 
+        if (msg->is_batch) {
+            req_batch_error(ctx, server->owner, msg, conn->err);
+            continue;
+        }
+
+        if (msg->leader) {
+            req_coalesce_done(ctx, server->owner, msg, NULL, conn->err);
+        }
+
         if (msg->swallow) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
                       " type %d", conn->sd, msg->id, msg->mlen, msg->type);
@@ -582,7 +727,7 @@ server_ok(struct context *ctx, struct conn *conn)
 }
 
 static rstatus_t
-server_pool_update(struct server_pool *pool)
+server_pool_update(struct context *ctx, struct server_pool *pool)
 {
     rstatus_t status;
     int64_t now;
@@ -611,7 +756,7 @@ server_pool_update(struct server_pool *pool)
 
     pnlive_server = pool->nlive_server;
 
-    status = server_pool_run(pool);
+    status = server_pool_rebuild(ctx, pool);
     if (status != NC_OK) {
         log_error("updating pool %"PRIu32" with dist %d failed: %s", pool->idx,
                   pool->dist_type, strerror(errno));
@@ -643,6 +788,31 @@ server_pool_hash(const struct server_pool *pool, const uint8_t *key, uint32_t ke
     return pool->key_hash((const char *)key, keylen);
 }
 
+/*
+ * If hash_tag: is configured for this server pool, narrow {key, keylen}
+ * down to the part of the key within the hash tag. Otherwise the full key
+ * is used as an input to the distributor.
+ */
+static void
+server_pool_tag(const struct server_pool *pool, const uint8_t **key, uint32_t *keylen)
+{
+    const struct string *tag = &pool->hash_tag;
+    const uint8_t *tag_start, *tag_end;
+
+    if (string_empty(tag)) {
+        return;
+    }
+
+    tag_start = nc_strchr(*key, *key + *keylen, tag->data[0]);
+    if (tag_start != NULL) {
+        tag_end = nc_strchr(tag_start + 1, *key + *keylen, tag->data[1]);
+        if ((tag_end != NULL) && (tag_end - tag_start > 1)) {
+            *key = tag_start + 1;
+            *keylen = (uint32_t)(tag_end - *key);
+        }
+    }
+}
+
 uint32_t
 server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t keylen)
 {
@@ -657,29 +827,12 @@ server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t key
         return 0;
     }
 
-    /*
-     * If hash_tag: is configured for this server pool, we use the part of
-     * the key within the hash tag as an input to the distributor. Otherwise
-     * we use the full key
-     */
-    if (!string_empty(&pool->hash_tag)) {
-        const struct string *tag = &pool->hash_tag;
-        const uint8_t *tag_start, *tag_end;
-
-        tag_start = nc_strchr(key, key + keylen, tag->data[0]);
-        if (tag_start != NULL) {
-            tag_end = nc_strchr(tag_start + 1, key + keylen, tag->data[1]);
-            if ((tag_end != NULL) && (tag_end - tag_start > 1)) {
-                key = tag_start + 1;
-                keylen = (uint32_t)(tag_end - key);
-            }
-        }
-    }
+    server_pool_tag(pool, &key, &keylen);
 
     switch (pool->dist_type) {
     case DIST_KETAMA:
         hash = server_pool_hash(pool, key, keylen);
-        idx = ketama_dispatch(pool->continuum, pool->ncontinuum, hash);
+        idx = ketama_lookup(pool->dist_data, hash);
         break;
 
     case DIST_MODULA:
@@ -691,6 +844,26 @@ server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t key
         idx = random_dispatch(pool->continuum, pool->ncontinuum, 0);
         break;
 
+    case DIST_REDIS_CLUSTER:
+        hash = pool->key_hash((const char *)key, keylen);
+        idx = cluster_dispatch(pool->continuum, pool->ncontinuum, hash);
+        break;
+
+    case DIST_JUMP:
+        hash = server_pool_hash(pool, key, keylen);
+        idx = jump_dispatch(pool->continuum, pool->ncontinuum, hash);
+        break;
+
+    case DIST_MAGLEV:
+        hash = server_pool_hash(pool, key, keylen);
+        idx = maglev_dispatch(pool->continuum, pool->ncontinuum, hash);
+        break;
+
+    case DIST_RENDEZVOUS:
+        hash = server_pool_hash(pool, key, keylen);
+        idx = rendezvous_dispatch(pool->dist_data, hash);
+        break;
+
     default:
         NOT_REACHED();
         return 0;
@@ -699,15 +872,405 @@ server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t key
     return idx;
 }
 
+/*
+ * Add the redis cluster node {host, hostlen}:port, which a node told us of
+ * in a 'CLUSTER SLOTS' reply or a redirect, to the servers of pool. The
+ * node has no stats of its own, as the stats are mapped from the servers
+ * in the configuration.
+ *
+ * Return the index of the server, or the # servers on error
+ */
+uint32_t
+server_pool_add(struct server_pool *pool, const uint8_t *host, uint32_t hostlen,
+                uint16_t port)
+{
+    rstatus_t status;
+    struct server *s;
+    uint32_t nserver;
+    char name[NC_MAXHOSTNAMELEN + sizeof(":65535:1")];
+    int len;
+
+    ASSERT(pool->dist_type == DIST_REDIS_CLUSTER);
+
+    nserver = array_n(&pool->server);
+
+    /* the servers are never moved, as connections and requests point to them */
+    if (nserver == pool->server.nalloc || hostlen == 0 ||
+        hostlen >= NC_MAXHOSTNAMELEN) {
+        log_warn("no room for node '%.*s:%"PRIu16"' in %"PRIu32" servers of "
+                 "pool '%.*s'", hostlen, host, port, nserver, pool->name.len,
+                 pool->name.data);
+        return nserver;
+    }
+
+    s = array_push(&pool->server);
+    ASSERT(s != NULL);
+
+    s->idx = nserver;
+    s->owner = pool;
+
+    string_init(&s->pname);
+    string_init(&s->name);
+    string_init(&s->addrstr);
+    s->port = port;
+    s->weight = 1;
+
+    s->ns_conn_q = 0;
+    TAILQ_INIT(&s->s_conn_q);
+
+    s->next_retry = 0LL;
+    s->failure_count = 0;
+    s->nqueue = 0;
+    s->latency = 0LL;
+    s->score = 0LL;
+
+    s->replica = NULL;
+    s->nreplica = 0;
+
+    s->is_replica = 0;
+    s->retired = 0;
+    s->discovered = 1;
+
+    len = nc_snprintf(name, sizeof(name), "%.*s:%"PRIu16":1", hostlen, host,
+                      port);
+    status = string_copy(&s->pname, (uint8_t *)name, (uint32_t)len);
+    if (status == NC_OK) {
+        status = string_copy(&s->name, (uint8_t *)name, (uint32_t)len - 2);
+    }
+    if (status == NC_OK) {
+        status = string_copy(&s->addrstr, host, hostlen);
+    }
+    if (status == NC_OK && nc_resolve(&s->addrstr, port, &s->info) != 0) {
+        status = NC_ERROR;
+    }
+    if (status != NC_OK) {
+        log_warn("adding node '%.*s:%"PRIu16"' to pool '%.*s' failed",
+                 hostlen, host, port, pool->name.len, pool->name.data);
+        string_deinit(&s->pname);
+        string_deinit(&s->name);
+        string_deinit(&s->addrstr);
+        array_pop(&pool->server);
+        return nserver;
+    }
+
+    /* account for the new server, keeping the slot map */
+    status = server_pool_run(pool);
+    if (status != NC_OK) {
+        log_warn("updating pool '%.*s' failed, ignored", pool->name.len,
+                 pool->name.data);
+    }
+
+    log_debug(LOG_NOTICE, "added node '%.*s' as server %"PRIu32" of pool '%.*s'",
+              s->name.len, s->name.data, s->idx, pool->name.len,
+              pool->name.data);
+
+    return s->idx;
+}
+
+/*
+ * Return the redis cluster hash slot of {key, keylen}
+ */
+uint32_t
+server_pool_slot(const struct server_pool *pool, const uint8_t *key, uint32_t keylen)
+{
+    ASSERT(pool->dist_type == DIST_REDIS_CLUSTER);
+
+    server_pool_tag(pool, &key, &keylen);
+
+    return pool->key_hash((const char *)key, keylen) % CLUSTER_NSLOT;
+}
+
+/*
+ * Return the index of the server in pool listening on host:port, or
+ * nserver if there is no such server
+ */
+uint32_t
+server_pool_find(const struct server_pool *pool, const uint8_t *host, uint32_t hostlen,
+                 uint16_t port)
+{
+    uint32_t i, nserver;
+
+    for (i = 0, nserver = array_n(&pool->server); i < nserver; i++) {
+        const struct server *server = array_get(&pool->server, i);
+
+        if (server->port == port && server->addrstr.len == hostlen &&
+            nc_strncmp(server->addrstr.data, host, hostlen) == 0) {
+            return i;
+        }
+    }
+
+    return nserver;
+}
+
+/*
+ * Return true if server has its share of the requests queued on the live
+ * servers of pool under hash_load_bound:, which is at most the ceiling of
+ * load_bound times the average, counting the request about to be queued
+ */
+static bool
+server_pool_overloaded(const struct server_pool *pool, const struct server *server)
+{
+    return (uint64_t)server->nqueue * pool->nlive_server * 100 >=
+           (uint64_t)pool->load_bound * (pool->nqueue + 1);
+}
+
+/*
+ * Consistent hashing with bounded loads (Mirrokni et al., SODA 2018): if
+ * the server idx that {key, keylen} maps to has its share of the queued
+ * requests, walk the continuum on from the point of the key to the first
+ * server that does not. The walk always ends, as the shares of the live
+ * servers add up to more than all the queued requests. Return the index
+ * of that server, or idx if it is not overloaded.
+ */
+uint32_t
+server_pool_bound(const struct server_pool *pool, const uint8_t *key, uint32_t keylen,
+                  uint32_t idx)
+{
+    uint32_t point, n, next;
+
+    ASSERT(pool->load_bound != 0);
+    ASSERT(pool->dist_type == DIST_KETAMA);
+
+    if (array_n(&pool->server) == 1 || pool->nlive_server == 0 ||
+        !server_pool_overloaded(pool, array_get(&pool->server, idx))) {
+        return idx;
+    }
+
+    server_pool_tag(pool, &key, &keylen);
+    point = ketama_point(pool->dist_data, server_pool_hash(pool, key, keylen));
+
+    for (n = 1; n < pool->ncontinuum; n++) {
+        next = ketama_point_index(pool->dist_data, point, n);
+        if (next != idx &&
+            !server_pool_overloaded(pool, array_get(&pool->server, next))) {
+            return next;
+        }
+    }
+
+    return idx;
+}
+
+/*
+ * Return the cost of sending one more request to server: the ewma of its
+ * latency times the number of requests in flight on it, counting the new
+ * one, so that a server is preferred for being fast or for being idle
+ */
+static int64_t
+server_score(const struct server *server)
+{
+    return (server->latency + 1) * ((int64_t)server->nqueue + 1);
+}
+
+/*
+ * Fold the latency of a response from server into the ewma of its latency,
+ * with a weight of 1/8 as for the smoothed rtt of tcp
+ */
+void
+server_latency(struct context *ctx, struct server *server, int64_t latency)
+{
+    int64_t prev, score;
+
+    prev = server->latency;
+    if (server->latency == 0LL) {
+        server->latency = latency;
+    } else {
+        server->latency += (latency - server->latency) / 8;
+    }
+    stats_server_set_mean(ctx, server, latency_ewma, prev, server->latency);
+
+    score = server_score(server);
+    stats_server_set_mean(ctx, server, read_score, server->score, score);
+    server->score = score;
+}
+
+/* Return true if replica is not ejected, getting the current time lazily */
+static bool
+server_read_live(const struct server *replica, int64_t *now)
+{
+    if (replica->next_retry == 0LL) {
+        return true;
+    }
+
+    if (*now == 0LL) {
+        *now = nc_usec_now();
+    }
+
+    return replica->next_retry <= *now;
+}
+
+/*
+ * Return a live replica of shard server other than exclude, or server itself
+ * if there is none.
+ *
+ * Replicas are picked by the power of two choices: of two distinct live
+ * replicas drawn at random, the one with the lower score wins. Unlike
+ * always picking the lowest score, this does not herd all the reads onto
+ * the replica that was the fastest at its last response.
+ */
 static struct server *
-server_pool_server(struct server_pool *pool, const uint8_t *key, uint32_t keylen)
+server_pick(struct server *server, const struct server *exclude)
+{
+    struct server *first, *second;
+    int64_t now = 0LL;
+    uint32_t i, n, nlive, a, b;
+
+    for (nlive = 0, i = 0; i < server->nreplica; i++) {
+        struct server *replica = &server->replica[i];
+
+        if (replica != exclude && server_read_live(replica, &now)) {
+            nlive++;
+        }
+    }
+
+    if (nlive == 0) {
+        return server;
+    }
+
+    a = nc_random() % nlive;
+    b = nlive == 1 ? a : (a + 1 + nc_random() % (nlive - 1)) % nlive;
+
+    first = second = NULL;
+    for (n = 0, i = 0; i < server->nreplica; i++) {
+        struct server *replica = &server->replica[i];
+
+        if (replica == exclude || !server_read_live(replica, &now)) {
+            continue;
+        }
+        if (n == a) {
+            first = replica;
+        }
+        if (n == b) {
+            second = replica;
+        }
+        n++;
+    }
+    ASSERT(first != NULL && second != NULL);
+
+    return server_score(second) < server_score(first) ? second : first;
+}
+
+/*
+ * Return the replica of shard server to send a read only request to, or
+ * server itself if it has no replicas or all of them are ejected. The
+ * master of a shard only serves reads when it is left without replicas.
+ */
+struct server *
+server_read(struct server *server)
+{
+    return server_pick(server, NULL);
+}
+
+/*
+ * Return another server of the shard of server in pool to hedge a read
+ * only request sent to server with, or NULL if there is none. A live
+ * replica is preferred to the master, as it is for the request itself.
+ */
+struct server *
+server_hedge(struct server_pool *pool, struct server *server)
+{
+    struct server *master, *hedge;
+    int64_t now = 0LL;
+    uint32_t i, nserver;
+
+    if (!server->is_replica) {
+        hedge = server_read(server);
+        return hedge != server ? hedge : NULL;
+    }
+
+    master = NULL;
+    for (i = 0, nserver = array_n(&pool->server); i < nserver; i++) {
+        struct server *s = array_get(&pool->server, i);
+
+        if (server >= s->replica && server < s->replica + s->nreplica) {
+            master = s;
+            break;
+        }
+    }
+    if (master == NULL) {
+        return NULL;
+    }
+
+    hedge = server_pick(master, server);
+    if (hedge == master && !server_read_live(master, &now)) {
+        return NULL;
+    }
+
+    return hedge;
+}
+
+/*
+ * Record the latency of a read in pool, when its hedge delay is a percentile
+ * of the read latency. The delay is recomputed from every HEDGE_NSAMPLE new
+ * reads, after which the counts are halved so that the delay follows the
+ * recent latency rather than that since the start.
+ */
+void
+server_pool_hedge_latency(struct server_pool *pool, int64_t latency)
+{
+    struct stats_histogram *h = pool->hedge_latency;
+    int64_t delay;
+    uint32_t i;
+
+    if (h == NULL) {
+        return;
+    }
+
+    stats_histogram_record(h, latency);
+    if (h->count < HEDGE_NSAMPLE) {
+        return;
+    }
+
+    delay = (stats_histogram_percentile(h, pool->hedge_permille) + 500) / 1000;
+    pool->hedge_delay = (uint32_t)MAX(delay, 1LL);
+
+    log_debug(LOG_VERB, "hedge delay of pool '%.*s' is %"PRIu32" msec",
+              pool->name.len, pool->name.data, pool->hedge_delay);
+
+    h->count = 0;
+    for (i = 0; i < STATS_HISTOGRAM_NBUCKET; i++) {
+        h->bucket[i] /= 2;
+        h->count += h->bucket[i];
+    }
+    h->sum /= 2;
+}
+
+static struct server *
+server_pool_server(struct context *ctx, struct server_pool *pool,
+                   const struct msg *msg, const uint8_t *key, uint32_t keylen)
 {
     struct server *server;
-    uint32_t idx;
+    uint32_t idx, bidx;
 
     idx = server_pool_idx(pool, key, keylen);
+
+    if (pool->load_bound != 0) {
+        bidx = server_pool_bound(pool, key, keylen, idx);
+        if (bidx != idx) {
+            server = array_get(&pool->server, idx);
+            stats_server_incr(ctx, server, load_displaced);
+            stats_pool_incr(ctx, pool, load_displaced);
+            if (pool->nlive_server < array_n(&pool->server)) {
+                stats_pool_incr(ctx, pool, load_displaced_ejected);
+            }
+
+            log_debug(LOG_VERB, "key '%.*s' displaced off server '%.*s' with "
+                      "%"PRIu32" of %"PRIu32" queued requests", keylen, key,
+                      server->pname.len, server->pname.data, server->nqueue,
+                      pool->nqueue);
+
+            idx = bidx;
+        }
+    }
+
     server = array_get(&pool->server, idx);
 
+    if (server->nreplica != 0 && msg->readonly(msg)) {
+        server = server_read(server);
+        if (server->is_replica) {
+            stats_pool_incr(ctx, pool, replica_reads);
+        }
+    }
+
     log_debug(LOG_VERB, "key '%.*s' on dist %d maps to server '%.*s'", keylen,
               key, pool->dist_type, server->pname.len, server->pname.data);
 
@@ -715,20 +1278,20 @@ server_pool_server(struct server_pool *pool, const uint8_t *key, uint32_t keylen
 }
 
 struct conn *
-server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *key,
-                 uint32_t keylen)
+server_pool_conn(struct context *ctx, struct server_pool *pool, const struct msg *msg,
+                 const uint8_t *key, uint32_t keylen)
 {
     rstatus_t status;
     struct server *server;
     struct conn *conn;
 
-    status = server_pool_update(pool);
+    status = server_pool_update(ctx, pool);
     if (status != NC_OK) {
         return NULL;
     }
 
     /* from a given {key, keylen} pick a server from pool */
-    server = server_pool_server(pool, key, keylen);
+    server = server_pool_server(ctx, pool, msg, key, keylen);
     if (server == NULL) {
         return NULL;
     }
@@ -763,6 +1326,13 @@ server_pool_each_preconnect(void *elem, void *data)
         return status;
     }
 
+    if (array_n(&sp->replica) != 0) {
+        status = array_each(&sp->replica, server_each_preconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -790,6 +1360,13 @@ server_pool_each_disconnect(void *elem, void *data)
         return status;
     }
 
+    if (array_n(&sp->replica) != 0) {
+        status = array_each(&sp->replica, server_each_disconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -810,6 +1387,22 @@ server_pool_each_set_owner(void *elem, void *data)
     return NC_OK;
 }
 
+static rstatus_t
+server_pool_each_set_mirror(void *elem, void *data)
+{
+    struct server_pool *sp = elem;
+    struct array *server_pool = data;
+
+    if (sp->mirror_name.len == 0) {
+        return NC_OK;
+    }
+
+    sp->mirror = server_pool_lookup(server_pool, &sp->mirror_name);
+    ASSERT(sp->mirror != NULL && sp->mirror != sp);
+
+    return NC_OK;
+}
+
 static rstatus_t
 server_pool_each_calc_connections(void *elem, void *data)
 {
@@ -817,6 +1410,7 @@ server_pool_each_calc_connections(void *elem, void *data)
     struct context *ctx = data;
 
     ctx->max_nsconn += sp->server_connections * array_n(&sp->server);
+    ctx->max_nsconn += sp->server_connections * array_n(&sp->replica);
     ctx->max_nsconn += 1; /* pool listening socket */
 
     return NC_OK;
@@ -837,6 +1431,18 @@ server_pool_run(struct server_pool *pool)
     case DIST_RANDOM:
         return random_update(pool);
 
+    case DIST_REDIS_CLUSTER:
+        return cluster_update(pool);
+
+    case DIST_JUMP:
+        return jump_update(pool);
+
+    case DIST_MAGLEV:
+        return maglev_update(pool);
+
+    case DIST_RENDEZVOUS:
+        return rendezvous_update(pool);
+
     default:
         NOT_REACHED();
         return NC_ERROR;
@@ -882,6 +1488,13 @@ server_pool_init(struct array *server_pool, struct array *conf_pool,
         return status;
     }
 
+    /* link each pool to the pool it mirrors to, if any */
+    status = array_each(server_pool, server_pool_each_set_mirror, server_pool);
+    if (status != NC_OK) {
+        server_pool_deinit(server_pool);
+        return status;
+    }
+
     /* compute max server connections */
     ctx->max_nsconn = 0;
     status = array_each(server_pool, server_pool_each_calc_connections, ctx);
@@ -921,6 +1534,36 @@ server_pool_deinit(struct array *server_pool)
             sp->nlive_server = 0;
         }
 
+        if (sp->dist_data != NULL) {
+            if (sp->dist_type == DIST_KETAMA) {
+                ketama_free(sp->dist_data);
+            } else {
+                nc_free(sp->dist_data);
+            }
+            sp->dist_data = NULL;
+        }
+
+        if (sp->hedge_latency != NULL) {
+            nc_free(sp->hedge_latency);
+            sp->hedge_latency = NULL;
+        }
+
+        if (sp->hotkey != NULL) {
+            hotkey_destroy(sp->hotkey);
+            sp->hotkey = NULL;
+        }
+
+        if (sp->near_cache != NULL) {
+            nearcache_destroy(sp->near_cache);
+            sp->near_cache = NULL;
+        }
+
+        if (sp->coalesce_q != NULL) {
+            nc_free(sp->coalesce_q);
+            sp->coalesce_q = NULL;
+        }
+
+        server_deinit(&sp->replica);
         server_deinit(&sp->server);
 
         log_debug(LOG_DEBUG, "deinit pool %"PRIu32" '%.*s'", sp->idx,
@@ -931,3 +1574,368 @@ server_pool_deinit(struct array *server_pool)
 
     log_debug(LOG_DEBUG, "deinit %"PRIu32" pools", npool);
 }
+
+/*
+ * Close conn outside of the event loop, like core_close() would on an
+ * error or eof
+ */
+static void
+server_pool_close_conn(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+
+    if (conn->sd > 0) {
+        status = event_del_conn(ctx->evb, conn);
+        if (status < 0) {
+            log_warn("event del conn %d failed, ignored: %s", conn->sd,
+                     strerror(errno));
+        }
+    }
+
+    conn->close(ctx, conn);
+}
+
+/* Close the listener and all the client connections of pool */
+static void
+server_pool_close_clients(struct context *ctx, struct server_pool *pool)
+{
+    if (pool->p_conn != NULL) {
+        server_pool_close_conn(ctx, pool->p_conn);
+    }
+
+    while (!TAILQ_EMPTY(&pool->c_conn_q)) {
+        server_pool_close_conn(ctx, TAILQ_FIRST(&pool->c_conn_q));
+    }
+
+    log_debug(LOG_NOTICE, "closed listener and clients of pool '%.*s' on "
+              "reload", pool->name.len, pool->name.data);
+}
+
+/* Move the listener and all the client connections of pool from to pool to */
+static void
+server_pool_move_clients(struct server_pool *to, struct server_pool *from)
+{
+    struct conn *p = from->p_conn;
+
+    ASSERT(to->p_conn == NULL && to->nc_conn_q == 0);
+
+    if (p != NULL) {
+        from->p_conn = NULL;
+        to->p_conn = p;
+        p->owner = to;
+        p->addr = (struct sockaddr *)&to->info.addr;
+    }
+
+    while (!TAILQ_EMPTY(&from->c_conn_q)) {
+        struct conn *c = TAILQ_FIRST(&from->c_conn_q);
+
+        TAILQ_REMOVE(&from->c_conn_q, c, conn_tqe);
+        TAILQ_INSERT_TAIL(&to->c_conn_q, c, conn_tqe);
+        c->owner = to;
+    }
+    to->nc_conn_q = from->nc_conn_q;
+    from->nc_conn_q = 0;
+}
+
+/* Move up to nconn connections of server from to server to */
+static void
+server_move_conns(struct server *to, struct server *from, uint32_t nconn)
+{
+    while (nconn-- > 0 && !TAILQ_EMPTY(&from->s_conn_q)) {
+        struct conn *conn = TAILQ_FIRST(&from->s_conn_q);
+        struct msg *msg;
+        uint32_t nqueue;
+        size_t nqueue_bytes;
+
+        TAILQ_REMOVE(&from->s_conn_q, conn, conn_tqe);
+        from->ns_conn_q--;
+
+        /* outstanding requests move along with their connection */
+        nqueue = 0;
+        nqueue_bytes = 0;
+        TAILQ_FOREACH(msg, &conn->imsg_q, s_tqe) {
+            nqueue++;
+            nqueue_bytes += msg->mlen;
+        }
+        TAILQ_FOREACH(msg, &conn->omsg_q, s_tqe) {
+            nqueue++;
+            nqueue_bytes += msg->mlen;
+        }
+        from->nqueue -= nqueue;
+        to->nqueue += nqueue;
+        from->owner->nqueue_bytes -= nqueue_bytes;
+        to->owner->nqueue_bytes += nqueue_bytes;
+        if (!from->is_replica) {
+            from->owner->nqueue -= nqueue;
+        }
+        if (!to->is_replica) {
+            to->owner->nqueue += nqueue;
+        }
+
+        TAILQ_INSERT_TAIL(&to->s_conn_q, conn, conn_tqe);
+        to->ns_conn_q++;
+
+        conn->owner = to;
+        conn->family = to->info.family;
+        conn->addrlen = to->info.addrlen;
+        conn->addr = (struct sockaddr *)&to->info.addr;
+    }
+}
+
+/*
+ * Retire the connections of server, which is gone after a reload, to a
+ * copy of server that outlives the configuration. The retired server is
+ * owned by pool, but it is not on its continuum, so it gets no new
+ * requests and its connections are closed by server_drain() once they
+ * have no outstanding requests.
+ */
+static void
+server_retire(struct context *ctx, struct server_pool *pool,
+              struct server *server)
+{
+    struct server *rs, **prs;
+
+    if (server->ns_conn_q == 0) {
+        return;
+    }
+
+    rs = nc_alloc(sizeof(*rs));
+    if (rs == NULL) {
+        goto error;
+    }
+
+    *rs = *server;
+    rs->owner = pool;
+    rs->retired = 1;
+    string_init(&rs->pname);
+    string_init(&rs->name);
+    string_init(&rs->addrstr);
+    rs->ns_conn_q = 0;
+    rs->nqueue = 0;
+    rs->replica = NULL;
+    rs->nreplica = 0;
+    TAILQ_INIT(&rs->s_conn_q);
+
+    if (string_duplicate(&rs->pname, &server->pname) != NC_OK ||
+        string_duplicate(&rs->name, &server->name) != NC_OK ||
+        string_duplicate(&rs->addrstr, &server->addrstr) != NC_OK) {
+        goto error;
+    }
+
+    if (ctx->drain.elem == NULL &&
+        array_init(&ctx->drain, 1, sizeof(struct server *)) != NC_OK) {
+        goto error;
+    }
+
+    prs = array_push(&ctx->drain);
+    if (prs == NULL) {
+        goto error;
+    }
+    *prs = rs;
+
+    server_move_conns(rs, server, server->ns_conn_q);
+
+    log_debug(LOG_NOTICE, "retired server '%.*s' of pool '%.*s' with %"PRIu32
+              " connections on reload", rs->pname.len, rs->pname.data,
+              pool->name.len, pool->name.data, rs->ns_conn_q);
+
+    return;
+
+error:
+    log_warn("retire of server '%.*s' failed, closing its connections: %s",
+             server->pname.len, server->pname.data, strerror(errno));
+
+    if (rs != NULL) {
+        string_deinit(&rs->pname);
+        string_deinit(&rs->name);
+        string_deinit(&rs->addrstr);
+        nc_free(rs);
+    }
+
+    while (!TAILQ_EMPTY(&server->s_conn_q)) {
+        server_pool_close_conn(ctx, TAILQ_FIRST(&server->s_conn_q));
+    }
+}
+
+/*
+ * Close the connections of the retired servers of ctx that have no more
+ * outstanding requests, or all of them if force is set, and free the
+ * retired servers that are left without any connection
+ */
+void
+server_drain(struct context *ctx, bool force)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(&ctx->drain);) {
+        struct server **prs = array_get(&ctx->drain, i);
+        struct server *rs = *prs, **last;
+        struct conn *conn, *nconn;
+
+        for (conn = TAILQ_FIRST(&rs->s_conn_q); conn != NULL; conn = nconn) {
+            nconn = TAILQ_NEXT(conn, conn_tqe);
+
+            if (force || !server_active(conn)) {
+                server_pool_close_conn(ctx, conn);
+            }
+        }
+
+        if (rs->ns_conn_q != 0) {
+            i++;
+            continue;
+        }
+
+        log_debug(LOG_NOTICE, "drained retired server '%.*s'", rs->pname.len,
+                  rs->pname.data);
+
+        string_deinit(&rs->pname);
+        string_deinit(&rs->name);
+        string_deinit(&rs->addrstr);
+        nc_free(rs);
+
+        last = array_pop(&ctx->drain);
+        if (last != prs) {
+            *prs = *last;
+        }
+    }
+}
+
+/* Return the replica of server with the name of replica r, or NULL */
+static struct server *
+server_find_replica(struct server *server, const struct server *r)
+{
+    uint32_t i;
+
+    for (i = 0; i < server->nreplica; i++) {
+        if (string_compare(&server->replica[i].name, &r->name) == 0) {
+            return &server->replica[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand the connections of server os of pool op over to server ns of the
+ * reloaded pool np, if any, and retire the rest of them. All of them are
+ * closed if the pool is gone.
+ */
+static void
+server_reload(struct context *ctx, struct server_pool *op,
+              struct server_pool *np, struct server *os, struct server *ns)
+{
+    if (np == NULL) {
+        while (!TAILQ_EMPTY(&os->s_conn_q)) {
+            server_pool_close_conn(ctx, TAILQ_FIRST(&os->s_conn_q));
+        }
+        return;
+    }
+
+    if (ns != NULL && np->redis == op->redis) {
+        ns->next_retry = os->next_retry;
+        ns->failure_count = os->failure_count;
+        ns->latency = os->latency;
+        ns->score = os->score;
+        server_move_conns(ns, os, np->server_connections);
+    }
+
+    server_retire(ctx, np, os);
+}
+
+static struct server_pool *
+server_pool_lookup(struct array *server_pool, const struct string *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(server_pool); i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+
+        if (string_compare(&sp->name, name) == 0) {
+            return sp;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Replace the pools of ctx with server_pool, created from a reloaded
+ * configuration, without dropping more connections than needed:
+ *
+ * - the listener and the client connections of a pool are moved over to
+ *   the reloaded pool of the same name, if it listens on the same address
+ *   for the same protocol, and are closed otherwise.
+ * - the connections to a server are moved over to the server of the same
+ *   name and address in the reloaded pool, up to its server_connections.
+ *   The same goes for the replicas of a server that stays in the pool.
+ *   The connections to servers that are gone are retired and drained.
+ * - all the connections of pools that are gone are closed.
+ * - the reads in flight that identical reads wait on, see req_coalesce(),
+ *   are moved over to the reloaded pool along with their connections.
+ *
+ * Closing happens while the stats of ctx still map to the old pools, so
+ * it is up to the caller to remap them after this returns. Nothing here
+ * fails; on return ctx owns server_pool and the old pools are freed.
+ */
+void
+server_pool_reload(struct context *ctx, struct array *server_pool)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < array_n(&ctx->pool); i++) {
+        struct server_pool *op = array_get(&ctx->pool, i);
+        struct server_pool *np = server_pool_lookup(server_pool, &op->name);
+
+        if (np != NULL && np->redis == op->redis && np->port == op->port &&
+            string_compare(&np->addrstr, &op->addrstr) == 0) {
+            server_pool_move_clients(np, op);
+        } else {
+            server_pool_close_clients(ctx, op);
+        }
+
+        for (j = 0; j < array_n(&op->server); j++) {
+            struct server *os = array_get(&op->server, j);
+            struct server *ns = NULL;
+            uint32_t idx, k;
+
+            if (np != NULL) {
+                idx = server_pool_find(np, os->addrstr.data, os->addrstr.len,
+                                       os->port);
+                if (idx < array_n(&np->server)) {
+                    ns = array_get(&np->server, idx);
+                    if (string_compare(&ns->name, &os->name) != 0) {
+                        ns = NULL;
+                    }
+                }
+            }
+
+            /* replicas stay with the shard they replicate */
+            for (k = 0; k < os->nreplica; k++) {
+                struct server *or = &os->replica[k];
+
+                server_reload(ctx, op, np, or,
+                              ns != NULL ? server_find_replica(ns, or) : NULL);
+            }
+
+            server_reload(ctx, op, np, os, ns);
+        }
+
+        /* reads in flight on moved connections complete on np */
+        req_coalesce_reload(ctx, op, np);
+
+        if (np != NULL) {
+            /* account for the ejected servers carried over */
+            if (server_pool_run(np) != NC_OK) {
+                log_error("updating reloaded pool '%.*s' failed: %s",
+                          np->name.len, np->name.data, strerror(errno));
+            }
+        }
+
+        log_debug(LOG_NOTICE, "reload pool '%.*s' %s", op->name.len,
+                  op->name.data, np != NULL ? "kept" : "removed");
+    }
+
+    server_pool_deinit(&ctx->pool);
+    ctx->pool = *server_pool;
+    array_null(server_pool);
+}
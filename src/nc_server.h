@@ -20,6 +20,10 @@
 
 #include <nc_core.h>
 
+#define HEDGE_NSAMPLE   1024    /* # reads per percentile hedge delay */
+#define HEDGE_BURST     10      /* max # hedges in a burst */
+#define COALESCE_NBUCKET 1024   /* # buckets of reads in flight, a power of two */
+
 /*
  * server_pool is a collection of servers and their continuum. Each
  * server_pool is the owner of a single proxy connection and one or
@@ -82,6 +86,16 @@ struct server {
 
     int64_t            next_retry;    /* next retry time in usec */
     uint32_t           failure_count; /* # consecutive failures */
+    uint32_t           nqueue;        /* # requests in in_q and out_q */
+    int64_t            latency;       /* ewma of the latency in usec */
+    int64_t            score;         /* read score as of the last response */
+
+    struct server      *replica;      /* replica[] of a shard (ref in owner replica[]) */
+    uint32_t           nreplica;      /* # replica */
+
+    unsigned           is_replica:1;  /* replica, off the continuum? */
+    unsigned           retired:1;     /* gone after reload and draining? */
+    unsigned           discovered:1;  /* learned from a redis cluster, owns its strings? */
 };
 
 struct server_pool {
@@ -93,11 +107,16 @@ struct server_pool {
     struct conn_tqh    c_conn_q;             /* client connection q */
 
     struct array       server;               /* server[] */
+    struct array       replica;              /* replica server[] of server[] */
     uint32_t           ncontinuum;           /* # continuum points */
     uint32_t           nserver_continuum;    /* # servers - live and dead on continuum (const) */
     struct continuum   *continuum;           /* continuum */
+    void               *dist_data;           /* distribution private state */
     uint32_t           nlive_server;         /* # live server */
     int64_t            next_rebuild;         /* next distribution rebuild time in usec */
+    int64_t            next_slots_refresh;   /* next redis cluster slot map refresh time in usec */
+    uint32_t           nqueue;               /* # requests queued on servers */
+    size_t             nqueue_bytes;         /* # bytes of requests queued on servers */
 
     struct string      name;                 /* pool name (ref in conf_pool) */
     struct string      addrstr;              /* pool address - hostname:port (ref in conf_pool) */
@@ -108,6 +127,7 @@ struct server_pool {
     int                key_hash_type;        /* key hash type (hash_type_t) */
     hash_t             key_hash;             /* key hasher */
     struct string      hash_tag;             /* key hash tag (ref in conf_pool) */
+    uint32_t           load_bound;           /* hash load bound in 1/100ths or 0 */
     int                timeout;              /* timeout in msec */
     int                backlog;              /* listen backlog */
     int                redis_db;             /* redis database to connect to */
@@ -115,6 +135,21 @@ struct server_pool {
     uint32_t           server_connections;   /* maximum # server connection */
     int64_t            server_retry_timeout; /* server retry timeout in usec */
     uint32_t           server_failure_limit; /* server failure limit */
+    uint32_t           hedge_delay;          /* hedge delay in msec or 0 */
+    uint32_t           hedge_permille;       /* hedge delay as a read latency percentile in per mille or 0 */
+    uint32_t           hedge_budget;         /* hedges in % of reads */
+    uint32_t           hedge_tokens;         /* hedges left in 1/100ths */
+    struct stats_histogram *hedge_latency;   /* read latency for hedge_permille */
+    struct hotkey      *hotkey;              /* hot key detector or NULL */
+    struct nearcache   *near_cache;          /* near cache or NULL */
+    struct string      near_cache_pattern;   /* keys to near cache, besides the hot ones */
+    struct msg_tqh     *coalesce_q;          /* reads in flight by key hash, or NULL */
+    uint32_t           batch_size;           /* most reads per batch or 0 */
+    uint32_t           batch_delay;          /* most msec a read waits for its batch */
+    struct server_pool *mirror;              /* pool to mirror requests to or NULL */
+    struct string      mirror_name;          /* mirror pool name (ref in conf_pool) */
+    uint32_t           mirror_rate;          /* requests to mirror in % */
+    size_t             mirror_queue_size;    /* most bytes queued on the mirror pool */
     struct string      redis_auth;           /* redis_auth password (matches requirepass on redis) */
     unsigned           require_auth;         /* require_auth? */
     unsigned           auto_eject_hosts:1;   /* auto_eject_hosts? */
@@ -122,6 +157,7 @@ struct server_pool {
     unsigned           redis:1;              /* redis? */
     unsigned           tcpkeepalive:1;       /* tcpkeepalive? */
     unsigned           reuseport:1;          /* set SO_REUSEPORT to socket */
+    unsigned           mirror_writes:1;      /* mirror writes as well as reads? */
 };
 
 void server_ref(struct conn *conn, void *owner);
@@ -135,13 +171,23 @@ rstatus_t server_connect(struct context *ctx, struct server *server, struct conn
 void server_close(struct context *ctx, struct conn *conn);
 void server_connected(struct context *ctx, struct conn *conn);
 void server_ok(struct context *ctx, struct conn *conn);
+void server_latency(struct context *ctx, struct server *server, int64_t latency);
+struct server *server_read(struct server *server);
+struct server *server_hedge(struct server_pool *pool, struct server *server);
+void server_pool_hedge_latency(struct server_pool *pool, int64_t latency);
 
 uint32_t server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t keylen);
-struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *key, uint32_t keylen);
+uint32_t server_pool_bound(const struct server_pool *pool, const uint8_t *key, uint32_t keylen, uint32_t idx);
+uint32_t server_pool_slot(const struct server_pool *pool, const uint8_t *key, uint32_t keylen);
+uint32_t server_pool_find(const struct server_pool *pool, const uint8_t *host, uint32_t hostlen, uint16_t port);
+uint32_t server_pool_add(struct server_pool *pool, const uint8_t *host, uint32_t hostlen, uint16_t port);
+struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, const struct msg *msg, const uint8_t *key, uint32_t keylen);
 rstatus_t server_pool_run(struct server_pool *pool);
 rstatus_t server_pool_preconnect(struct context *ctx);
 void server_pool_disconnect(struct context *ctx);
 rstatus_t server_pool_init(struct array *server_pool, struct array *conf_pool, struct context *ctx);
 void server_pool_deinit(struct array *server_pool);
+void server_pool_reload(struct context *ctx, struct array *server_pool);
+void server_drain(struct context *ctx, bool force);
 
 #endif
@@ -69,7 +69,7 @@ signal_handler(int signo)
     const struct signal *sig;
     void (*action)(void);
     char *actionstr;
-    bool done;
+    bool done, reload, upgrade;
 
     for (sig = signals; sig->signo != 0; sig++) {
         if (sig->signo == signo) {
@@ -81,12 +81,16 @@ signal_handler(int signo)
     actionstr = "";
     action = NULL;
     done = false;
+    reload = false;
+    upgrade = false;
 
     switch (signo) {
     case SIGUSR1:
         break;
 
     case SIGUSR2:
+        actionstr = ", upgrading binary";
+        upgrade = true;
         break;
 
     case SIGTTIN:
@@ -100,8 +104,9 @@ signal_handler(int signo)
         break;
 
     case SIGHUP:
-        actionstr = ", reopening log file";
+        actionstr = ", reopening log file and reloading configuration";
         action = log_reopen;
+        reload = true;
         break;
 
     case SIGINT:
@@ -125,6 +130,14 @@ signal_handler(int signo)
         action();
     }
 
+    if (reload) {
+        core_reload_request();
+    }
+
+    if (upgrade) {
+        core_upgrade_request();
+    }
+
     if (done) {
         exit(1);
     }
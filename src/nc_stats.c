@@ -17,14 +17,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <nc_upgrade.h>
 
 struct stats_desc {
     char *name; /* stats name */
@@ -41,6 +44,27 @@ static struct stats_metric stats_server_codec[] = {
 };
 #undef DEFINE_ACTION
 
+/*
+ * Hot keys are reported with their non printable bytes as \xNN, which takes
+ * at most 4 bytes per byte of a key, and 5 bytes once escaped for json
+ */
+#define STATS_HOTKEY_TEXTLEN    (4 * STATS_HOTKEY_KEYLEN)
+#define STATS_HOTKEY_JSONLEN    (5 * STATS_HOTKEY_KEYLEN)
+
+/* percentiles reported for a histogram, in per mille */
+static const struct stats_percentile {
+    struct string name;      /* json key */
+    const char    *quantile; /* prometheus quantile label */
+    uint32_t      permille;
+} stats_percentiles[] = {
+    { string("p50"),  "0.5",   500 },
+    { string("p90"),  "0.9",   900 },
+    { string("p99"),  "0.99",  990 },
+    { string("p999"), "0.999", 999 },
+};
+
+static struct string stats_max_str = string("max");
+
 #define DEFINE_ACTION(_name, _type, _desc) { .name = #_name, .desc = _desc },
 static const struct stats_desc stats_pool_desc[] = {
     STATS_POOL_CODEC( DEFINE_ACTION )
@@ -83,15 +107,57 @@ stats_metric_init(struct stats_metric *stm)
         stm->value.counter = 0LL;
         break;
 
+    case STATS_MEAN:
+        stm->value.mean.sum = 0LL;
+        stm->value.mean.nvalue = 0LL;
+        break;
+
     case STATS_TIMESTAMP:
         stm->value.timestamp = 0LL;
         break;
 
+    case STATS_HISTOGRAM:
+        memset(stm->value.histogram, 0, sizeof(*stm->value.histogram));
+        break;
+
+    case STATS_HOTKEYS:
+        stm->value.hotkeys->reported = 0;
+        stm->value.hotkeys->nkey = 0;
+        break;
+
     default:
         NOT_REACHED();
     }
 }
 
+/*
+ * Initialize metric stm from its codec entry, allocating the buckets of
+ * histograms and the keys of hot keys
+ */
+static rstatus_t
+stats_metric_create(struct stats_metric *stm, const struct stats_metric *codec)
+{
+    *stm = *codec;
+
+    if (stm->type == STATS_HISTOGRAM) {
+        stm->value.histogram = nc_alloc(sizeof(*stm->value.histogram));
+        if (stm->value.histogram == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    if (stm->type == STATS_HOTKEYS) {
+        stm->value.hotkeys = nc_alloc(sizeof(*stm->value.hotkeys));
+        if (stm->value.hotkeys == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    stats_metric_init(stm);
+
+    return NC_OK;
+}
+
 static void
 stats_metric_reset(struct array *stats_metric)
 {
@@ -121,11 +187,11 @@ stats_pool_metric_init(struct array *stats_metric)
     for (i = 0; i < nfield; i++) {
         struct stats_metric *stm = array_push(stats_metric);
 
-        /* initialize from pool codec first */
-        *stm = stats_pool_codec[i];
-
-        /* initialize individual metric */
-        stats_metric_init(stm);
+        /* initialize from pool codec */
+        status = stats_metric_create(stm, &stats_pool_codec[i]);
+        if (status != NC_OK) {
+            return status;
+        }
     }
 
     return NC_OK;
@@ -145,11 +211,11 @@ stats_server_metric_init(struct stats_server *sts)
     for (i = 0; i < nfield; i++) {
         struct stats_metric *stm = array_push(&sts->metric);
 
-        /* initialize from server codec first */
-        *stm = stats_server_codec[i];
-
-        /* initialize individual metric */
-        stats_metric_init(stm);
+        /* initialize from server codec */
+        status = stats_metric_create(stm, &stats_server_codec[i]);
+        if (status != NC_OK) {
+            return status;
+        }
     }
 
     return NC_OK;
@@ -162,19 +228,32 @@ stats_metric_deinit(struct array *metric)
 
     nmetric = array_n(metric);
     for (i = 0; i < nmetric; i++) {
-        array_pop(metric);
+        struct stats_metric *stm = array_pop(metric);
+
+        if (stm->type == STATS_HISTOGRAM && stm->value.histogram != NULL) {
+            nc_free(stm->value.histogram);
+        }
+
+        if (stm->type == STATS_HOTKEYS && stm->value.hotkeys != NULL) {
+            nc_free(stm->value.hotkeys);
+        }
     }
     array_deinit(metric);
 }
 
 static rstatus_t
-stats_server_init(struct stats_server *sts, struct server *s)
+stats_server_init(struct stats_server *sts, const struct string *name)
 {
     rstatus_t status;
 
-    sts->name = s->name;
+    string_init(&sts->name);
     array_null(&sts->metric);
 
+    status = string_duplicate(&sts->name, name);
+    if (status != NC_OK) {
+        return status;
+    }
+
     status = stats_server_metric_init(sts);
     if (status != NC_OK) {
         return status;
@@ -187,13 +266,17 @@ stats_server_init(struct stats_server *sts, struct server *s)
 
 }
 
+/*
+ * Map stats_server to the servers of pool sp, followed by their replicas,
+ * so that a server or a replica finds its stats at its idx
+ */
 static rstatus_t
-stats_server_map(struct array *stats_server, const struct array *server)
+stats_server_map(struct array *stats_server, const struct server_pool *sp)
 {
     rstatus_t status;
     uint32_t i, nserver;
 
-    nserver = array_n(server);
+    nserver = array_n(&sp->server) + array_n(&sp->replica);
     ASSERT(nserver != 0);
 
     status = array_init(stats_server, nserver, sizeof(struct stats_server));
@@ -202,10 +285,14 @@ stats_server_map(struct array *stats_server, const struct array *server)
     }
 
     for (i = 0; i < nserver; i++) {
-        struct server *s = array_get(server, i);
+        struct server *s = i < array_n(&sp->server) ?
+                           array_get(&sp->server, i) :
+                           array_get(&sp->replica, i - array_n(&sp->server));
         struct stats_server *sts = array_push(stats_server);
 
-        status = stats_server_init(sts, s);
+        ASSERT(s->idx == i);
+
+        status = stats_server_init(sts, &s->name);
         if (status != NC_OK) {
             return status;
         }
@@ -226,6 +313,7 @@ stats_server_unmap(struct array *stats_server)
     for (i = 0; i < nserver; i++) {
         struct stats_server *sts = array_pop(stats_server);
         stats_metric_deinit(&sts->metric);
+        string_deinit(&sts->name);
     }
     array_deinit(stats_server);
 
@@ -233,28 +321,26 @@ stats_server_unmap(struct array *stats_server)
 }
 
 static rstatus_t
-stats_pool_init(struct stats_pool *stp, const struct server_pool *sp)
+stats_pool_init(struct stats_pool *stp, const struct string *name)
 {
     rstatus_t status;
 
-    stp->name = sp->name;
+    string_init(&stp->name);
     array_null(&stp->metric);
     array_null(&stp->server);
 
-    status = stats_pool_metric_init(&stp->metric);
+    status = string_duplicate(&stp->name, name);
     if (status != NC_OK) {
         return status;
     }
 
-    status = stats_server_map(&stp->server, &sp->server);
+    status = stats_pool_metric_init(&stp->metric);
     if (status != NC_OK) {
-        stats_metric_deinit(&stp->metric);
         return status;
     }
 
-    log_debug(LOG_VVVERB, "init stats pool '%.*s' with %"PRIu32" metric and "
-              "%"PRIu32" server", stp->name.len, stp->name.data,
-              array_n(&stp->metric), array_n(&stp->metric));
+    log_debug(LOG_VVVERB, "init stats pool '%.*s' with %"PRIu32" metric",
+              stp->name.len, stp->name.data, array_n(&stp->metric));
 
     return NC_OK;
 }
@@ -298,7 +384,12 @@ stats_pool_map(struct array *stats_pool, const struct array *server_pool)
         const struct server_pool *sp = array_get(server_pool, i);
         struct stats_pool *stp = array_push(stats_pool);
 
-        status = stats_pool_init(stp, sp);
+        status = stats_pool_init(stp, &sp->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_server_map(&stp->server, sp);
         if (status != NC_OK) {
             return status;
         }
@@ -309,6 +400,92 @@ stats_pool_map(struct array *stats_pool, const struct array *server_pool)
     return NC_OK;
 }
 
+/*
+ * Map stats_pool to the same pools and servers as the stats_pool src,
+ * with all the metrics reset
+ */
+static rstatus_t
+stats_pool_clone(struct array *stats_pool, const struct array *src)
+{
+    rstatus_t status;
+    uint32_t i, npool;
+
+    npool = array_n(src);
+    ASSERT(npool != 0);
+
+    status = array_init(stats_pool, npool, sizeof(struct stats_pool));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < npool; i++) {
+        const struct stats_pool *stp1 = array_get(src, i);
+        struct stats_pool *stp2 = array_push(stats_pool);
+        uint32_t j, nserver;
+
+        status = stats_pool_init(stp2, &stp1->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        nserver = array_n(&stp1->server);
+
+        status = array_init(&stp2->server, nserver, sizeof(struct stats_server));
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < nserver; j++) {
+            const struct stats_server *sts1 = array_get(&stp1->server, j);
+            struct stats_server *sts2 = array_push(&stp2->server);
+
+            status = stats_server_init(sts2, &sts1->name);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    log_debug(LOG_VVVERB, "clone %"PRIu32" stats pools", npool);
+
+    return NC_OK;
+}
+
+/*
+ * Return true if stats_pool a and b have the same pools and servers in the
+ * same order
+ */
+static bool
+stats_pool_same(const struct array *a, const struct array *b)
+{
+    uint32_t i, j;
+
+    if (array_n(a) != array_n(b)) {
+        return false;
+    }
+
+    for (i = 0; i < array_n(a); i++) {
+        const struct stats_pool *stp1 = array_get(a, i);
+        const struct stats_pool *stp2 = array_get(b, i);
+
+        if (string_compare(&stp1->name, &stp2->name) != 0 ||
+            array_n(&stp1->server) != array_n(&stp2->server)) {
+            return false;
+        }
+
+        for (j = 0; j < array_n(&stp1->server); j++) {
+            const struct stats_server *sts1 = array_get(&stp1->server, j);
+            const struct stats_server *sts2 = array_get(&stp2->server, j);
+
+            if (string_compare(&sts1->name, &sts2->name) != 0) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 static void
 stats_pool_unmap(struct array *stats_pool)
 {
@@ -320,23 +497,48 @@ stats_pool_unmap(struct array *stats_pool)
         struct stats_pool *stp = array_pop(stats_pool);
         stats_metric_deinit(&stp->metric);
         stats_server_unmap(&stp->server);
+        string_deinit(&stp->name);
     }
     array_deinit(stats_pool);
 
     log_debug(LOG_VVVERB, "unmap %"PRIu32" stats pool", npool);
 }
 
-static rstatus_t
-stats_create_buf(struct stats *st)
+/* Return the length of the longest server name of stats pool stp */
+static uint32_t
+stats_pool_server_namelen(const struct stats_pool *stp)
+{
+    uint32_t i, len;
+
+    for (len = 0, i = 0; i < array_n(&stp->server); i++) {
+        const struct stats_server *sts = array_get(&stp->server, i);
+
+        len = MAX(len, sts->name.len);
+    }
+
+    return len;
+}
+
+/* Return the size of the json object with the sum (c) stats of st */
+static size_t
+stats_json_size(struct stats *st)
 {
     uint32_t int64_max_digits = 20; /* INT64_MAX = 9223372036854775807 */
     uint32_t key_value_extra = 8;   /* "key": "value", */
     uint32_t pool_extra = 8;        /* '"pool_name": { ' + ' }' */
     uint32_t server_extra = 8;      /* '"server_name": { ' + ' }' */
+    uint32_t hotkey_extra = 32;     /* '{"key":"","rate":,"server":""},' */
+    size_t histogram_extra = 0;     /* '{ "p50":value, ... "max":value }' */
     size_t size = 0;
     uint32_t i;
 
-    ASSERT(st->buf.data == NULL && st->buf.size == 0);
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        histogram_extra += stats_percentiles[i].name.len;
+        histogram_extra += int64_max_digits;
+        histogram_extra += key_value_extra;
+    }
+    histogram_extra += stats_max_str.len;
+    histogram_extra += key_value_extra;
 
     /* header */
     size += 1;
@@ -383,6 +585,17 @@ stats_create_buf(struct stats *st)
             size += stm->name.len;
             size += int64_max_digits;
             size += key_value_extra;
+
+            if (stm->type == STATS_HISTOGRAM) {
+                size += histogram_extra;
+            }
+
+            if (stm->type == STATS_HOTKEYS) {
+                size += STATS_NHOTKEY * (hotkey_extra +
+                                         STATS_HOTKEY_JSONLEN +
+                                         int64_max_digits +
+                                         stats_pool_server_namelen(stp));
+            }
         }
 
         /* servers per pool */
@@ -399,6 +612,10 @@ stats_create_buf(struct stats *st)
                 size += stm->name.len;
                 size += int64_max_digits;
                 size += key_value_extra;
+
+                if (stm->type == STATS_HISTOGRAM) {
+                    size += histogram_extra;
+                }
             }
         }
     }
@@ -406,6 +623,92 @@ stats_create_buf(struct stats *st)
     /* footer */
     size += 2;
 
+    return size;
+}
+
+/* Return the size of the prometheus text with the sum (c) stats of st */
+static size_t
+stats_prometheus_size(struct stats *st)
+{
+    uint32_t int64_max_digits = 20; /* INT64_MAX = 9223372036854775807 */
+    uint32_t family_extra = 128;    /* '# HELP nutcracker_..._total ' + '# TYPE ...' */
+    uint32_t sample_extra = 64;     /* 'nutcracker_..._count{pool="",server="",quantile=""} ' */
+    uint32_t header_extra = 1024;   /* info, uptime and connection families */
+    size_t size = 0;
+    uint32_t i, j, k;
+
+    size += header_extra;
+    size += 2 * (st->source.len + st->version.len);
+
+    for (i = 0; i < STATS_POOL_NFIELD; i++) {
+        const struct stats_metric *stm = &stats_pool_codec[i];
+        uint32_t nsample = stm->type == STATS_HISTOGRAM ?
+                           NELEMS(stats_percentiles) + 2 :
+                           stm->type == STATS_HOTKEYS ? STATS_NHOTKEY : 1;
+
+        size += family_extra;
+        size += 2 * stm->name.len;
+        size += strlen(stats_pool_desc[i].desc);
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+
+            if (stm->type == STATS_HOTKEYS) {
+                size += nsample * (2 * STATS_HOTKEY_TEXTLEN +
+                                   2 * stats_pool_server_namelen(stp));
+            }
+
+            size += nsample * (sample_extra + stm->name.len +
+                               2 * stp->name.len + int64_max_digits);
+        }
+    }
+
+    for (i = 0; i < STATS_SERVER_NFIELD; i++) {
+        const struct stats_metric *stm = &stats_server_codec[i];
+        uint32_t nsample = stm->type == STATS_HISTOGRAM ?
+                           NELEMS(stats_percentiles) + 2 : 1;
+
+        size += family_extra;
+        size += 2 * stm->name.len;
+        size += strlen(stats_server_desc[i].desc);
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+
+            for (k = 0; k < array_n(&stp->server); k++) {
+                struct stats_server *sts = array_get(&stp->server, k);
+
+                size += nsample * (sample_extra + stm->name.len +
+                                   2 * (stp->name.len + sts->name.len) +
+                                   int64_max_digits);
+            }
+        }
+    }
+
+    return size;
+}
+
+static rstatus_t
+stats_create_buf(struct stats *st)
+{
+    size_t size;
+
+    ASSERT(st->buf.data == NULL && st->buf.size == 0);
+
+    switch (st->format) {
+    case STATS_FORMAT_JSON:
+        size = stats_json_size(st);
+        break;
+
+    case STATS_FORMAT_PROMETHEUS:
+        size = stats_prometheus_size(st);
+        break;
+
+    default:
+        NOT_REACHED();
+        return NC_ERROR;
+    }
+
     size = NC_ALIGN(size, NC_ALIGNMENT);
 
     st->buf.data = nc_alloc(size);
@@ -431,6 +734,31 @@ stats_destroy_buf(struct stats *st)
     }
 }
 
+static rstatus_t
+stats_add_text(struct stats *st, const char *fmt, ...)
+{
+    struct stats_buffer *buf;
+    va_list args;
+    uint8_t *pos;
+    size_t room;
+    int n;
+
+    buf = &st->buf;
+    pos = buf->data + buf->len;
+    room = buf->size - buf->len - 1;
+
+    va_start(args, fmt);
+    n = nc_vsnprintf(pos, room, fmt, args);
+    va_end(args);
+    if (n < 0 || n >= (int)room) {
+        return NC_ERROR;
+    }
+
+    buf->len += (size_t)n;
+
+    return NC_OK;
+}
+
 static rstatus_t
 stats_add_string(struct stats *st, const struct string *key, const struct string *val)
 {
@@ -610,99 +938,847 @@ stats_end_nesting(struct stats *st)
 }
 
 static rstatus_t
-stats_copy_metric(struct stats *st, struct array *metric)
+stats_add_histogram(struct stats *st, const struct string *key,
+                    const struct stats_histogram *h)
 {
     rstatus_t status;
     uint32_t i;
 
-    for (i = 0; i < array_n(metric); i++) {
-        struct stats_metric *stm = array_get(metric, i);
+    status = stats_begin_nesting(st, key);
+    if (status != NC_OK) {
+        return status;
+    }
 
-        status = stats_add_num(st, &stm->name, stm->value.counter);
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        const struct stats_percentile *pct = &stats_percentiles[i];
+
+        status = stats_add_num(st, &pct->name,
+                               stats_histogram_percentile(h, pct->permille));
         if (status != NC_OK) {
             return status;
         }
     }
 
-    return NC_OK;
+    status = stats_add_num(st, &stats_max_str, h->max);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_end_nesting(st);
 }
 
-static void
-stats_aggregate_metric(struct array *dst, const struct array *src)
+/*
+ * Write hot key hk to text, with its backslashes and non printable bytes
+ * as \xNN, and return its length
+ */
+static uint32_t
+stats_hotkey_text(const struct stats_hotkey *hk, uint8_t *text)
 {
-    uint32_t i;
-
-    for (i = 0; i < array_n(src); i++) {
-        const struct stats_metric *stm1;
-        struct stats_metric *stm2;
-
-        stm1 = array_get(src, i);
-        stm2 = array_get(dst, i);
+    static const char hex[] = "0123456789abcdef";
+    uint32_t i, len;
 
-        ASSERT(stm1->type == stm2->type);
-
-        switch (stm1->type) {
-        case STATS_COUNTER:
-            stm2->value.counter += stm1->value.counter;
-            break;
-
-        case STATS_GAUGE:
-            stm2->value.counter += stm1->value.counter;
-            break;
-
-        case STATS_TIMESTAMP:
-            if (stm1->value.timestamp) {
-                stm2->value.timestamp = stm1->value.timestamp;
-            }
-            break;
+    for (len = 0, i = 0; i < hk->keylen; i++) {
+        uint8_t ch = hk->key[i];
 
-        default:
-            NOT_REACHED();
+        if (ch >= ' ' && ch < 0x7f && ch != '\\') {
+            text[len++] = ch;
+            continue;
         }
+
+        text[len++] = '\\';
+        text[len++] = 'x';
+        text[len++] = (uint8_t)hex[ch >> 4];
+        text[len++] = (uint8_t)hex[ch & 0xf];
     }
+
+    return len;
 }
 
-static void
-stats_aggregate(struct stats *st)
+/* Return the name of the server of hot key hk of stats pool stp */
+static const struct string *
+stats_hotkey_server(const struct stats_pool *stp, const struct stats_hotkey *hk)
 {
-    uint32_t i;
+    static const struct string unknown = null_string;
+    const struct stats_server *sts;
 
-    if (st->aggregate == 0) {
-        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
-                  "generator is slow", st->shadow.elem, st->sum.elem);
-        return;
+    if (hk->server >= array_n(&stp->server)) {
+        return &unknown;
     }
 
-    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
-              st->sum.elem);
-
-    for (i = 0; i < array_n(&st->shadow); i++) {
-        struct stats_pool *stp1, *stp2;
-        uint32_t j;
-
-        stp1 = array_get(&st->shadow, i);
-        stp2 = array_get(&st->sum, i);
-        stats_aggregate_metric(&stp2->metric, &stp1->metric);
-
-        for (j = 0; j < array_n(&stp1->server); j++) {
-            struct stats_server *sts1, *sts2;
-
-            sts1 = array_get(&stp1->server, j);
-            sts2 = array_get(&stp2->server, j);
-            stats_aggregate_metric(&sts2->metric, &sts1->metric);
-        }
-    }
+    sts = array_get(&stp->server, hk->server);
 
-    st->aggregate = 0;
+    return &sts->name;
 }
 
+/*
+ * Add the hot keys hks of stats pool stp as a json array of objects with
+ * the key, its rate and its server
+ */
 static rstatus_t
-stats_make_rsp(struct stats *st)
+stats_add_hotkeys(struct stats *st, const struct string *key,
+                  const struct stats_pool *stp, const struct stats_hotkeys *hks)
 {
     rstatus_t status;
-    uint32_t i;
+    struct stats_buffer *buf;
+    uint8_t text[STATS_HOTKEY_TEXTLEN];
+    uint32_t i, j, len;
 
-    status = stats_add_header(st);
+    buf = &st->buf;
+
+    status = stats_add_text(st, "\"%.*s\":[", key->len, key->data);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < hks->nkey; i++) {
+        const struct stats_hotkey *hk = &hks->key[i];
+        const struct string *server = stats_hotkey_server(stp, hk);
+
+        status = stats_add_text(st, "%s{\"key\":\"", i == 0 ? "" : ",");
+        if (status != NC_OK) {
+            return status;
+        }
+
+        len = stats_hotkey_text(hk, text);
+        for (j = 0; j < len; j++) {
+            if (buf->size - buf->len < 3) {
+                return NC_ERROR;
+            }
+
+            if (text[j] == '\\' || text[j] == '"') {
+                buf->data[buf->len++] = '\\';
+            }
+            buf->data[buf->len++] = text[j];
+        }
+
+        status = stats_add_text(st, "\",\"rate\":%"PRId64",\"server\":\"%.*s\"}",
+                                hk->rate, server->len, server->data);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_add_text(st, "], ");
+}
+
+/*
+ * Return the reported value of counter or gauge stm. A mean gauge is
+ * averaged over the generators that have a value for it, as a server
+ * need not be talked to by every worker thread
+ */
+static int64_t
+stats_metric_value(const struct stats_metric *stm)
+{
+    if (stm->type == STATS_MEAN) {
+        if (stm->value.mean.nvalue == 0) {
+            return 0LL;
+        }
+        return stm->value.mean.sum / stm->value.mean.nvalue;
+    }
+
+    return stm->value.counter;
+}
+
+static rstatus_t
+stats_copy_metric(struct stats *st, const struct stats_pool *stp,
+                  struct array *metric)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    for (i = 0; i < array_n(metric); i++) {
+        struct stats_metric *stm = array_get(metric, i);
+
+        if (stm->type == STATS_HISTOGRAM) {
+            status = stats_add_histogram(st, &stm->name, stm->value.histogram);
+        } else if (stm->type == STATS_HOTKEYS) {
+            status = stats_add_hotkeys(st, &stm->name, stp, stm->value.hotkeys);
+        } else {
+            status = stats_add_num(st, &stm->name,
+                                   stats_metric_value(stm));
+        }
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Merge the hot keys src into dst, adding up the rates of the keys that
+ * are in both, and keep the hottest of them. The first report replaces the
+ * hot keys that dst had before it.
+ */
+static void
+stats_merge_hotkeys(struct stats_hotkeys *dst, const struct stats_hotkeys *src)
+{
+    uint32_t i, j;
+
+    if (!src->reported) {
+        return;
+    }
+
+    if (!dst->reported) {
+        dst->reported = 1;
+        dst->nkey = 0;
+    }
+
+    for (i = 0; i < src->nkey; i++) {
+        const struct stats_hotkey *hk = &src->key[i];
+        struct stats_hotkey *min = NULL;
+
+        for (j = 0; j < dst->nkey; j++) {
+            struct stats_hotkey *dhk = &dst->key[j];
+
+            if (dhk->keylen == hk->keylen &&
+                memcmp(dhk->key, hk->key, hk->keylen) == 0) {
+                dhk->rate += hk->rate;
+                break;
+            }
+
+            if (min == NULL || dhk->rate < min->rate) {
+                min = dhk;
+            }
+        }
+        if (j < dst->nkey) {
+            continue;
+        }
+
+        if (dst->nkey < STATS_NHOTKEY) {
+            dst->key[dst->nkey++] = *hk;
+        } else if (hk->rate > min->rate) {
+            *min = *hk;
+        }
+    }
+
+    /* keep the hottest first */
+    for (i = 1; i < dst->nkey; i++) {
+        struct stats_hotkey hk = dst->key[i];
+
+        for (j = i; j > 0 && dst->key[j - 1].rate < hk.rate; j--) {
+            dst->key[j] = dst->key[j - 1];
+        }
+        dst->key[j] = hk;
+    }
+}
+
+static void
+stats_aggregate_metric(struct array *dst, const struct array *src)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(src); i++) {
+        const struct stats_metric *stm1;
+        struct stats_metric *stm2;
+
+        stm1 = array_get(src, i);
+        stm2 = array_get(dst, i);
+
+        ASSERT(stm1->type == stm2->type);
+
+        switch (stm1->type) {
+        case STATS_COUNTER:
+            stm2->value.counter += stm1->value.counter;
+            break;
+
+        case STATS_GAUGE:
+            stm2->value.counter += stm1->value.counter;
+            break;
+
+        case STATS_MEAN:
+            stm2->value.mean.sum += stm1->value.mean.sum;
+            stm2->value.mean.nvalue += stm1->value.mean.nvalue;
+            break;
+
+        case STATS_TIMESTAMP:
+            if (stm1->value.timestamp) {
+                stm2->value.timestamp = stm1->value.timestamp;
+            }
+            break;
+
+        case STATS_HISTOGRAM: {
+            const struct stats_histogram *h1 = stm1->value.histogram;
+            struct stats_histogram *h2 = stm2->value.histogram;
+            uint32_t j;
+
+            if (h1->count == 0) {
+                break;
+            }
+
+            for (j = 0; j < STATS_HISTOGRAM_NBUCKET; j++) {
+                h2->bucket[j] += h1->bucket[j];
+            }
+            h2->count += h1->count;
+            h2->sum += h1->sum;
+            h2->max = MAX(h2->max, h1->max);
+            break;
+        }
+
+        case STATS_HOTKEYS:
+            stats_merge_hotkeys(stm2->value.hotkeys, stm1->value.hotkeys);
+            break;
+
+        default:
+            NOT_REACHED();
+        }
+    }
+}
+
+/*
+ * Aggregate the shadow (b) stats of generator gen into the sum (c) stats
+ * of st. The generator is either the main context or one of the worker
+ * threads, each of which swaps its own current (a) and shadow (b).
+ */
+static void
+stats_aggregate_shadow(struct stats *st, struct stats *gen)
+{
+    uint32_t i;
+
+    if (gen->aggregate == 0) {
+        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
+                  "generator is slow", gen->shadow.elem, st->sum.elem);
+        return;
+    }
+
+    if (!stats_pool_same(&gen->shadow, &st->sum)) {
+        /*
+         * Generator is yet to reload or has reloaded ahead of the sum,
+         * which lasts for an interval at most. A generator whose pools
+         * still differ after that has diverged from the other contexts.
+         */
+        gen->ndiverged++;
+        if (gen->ndiverged == 2) {
+            log_error("stats of a worker are dropped as its pools differ "
+                      "from the pools of the main context");
+        } else {
+            log_debug(LOG_PVERB, "drop shadow %p as its pools differ from "
+                      "sum %p", gen->shadow.elem, st->sum.elem);
+        }
+        gen->aggregate = 0;
+        return;
+    }
+
+    gen->ndiverged = 0;
+
+    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", gen->shadow.elem,
+              st->sum.elem);
+
+    for (i = 0; i < array_n(&gen->shadow); i++) {
+        struct stats_pool *stp1, *stp2;
+        uint32_t j;
+
+        stp1 = array_get(&gen->shadow, i);
+        stp2 = array_get(&st->sum, i);
+        stats_aggregate_metric(&stp2->metric, &stp1->metric);
+
+        for (j = 0; j < array_n(&stp1->server); j++) {
+            struct stats_server *sts1, *sts2;
+
+            sts1 = array_get(&stp1->server, j);
+            sts2 = array_get(&stp2->server, j);
+            stats_aggregate_metric(&sts2->metric, &sts1->metric);
+        }
+    }
+
+    gen->aggregate = 0;
+}
+
+/*
+ * Remap the sum (c) stats to the pools of the shadow (b) stats after the
+ * configuration was reloaded, carrying the stats of the pools and servers
+ * that are still there over to the new sum
+ */
+static void
+stats_reload_sum(struct stats *st)
+{
+    rstatus_t status;
+    struct array sum;
+    struct stats_buffer buf;
+    uint32_t i, j, k, l;
+
+    array_null(&sum);
+
+    status = stats_pool_clone(&sum, &st->shadow);
+    if (status != NC_OK) {
+        log_error("remap stats sum to reloaded pools failed: %s",
+                  strerror(errno));
+        stats_pool_unmap(&sum);
+        return;
+    }
+
+    for (i = 0; i < array_n(&sum); i++) {
+        struct stats_pool *stp2 = array_get(&sum, i);
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp1 = array_get(&st->sum, j);
+
+            if (string_compare(&stp1->name, &stp2->name) != 0) {
+                continue;
+            }
+
+            stats_aggregate_metric(&stp2->metric, &stp1->metric);
+
+            for (k = 0; k < array_n(&stp2->server); k++) {
+                struct stats_server *sts2 = array_get(&stp2->server, k);
+
+                for (l = 0; l < array_n(&stp1->server); l++) {
+                    struct stats_server *sts1 = array_get(&stp1->server, l);
+
+                    if (string_compare(&sts1->name, &sts2->name) == 0) {
+                        stats_aggregate_metric(&sts2->metric, &sts1->metric);
+                        break;
+                    }
+                }
+            }
+            break;
+        }
+    }
+
+    stats_pool_unmap(&st->sum);
+    st->sum = sum;
+
+    /* size the buffer for the new pools; keep the old one on failure */
+    buf = st->buf;
+    st->buf.len = 0;
+    st->buf.data = NULL;
+    st->buf.size = 0;
+
+    status = stats_create_buf(st);
+    if (status != NC_OK) {
+        st->buf = buf;
+        return;
+    }
+
+    if (buf.size != 0) {
+        nc_free(buf.data);
+    }
+
+    log_debug(LOG_NOTICE, "remap stats sum to %"PRIu32" reloaded pools",
+              array_n(&st->sum));
+}
+
+/*
+ * Mark the hot keys in the sum (c) stats as old, as unlike the other metrics
+ * they are not summed over time but only over the generators. They are
+ * replaced by the first generator that reported hot keys since the last
+ * aggregation, and kept as they are when none did.
+ */
+static void
+stats_expire_hotkeys(struct stats *st)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        for (j = 0; j < array_n(&stp->metric); j++) {
+            struct stats_metric *stm = array_get(&stp->metric, j);
+
+            if (stm->type == STATS_HOTKEYS) {
+                stm->value.hotkeys->reported = 0;
+            }
+        }
+    }
+}
+
+static void
+stats_aggregate(struct stats *st)
+{
+    uint32_t i;
+
+    /* the pools of the main context are the ones to report */
+    if (st->aggregate != 0 && !stats_pool_same(&st->shadow, &st->sum)) {
+        stats_reload_sum(st);
+    }
+
+    stats_expire_hotkeys(st);
+
+    stats_aggregate_shadow(st, st);
+
+    for (i = 0; i < array_n(&st->worker); i++) {
+        struct stats **wst = array_get(&st->worker, i);
+
+        stats_aggregate_shadow(st, *wst);
+    }
+}
+
+/*
+ * Add prometheus label key with value val, escaping the backslash, double
+ * quote and line feed characters in val
+ */
+static rstatus_t
+stats_add_label(struct stats *st, const char *key, const struct string *val)
+{
+    rstatus_t status;
+    struct stats_buffer *buf;
+    uint32_t i;
+
+    status = stats_add_text(st, "%s=\"", key);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    buf = &st->buf;
+
+    for (i = 0; i < val->len; i++) {
+        uint8_t ch = val->data[i];
+
+        if (buf->size - buf->len < 3) {
+            return NC_ERROR;
+        }
+
+        switch (ch) {
+        case '\\':
+        case '"':
+            buf->data[buf->len++] = '\\';
+            buf->data[buf->len++] = ch;
+            break;
+
+        case '\n':
+            buf->data[buf->len++] = '\\';
+            buf->data[buf->len++] = 'n';
+            break;
+
+        default:
+            buf->data[buf->len++] = ch;
+            break;
+        }
+    }
+
+    return stats_add_text(st, "\"");
+}
+
+/* Return the suffix of the prometheus name of a metric of type type */
+static const char *
+stats_prometheus_suffix(stats_type_t type)
+{
+    return type == STATS_COUNTER ? "_total" : "";
+}
+
+/* Add the HELP and TYPE lines of prometheus metric family scope_name */
+static rstatus_t
+stats_add_family(struct stats *st, const char *scope,
+                 const struct stats_metric *stm, const char *desc)
+{
+    const char *type, *suffix, *prefix;
+
+    switch (stm->type) {
+    case STATS_COUNTER:
+        type = "counter";
+        break;
+
+    case STATS_GAUGE:
+    case STATS_MEAN:
+    case STATS_TIMESTAMP:
+    case STATS_HOTKEYS:
+        type = "gauge";
+        break;
+
+    case STATS_HISTOGRAM:
+        type = "summary";
+        break;
+
+    default:
+        NOT_REACHED();
+        return NC_ERROR;
+    }
+
+    suffix = stats_prometheus_suffix(stm->type);
+
+    /* descriptions of counts start with '#' which reads as 'number of' */
+    prefix = "";
+    if (desc[0] == '#' && desc[1] == ' ') {
+        prefix = "number of ";
+        desc += 2;
+    }
+
+    return stats_add_text(st, "# HELP nutcracker_%s_%.*s%s %s%s\n"
+                          "# TYPE nutcracker_%s_%.*s%s %s\n",
+                          scope, stm->name.len, stm->name.data, suffix,
+                          prefix, desc,
+                          scope, stm->name.len, stm->name.data, suffix, type);
+}
+
+/*
+ * Add a sample of prometheus metric scope_name with suffix, labelled with
+ * the pool stp, the server sts and the quantile, if any
+ */
+static rstatus_t
+stats_add_sample(struct stats *st, const char *scope,
+                 const struct string *name, const char *suffix,
+                 const struct stats_pool *stp, const struct stats_server *sts,
+                 const char *quantile, int64_t val)
+{
+    rstatus_t status;
+
+    status = stats_add_text(st, "nutcracker_%s_%.*s%s{", scope, name->len,
+                            name->data, suffix);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_label(st, "pool", &stp->name);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    if (sts != NULL) {
+        status = stats_add_text(st, ",");
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_label(st, "server", &sts->name);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (quantile != NULL) {
+        status = stats_add_text(st, ",quantile=\"%s\"", quantile);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_add_text(st, "} %"PRId64"\n", val);
+}
+
+/*
+ * Add the hot keys of metric stm of pool stp as samples of their rate,
+ * labelled with the pool, the key and its server
+ */
+static rstatus_t
+stats_add_hotkey_samples(struct stats *st, const char *scope,
+                         const struct stats_metric *stm,
+                         const struct stats_pool *stp)
+{
+    rstatus_t status;
+    const struct stats_hotkeys *hks = stm->value.hotkeys;
+    uint8_t text[STATS_HOTKEY_TEXTLEN];
+    struct string key;
+    uint32_t i;
+
+    for (i = 0; i < hks->nkey; i++) {
+        const struct stats_hotkey *hk = &hks->key[i];
+
+        status = stats_add_text(st, "nutcracker_%s_%.*s{", scope,
+                                stm->name.len, stm->name.data);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_label(st, "pool", &stp->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        key.len = stats_hotkey_text(hk, text);
+        key.data = text;
+
+        status = stats_add_text(st, ",");
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_label(st, "key", &key);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_text(st, ",");
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_label(st, "server", stats_hotkey_server(stp, hk));
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_text(st, "} %"PRId64"\n", hk->rate);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+/* Add the samples of metric stm of pool stp and server sts, if any */
+static rstatus_t
+stats_add_samples(struct stats *st, const char *scope,
+                  const struct stats_metric *stm,
+                  const struct stats_pool *stp, const struct stats_server *sts)
+{
+    rstatus_t status;
+    const struct stats_histogram *h;
+    uint32_t i;
+
+    switch (stm->type) {
+    case STATS_COUNTER:
+    case STATS_GAUGE:
+    case STATS_MEAN:
+        return stats_add_sample(st, scope, &stm->name,
+                                stats_prometheus_suffix(stm->type), stp, sts,
+                                NULL, stats_metric_value(stm));
+
+    case STATS_TIMESTAMP:
+        return stats_add_sample(st, scope, &stm->name, "", stp, sts, NULL,
+                                stm->value.timestamp);
+
+    case STATS_HISTOGRAM:
+        break;
+
+    case STATS_HOTKEYS:
+        return stats_add_hotkey_samples(st, scope, stm, stp);
+
+    default:
+        NOT_REACHED();
+        return NC_ERROR;
+    }
+
+    h = stm->value.histogram;
+
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        const struct stats_percentile *pct = &stats_percentiles[i];
+
+        status = stats_add_sample(st, scope, &stm->name, "", stp, sts,
+                                  pct->quantile,
+                                  stats_histogram_percentile(h, pct->permille));
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_add_sample(st, scope, &stm->name, "_sum", stp, sts, NULL,
+                              h->sum);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_add_sample(st, scope, &stm->name, "_count", stp, sts, NULL,
+                            h->count);
+}
+
+static rstatus_t
+stats_add_prometheus_header(struct stats *st)
+{
+    rstatus_t status;
+    int64_t uptime;
+
+    uptime = (int64_t)time(NULL) - st->start_ts;
+
+    status = stats_add_text(st, "# HELP nutcracker_info nutcracker instance\n"
+                            "# TYPE nutcracker_info gauge\n"
+                            "nutcracker_info{");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_label(st, "source", &st->source);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_text(st, ",");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_label(st, "version", &st->version);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_add_text(st, "} 1\n"
+                          "# HELP nutcracker_uptime_seconds uptime in seconds\n"
+                          "# TYPE nutcracker_uptime_seconds gauge\n"
+                          "nutcracker_uptime_seconds %"PRId64"\n"
+                          "# HELP nutcracker_connections_total number of "
+                          "connections accepted\n"
+                          "# TYPE nutcracker_connections_total counter\n"
+                          "nutcracker_connections_total %"PRIu64"\n"
+                          "# HELP nutcracker_curr_connections number of "
+                          "open connections\n"
+                          "# TYPE nutcracker_curr_connections gauge\n"
+                          "nutcracker_curr_connections %"PRIu32"\n",
+                          uptime, conn_ntotal_conn(), conn_ncurr_conn());
+}
+
+/*
+ * Make the prometheus text exposition of the sum (c) stats. Samples are
+ * grouped by metric family with the pool and server as labels, so that
+ * all the samples of a family follow its HELP and TYPE lines.
+ */
+static rstatus_t
+stats_make_prometheus(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i, j, k;
+
+    st->buf.len = 0;
+
+    status = stats_add_prometheus_header(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < STATS_POOL_NFIELD; i++) {
+        status = stats_add_family(st, "pool", &stats_pool_codec[i],
+                                  stats_pool_desc[i].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+
+            status = stats_add_samples(st, "pool", array_get(&stp->metric, i),
+                                       stp, NULL);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    for (i = 0; i < STATS_SERVER_NFIELD; i++) {
+        status = stats_add_family(st, "server", &stats_server_codec[i],
+                                  stats_server_desc[i].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+
+            for (k = 0; k < array_n(&stp->server); k++) {
+                struct stats_server *sts = array_get(&stp->server, k);
+
+                status = stats_add_samples(st, "server",
+                                           array_get(&sts->metric, i), stp, sts);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_make_rsp(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    if (st->format == STATS_FORMAT_PROMETHEUS) {
+        return stats_make_prometheus(st);
+    }
+
+    status = stats_add_header(st);
     if (status != NC_OK) {
         return status;
     }
@@ -711,49 +1787,167 @@ stats_make_rsp(struct stats *st)
         struct stats_pool *stp = array_get(&st->sum, i);
         uint32_t j;
 
-        status = stats_begin_nesting(st, &stp->name);
-        if (status != NC_OK) {
-            return status;
-        }
+        status = stats_begin_nesting(st, &stp->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* copy pool metric from sum(c) to buffer */
+        status = stats_copy_metric(st, stp, &stp->metric);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            status = stats_begin_nesting(st, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            /* copy server metric from sum(c) to buffer */
+            status = stats_copy_metric(st, stp, &sts->metric);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_end_nesting(st);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_add_footer(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Read what has arrived of the http request of the client on st->http_sd,
+ * up to the end of its header, so that closing the client does not reset
+ * the connection. Returns NC_EAGAIN while the header is incomplete.
+ */
+static rstatus_t
+stats_recv_http(struct stats *st)
+{
+    ssize_t n;
+
+    while (st->http_len < STATS_HTTP_REQLEN &&
+           strstr(st->http_req, CRLF CRLF) == NULL) {
+        n = nc_read(st->http_sd, st->http_req + st->http_len,
+                    STATS_HTTP_REQLEN - st->http_len);
+        if (n > 0) {
+            st->http_len += (size_t)n;
+            st->http_req[st->http_len] = '\0';
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (nc_msec_now() < st->http_deadline) {
+                return NC_EAGAIN;
+            }
+            log_error("recv http request on sd %d timed out", st->http_sd);
+            return NC_ERROR;
+        }
+
+        log_error("recv http request on sd %d failed: %s", st->http_sd,
+                  n == 0 ? "eof" : strerror(errno));
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Send the http response to the request of the client on st->http_sd: the
+ * prometheus text of the stats for a GET of the /metrics path
+ */
+static rstatus_t
+stats_send_http(struct stats *st)
+{
+    rstatus_t status;
+    char hdr[256];
+    bool metrics;
+    int len, sd;
+
+    sd = st->http_sd;
+    metrics = (strncmp(st->http_req, "GET /metrics", 12) == 0 &&
+               (st->http_req[12] == ' ' || st->http_req[12] == '?'));
+
+    /* the response is sent in one go, like the json one */
+    status = nc_set_blocking(sd);
+    if (status < 0) {
+        log_error("set block on sd %d failed: %s", sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (!metrics) {
+        len = nc_scnprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found" CRLF
+                           "Content-Length: 0" CRLF
+                           "Connection: close" CRLF CRLF);
+        return nc_sendn(sd, hdr, (size_t)len) < 0 ? NC_ERROR : NC_OK;
+    }
+
+    status = stats_make_rsp(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    len = nc_scnprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK" CRLF
+                       "Content-Type: text/plain; version=0.0.4" CRLF
+                       "Content-Length: %zu" CRLF
+                       "Connection: close" CRLF CRLF, st->buf.len);
 
-        /* copy pool metric from sum(c) to buffer */
-        status = stats_copy_metric(st, &stp->metric);
-        if (status != NC_OK) {
-            return status;
-        }
+    if (nc_sendn(sd, hdr, (size_t)len) < 0 ||
+        nc_sendn(sd, st->buf.data, st->buf.len) < 0) {
+        return NC_ERROR;
+    }
 
-        for (j = 0; j < array_n(&stp->server); j++) {
-            struct stats_server *sts = array_get(&stp->server, j);
+    return NC_OK;
+}
 
-            status = stats_begin_nesting(st, &sts->name);
-            if (status != NC_OK) {
-                return status;
-            }
+/*
+ * Serve the http client on st->http_sd as far as its request has arrived,
+ * and close it once it is answered or has failed
+ */
+static rstatus_t
+stats_serve_http(struct stats *st)
+{
+    rstatus_t status;
 
-            /* copy server metric from sum(c) to buffer */
-            status = stats_copy_metric(st, &sts->metric);
-            if (status != NC_OK) {
-                return status;
-            }
+    status = stats_recv_http(st);
+    if (status == NC_EAGAIN) {
+        return NC_OK;
+    }
 
-            status = stats_end_nesting(st);
-            if (status != NC_OK) {
-                return status;
-            }
-        }
+    if (status == NC_OK) {
+        log_debug(LOG_VERB, "send stats on sd %d", st->http_sd);
 
-        status = stats_end_nesting(st);
+        status = stats_send_http(st);
         if (status != NC_OK) {
-            return status;
+            log_error("send stats on sd %d failed: %s", st->http_sd,
+                      strerror(errno));
         }
     }
 
-    status = stats_add_footer(st);
-    if (status != NC_OK) {
-        return status;
-    }
+    close(st->http_sd);
+    st->http_sd = -1;
 
-    return NC_OK;
+    return status;
 }
 
 static rstatus_t
@@ -763,9 +1957,8 @@ stats_send_rsp(struct stats *st)
     ssize_t n;
     int sd;
 
-    status = stats_make_rsp(st);
-    if (status != NC_OK) {
-        return status;
+    if (st->http_sd >= 0) {
+        return stats_serve_http(st);
     }
 
     sd = accept(st->sd, NULL, NULL);
@@ -774,6 +1967,32 @@ stats_send_rsp(struct stats *st)
         return NC_ERROR;
     }
 
+    if (st->format == STATS_FORMAT_PROMETHEUS) {
+        /*
+         * the request is read as it arrives, so that a client that is slow
+         * to send it does not hold up the aggregator thread
+         */
+        status = nc_set_nonblocking(sd);
+        if (status < 0) {
+            log_error("set nonblock on sd %d failed: %s", sd, strerror(errno));
+            close(sd);
+            return NC_ERROR;
+        }
+
+        st->http_sd = sd;
+        st->http_deadline = nc_msec_now() + STATS_HTTP_TIMEOUT;
+        st->http_len = 0;
+        st->http_req[0] = '\0';
+
+        return stats_serve_http(st);
+    }
+
+    status = stats_make_rsp(st);
+    if (status != NC_OK) {
+        close(sd);
+        return status;
+    }
+
     log_debug(LOG_VERB, "send stats on sd %d %zu bytes", sd, st->buf.len);
 
     n = nc_sendn(sd, st->buf.data, st->buf.len);
@@ -788,6 +2007,37 @@ stats_send_rsp(struct stats *st)
     return NC_OK;
 }
 
+/*
+ * Descriptor that the aggregator thread of st waits on: the http client
+ * being read if there is one, and the stats descriptor otherwise
+ */
+int
+stats_loop_sd(struct stats *st)
+{
+    return st->http_sd >= 0 ? st->http_sd : st->sd;
+}
+
+/*
+ * Timeout in msec of the wait of the aggregator thread of st, which is cut
+ * short by the deadline of the http client being read
+ */
+int
+stats_loop_timeout(struct stats *st)
+{
+    int64_t timeout;
+
+    if (st->http_sd < 0) {
+        return st->interval;
+    }
+
+    timeout = MAX(st->http_deadline - nc_msec_now(), 0);
+    if (st->interval >= 0) {
+        timeout = MIN(timeout, st->interval);
+    }
+
+    return (int)timeout;
+}
+
 static void
 stats_loop_callback(void *arg1, void *arg2)
 {
@@ -797,7 +2047,8 @@ stats_loop_callback(void *arg1, void *arg2)
     /* aggregate stats from shadow (b) -> sum (c) */
     stats_aggregate(st);
 
-    if (n == 0) {
+    /* on a timeout, an http client being read may be past its deadline */
+    if (n == 0 && st->http_sd < 0) {
         return;
     }
 
@@ -817,12 +2068,23 @@ stats_listen(struct stats *st)
 {
     rstatus_t status;
     struct sockinfo si;
+    char name[UPGRADE_NAMELEN];
 
     status = nc_resolve(&st->addr, st->port, &si);
     if (status < 0) {
         return status;
     }
 
+    /* skip bind and listen on a socket handed over by an upgrade */
+    nc_snprintf(name, sizeof(name), "stats %.*s:%u", st->addr.len,
+                st->addr.data, st->port);
+    st->sd = upgrade_listener(name);
+    if (st->sd >= 0) {
+        log_debug(LOG_NOTICE, "m %d inherited listening on stats server "
+                  "'%.*s:%u'", st->sd, st->addr.len, st->addr.data, st->port);
+        return NC_OK;
+    }
+
     st->sd = socket(si.family, SOCK_STREAM, 0);
     if (st->sd < 0) {
         log_error("socket failed: %s", strerror(errno));
@@ -855,7 +2117,7 @@ stats_listen(struct stats *st)
     return NC_OK;
 }
 
-static rstatus_t
+rstatus_t
 stats_start_aggregator(struct stats *st)
 {
     rstatus_t status;
@@ -878,6 +2140,17 @@ stats_start_aggregator(struct stats *st)
     return NC_OK;
 }
 
+/*
+ * Have the aggregator thread of st stop accepting on sd, which a new process
+ * accepts on after an upgrade. The thread checks as it wakes up, which is
+ * at the latest when a connection comes in, and then quits.
+ */
+void
+stats_handoff(struct stats *st)
+{
+    st->handoff = 1;
+}
+
 static void
 stats_stop_aggregator(struct stats *st)
 {
@@ -885,12 +2158,37 @@ stats_stop_aggregator(struct stats *st)
         return;
     }
 
+    if (st->http_sd >= 0) {
+        close(st->http_sd);
+    }
+
+    if (st->sd < 0) {
+        return;
+    }
+
     close(st->sd);
 }
 
+rstatus_t
+stats_format_parse(const char *name, stats_format_t *format)
+{
+    if (strcmp(name, "json") == 0) {
+        *format = STATS_FORMAT_JSON;
+        return NC_OK;
+    }
+
+    if (strcmp(name, "prometheus") == 0) {
+        *format = STATS_FORMAT_PROMETHEUS;
+        return NC_OK;
+    }
+
+    return NC_ERROR;
+}
+
 struct stats *
 stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
-             const char *source, const struct array *server_pool)
+             stats_format_t stats_format, const char *source,
+             const struct array *server_pool)
 {
     rstatus_t status;
     struct stats *st;
@@ -902,6 +2200,7 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
 
     st->port = stats_port;
     st->interval = stats_interval;
+    st->format = stats_format;
     string_set_raw(&st->addr, stats_ip);
 
     st->start_ts = (int64_t)time(NULL);
@@ -913,9 +2212,14 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
     array_null(&st->current);
     array_null(&st->shadow);
     array_null(&st->sum);
+    array_null(&st->worker);
+    array_null(&st->reload);
 
     st->tid = (pthread_t) -1;
     st->sd = -1;
+    st->http_sd = -1;
+    st->http_deadline = 0;
+    st->http_len = 0;
 
     string_set_text(&st->service_str, "service");
     string_set_text(&st->service, "nutcracker");
@@ -934,6 +2238,9 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
 
     st->updated = 0;
     st->aggregate = 0;
+    st->ndiverged = 0;
+    st->handoff = 0;
+    st->stale = 0;
 
     /* map server pool to current (a), shadow (b) and sum (c) */
 
@@ -957,11 +2264,6 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
         goto error;
     }
 
-    status = stats_start_aggregator(st);
-    if (status != NC_OK) {
-        goto error;
-    }
-
     return st;
 
 error:
@@ -973,6 +2275,11 @@ void
 stats_destroy(struct stats *st)
 {
     stats_stop_aggregator(st);
+    while (array_n(&st->worker) != 0) {
+        array_pop(&st->worker);
+    }
+    array_deinit(&st->worker);
+    stats_pool_unmap(&st->reload);
     stats_pool_unmap(&st->sum);
     stats_pool_unmap(&st->shadow);
     stats_pool_unmap(&st->current);
@@ -980,6 +2287,57 @@ stats_destroy(struct stats *st)
     nc_free(st);
 }
 
+/*
+ * Register the stats of a worker thread with the stats st of the main
+ * context, so that the aggregator thread of st also sums up the stats
+ * generated by the worker. Worker contexts are created from the same
+ * configuration and hence have the same pool and server layout.
+ *
+ * Must be called before the aggregator thread is started.
+ */
+rstatus_t
+stats_add_worker(struct stats *st, struct stats *worker)
+{
+    rstatus_t status;
+    struct stats **wst;
+    uint32_t i;
+
+    ASSERT(st->tid == (pthread_t) -1);
+
+    if (array_n(&worker->sum) != array_n(&st->sum)) {
+        log_error("stats of worker has %"PRIu32" pools, expected %"PRIu32"",
+                  array_n(&worker->sum), array_n(&st->sum));
+        return NC_ERROR;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp1 = array_get(&st->sum, i);
+        struct stats_pool *stp2 = array_get(&worker->sum, i);
+
+        if (array_n(&stp1->server) != array_n(&stp2->server)) {
+            log_error("stats of worker pool '%.*s' has %"PRIu32" servers, "
+                      "expected %"PRIu32"", stp2->name.len, stp2->name.data,
+                      array_n(&stp2->server), array_n(&stp1->server));
+            return NC_ERROR;
+        }
+    }
+
+    if (st->worker.elem == NULL) {
+        status = array_init(&st->worker, 1, sizeof(struct stats *));
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    wst = array_push(&st->worker);
+    if (wst == NULL) {
+        return NC_ENOMEM;
+    }
+    *wst = worker;
+
+    return NC_OK;
+}
+
 void
 stats_swap(struct stats *st)
 {
@@ -999,6 +2357,26 @@ stats_swap(struct stats *st)
         return;
     }
 
+    if (st->stale) {
+        struct array shadow;
+        rstatus_t status;
+
+        /* shadow is ours again; remap it to the reloaded pools of current */
+        array_null(&shadow);
+        status = stats_pool_clone(&shadow, &st->current);
+        if (status != NC_OK) {
+            log_debug(LOG_PVERB, "skip swap of current %p shadow %p as "
+                      "remap of shadow failed", st->current.elem,
+                      st->shadow.elem);
+            stats_pool_unmap(&shadow);
+            return;
+        }
+
+        stats_pool_unmap(&st->shadow);
+        st->shadow = shadow;
+        st->stale = 0;
+    }
+
     log_debug(LOG_PVERB, "swap stats current %p shadow %p", st->current.elem,
               st->shadow.elem);
 
@@ -1014,6 +2392,137 @@ stats_swap(struct stats *st)
     st->aggregate = 1;
 }
 
+/*
+ * Map the stats of the pools reloaded into server_pool, without giving
+ * them to the generator yet. This is the only step of a reload of the
+ * stats that can fail and it must be followed by stats_reload_done(),
+ * which takes the reloaded stats into use on commit.
+ */
+rstatus_t
+stats_reload(struct stats *st, const struct array *server_pool)
+{
+    rstatus_t status;
+
+    ASSERT(array_n(&st->reload) == 0);
+
+    status = stats_pool_map(&st->reload, server_pool);
+    if (status != NC_OK) {
+        stats_pool_unmap(&st->reload);
+        array_null(&st->reload);
+        return status;
+    }
+
+    return NC_OK;
+}
+
+void
+stats_reload_done(struct stats *st, bool commit)
+{
+    if (!commit) {
+        stats_pool_unmap(&st->reload);
+        array_null(&st->reload);
+        return;
+    }
+
+    /* current (a) is only ever touched by the generator */
+    stats_pool_unmap(&st->current);
+    st->current = st->reload;
+    array_null(&st->reload);
+
+    /*
+     * Shadow (b) may be in the hands of the aggregator, in which case it
+     * is remapped on the next swap. Either way, force that swap so that
+     * the aggregator learns of the reloaded pools.
+     */
+    st->stale = 1;
+    st->updated = 1;
+
+    log_debug(LOG_NOTICE, "remap stats current %p to %"PRIu32" reloaded "
+              "pools", st->current.elem, array_n(&st->current));
+}
+
+/* Return the bucket of histogram value val */
+static uint32_t
+stats_histogram_bucket(int64_t val)
+{
+    uint32_t msb;
+
+    if (val < (1LL << STATS_HISTOGRAM_BITS)) {
+        return val < 0 ? 0 : (uint32_t)val;
+    }
+
+    if (val >= (1LL << STATS_HISTOGRAM_MAXBITS)) {
+        return STATS_HISTOGRAM_NBUCKET - 1;
+    }
+
+    msb = 63 - (uint32_t)__builtin_clzll((unsigned long long)val);
+
+    return ((msb - STATS_HISTOGRAM_BITS + 1) << STATS_HISTOGRAM_BITS) +
+           (uint32_t)((val >> (msb - STATS_HISTOGRAM_BITS)) &
+                      ((1 << STATS_HISTOGRAM_BITS) - 1));
+}
+
+/* Return the largest value counted in bucket idx of a histogram */
+static int64_t
+stats_histogram_value(uint32_t idx)
+{
+    uint32_t shift;
+    int64_t base;
+
+    if (idx < (1U << STATS_HISTOGRAM_BITS)) {
+        return (int64_t)idx;
+    }
+
+    shift = (idx >> STATS_HISTOGRAM_BITS) - 1;
+    base = (int64_t)((1U << STATS_HISTOGRAM_BITS) +
+                     (idx & ((1U << STATS_HISTOGRAM_BITS) - 1)));
+
+    return ((base + 1) << shift) - 1;
+}
+
+void
+stats_histogram_record(struct stats_histogram *h, int64_t val)
+{
+    h->bucket[stats_histogram_bucket(val)]++;
+    h->count++;
+    h->sum += val;
+    if (val > h->max) {
+        h->max = val;
+    }
+}
+
+/*
+ * Return the value below which permille per mille of the values recorded
+ * in histogram h fall, or 0 if h is empty
+ */
+int64_t
+stats_histogram_percentile(const struct stats_histogram *h, uint32_t permille)
+{
+    int64_t rank, seen;
+    uint32_t i;
+
+    ASSERT(permille <= 1000);
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    rank = (h->count * permille + 999) / 1000;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    /* the last bucket is open ended, so it is left to the max value */
+    for (seen = 0, i = 0; i < STATS_HISTOGRAM_NBUCKET - 1; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            return MIN(stats_histogram_value(i), h->max);
+        }
+    }
+
+    return h->max;
+}
+
 static struct stats_metric *
 stats_pool_to_metric(struct context *ctx, const struct server_pool *pool,
                      stats_pool_field_t fidx)
@@ -1112,6 +2621,38 @@ _stats_pool_set_ts(struct context *ctx, const struct server_pool *pool,
               stm->name.data, stm->value.timestamp);
 }
 
+void
+_stats_pool_record(struct context *ctx, const struct server_pool *pool,
+                   stats_pool_field_t fidx, int64_t val)
+{
+    struct stats_metric *stm;
+
+    stm = stats_pool_to_metric(ctx, pool, fidx);
+
+    ASSERT(stm->type == STATS_HISTOGRAM);
+    stats_histogram_record(stm->value.histogram, val);
+
+    log_debug(LOG_VVVERB, "record field '%.*s' value %"PRId64"", stm->name.len,
+              stm->name.data, val);
+}
+
+void
+_stats_pool_set_hotkeys(struct context *ctx, const struct server_pool *pool,
+                        stats_pool_field_t fidx, const struct hotkey *hk)
+{
+    struct stats_metric *stm;
+
+    stm = stats_pool_to_metric(ctx, pool, fidx);
+
+    ASSERT(stm->type == STATS_HOTKEYS);
+    stm->value.hotkeys->reported = 1;
+    stm->value.hotkeys->nkey = hotkey_top(hk, stm->value.hotkeys->key,
+                                          STATS_NHOTKEY);
+
+    log_debug(LOG_VVVERB, "set field '%.*s' to %"PRIu32" keys", stm->name.len,
+              stm->name.data, stm->value.hotkeys->nkey);
+}
+
 static struct stats_metric *
 stats_server_to_metric(struct context *ctx, const struct server *server,
                        stats_server_field_t fidx)
@@ -1122,6 +2663,14 @@ stats_server_to_metric(struct context *ctx, const struct server *server,
     struct stats_metric *stm;
     uint32_t pidx, sidx;
 
+    if (server->retired || server->discovered) {
+        /*
+         * Servers that are gone after a reload and nodes learned from a
+         * redis cluster have no stats
+         */
+        return NULL;
+    }
+
     sidx = server->idx;
     pidx = server->owner->idx;
 
@@ -1145,6 +2694,9 @@ _stats_server_incr(struct context *ctx, const struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
     stm->value.counter++;
@@ -1160,6 +2712,9 @@ _stats_server_decr(struct context *ctx, const struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_GAUGE);
     stm->value.counter--;
@@ -1175,6 +2730,9 @@ _stats_server_incr_by(struct context *ctx, const struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
     stm->value.counter += val;
@@ -1190,6 +2748,9 @@ _stats_server_decr_by(struct context *ctx, const struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_GAUGE);
     stm->value.counter -= val;
@@ -1205,6 +2766,9 @@ _stats_server_set_ts(struct context *ctx, const struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_TIMESTAMP);
     stm->value.timestamp = val;
@@ -1212,3 +2776,45 @@ _stats_server_set_ts(struct context *ctx, const struct server *server,
     log_debug(LOG_VVVERB, "set ts field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.timestamp);
 }
+
+void
+_stats_server_record(struct context *ctx, const struct server *server,
+                     stats_server_field_t fidx, int64_t val)
+{
+    struct stats_metric *stm;
+
+    stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
+
+    ASSERT(stm->type == STATS_HISTOGRAM);
+    stats_histogram_record(stm->value.histogram, val);
+
+    log_debug(LOG_VVVERB, "record field '%.*s' value %"PRId64"", stm->name.len,
+              stm->name.data, val);
+}
+
+/*
+ * Set the value of mean gauge fidx of server from prev to val. The sum and
+ * the # generators that have a value are both kept as deltas, like gauges,
+ * so that they add up over the generators
+ */
+void
+_stats_server_set_mean(struct context *ctx, const struct server *server,
+                       stats_server_field_t fidx, int64_t prev, int64_t val)
+{
+    struct stats_metric *stm;
+
+    stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
+
+    ASSERT(stm->type == STATS_MEAN);
+    stm->value.mean.sum += val - prev;
+    stm->value.mean.nvalue += (val != 0) - (prev != 0);
+
+    log_debug(LOG_VVVERB, "set mean field '%.*s' from %"PRId64" to %"PRId64"",
+              stm->name.len, stm->name.data, prev, val);
+}
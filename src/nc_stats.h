@@ -27,9 +27,40 @@
     ACTION( client_connections,     STATS_GAUGE,        "# active client connections")                              \
     /* pool behavior */                                                                                             \
     ACTION( server_ejects,          STATS_COUNTER,      "# times backend server was ejected")                       \
+    ACTION( rebuild_stall,          STATS_HISTOGRAM,    "event loop stall of distribution rebuilds in usec")        \
     /* forwarder behavior */                                                                                        \
     ACTION( forward_error,          STATS_COUNTER,      "# times we encountered a forwarding error")                \
     ACTION( fragments,              STATS_COUNTER,      "# fragments created from a multi-vector request")          \
+    ACTION( load_displaced,         STATS_COUNTER,      "# requests displaced off their server by hash_load_bound") \
+    ACTION( load_displaced_ejected, STATS_COUNTER,      "# requests displaced while servers were ejected")          \
+    ACTION( replica_reads,          STATS_COUNTER,      "# read requests sent to a replica")                        \
+    ACTION( hedges,                 STATS_COUNTER,      "# hedges sent for slow read requests")                     \
+    ACTION( hedges_won,             STATS_COUNTER,      "# hedges answered before the request they hedged")         \
+    ACTION( hedges_over_budget,     STATS_COUNTER,      "# hedges not sent for being over hedge_budget")            \
+    ACTION( hotkey_samples,         STATS_COUNTER,      "# requests sampled for hot keys")                          \
+    ACTION( hot_keys,               STATS_HOTKEYS,      "hottest keys with their requests per sec and server")      \
+    ACTION( near_cache_hits,        STATS_COUNTER,      "# reads answered from the near cache")                     \
+    ACTION( near_cache_misses,      STATS_COUNTER,      "# cacheable reads that missed the near cache")             \
+    ACTION( near_cache_evictions,   STATS_COUNTER,      "# near cache entries evicted to make room")                \
+    ACTION( near_cache_invalidations, STATS_COUNTER,    "# near cache entries dropped by writes")                   \
+    ACTION( coalesced_reads,        STATS_COUNTER,      "# reads that waited on an identical read in flight")       \
+    ACTION( batches,                STATS_COUNTER,      "# batches of single key reads sent")                       \
+    ACTION( batched_reads,          STATS_COUNTER,      "# single key reads sent in a batch")                       \
+    ACTION( mirrored_requests,      STATS_COUNTER,      "# requests copied to the mirror pool")                     \
+    ACTION( mirror_drops,           STATS_COUNTER,      "# copies dropped for a full or failing mirror pool")       \
+    ACTION( read_latency,           STATS_HISTOGRAM,    "latency of read requests in usec")                         \
+    ACTION( write_latency,          STATS_HISTOGRAM,    "latency of write and other requests in usec")              \
+    ACTION( key_latency,            STATS_HISTOGRAM,    "latency of key requests: del, expire, ttl... in usec")     \
+    ACTION( string_latency,         STATS_HISTOGRAM,    "latency of string requests: get, set, incr... in usec")    \
+    ACTION( hash_latency,           STATS_HISTOGRAM,    "latency of hash requests in usec")                         \
+    ACTION( list_latency,           STATS_HISTOGRAM,    "latency of list requests in usec")                         \
+    ACTION( set_latency,            STATS_HISTOGRAM,    "latency of set requests: sadd, smembers... in usec")      \
+    ACTION( zset_latency,           STATS_HISTOGRAM,    "latency of sorted set and geo requests in usec")           \
+    ACTION( script_latency,         STATS_HISTOGRAM,    "latency of eval and evalsha requests in usec")             \
+    /* redis cluster behavior */                                                                                    \
+    ACTION( redirect_moved,         STATS_COUNTER,      "# requests redirected by a MOVED response")                \
+    ACTION( redirect_ask,           STATS_COUNTER,      "# requests redirected by an ASK response")                 \
+    ACTION( slots_refresh,          STATS_COUNTER,      "# times the cluster slot map was refreshed")               \
 
 #define STATS_SERVER_CODEC(ACTION)                                                                                  \
     /* server behavior */                                                                                           \
@@ -38,6 +69,7 @@
     ACTION( server_timedout,        STATS_COUNTER,      "# timeouts on server connections")                         \
     ACTION( server_connections,     STATS_GAUGE,        "# active server connections")                              \
     ACTION( server_ejected_at,      STATS_TIMESTAMP,    "timestamp when server was ejected in usec since epoch")    \
+    ACTION( load_displaced,         STATS_COUNTER,      "# requests displaced off this server by hash_load_bound")  \
     /* data behavior */                                                                                             \
     ACTION( requests,               STATS_COUNTER,      "# requests")                                               \
     ACTION( request_bytes,          STATS_COUNTER,      "total request bytes")                                      \
@@ -47,25 +79,85 @@
     ACTION( in_queue_bytes,         STATS_GAUGE,        "current request bytes in incoming queue")                  \
     ACTION( out_queue,              STATS_GAUGE,        "# requests in outgoing queue")                             \
     ACTION( out_queue_bytes,        STATS_GAUGE,        "current request bytes in outgoing queue")                  \
+    ACTION( latency,                STATS_HISTOGRAM,    "latency of requests in usec")                              \
+    ACTION( latency_ewma,           STATS_MEAN,         "moving average of the latency in usec")                    \
+    ACTION( read_score,             STATS_MEAN,         "cost of a read: latency_ewma times requests in flight")    \
 
 #define STATS_ADDR      "0.0.0.0"
 #define STATS_PORT      22222
 #define STATS_INTERVAL  (30 * 1000) /* in msec */
+#define STATS_FORMAT    STATS_FORMAT_JSON
+#define STATS_HTTP_TIMEOUT  1000    /* in msec */
+#define STATS_HTTP_REQLEN   4096    /* max http request length */
+
+/*
+ * Histograms are log-linear, like HDR histograms: values below 2^BITS have
+ * a bucket each and every larger power of two range is split into 2^BITS
+ * buckets, which bounds the relative error of a percentile to 1/2^BITS.
+ * Values of 2^MAXBITS or more are counted in the last bucket.
+ */
+#define STATS_HISTOGRAM_BITS    4
+#define STATS_HISTOGRAM_MAXBITS 32
+#define STATS_HISTOGRAM_NBUCKET \
+    ((STATS_HISTOGRAM_MAXBITS - STATS_HISTOGRAM_BITS + 1) << STATS_HISTOGRAM_BITS)
 
 typedef enum stats_type {
     STATS_INVALID,
     STATS_COUNTER,    /* monotonic accumulator */
     STATS_GAUGE,      /* non-monotonic accumulator */
+    STATS_MEAN,       /* gauge averaged over the threads that have a value */
     STATS_TIMESTAMP,  /* monotonic timestamp (in nsec) */
+    STATS_HISTOGRAM,  /* distribution of values */
+    STATS_HOTKEYS,    /* hottest keys */
     STATS_SENTINEL
 } stats_type_t;
 
+typedef enum stats_format {
+    STATS_FORMAT_JSON,        /* json object on connect */
+    STATS_FORMAT_PROMETHEUS   /* prometheus text on http get /metrics */
+} stats_format_t;
+
+struct stats_mean {
+    int64_t sum;    /* sum of the values of the threads */
+    int64_t nvalue; /* # threads that have a nonzero value */
+};
+
+struct stats_histogram {
+    int64_t count;                           /* # values */
+    int64_t sum;                             /* sum of values */
+    int64_t max;                             /* max value */
+    int64_t bucket[STATS_HISTOGRAM_NBUCKET]; /* # values per bucket */
+};
+
+/*
+ * Hottest keys of a pool, as last reported by its hot key detectors. Keys
+ * longer than STATS_HOTKEY_KEYLEN are truncated.
+ */
+#define STATS_NHOTKEY       10
+#define STATS_HOTKEY_KEYLEN 64
+
+struct stats_hotkey {
+    int64_t  rate;                      /* estimated # requests per sec */
+    uint32_t server;                    /* idx of the server of the key */
+    uint32_t keylen;                    /* key length */
+    uint8_t  key[STATS_HOTKEY_KEYLEN];  /* key */
+};
+
+struct stats_hotkeys {
+    unsigned            reported:1;         /* reported since reset? */
+    uint32_t            nkey;               /* # hot keys */
+    struct stats_hotkey key[STATS_NHOTKEY]; /* hot keys, hottest first */
+};
+
 struct stats_metric {
     stats_type_t  type;         /* type */
     struct string name;         /* name (ref) */
     union {
         int64_t   counter;      /* accumulating counter */
         int64_t   timestamp;    /* monotonic timestamp */
+        struct stats_mean mean; /* mean over the threads */
+        struct stats_histogram *histogram; /* histogram (owned) */
+        struct stats_hotkeys *hotkeys;     /* hot keys (owned) */
     } value;
 };
 
@@ -89,6 +181,7 @@ struct stats_buffer {
 struct stats {
     uint16_t            port;            /* stats monitoring port */
     int                 interval;        /* stats aggregation interval */
+    stats_format_t      format;          /* stats output format */
     struct string       addr;            /* stats monitoring address */
 
     int64_t             start_ts;        /* start timestamp of nutcracker */
@@ -97,9 +190,15 @@ struct stats {
     struct array        current;         /* stats_pool[] (a) */
     struct array        shadow;          /* stats_pool[] (b) */
     struct array        sum;             /* stats_pool[] (c = a + b) */
+    struct array        worker;          /* stats *[] of worker threads */
+    struct array        reload;          /* stats_pool[] (a) of reloaded pools */
 
     pthread_t           tid;             /* stats aggregator thread */
     int                 sd;              /* stats descriptor */
+    int                 http_sd;         /* http client being read */
+    int64_t             http_deadline;   /* msec to read its request by */
+    size_t              http_len;        /* length of its request read */
+    char                http_req[STATS_HTTP_REQLEN + 1]; /* its request */
 
     struct string       service_str;     /* service string */
     struct string       service;         /* service */
@@ -113,7 +212,10 @@ struct stats {
     struct string       ncurr_conn_str;  /* curr connections string */
 
     volatile int        aggregate;       /* shadow (b) aggregate? */
+    uint32_t            ndiverged;       /* # shadows (b) dropped in a row */
     volatile int        updated;         /* current (a) updated? */
+    volatile int        handoff;         /* sd handed off by an upgrade? */
+    int                 stale;           /* shadow (b) of pools before reload? */
 };
 
 #define DEFINE_ACTION(_name, _type, _desc) STATS_POOL_##_name,
@@ -152,6 +254,14 @@ typedef enum stats_server_field {
     _stats_pool_set_ts(_ctx, _pool, STATS_POOL_##_name, _val);          \
 } while (0)
 
+#define stats_pool_record(_ctx, _pool, _name, _val) do {                \
+    _stats_pool_record(_ctx, _pool, STATS_POOL_##_name, _val);          \
+} while (0)
+
+#define stats_pool_set_hotkeys(_ctx, _pool, _name, _val) do {           \
+    _stats_pool_set_hotkeys(_ctx, _pool, STATS_POOL_##_name, _val);     \
+} while (0)
+
 #define stats_server_incr(_ctx, _server, _name) do {                    \
     _stats_server_incr(_ctx, _server, STATS_SERVER_##_name);            \
 } while (0)
@@ -172,6 +282,15 @@ typedef enum stats_server_field {
      _stats_server_set_ts(_ctx, _server, STATS_SERVER_##_name, _val);   \
 } while (0)
 
+#define stats_server_record(_ctx, _server, _name, _val) do {            \
+    _stats_server_record(_ctx, _server, STATS_SERVER_##_name, _val);    \
+} while (0)
+
+#define stats_server_set_mean(_ctx, _server, _name, _prev, _val) do {   \
+    _stats_server_set_mean(_ctx, _server, STATS_SERVER_##_name, _prev,  \
+                           _val);                                       \
+} while (0)
+
 #else
 
 #define stats_pool_incr(_ctx, _pool, _name)
@@ -182,6 +301,10 @@ typedef enum stats_server_field {
 
 #define stats_pool_decr_by(_ctx, _pool, _name, _val)
 
+#define stats_pool_record(_ctx, _pool, _name, _val)
+
+#define stats_pool_set_hotkeys(_ctx, _pool, _name, _val)
+
 #define stats_server_incr(_ctx, _server, _name)
 
 #define stats_server_decr(_ctx, _server, _name)
@@ -190,6 +313,10 @@ typedef enum stats_server_field {
 
 #define stats_server_decr_by(_ctx, _server, _name, _val)
 
+#define stats_server_record(_ctx, _server, _name, _val)
+
+#define stats_server_set_mean(_ctx, _server, _name, _prev, _val)
+
 #endif
 
 #define stats_enabled   NC_STATS
@@ -201,15 +328,30 @@ void _stats_pool_decr(struct context *ctx, const struct server_pool *pool, stats
 void _stats_pool_incr_by(struct context *ctx, const struct server_pool *pool, stats_pool_field_t fidx, int64_t val);
 void _stats_pool_decr_by(struct context *ctx, const struct server_pool *pool, stats_pool_field_t fidx, int64_t val);
 void _stats_pool_set_ts(struct context *ctx, const struct server_pool *pool, stats_pool_field_t fidx, int64_t val);
+void _stats_pool_record(struct context *ctx, const struct server_pool *pool, stats_pool_field_t fidx, int64_t val);
+void _stats_pool_set_hotkeys(struct context *ctx, const struct server_pool *pool, stats_pool_field_t fidx, const struct hotkey *hk);
 
 void _stats_server_incr(struct context *ctx, const struct server *server, stats_server_field_t fidx);
 void _stats_server_decr(struct context *ctx, const struct server *server, stats_server_field_t fidx);
 void _stats_server_incr_by(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_decr_by(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_set_ts(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t val);
+void _stats_server_record(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t val);
+void _stats_server_set_mean(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t prev, int64_t val);
+
+void stats_histogram_record(struct stats_histogram *h, int64_t val);
+int64_t stats_histogram_percentile(const struct stats_histogram *h, uint32_t permille);
 
-struct stats *stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval, const char *source, const struct array *server_pool);
+rstatus_t stats_format_parse(const char *name, stats_format_t *format);
+struct stats *stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval, stats_format_t stats_format, const char *source, const struct array *server_pool);
 void stats_destroy(struct stats *stats);
+rstatus_t stats_add_worker(struct stats *stats, struct stats *worker);
+rstatus_t stats_start_aggregator(struct stats *stats);
 void stats_swap(struct stats *stats);
+void stats_handoff(struct stats *stats);
+int stats_loop_sd(struct stats *stats);
+int stats_loop_timeout(struct stats *stats);
+rstatus_t stats_reload(struct stats *stats, const struct array *server_pool);
+void stats_reload_done(struct stats *stats, bool commit);
 
 #endif
@@ -0,0 +1,570 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_upgrade.h>
+
+struct upgrade_listener {
+    char name[UPGRADE_NAMELEN]; /* listener name */
+    int  sd;                    /* inherited socket descriptor */
+};
+
+static struct array inherited; /* upgrade_listener[] from the old process */
+static int channel = -1;       /* channel to the old process */
+
+static struct conn *ack_conn;  /* channel to the new process, until it acks */
+static pid_t ack_pid = -1;     /* new process, until it acks */
+static int64_t ack_deadline;   /* time the new process has to ack by in msec */
+static bool acked;             /* did the new process ack? */
+
+static rstatus_t
+upgrade_send(int sd, const char *name, int fd)
+{
+    char buf[UPGRADE_NAMELEN];
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char           control[CMSG_SPACE(sizeof(int))];
+    } cmsgu;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(buf, 0, sizeof(buf));
+    strncpy(buf, name, sizeof(buf) - 1);
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        memset(&cmsgu, 0, sizeof(cmsgu));
+        msg.msg_control = cmsgu.control;
+        msg.msg_controllen = sizeof(cmsgu.control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        n = sendmsg(sd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        log_error("sendmsg of listener '%s' on %d failed: %s", name, sd,
+                  strerror(errno));
+        return NC_ERROR;
+    }
+
+    /* the fd went out with the first byte, the rest is plain data */
+    if ((size_t)n < sizeof(buf)) {
+        n = nc_sendn(sd, buf + n, sizeof(buf) - (size_t)n);
+        if (n < 0) {
+            log_error("send of listener '%s' on %d failed: %s", name, sd,
+                      strerror(errno));
+            return NC_ERROR;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+upgrade_recv(int sd, struct upgrade_listener *l)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr cm;
+        char           control[CMSG_SPACE(sizeof(int))];
+    } cmsgu;
+    struct cmsghdr *cmsg;
+    ssize_t n, m;
+
+    l->sd = -1;
+
+    iov.iov_base = l->name;
+    iov.iov_len = sizeof(l->name);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgu.control;
+    msg.msg_controllen = sizeof(cmsgu.control);
+
+    do {
+        n = recvmsg(sd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        log_error("recvmsg of listener on %d failed: %s", sd,
+                  n == 0 ? "eof" : strerror(errno));
+        return NC_ERROR;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&l->sd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if ((size_t)n < sizeof(l->name)) {
+        m = nc_recvn(sd, l->name + n, sizeof(l->name) - (size_t)n);
+        if (m != (ssize_t)sizeof(l->name) - n) {
+            log_error("recv of listener on %d failed: %s", sd,
+                      m < 0 ? strerror(errno) : "eof");
+            if (l->sd >= 0) {
+                close(l->sd);
+            }
+            return NC_ERROR;
+        }
+    }
+
+    l->name[sizeof(l->name) - 1] = '\0';
+
+    return NC_OK;
+}
+
+/*
+ * Receive the listeners handed over by the old process, when we were
+ * exec'd by an upgrade
+ */
+rstatus_t
+upgrade_init(void)
+{
+    rstatus_t status;
+    char *env;
+
+    env = getenv(UPGRADE_ENV);
+    if (env == NULL) {
+        return NC_OK;
+    }
+
+    channel = nc_atoi(env, strlen(env));
+    unsetenv(UPGRADE_ENV);
+    if (channel < 0) {
+        log_error("invalid upgrade channel '%s' in env", env);
+        return NC_ERROR;
+    }
+
+    status = array_init(&inherited, 8, sizeof(struct upgrade_listener));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (;;) {
+        struct upgrade_listener l, *pl;
+
+        status = upgrade_recv(channel, &l);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        if (l.name[0] == '\0') {
+            break;
+        }
+
+        if (l.sd < 0) {
+            log_warn("listener '%s' was handed over without fd, ignored",
+                     l.name);
+            continue;
+        }
+
+        pl = array_push(&inherited);
+        if (pl == NULL) {
+            close(l.sd);
+            return NC_ENOMEM;
+        }
+        *pl = l;
+
+        log_debug(LOG_VERB, "inherited listener '%s' on %d", l.name, l.sd);
+    }
+
+    log_debug(LOG_NOTICE, "inherited %"PRIu32" listeners on upgrade",
+              array_n(&inherited));
+
+    return NC_OK;
+}
+
+/*
+ * Return the inherited socket listening as name, which is then owned by
+ * the caller, or -1 if there is none and the caller has to listen itself
+ */
+int
+upgrade_listener(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(&inherited); i++) {
+        struct upgrade_listener *l = array_get(&inherited, i);
+        int sd;
+
+        if (l->sd < 0 || strcmp(l->name, name) != 0) {
+            continue;
+        }
+
+        sd = l->sd;
+        l->sd = -1;
+
+        return sd;
+    }
+
+    return -1;
+}
+
+/*
+ * Return true if we were exec'd by an upgrade and did not take over from
+ * the old process yet
+ */
+bool
+upgrade_taking_over(void)
+{
+    return channel >= 0;
+}
+
+/*
+ * Tell the old process that we are up and listening, so that it stops
+ * accepting and starts draining its clients. If the old process gave up
+ * on us, it kept its listeners, and we have to go.
+ */
+rstatus_t
+upgrade_done(void)
+{
+    ssize_t n;
+
+    if (channel < 0) {
+        return NC_OK;
+    }
+
+    while (array_n(&inherited) != 0) {
+        struct upgrade_listener *l = array_pop(&inherited);
+
+        if (l->sd >= 0) {
+            log_warn("inherited listener '%s' on %d is not used, closing",
+                     l->name, l->sd);
+            close(l->sd);
+        }
+    }
+    array_deinit(&inherited);
+    array_null(&inherited);
+
+    n = nc_write(channel, "", 1);
+    if (n < 0) {
+        log_error("ack of upgrade on %d failed: %s", channel, strerror(errno));
+    }
+
+    close(channel);
+    channel = -1;
+
+    return n < 0 ? NC_ERROR : NC_OK;
+}
+
+static rstatus_t
+upgrade_send_pools(int sd, struct context *ctx)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    for (i = 0; i < array_n(&ctx->pool); i++) {
+        struct server_pool *pool = array_get(&ctx->pool, i);
+        char name[UPGRADE_NAMELEN];
+
+        if (pool->p_conn == NULL || pool->p_conn->sd < 0) {
+            continue;
+        }
+
+        nc_snprintf(name, sizeof(name), "pool %.*s", pool->addrstr.len,
+                    pool->addrstr.data);
+
+        status = upgrade_send(sd, name, pool->p_conn->sd);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+upgrade_send_all(int sd, struct context *ctx)
+{
+    rstatus_t status;
+    struct stats *st = ctx->stats;
+    uint32_t i;
+
+    status = upgrade_send_pools(sd, ctx);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&ctx->worker); i++) {
+        struct context **wctx = array_get(&ctx->worker, i);
+
+        status = upgrade_send_pools(sd, *wctx);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (st->sd >= 0) {
+        char name[UPGRADE_NAMELEN];
+
+        nc_snprintf(name, sizeof(name), "stats %.*s:%u", st->addr.len,
+                    st->addr.data, st->port);
+
+        status = upgrade_send(sd, name, st->sd);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return upgrade_send(sd, "", -1);
+}
+
+/*
+ * Read the ack of the new process on channel conn. The channel is done
+ * once the ack or eof is read.
+ */
+static rstatus_t
+upgrade_recv_ack(struct context *ctx, struct conn *conn)
+{
+    ssize_t n;
+    char ack;
+
+    for (;;) {
+        n = nc_read(conn->sd, &ack, 1);
+        if (n == 1) {
+            acked = true;
+            conn->done = 1;
+            return NC_OK;
+        }
+
+        if (n == 0) {
+            conn->eof = 1;
+            conn->done = 1;
+            return NC_OK;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return NC_OK;
+        }
+
+        conn->err = errno;
+        return NC_ERROR;
+    }
+}
+
+static void
+upgrade_close(struct context *ctx, struct conn *conn)
+{
+    ASSERT(conn == ack_conn);
+
+    close(conn->sd);
+    conn->sd = -1;
+    conn->owner = NULL;
+    conn_put(conn);
+
+    ack_conn = NULL;
+}
+
+/*
+ * Wait for the ack of new process pid on channel sd in the event loop of
+ * ctx, so that the clients of ctx are served in the meantime
+ */
+static rstatus_t
+upgrade_watch(struct context *ctx, int sd, pid_t pid)
+{
+    rstatus_t status;
+    struct conn *conn;
+
+    status = nc_set_nonblocking(sd);
+    if (status < 0) {
+        log_error("set nonblock on %d failed: %s", sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    conn = conn_get_channel(array_get(&ctx->pool, 0), sd, upgrade_recv_ack,
+                            upgrade_close);
+    if (conn == NULL) {
+        return NC_ENOMEM;
+    }
+
+    status = event_add_conn(ctx->evb, conn);
+    if (status == NC_OK) {
+        status = event_del_out(ctx->evb, conn);
+    }
+    if (status != NC_OK) {
+        log_error("event add conn on %d failed: %s", sd, strerror(errno));
+        event_del_conn(ctx->evb, conn);
+        conn->sd = -1;
+        conn->owner = NULL;
+        conn_put(conn);
+        return NC_ERROR;
+    }
+
+    ack_conn = conn;
+    ack_pid = pid;
+    ack_deadline = nc_msec_now() + UPGRADE_TIMEOUT;
+    acked = false;
+
+    return NC_OK;
+}
+
+/*
+ * Exec a new process from the same command line as ours and hand all our
+ * listeners over to it. On success, the new process is starting and its
+ * ack is waited for by upgrade_wait. On failure, we keep running as if
+ * nothing happened.
+ */
+rstatus_t
+upgrade_start(struct context *ctx)
+{
+    rstatus_t status;
+    struct instance *nci = ctx->nci;
+    char fd[NC_UINTMAX_MAXLEN];
+    int sv[2];
+    uint32_t i;
+    pid_t pid;
+
+    ASSERT(ack_conn == NULL);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        log_error("socketpair for upgrade failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
+    nc_snprintf(fd, sizeof(fd), "%d", sv[1]);
+    if (setenv(UPGRADE_ENV, fd, 1) < 0) {
+        log_error("setenv for upgrade failed: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return NC_ERROR;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        /* nothing but the std streams and the channel survives the exec */
+        for (i = STDERR_FILENO + 1; i < ctx->max_nfd; i++) {
+            if ((int)i != sv[1]) {
+                close((int)i);
+            }
+        }
+        execvp(nci->argv[0], nci->argv);
+        _exit(1);
+    }
+
+    unsetenv(UPGRADE_ENV);
+    close(sv[1]);
+
+    if (pid < 0) {
+        log_error("fork for upgrade failed: %s", strerror(errno));
+        close(sv[0]);
+        return NC_ERROR;
+    }
+
+    log_debug(LOG_NOTICE, "upgrading to '%s' in new process %d", nci->argv[0],
+              pid);
+
+    status = upgrade_send_all(sv[0], ctx);
+    if (status == NC_OK) {
+        status = upgrade_watch(ctx, sv[0], pid);
+    }
+    if (status != NC_OK) {
+        log_error("upgrade to '%s' failed, killing new process %d",
+                  nci->argv[0], pid);
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Check on the upgrade started by upgrade_start. Return NC_EAGAIN while
+ * the new process has yet to ack, and NC_OK once it did, after which the
+ * caller is expected to stop accepting and drain its clients. Return
+ * NC_ERROR if the new process failed or did not ack in time, after which
+ * we keep running as if nothing happened.
+ */
+rstatus_t
+upgrade_wait(struct context *ctx)
+{
+    struct instance *nci = ctx->nci;
+    int64_t now;
+
+    ASSERT(ack_pid > 0);
+
+    if (ack_conn != NULL) {
+        now = nc_msec_now();
+        if (now < ack_deadline) {
+            ctx->timeout = MIN(ctx->timeout, (int)(ack_deadline - now));
+            return NC_EAGAIN;
+        }
+
+        log_error("new process %d did not take over in %d msec", ack_pid,
+                  UPGRADE_TIMEOUT);
+        event_del_conn(ctx->evb, ack_conn);
+        ack_conn->close(ctx, ack_conn);
+    }
+
+    if (!acked) {
+        /*
+         * If the new process daemonized, pid is its first child, which
+         * exited already. The new process itself quits on its own as it
+         * finds the channel closed.
+         */
+        log_error("upgrade to '%s' failed, killing new process %d",
+                  nci->argv[0], ack_pid);
+        kill(ack_pid, SIGKILL);
+        waitpid(ack_pid, NULL, 0);
+        ack_pid = -1;
+        return NC_ERROR;
+    }
+
+    /*
+     * pid is the new process, or if that daemonized, its first child that
+     * exited already and has to be reaped
+     */
+    waitpid(ack_pid, NULL, WNOHANG);
+
+    /* the pid file now belongs to the new process */
+    nci->pidfile = 0;
+
+    log_debug(LOG_NOTICE, "handed listeners over to new process %d", ack_pid);
+
+    ack_pid = -1;
+
+    return NC_OK;
+}
@@ -0,0 +1,53 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_UPGRADE_H_
+#define _NC_UPGRADE_H_
+
+#include <nc_core.h>
+
+#define UPGRADE_ENV         "NC_UPGRADE_FD" /* channel fd in the new process */
+#define UPGRADE_NAMELEN     128             /* listener name record length */
+#define UPGRADE_TIMEOUT     10000           /* new process startup in msec */
+#define UPGRADE_INTERVAL    100             /* drain check interval in msec */
+#define UPGRADE_GRACE       1000            /* grace for new clients in msec */
+
+/*
+ * An upgrade hands the listening sockets of the running process over to a
+ * freshly exec'd binary through a unix socket channel:
+ *
+ *  old process                          new process
+ *  -----------                          -----------
+ *  socketpair, fork, exec  ---------->  upgrade_init: receive listeners
+ *  send "name" + fd, ..., ""            core_start: take listeners by name
+ *  upgrade_wait: ack?      <----------  upgrade_done: ack
+ *  close listeners, drain clients, exit
+ *
+ * Every listener is sent as a fixed length name record, like "pool <addr>"
+ * or "stats <addr>:<port>", carrying the fd as SCM_RIGHTS ancillary data.
+ * An empty name record ends the list. The old process keeps serving its
+ * clients while it waits for the ack, which it reads in its event loop.
+ */
+
+rstatus_t upgrade_init(void);
+int upgrade_listener(const char *name);
+bool upgrade_taking_over(void);
+rstatus_t upgrade_done(void);
+rstatus_t upgrade_start(struct context *ctx);
+rstatus_t upgrade_wait(struct context *ctx);
+
+#endif
@@ -475,6 +475,31 @@ nc_msec_now(void)
     return nc_usec_now() / 1000LL;
 }
 
+/*
+ * Return a pseudo random number from a xorshift generator of the calling
+ * thread, seeded on first use. Unlike random(), it takes no lock that the
+ * worker threads would contend on.
+ */
+uint32_t
+nc_random(void)
+{
+    static __thread uint64_t state;
+    uint64_t x;
+
+    if (state == 0) {
+        state = (uint64_t)nc_usec_now() ^ (uint64_t)(uintptr_t)&state;
+        state = state == 0 ? 1 : state;
+    }
+
+    x = state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    state = x;
+
+    return (uint32_t)(x >> 32);
+}
+
 static int
 nc_resolve_inet(const struct string *name, int port, struct sockinfo *si)
 {
@@ -587,13 +612,14 @@ nc_resolve(const struct string *name, int port, struct sockinfo *si)
  * Unresolve the socket address by translating it to a character string
  * describing the host and service
  *
- * This routine is not reentrant
+ * This routine is not reentrant, but is safe to call from multiple worker
+ * threads
  */
 const char *
 nc_unresolve_addr(struct sockaddr *addr, socklen_t addrlen)
 {
-    static char unresolve[NI_MAXHOST + NI_MAXSERV];
-    static char host[NI_MAXHOST], service[NI_MAXSERV];
+    static __thread char unresolve[NI_MAXHOST + NI_MAXSERV];
+    static __thread char host[NI_MAXHOST], service[NI_MAXSERV];
     int status;
 
     status = getnameinfo(addr, addrlen, host, sizeof(host),
@@ -612,12 +638,13 @@ nc_unresolve_addr(struct sockaddr *addr, socklen_t addrlen)
  * Unresolve the socket descriptor peer address by translating it to a
  * character string describing the host and service
  *
- * This routine is not reentrant
+ * This routine is not reentrant, but is safe to call from multiple worker
+ * threads
  */
 const char *
 nc_unresolve_peer_desc(int sd)
 {
-    static struct sockinfo si;
+    static __thread struct sockinfo si;
     struct sockaddr *addr;
     socklen_t addrlen;
     int status;
@@ -638,12 +665,13 @@ nc_unresolve_peer_desc(int sd)
  * Unresolve the socket descriptor address by translating it to a
  * character string describing the host and service
  *
- * This routine is not reentrant
+ * This routine is not reentrant, but is safe to call from multiple worker
+ * threads
  */
 const char *
 nc_unresolve_desc(int sd)
 {
-    static struct sockinfo si;
+    static __thread struct sockinfo si;
     struct sockaddr *addr;
     socklen_t addrlen;
     int status;
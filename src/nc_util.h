@@ -205,6 +205,7 @@ int _scnprintf(char *buf, size_t size, const char *fmt, ...) NC_ATTRIBUTE_FORMAT
 int _vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
 int64_t nc_usec_now(void);
 int64_t nc_msec_now(void);
+uint32_t nc_random(void);
 
 /*
  * Address resolution for internet (ipv4 and ipv6) and unix domain
@@ -0,0 +1,213 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+
+void
+wheel_node_init(struct wheel_node *node)
+{
+    node->slot = NULL;
+    node->key = 0LL;
+    node->data = NULL;
+}
+
+void
+wheel_init(struct wheel *wheel, int64_t now)
+{
+    int i, j;
+
+    wheel->now = now;
+    wheel->nnode = 0;
+
+    for (i = 0; i < WHEEL_ROOT_SIZE; i++) {
+        TAILQ_INIT(&wheel->root[i]);
+    }
+
+    for (i = 0; i < WHEEL_NLEVEL; i++) {
+        for (j = 0; j < WHEEL_LEVEL_SIZE; j++) {
+            TAILQ_INIT(&wheel->level[i][j]);
+        }
+    }
+
+    TAILQ_INIT(&wheel->expired);
+}
+
+/*
+ * Link node into the slot of the wheel that covers its expiry relative
+ * to the next tick. Nodes beyond the span of the wheel are parked in the
+ * last slot they can reach and re-placed when they are cascaded.
+ */
+static void
+wheel_place(struct wheel *wheel, struct wheel_node *node)
+{
+    struct wheel_tqh *slot;
+    int64_t expire, delta;
+    int i;
+
+    expire = node->key;
+    delta = expire - wheel->now;
+    ASSERT(delta >= 0);
+
+    if (delta < WHEEL_ROOT_SIZE) {
+        slot = &wheel->root[expire & WHEEL_ROOT_MASK];
+    } else {
+        if (delta >= WHEEL_SPAN) {
+            expire = wheel->now + WHEEL_SPAN - 1;
+            delta = WHEEL_SPAN - 1;
+        }
+
+        for (i = 0; i < WHEEL_NLEVEL - 1; i++) {
+            if (delta < (1LL << (WHEEL_ROOT_BITS + (i + 1) * WHEEL_LEVEL_BITS))) {
+                break;
+            }
+        }
+
+        slot = &wheel->level[i][(expire >> (WHEEL_ROOT_BITS +
+                                            i * WHEEL_LEVEL_BITS)) &
+                                WHEEL_LEVEL_MASK];
+    }
+
+    TAILQ_INSERT_TAIL(slot, node, tqe);
+    node->slot = slot;
+}
+
+void
+wheel_insert(struct wheel *wheel, struct wheel_node *node)
+{
+    ASSERT(node->slot == NULL);
+
+    if (node->key < wheel->now) {
+        /* already behind the wheel; due on the next wheel_expire() */
+        TAILQ_INSERT_TAIL(&wheel->expired, node, tqe);
+        node->slot = &wheel->expired;
+        return;
+    }
+
+    wheel_place(wheel, node);
+    wheel->nnode++;
+}
+
+void
+wheel_delete(struct wheel *wheel, struct wheel_node *node)
+{
+    ASSERT(node->slot != NULL);
+
+    TAILQ_REMOVE(node->slot, node, tqe);
+
+    if (node->slot != &wheel->expired) {
+        ASSERT(wheel->nnode > 0);
+        wheel->nnode--;
+    }
+
+    node->slot = NULL;
+    node->data = NULL;
+}
+
+/*
+ * Re-place all the nodes in slot idx of upper wheel level into the wheels
+ * below it. Returns idx.
+ */
+static int
+wheel_cascade(struct wheel *wheel, int level, int idx)
+{
+    struct wheel_tqh slot;
+    struct wheel_node *node;
+
+    TAILQ_INIT(&slot);
+    TAILQ_CONCAT(&slot, &wheel->level[level][idx], tqe);
+
+    while (!TAILQ_EMPTY(&slot)) {
+        node = TAILQ_FIRST(&slot);
+        TAILQ_REMOVE(&slot, node, tqe);
+        wheel_place(wheel, node);
+    }
+
+    return idx;
+}
+
+/*
+ * Advance the wheel up to and including tick now and return the first
+ * expired node, if any. Like rbtree_min(), the node is not unlinked and
+ * it is up to the caller to delete it.
+ */
+struct wheel_node *
+wheel_expire(struct wheel *wheel, int64_t now)
+{
+    struct wheel_node *node;
+
+    while (wheel->now <= now) {
+        int i, idx;
+
+        if (wheel->nnode == 0) {
+            /* nothing to cascade or expire; jump straight to now */
+            wheel->now = now + 1;
+            break;
+        }
+
+        idx = (int)(wheel->now & WHEEL_ROOT_MASK);
+        if (idx == 0) {
+            for (i = 0; i < WHEEL_NLEVEL; i++) {
+                int lidx = (int)((wheel->now >> (WHEEL_ROOT_BITS +
+                                                 i * WHEEL_LEVEL_BITS)) &
+                                 WHEEL_LEVEL_MASK);
+                if (wheel_cascade(wheel, i, lidx) != 0) {
+                    break;
+                }
+            }
+        }
+
+        TAILQ_FOREACH(node, &wheel->root[idx], tqe) {
+            node->slot = &wheel->expired;
+            wheel->nnode--;
+        }
+        TAILQ_CONCAT(&wheel->expired, &wheel->root[idx], tqe);
+
+        wheel->now++;
+    }
+
+    return TAILQ_FIRST(&wheel->expired);
+}
+
+/*
+ * Return the tick at which the next node might expire, or -1 if the wheel
+ * is empty. The returned tick is exact when the next expiry is within the
+ * current revolution of the root wheel, otherwise it is the tick at which
+ * the root wheel wraps around and the upper wheels are cascaded.
+ */
+int64_t
+wheel_next(const struct wheel *wheel)
+{
+    int64_t tick;
+
+    if (!TAILQ_EMPTY(&wheel->expired)) {
+        return wheel->now - 1;
+    }
+
+    if (wheel->nnode == 0) {
+        return -1;
+    }
+
+    tick = wheel->now;
+    do {
+        if (!TAILQ_EMPTY(&wheel->root[tick & WHEEL_ROOT_MASK])) {
+            return tick;
+        }
+        tick++;
+    } while ((tick & WHEEL_ROOT_MASK) != 0);
+
+    return tick;
+}
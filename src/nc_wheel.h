@@ -0,0 +1,65 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_WHEEL_H_
+#define _NC_WHEEL_H_
+
+#include <nc_core.h>
+
+/*
+ * Hierarchical timing wheel with a tick of 1 msec. The root wheel has
+ * 256 slots of 1 tick each; every one of the WHEEL_NLEVEL upper wheels
+ * has 64 slots, each covering a whole revolution of the wheel below it.
+ * Nodes in upper wheels are cascaded down when the wheel below wraps
+ * around, which gives O(1) insert and delete and a span of 2^32 msec.
+ */
+#define WHEEL_ROOT_BITS     8
+#define WHEEL_ROOT_SIZE     (1 << WHEEL_ROOT_BITS)
+#define WHEEL_ROOT_MASK     (WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_BITS    6
+#define WHEEL_LEVEL_SIZE    (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVEL_MASK    (WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_NLEVEL        4
+#define WHEEL_SPAN          (1LL << (WHEEL_ROOT_BITS + WHEEL_NLEVEL * WHEEL_LEVEL_BITS))
+
+struct wheel_tqh;
+
+struct wheel_node {
+    TAILQ_ENTRY(wheel_node) tqe;   /* link in wheel slot */
+    struct wheel_tqh        *slot; /* slot that node is linked in */
+    int64_t                 key;   /* expiry in msec */
+    void                    *data; /* opaque data */
+};
+
+TAILQ_HEAD(wheel_tqh, wheel_node);
+
+struct wheel {
+    int64_t          now;                                   /* next tick to process */
+    uint32_t         nnode;                                 /* # node in root and level slots */
+    struct wheel_tqh root[WHEEL_ROOT_SIZE];                 /* root wheel */
+    struct wheel_tqh level[WHEEL_NLEVEL][WHEEL_LEVEL_SIZE]; /* upper wheels */
+    struct wheel_tqh expired;                               /* expired nodes */
+};
+
+void wheel_node_init(struct wheel_node *node);
+void wheel_init(struct wheel *wheel, int64_t now);
+void wheel_insert(struct wheel *wheel, struct wheel_node *node);
+void wheel_delete(struct wheel *wheel, struct wheel_node *node);
+struct wheel_node *wheel_expire(struct wheel *wheel, int64_t now);
+int64_t wheel_next(const struct wheel *wheel);
+
+#endif
@@ -1151,18 +1151,18 @@ memcache_parse_rsp(struct msg *r)
             break;
 
         case SW_RUNTO_CRLF:
-            switch (ch) {
-            case CR:
-                if (r->type == MSG_RSP_MC_VALUE) {
-                    state = SW_RUNTO_VAL;
-                } else {
-                    state = SW_ALMOST_DONE;
-                }
-
+            /* jump to the CR that ends the line */
+            m = nc_memchr(p, CR, b->last - p);
+            if (m == NULL) {
+                p = b->last - 1;
                 break;
+            }
 
-            default:
-                break;
+            p = m;
+            if (r->type == MSG_RSP_MC_VALUE) {
+                state = SW_RUNTO_VAL;
+            } else {
+                state = SW_ALMOST_DONE;
             }
 
             break;
@@ -1251,6 +1251,31 @@ memcache_failure(const struct msg *r)
     return false;
 }
 
+bool
+memcache_readonly(const struct msg *r)
+{
+    ASSERT(r->request);
+
+    return memcache_retrieval(r);
+}
+
+msg_family_t
+memcache_family(const struct msg *r)
+{
+    ASSERT(r->request);
+
+    if (memcache_delete(r) || memcache_touch(r)) {
+        return MSG_FAMILY_KEY;
+    }
+
+    if (memcache_retrieval(r) || memcache_storage(r) ||
+        memcache_arithmetic(r)) {
+        return MSG_FAMILY_STRING;
+    }
+
+    return MSG_FAMILY_NONE;
+}
+
 static rstatus_t
 memcache_append_key(struct msg *r, const uint8_t *key, uint32_t keylen)
 {
@@ -1392,6 +1417,41 @@ memcache_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq)
     return NC_OK;
 }
 
+/*
+ * Strip the end marker off retrieval response r
+ */
+static void
+memcache_strip_end(struct msg *r)
+{
+    struct mbuf *mbuf;
+
+    ASSERT(r->end != NULL);
+
+    for (;;) {
+        mbuf = STAILQ_LAST(&r->mhdr, mbuf, next);
+        ASSERT(mbuf != NULL);
+
+        /*
+         * We cannot assert that end marker points to the last mbuf
+         * Consider a scenario where end marker points to the
+         * penultimate mbuf and the last mbuf only contains spaces
+         * and CRLF: mhdr -> [...END] -> [\r\n]
+         */
+
+        if (r->end >= mbuf->pos && r->end < mbuf->last) {
+            /* end marker is within this mbuf */
+            r->mlen -= (uint32_t)(mbuf->last - r->end);
+            mbuf->last = r->end;
+            break;
+        }
+
+        /* end marker is not in this mbuf */
+        r->mlen -= mbuf_length(mbuf);
+        mbuf_remove(&r->mhdr, mbuf);
+        mbuf_put(mbuf);
+    }
+}
+
 /*
  * Pre-coalesce handler is invoked when the message is a response to
  * the fragmented multi vector request - 'get' or 'gets' and all the
@@ -1401,7 +1461,6 @@ void
 memcache_pre_coalesce(struct msg *r)
 {
     struct msg *pr = r->peer; /* peer request */
-    struct mbuf *mbuf;
 
     ASSERT(!r->request);
     ASSERT(pr->request);
@@ -1421,33 +1480,7 @@ memcache_pre_coalesce(struct msg *r)
          * Readjust responses of the fragmented message vector by not
          * including the end marker for all
          */
-
-        ASSERT(r->end != NULL);
-
-        for (;;) {
-            mbuf = STAILQ_LAST(&r->mhdr, mbuf, next);
-            ASSERT(mbuf != NULL);
-
-            /*
-             * We cannot assert that end marker points to the last mbuf
-             * Consider a scenario where end marker points to the
-             * penultimate mbuf and the last mbuf only contains spaces
-             * and CRLF: mhdr -> [...END] -> [\r\n]
-             */
-
-            if (r->end >= mbuf->pos && r->end < mbuf->last) {
-                /* end marker is within this mbuf */
-                r->mlen -= (uint32_t)(mbuf->last - r->end);
-                mbuf->last = r->end;
-                break;
-            }
-
-            /* end marker is not in this mbuf */
-            r->mlen -= mbuf_length(mbuf);
-            mbuf_remove(&r->mhdr, mbuf);
-            mbuf_put(mbuf);
-        }
-
+        memcache_strip_end(r);
         break;
 
     default:
@@ -1456,8 +1489,8 @@ memcache_pre_coalesce(struct msg *r)
          * MSG_RSP_MC_END. For an invalid response, we send out SERVER_ERRROR
          * with EINVAL errno
          */
-        mbuf = STAILQ_FIRST(&r->mhdr);
-        log_hexdump(LOG_ERR, mbuf->pos, mbuf_length(mbuf), "rsp fragment "
+        log_hexdump(LOG_ERR, STAILQ_FIRST(&r->mhdr)->pos,
+                    mbuf_length(STAILQ_FIRST(&r->mhdr)), "rsp fragment "
                     "with unknown type %d", r->type);
         pr->error = 1;
         pr->err = EINVAL;
@@ -1601,6 +1634,107 @@ memcache_post_coalesce(struct msg *request)
     }
 }
 
+/*
+ * Build batch r of the single key reads in r->frag_seq into a 'get' of
+ * their keys, in the same order
+ */
+rstatus_t
+memcache_batch(struct msg *r)
+{
+    rstatus_t status;
+    struct keypos *kpos;
+    uint32_t i;
+
+    ASSERT(r->request && r->is_batch);
+    ASSERT(r->type == MSG_REQ_MC_GET);
+
+    for (i = 0; i < r->nfrag; i++) {
+        kpos = array_get(r->frag_seq[i]->keys, 0);
+
+        status = memcache_append_key(r, kpos->start,
+                                     (uint32_t)(kpos->end - kpos->start));
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = msg_prepend(r, (const uint8_t *)"get ", 4);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = msg_append(r, (const uint8_t *)CRLF, CRLF_LEN);
+    if (status != NC_OK) {
+        return status;
+    }
+    r->narg = r->nfrag;
+
+    return NC_OK;
+}
+
+/*
+ * Move the response to the idx-th read of batch r out of the response to
+ * r and into rsp. The reads are split in order, starting with idx 0, for
+ * which NC_ERROR is returned with nothing moved if the response to r is
+ * not a retrieval response, like an error.
+ *
+ * The values come back in the order of the keys, without the keys that
+ * were not found, so the read gets the next value only if it is for its
+ * key.
+ */
+rstatus_t
+memcache_unbatch(struct msg *r, uint32_t idx, struct msg *rsp)
+{
+    struct msg *pr = r->peer; /* peer response */
+    struct keypos *kpos;
+    struct mbuf *mbuf;
+    uint32_t keylen;
+    rstatus_t status;
+
+    ASSERT(r->request && r->is_batch && idx < r->nfrag);
+    ASSERT(pr != NULL && !pr->request);
+
+    if (idx == 0) {
+        if (pr->type != MSG_RSP_MC_END) {
+            return NC_ERROR;
+        }
+        memcache_strip_end(pr);
+    }
+
+    kpos = array_get(r->frag_seq[idx]->keys, 0);
+    keylen = (uint32_t)(kpos->end - kpos->start);
+
+    STAILQ_FOREACH(mbuf, &pr->mhdr, next) {
+        if (!mbuf_empty(mbuf)) {
+            break;
+        }
+    }
+
+    if (mbuf != NULL) {
+        /* the header line is within the first mbuf, as memcache_copy_bulk needs */
+        if (nc_strchr(mbuf->pos, mbuf->last, CR) == NULL) {
+            return NC_ERROR;
+        }
+
+        if (mbuf_length(mbuf) > 6 + keylen &&
+            nc_strncmp(mbuf->pos + 6, kpos->start, keylen) == 0 &&
+            mbuf->pos[6 + keylen] == ' ') {
+            status = memcache_copy_bulk(rsp, pr);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    status = msg_append(rsp, (const uint8_t *)"END\r\n", 5);
+    if (status != NC_OK) {
+        return status;
+    }
+    rsp->type = MSG_RSP_MC_END;
+
+    return NC_OK;
+}
+
 void
 memcache_post_connect(struct context *ctx, struct conn *conn, struct server *server)
 {
@@ -1611,6 +1745,12 @@ memcache_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg)
 {
 }
 
+bool
+memcache_redirect(struct context *ctx, struct conn *conn, struct msg *pmsg, struct msg *msg)
+{
+    return false;
+}
+
 rstatus_t
 memcache_add_auth(struct context *ctx, struct conn *c_conn, struct conn *s_conn)
 {
@@ -142,26 +142,54 @@
     (str16icmp(m, c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11, c12, c13, c14, c15) &&       \
      (m[16] == c16 || m[16] == (c16 ^ 0x20)))
 
+/*
+ * Command families that the latency of requests is also kept by. Memcache
+ * commands fall in the key and string families, redis hyperloglogs in the
+ * string family and geo sets in the sorted set family, as that is what they
+ * are stored as.
+ */
+typedef enum msg_family {
+    MSG_FAMILY_NONE,      /* no family: ping, auth... */
+    MSG_FAMILY_KEY,       /* key commands: del, expire, ttl... */
+    MSG_FAMILY_STRING,    /* string commands: get, set, incr... */
+    MSG_FAMILY_HASH,      /* hash commands */
+    MSG_FAMILY_LIST,      /* list commands */
+    MSG_FAMILY_SET,       /* set commands */
+    MSG_FAMILY_ZSET,      /* sorted set and geo commands */
+    MSG_FAMILY_SCRIPT     /* eval and evalsha */
+} msg_family_t;
+
 void memcache_parse_req(struct msg *r);
 void memcache_parse_rsp(struct msg *r);
 bool memcache_failure(const struct msg *r);
+bool memcache_readonly(const struct msg *r);
+msg_family_t memcache_family(const struct msg *r);
 void memcache_pre_coalesce(struct msg *r);
 void memcache_post_coalesce(struct msg *r);
+rstatus_t memcache_batch(struct msg *r);
+rstatus_t memcache_unbatch(struct msg *r, uint32_t idx, struct msg *rsp);
 rstatus_t memcache_add_auth(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
 rstatus_t memcache_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq);
 rstatus_t memcache_reply(struct msg *r);
 void memcache_post_connect(struct context *ctx, struct conn *conn, struct server *server);
 void memcache_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg);
+bool memcache_redirect(struct context *ctx, struct conn *conn, struct msg *pmsg, struct msg *msg);
 
+rstatus_t redis_init(void);
 void redis_parse_req(struct msg *r);
 void redis_parse_rsp(struct msg *r);
 bool redis_failure(const struct msg *r);
+bool redis_readonly(const struct msg *r);
+msg_family_t redis_family(const struct msg *r);
 void redis_pre_coalesce(struct msg *r);
 void redis_post_coalesce(struct msg *r);
+rstatus_t redis_batch(struct msg *r);
+rstatus_t redis_unbatch(struct msg *r, uint32_t idx, struct msg *rsp);
 rstatus_t redis_add_auth(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
 rstatus_t redis_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq);
 rstatus_t redis_reply(struct msg *r);
 void redis_post_connect(struct context *ctx, struct conn *conn, struct server *server);
 void redis_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg);
+bool redis_redirect(struct context *ctx, struct conn *conn, struct msg *pmsg, struct msg *msg);
 
 #endif
@@ -21,6 +21,7 @@
 
 #include <nc_core.h>
 #include <nc_proto.h>
+#include <hashkit/nc_hashkit.h>
 
 #define RSP_STRING(ACTION)                                                          \
     ACTION( ok,               "+OK\r\n"                                           ) \
@@ -33,8 +34,192 @@
     RSP_STRING( DEFINE_ACTION )
 #undef DEFINE_ACTION
 
+#define REDIS_CLUSTER_REFRESH   1000000LL   /* min usec between slot map refreshes */
+#define REDIS_CLUSTER_REDIRECT  5           /* max # redirects followed per request */
+
 static rstatus_t redis_handle_auth_req(struct msg *request, struct msg *response);
 
+/*
+ * Commands recognized by redis_parse_req(), keyed by their lower case name,
+ * with the family they are counted in by the latency stats
+ */
+#define REDIS_COMMAND_CODEC(ACTION)                                    \
+    ACTION( "get",               REQ_REDIS_GET,              STRING  ) \
+    ACTION( "set",               REQ_REDIS_SET,              STRING  ) \
+    ACTION( "ttl",               REQ_REDIS_TTL,              KEY     ) \
+    ACTION( "del",               REQ_REDIS_DEL,              KEY     ) \
+    ACTION( "pttl",              REQ_REDIS_PTTL,             KEY     ) \
+    ACTION( "decr",              REQ_REDIS_DECR,             STRING  ) \
+    ACTION( "dump",              REQ_REDIS_DUMP,             STRING  ) \
+    ACTION( "hdel",              REQ_REDIS_HDEL,             HASH    ) \
+    ACTION( "hget",              REQ_REDIS_HGET,             HASH    ) \
+    ACTION( "hlen",              REQ_REDIS_HLEN,             HASH    ) \
+    ACTION( "hset",              REQ_REDIS_HSET,             HASH    ) \
+    ACTION( "incr",              REQ_REDIS_INCR,             STRING  ) \
+    ACTION( "llen",              REQ_REDIS_LLEN,             LIST    ) \
+    ACTION( "lpop",              REQ_REDIS_LPOP,             LIST    ) \
+    ACTION( "lpos",              REQ_REDIS_LPOS,             LIST    ) \
+    ACTION( "lrem",              REQ_REDIS_LREM,             LIST    ) \
+    ACTION( "lset",              REQ_REDIS_LSET,             LIST    ) \
+    ACTION( "rpop",              REQ_REDIS_RPOP,             LIST    ) \
+    ACTION( "sadd",              REQ_REDIS_SADD,             SET     ) \
+    ACTION( "spop",              REQ_REDIS_SPOP,             SET     ) \
+    ACTION( "srem",              REQ_REDIS_SREM,             SET     ) \
+    ACTION( "type",              REQ_REDIS_TYPE,             KEY     ) \
+    ACTION( "mget",              REQ_REDIS_MGET,             STRING  ) \
+    ACTION( "mset",              REQ_REDIS_MSET,             STRING  ) \
+    ACTION( "zadd",              REQ_REDIS_ZADD,             ZSET    ) \
+    ACTION( "zrem",              REQ_REDIS_ZREM,             ZSET    ) \
+    ACTION( "eval",              REQ_REDIS_EVAL,             SCRIPT  ) \
+    ACTION( "sort",              REQ_REDIS_SORT,             KEY     ) \
+    ACTION( "ping",              REQ_REDIS_PING,             NONE    ) \
+    ACTION( "quit",              REQ_REDIS_QUIT,             NONE    ) \
+    ACTION( "auth",              REQ_REDIS_AUTH,             NONE    ) \
+    ACTION( "move",              REQ_REDIS_MOVE,             KEY     ) \
+    ACTION( "copy",              REQ_REDIS_COPY,             KEY     ) \
+    ACTION( "hkeys",             REQ_REDIS_HKEYS,            HASH    ) \
+    ACTION( "hmget",             REQ_REDIS_HMGET,            HASH    ) \
+    ACTION( "hmset",             REQ_REDIS_HMSET,            HASH    ) \
+    ACTION( "hvals",             REQ_REDIS_HVALS,            HASH    ) \
+    ACTION( "hscan",             REQ_REDIS_HSCAN,            HASH    ) \
+    ACTION( "lpush",             REQ_REDIS_LPUSH,            LIST    ) \
+    ACTION( "ltrim",             REQ_REDIS_LTRIM,            LIST    ) \
+    ACTION( "rpush",             REQ_REDIS_RPUSH,            LIST    ) \
+    ACTION( "scard",             REQ_REDIS_SCARD,            SET     ) \
+    ACTION( "sdiff",             REQ_REDIS_SDIFF,            SET     ) \
+    ACTION( "setex",             REQ_REDIS_SETEX,            STRING  ) \
+    ACTION( "setnx",             REQ_REDIS_SETNX,            STRING  ) \
+    ACTION( "smove",             REQ_REDIS_SMOVE,            SET     ) \
+    ACTION( "sscan",             REQ_REDIS_SSCAN,            SET     ) \
+    ACTION( "zcard",             REQ_REDIS_ZCARD,            ZSET    ) \
+    ACTION( "zdiff",             REQ_REDIS_ZDIFF,            ZSET    ) \
+    ACTION( "zrank",             REQ_REDIS_ZRANK,            ZSET    ) \
+    ACTION( "zscan",             REQ_REDIS_ZSCAN,            ZSET    ) \
+    ACTION( "pfadd",             REQ_REDIS_PFADD,            STRING  ) \
+    ACTION( "getex",             REQ_REDIS_GETEX,            STRING  ) \
+    ACTION( "touch",             REQ_REDIS_TOUCH,            KEY     ) \
+    ACTION( "lmove",             REQ_REDIS_LMOVE,            LIST    ) \
+    ACTION( "append",            REQ_REDIS_APPEND,           STRING  ) \
+    ACTION( "bitpos",            REQ_REDIS_BITPOS,           STRING  ) \
+    ACTION( "decrby",            REQ_REDIS_DECRBY,           STRING  ) \
+    ACTION( "exists",            REQ_REDIS_EXISTS,           KEY     ) \
+    ACTION( "expire",            REQ_REDIS_EXPIRE,           KEY     ) \
+    ACTION( "getbit",            REQ_REDIS_GETBIT,           STRING  ) \
+    ACTION( "getset",            REQ_REDIS_GETSET,           STRING  ) \
+    ACTION( "psetex",            REQ_REDIS_PSETEX,           STRING  ) \
+    ACTION( "hsetnx",            REQ_REDIS_HSETNX,           HASH    ) \
+    ACTION( "incrby",            REQ_REDIS_INCRBY,           STRING  ) \
+    ACTION( "lindex",            REQ_REDIS_LINDEX,           LIST    ) \
+    ACTION( "lpushx",            REQ_REDIS_LPUSHX,           LIST    ) \
+    ACTION( "lrange",            REQ_REDIS_LRANGE,           LIST    ) \
+    ACTION( "rpushx",            REQ_REDIS_RPUSHX,           LIST    ) \
+    ACTION( "setbit",            REQ_REDIS_SETBIT,           STRING  ) \
+    ACTION( "sinter",            REQ_REDIS_SINTER,           SET     ) \
+    ACTION( "strlen",            REQ_REDIS_STRLEN,           STRING  ) \
+    ACTION( "sunion",            REQ_REDIS_SUNION,           SET     ) \
+    ACTION( "zcount",            REQ_REDIS_ZCOUNT,           ZSET    ) \
+    ACTION( "zrange",            REQ_REDIS_ZRANGE,           ZSET    ) \
+    ACTION( "zscore",            REQ_REDIS_ZSCORE,           ZSET    ) \
+    ACTION( "geopos",            REQ_REDIS_GEOPOS,           ZSET    ) \
+    ACTION( "geoadd",            REQ_REDIS_GEOADD,           ZSET    ) \
+    ACTION( "getdel",            REQ_REDIS_GETDEL,           STRING  ) \
+    ACTION( "zunion",            REQ_REDIS_ZUNION,           ZSET    ) \
+    ACTION( "zinter",            REQ_REDIS_ZINTER,           ZSET    ) \
+    ACTION( "unlink",            REQ_REDIS_UNLINK,           KEY     ) \
+    ACTION( "lolwut",            REQ_REDIS_LOLWUT,           NONE    ) \
+    ACTION( "persist",           REQ_REDIS_PERSIST,          KEY     ) \
+    ACTION( "pexpire",           REQ_REDIS_PEXPIRE,          KEY     ) \
+    ACTION( "hexists",           REQ_REDIS_HEXISTS,          HASH    ) \
+    ACTION( "hgetall",           REQ_REDIS_HGETALL,          HASH    ) \
+    ACTION( "hincrby",           REQ_REDIS_HINCRBY,          HASH    ) \
+    ACTION( "linsert",           REQ_REDIS_LINSERT,          LIST    ) \
+    ACTION( "zincrby",           REQ_REDIS_ZINCRBY,          ZSET    ) \
+    ACTION( "evalsha",           REQ_REDIS_EVALSHA,          SCRIPT  ) \
+    ACTION( "restore",           REQ_REDIS_RESTORE,          STRING  ) \
+    ACTION( "pfcount",           REQ_REDIS_PFCOUNT,          STRING  ) \
+    ACTION( "pfmerge",           REQ_REDIS_PFMERGE,          STRING  ) \
+    ACTION( "zmscore",           REQ_REDIS_ZMSCORE,          ZSET    ) \
+    ACTION( "zpopmin",           REQ_REDIS_ZPOPMIN,          ZSET    ) \
+    ACTION( "zpopmax",           REQ_REDIS_ZPOPMAX,          ZSET    ) \
+    ACTION( "geodist",           REQ_REDIS_GEODIST,          ZSET    ) \
+    ACTION( "geohash",           REQ_REDIS_GEOHASH,          ZSET    ) \
+    ACTION( "hstrlen",           REQ_REDIS_HSTRLEN,          HASH    ) \
+    ACTION( "command",           REQ_REDIS_COMMAND,          NONE    ) \
+    ACTION( "expireat",          REQ_REDIS_EXPIREAT,         KEY     ) \
+    ACTION( "bitcount",          REQ_REDIS_BITCOUNT,         STRING  ) \
+    ACTION( "getrange",          REQ_REDIS_GETRANGE,         STRING  ) \
+    ACTION( "setrange",          REQ_REDIS_SETRANGE,         STRING  ) \
+    ACTION( "smembers",          REQ_REDIS_SMEMBERS,         SET     ) \
+    ACTION( "zrevrank",          REQ_REDIS_ZREVRANK,         ZSET    ) \
+    ACTION( "bitfield",          REQ_REDIS_BITFIELD,         STRING  ) \
+    ACTION( "pexpireat",         REQ_REDIS_PEXPIREAT,        KEY     ) \
+    ACTION( "rpoplpush",         REQ_REDIS_RPOPLPUSH,        LIST    ) \
+    ACTION( "sismember",         REQ_REDIS_SISMEMBER,        SET     ) \
+    ACTION( "zrevrange",         REQ_REDIS_ZREVRANGE,        ZSET    ) \
+    ACTION( "zlexcount",         REQ_REDIS_ZLEXCOUNT,        ZSET    ) \
+    ACTION( "geosearch",         REQ_REDIS_GEOSEARCH,        ZSET    ) \
+    ACTION( "georadius",         REQ_REDIS_GEORADIUS,        ZSET    ) \
+    ACTION( "sdiffstore",        REQ_REDIS_SDIFFSTORE,       SET     ) \
+    ACTION( "hrandfield",        REQ_REDIS_HRANDFIELD,       HASH    ) \
+    ACTION( "smismember",        REQ_REDIS_SMISMEMBER,       SET     ) \
+    ACTION( "zdiffstore",        REQ_REDIS_ZDIFFSTORE,       ZSET    ) \
+    ACTION( "incrbyfloat",       REQ_REDIS_INCRBYFLOAT,      STRING  ) \
+    ACTION( "sinterstore",       REQ_REDIS_SINTERSTORE,      SET     ) \
+    ACTION( "srandmember",       REQ_REDIS_SRANDMEMBER,      SET     ) \
+    ACTION( "sunionstore",       REQ_REDIS_SUNIONSTORE,      SET     ) \
+    ACTION( "zinterstore",       REQ_REDIS_ZINTERSTORE,      ZSET    ) \
+    ACTION( "zunionstore",       REQ_REDIS_ZUNIONSTORE,      ZSET    ) \
+    ACTION( "zrangebylex",       REQ_REDIS_ZRANGEBYLEX,      ZSET    ) \
+    ACTION( "zrandmember",       REQ_REDIS_ZRANDMEMBER,      ZSET    ) \
+    ACTION( "zrangestore",       REQ_REDIS_ZRANGESTORE,      ZSET    ) \
+    ACTION( "hincrbyfloat",      REQ_REDIS_HINCRBYFLOAT,     HASH    ) \
+    ACTION( "zrangebyscore",     REQ_REDIS_ZRANGEBYSCORE,    ZSET    ) \
+    ACTION( "zremrangebylex",    REQ_REDIS_ZREMRANGEBYLEX,   ZSET    ) \
+    ACTION( "zrevrangebylex",    REQ_REDIS_ZREVRANGEBYLEX,   ZSET    ) \
+    ACTION( "geosearchstore",    REQ_REDIS_GEOSEARCHSTORE,   ZSET    ) \
+    ACTION( "zremrangebyrank",   REQ_REDIS_ZREMRANGEBYRANK,  ZSET    ) \
+    ACTION( "zremrangebyscore",  REQ_REDIS_ZREMRANGEBYSCORE, ZSET    ) \
+    ACTION( "zrevrangebyscore",  REQ_REDIS_ZREVRANGEBYSCORE, ZSET    ) \
+    ACTION( "georadiusbymember", REQ_REDIS_GEORADIUSBYMEMBER, ZSET    ) \
+
+#define REDIS_COMMAND_MAX_LEN   24
+#define REDIS_COMMAND_NWORD     (REDIS_COMMAND_MAX_LEN / sizeof(uint64_t))
+#define REDIS_COMMAND_HASH_BITS 12
+#define REDIS_COMMAND_HASH_SIZE (1 << REDIS_COMMAND_HASH_BITS)
+#define REDIS_COMMAND_MAX_SEED  (1 << 20)
+
+struct redis_command {
+    uint64_t   word[REDIS_COMMAND_NWORD]; /* folded name */
+    size_t     len;                       /* name length */
+    msg_type_t type;                      /* request type */
+};
+
+#define DEFINE_ACTION(_name, _type, _family) { { 0 }, sizeof(_name) - 1, MSG_##_type },
+static struct redis_command redis_commands[] = {
+    REDIS_COMMAND_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _type, _family) _name,
+static const char *redis_command_names[] = {
+    REDIS_COMMAND_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _type, _family) [MSG_##_type] = MSG_FAMILY_##_family,
+static const msg_family_t redis_command_families[MSG_SENTINEL] = {
+    REDIS_COMMAND_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+/*
+ * Perfect hash table mapping the hash of a folded command name to one
+ * plus its index in redis_commands[], or to 0 if no command hashes there
+ */
+static uint8_t redis_command_slot[REDIS_COMMAND_HASH_SIZE];
+static uint64_t redis_command_seed;
+static bool redis_command_ready;
+
 /*
  * Return true, if the redis command take no key, otherwise
  * return false
@@ -388,6 +573,8 @@ redis_error(const struct msg *r)
     case MSG_RSP_REDIS_ERROR_EXECABORT:
     case MSG_RSP_REDIS_ERROR_MASTERDOWN:
     case MSG_RSP_REDIS_ERROR_NOREPLICAS:
+    case MSG_RSP_REDIS_ERROR_MOVED:
+    case MSG_RSP_REDIS_ERROR_ASK:
         return true;
 
     default:
@@ -421,6 +608,133 @@ redis_error(const struct msg *r)
  *
  * Nutcracker only supports the Redis unified protocol for requests.
  */
+/*
+ * Fold the name in [m, m + len) into words for comparison and hashing.
+ * Or-ing 0x20 into a byte maps upper case letters to lower case and keeps
+ * lower case letters as they are, while no other byte maps onto a letter.
+ * So for command names, which are made up of letters only, comparing the
+ * folded words of two names of equal length is a case-insensitive compare.
+ */
+static bool
+redis_command_fold(const uint8_t *m, size_t len, uint64_t *word)
+{
+    uint8_t buf[REDIS_COMMAND_MAX_LEN];
+    uint32_t i;
+
+    if (len > REDIS_COMMAND_MAX_LEN) {
+        return false;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    nc_memcpy(buf, m, len);
+
+    for (i = 0; i < REDIS_COMMAND_NWORD; i++) {
+        nc_memcpy(&word[i], &buf[i * sizeof(uint64_t)], sizeof(uint64_t));
+        word[i] |= 0x2020202020202020ULL;
+    }
+
+    return true;
+}
+
+static uint32_t
+redis_command_hash(const uint64_t *word, size_t len, uint64_t seed)
+{
+    uint64_t h;
+
+    h = (word[0] ^ seed) * 0x9e3779b97f4a7c15ULL;
+    h ^= (word[1] + len) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= word[2] * 0x165667b19e3779f9ULL;
+
+    return (uint32_t)(h >> (64 - REDIS_COMMAND_HASH_BITS));
+}
+
+/*
+ * Build the command lookup table by searching for a seed under which the
+ * hashes of all command names are distinct. Must be called before any
+ * request is parsed and before worker threads are started.
+ */
+rstatus_t
+redis_init(void)
+{
+    uint32_t i, idx, ncommand;
+    uint64_t seed;
+
+    if (redis_command_ready) {
+        return NC_OK;
+    }
+
+    ncommand = NELEMS(redis_commands);
+    ASSERT(ncommand < UINT8_MAX);
+
+    for (i = 0; i < ncommand; i++) {
+        struct redis_command *cmd = &redis_commands[i];
+
+        if (!redis_command_fold((const uint8_t *)redis_command_names[i],
+                                cmd->len, cmd->word)) {
+            log_error("redis: command '%s' exceeds %d bytes",
+                      redis_command_names[i], REDIS_COMMAND_MAX_LEN);
+            return NC_ERROR;
+        }
+    }
+
+    for (seed = 0; seed < REDIS_COMMAND_MAX_SEED; seed++) {
+        memset(redis_command_slot, 0, sizeof(redis_command_slot));
+
+        for (i = 0; i < ncommand; i++) {
+            struct redis_command *cmd = &redis_commands[i];
+
+            idx = redis_command_hash(cmd->word, cmd->len, seed);
+            if (redis_command_slot[idx] != 0) {
+                break;
+            }
+            redis_command_slot[idx] = (uint8_t)(i + 1);
+        }
+
+        if (i == ncommand) {
+            redis_command_seed = seed;
+            redis_command_ready = true;
+            log_debug(LOG_VVERB, "redis command table of %"PRIu32" commands "
+                      "uses seed %"PRIu64, ncommand, seed);
+            return NC_OK;
+        }
+    }
+
+    log_error("redis: no perfect hash found for %"PRIu32" commands", ncommand);
+
+    return NC_ERROR;
+}
+
+/*
+ * Return the request type of the command name in [m, m + len), or
+ * MSG_UNKNOWN if it is not a supported command
+ */
+static msg_type_t
+redis_command_lookup(const uint8_t *m, size_t len)
+{
+    uint64_t word[REDIS_COMMAND_NWORD];
+    const struct redis_command *cmd;
+    uint8_t slot;
+
+    ASSERT(redis_command_ready);
+
+    if (!redis_command_fold(m, len, word)) {
+        return MSG_UNKNOWN;
+    }
+
+    slot = redis_command_slot[redis_command_hash(word, len, redis_command_seed)];
+    if (slot == 0) {
+        return MSG_UNKNOWN;
+    }
+
+    cmd = &redis_commands[slot - 1];
+    if (cmd->len != len || cmd->word[0] != word[0] ||
+        cmd->word[1] != word[1] || cmd->word[2] != word[2]) {
+        return MSG_UNKNOWN;
+    }
+
+    return cmd->type;
+}
+
 void
 redis_parse_req(struct msg *r)
 {
@@ -574,865 +888,143 @@ redis_parse_req(struct msg *r)
             r->rlen = 0;
             m = r->token;
             r->token = NULL;
-            r->type = MSG_UNKNOWN;
-
-            switch (p - m) {
-
-            case 3:
-                if (str3icmp(m, 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_GET;
-                    break;
-                }
-
-                if (str3icmp(m, 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_SET;
-                    break;
-                }
-
-                if (str3icmp(m, 't', 't', 'l')) {
-                    r->type = MSG_REQ_REDIS_TTL;
-                    break;
-                }
-
-                if (str3icmp(m, 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_DEL;
-                    break;
-                }
+            r->type = redis_command_lookup(m, (size_t)(p - m));
 
+            switch (r->type) {
+            case MSG_REQ_REDIS_PING:
+            case MSG_REQ_REDIS_AUTH:
+            case MSG_REQ_REDIS_MOVE:
+                r->noforward = 1;
                 break;
 
-            case 4:
-                if (str4icmp(m, 'p', 't', 't', 'l')) {
-                    r->type = MSG_REQ_REDIS_PTTL;
-                    break;
-                }
-
-                if (str4icmp(m, 'd', 'e', 'c', 'r')) {
-                    r->type = MSG_REQ_REDIS_DECR;
-                    break;
-                }
-
-                if (str4icmp(m, 'd', 'u', 'm', 'p')) {
-                    r->type = MSG_REQ_REDIS_DUMP;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_HDEL;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HGET;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_HLEN;
-                    break;
-                }
-
-                if (str4icmp(m, 'h', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HSET;
-                    break;
-                }
-
-                if (str4icmp(m, 'i', 'n', 'c', 'r')) {
-                    r->type = MSG_REQ_REDIS_INCR;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_LLEN;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_LPOP;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'p', 'o', 's')) {
-                    r->type = MSG_REQ_REDIS_LPOS;
-                    break;
-                }
-
-                if (str4icmp(m, 'l', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_LREM;
-                    break;
-                }
+            case MSG_REQ_REDIS_QUIT:
+                r->quit = 1;
+                break;
 
-                if (str4icmp(m, 'l', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_LSET;
-                    break;
+            case MSG_REQ_REDIS_LOLWUT:
+            case MSG_REQ_REDIS_COMMAND:
+                if (!msg_set_placeholder_key(r)) {
+                    goto enomem;
                 }
+                break;
 
-                if (str4icmp(m, 'r', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_RPOP;
-                    break;
-                }
+            default:
+                break;
+            }
 
-                if (str4icmp(m, 's', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_SADD;
-                    break;
-                }
+            if (r->type == MSG_UNKNOWN) {
+                log_error("parsed unsupported command '%.*s'", (int)(p - m), m);
+                goto error;
+            }
 
-                if (str4icmp(m, 's', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_SPOP;
-                    break;
-                }
+            log_debug(LOG_VERB, "parsed command '%.*s'", (int)(p - m), m);
 
-                if (str4icmp(m, 's', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_SREM;
-                    break;
-                }
+            state = SW_REQ_TYPE_LF;
+            break;
 
-                if (str4icmp(m, 't', 'y', 'p', 'e')) {
-                    r->type = MSG_REQ_REDIS_TYPE;
-                    break;
+        case SW_REQ_TYPE_LF:
+            switch (ch) {
+            case LF:
+                if (redis_argz(r)) {
+                    if (r->narg != 1) {
+                        /* It's an error to provide more than one argument. */
+                        goto error;
+                    }
+                    goto done;
+                } else if (redis_nokey(r)) {
+                    if (r->narg == 1) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else if (r->narg == 1) {
+                    goto error;
+                } else if (redis_argeval(r)) {
+                    state = SW_ARG1_LEN;
+                } else {
+                    state = SW_KEY_LEN;
                 }
+                break;
 
-                if (str4icmp(m, 'm', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_MGET;
-                    break;
-                }
-                if (str4icmp(m, 'm', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_MSET;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str4icmp(m, 'z', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_ZADD;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'z', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_ZREM;
-                    break;
+        case SW_KEY_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str4icmp(m, 'e', 'v', 'a', 'l')) {
-                    r->type = MSG_REQ_REDIS_EVAL;
-                    break;
+                r->token = p;
+                r->rlen = 0;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if (r->rlen >= mbuf_data_size()) {
+                    log_error("parsed bad req %"PRIu64" of type %d with key "
+                              "length %d that greater than or equal to maximum"
+                              " redis key length of %zu", r->id, r->type,
+                              r->rlen, mbuf_data_size());
+                    goto error;
                 }
-
-                if (str4icmp(m, 's', 'o', 'r', 't')) {
-                    r->type = MSG_REQ_REDIS_SORT;
-                    break;
+                if (r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_KEY_LEN_LF;
+            } else {
+                goto error;
+            }
 
-                if (str4icmp(m, 'p', 'i', 'n', 'g')) {
-                    r->type = MSG_REQ_REDIS_PING;
-                    r->noforward = 1;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'q', 'u', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_QUIT;
-                    r->quit = 1;
-                    break;
-                }
+        case SW_KEY_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_KEY;
+                break;
 
-                if (str4icmp(m, 'a', 'u', 't', 'h')) {
-                    r->type = MSG_REQ_REDIS_AUTH;
-                    r->noforward = 1;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str4icmp(m, 'm', 'o', 'v', 'e')) {
-                    r->type = MSG_REQ_REDIS_MOVE;
-                    r->noforward = 1;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'c', 'o', 'p', 'y')) {
-                    r->type = MSG_REQ_REDIS_COPY;
-                    break;
-                }
+        case SW_KEY:
+            if (r->token == NULL) {
+                r->token = p;
+            }
 
+            m = r->token + r->rlen;
+            if (m >= b->last) {
+                m = b->last - 1;
+                p = m;
                 break;
+            }
 
-            case 5:
-                if (str5icmp(m, 'h', 'k', 'e', 'y', 's')) {
-                    r->type = MSG_REQ_REDIS_HKEYS;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'm', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HMGET;
-                    break;
-                }
+            if (*m != CR) {
+                goto error;
+            } else {        /* got a key */
+                struct keypos *kpos;
 
-                if (str5icmp(m, 'h', 'm', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HMSET;
-                    break;
-                }
+                p = m;      /* move forward by rlen bytes */
+                r->rlen = 0;
+                m = r->token;
+                r->token = NULL;
 
-                if (str5icmp(m, 'h', 'v', 'a', 'l', 's')) {
-                    r->type = MSG_REQ_REDIS_HVALS;
-                    break;
+                kpos = array_push(r->keys);
+                if (kpos == NULL) {
+                    goto enomem;
                 }
+                kpos->start = m;
+                kpos->end = p;
 
-                if (str5icmp(m, 'h', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_HSCAN;
-                    break;
-                }
+                state = SW_KEY_LF;
+            }
 
-                if (str5icmp(m, 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_LPUSH;
-                    break;
-                }
-
-                if (str5icmp(m, 'l', 't', 'r', 'i', 'm')) {
-                    r->type = MSG_REQ_REDIS_LTRIM;
-                    break;
-                }
-
-                if (str5icmp(m, 'r', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_RPUSH;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'c', 'a', 'r', 'd')) {
-                    r->type = MSG_REQ_REDIS_SCARD;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'd', 'i', 'f', 'f')) {
-                    r->type = MSG_REQ_REDIS_SDIFF;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_SETEX;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_SETNX;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'm', 'o', 'v', 'e')) {
-                    r->type = MSG_REQ_REDIS_SMOVE;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_SSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'c', 'a', 'r', 'd')) {
-                    r->type = MSG_REQ_REDIS_ZCARD;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'd', 'i', 'f', 'f')) {
-                    r->type = MSG_REQ_REDIS_ZDIFF;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZRANK;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_ZSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'p', 'f', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_PFADD;
-                    break;
-                }
-
-                if (str5icmp(m, 'g', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_GETEX;
-                    break;
-                }
-
-                if (str5icmp(m, 't', 'o', 'u', 'c', 'h')) {
-                    r->type = MSG_REQ_REDIS_TOUCH;
-                    break;
-                }
-
-                if (str5icmp(m, 'l', 'm', 'o', 'v', 'e')) {
-                    r->type = MSG_REQ_REDIS_LMOVE;
-                    break;
-                }
-
-                break;
-
-            case 6:
-                if (str6icmp(m, 'a', 'p', 'p', 'e', 'n', 'd')) {
-                    r->type = MSG_REQ_REDIS_APPEND;
-                    break;
-                }
-
-                if (str6icmp(m, 'b', 'i', 't', 'p', 'o', 's')) {
-                    r->type = MSG_REQ_REDIS_BITPOS;
-                    break;
-                }
-
-                if (str6icmp(m, 'd', 'e', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_DECRBY;
-                    break;
-                }
-
-                if (str6icmp(m, 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = MSG_REQ_REDIS_EXISTS;
-                    break;
-                }
-
-                if (str6icmp(m, 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_EXPIRE;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 'b', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_GETBIT;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_GETSET;
-                    break;
-                }
-
-                if (str6icmp(m, 'p', 's', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_PSETEX;
-                    break;
-                }
-
-                if (str6icmp(m, 'h', 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_HSETNX;
-                    break;
-                }
-
-                if (str6icmp(m, 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_INCRBY;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'i', 'n', 'd', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_LINDEX;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = MSG_REQ_REDIS_LPUSHX;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_LRANGE;
-                    break;
-                }
-
-                if (str6icmp(m, 'r', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = MSG_REQ_REDIS_RPUSHX;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'e', 't', 'b', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_SETBIT;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'i', 'n', 't', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SINTER;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 't', 'r', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_STRLEN;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'u', 'n', 'i', 'o', 'n')) {
-                    r->type = MSG_REQ_REDIS_SUNION;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_ZCOUNT;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGE;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZSCORE;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 'o', 'p', 'o', 's')) {
-                    r->type = MSG_REQ_REDIS_GEOPOS;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 'o', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_GEOADD;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_GETDEL;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'u', 'n', 'i', 'o', 'n')) {
-                    r->type = MSG_REQ_REDIS_ZUNION;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'i', 'n', 't', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_ZINTER;
-                    break;
-                }
-
-                if (str6icmp(m, 'u', 'n', 'l', 'i', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_UNLINK;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'o', 'l', 'w', 'u', 't')) {
-                    r->type = MSG_REQ_REDIS_LOLWUT;
-                    if (!msg_set_placeholder_key(r)) {
-                        goto enomem;
-                    }
-                    break;
-                }
-
-                break;
-
-            case 7:
-                if (str7icmp(m, 'p', 'e', 'r', 's', 'i', 's', 't')) {
-                    r->type = MSG_REQ_REDIS_PERSIST;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_PEXPIRE;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = MSG_REQ_REDIS_HEXISTS;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'g', 'e', 't', 'a', 'l', 'l')) {
-                    r->type = MSG_REQ_REDIS_HGETALL;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_HINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'l', 'i', 'n', 's', 'e', 'r', 't')) {
-                    r->type = MSG_REQ_REDIS_LINSERT;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_ZINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'e', 'v', 'a', 'l', 's', 'h', 'a')) {
-                    r->type = MSG_REQ_REDIS_EVALSHA;
-                    break;
-                }
-
-                if (str7icmp(m, 'r', 'e', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_RESTORE;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_PFCOUNT;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'm', 'e', 'r', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_PFMERGE;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'm', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZMSCORE;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'p', 'o', 'p', 'm', 'i', 'n')) {
-                    r->type = MSG_REQ_REDIS_ZPOPMIN;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'p', 'o', 'p', 'm', 'a', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZPOPMAX;
-                    break;
-                }
-
-                if (str7icmp(m, 'g', 'e', 'o', 'd', 'i', 's', 't')) {
-                    r->type = MSG_REQ_REDIS_GEODIST;
-                    break;
-                }
-
-                if (str7icmp(m, 'g', 'e', 'o', 'h', 'a', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_GEOHASH;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 's', 't', 'r', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_HSTRLEN;
-                    break;
-                }
-
-                if (str7icmp(m, 'c', 'o', 'm', 'm', 'a', 'n', 'd')) {
-                    r->type = MSG_REQ_REDIS_COMMAND;
-                    if (!msg_set_placeholder_key(r)) {
-                        goto enomem;
-                    }
-                    break;
-                }
-
-                break;
-
-            case 8:
-                if (str8icmp(m, 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_EXPIREAT;
-                    break;
-                }
-
-                if (str8icmp(m, 'b', 'i', 't', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_BITCOUNT;
-                    break;
-                }
-
-                if (str8icmp(m, 'g', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_GETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_SETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'm', 'e', 'm', 'b', 'e', 'r', 's')) {
-                    r->type = MSG_REQ_REDIS_SMEMBERS;
-                    break;
-                }
-
-                if (str8icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANK;
-                    break;
-                }
-
-                if (str8icmp(m, 'b', 'i', 't', 'f', 'i', 'e', 'l', 'd')) {
-                    r->type = MSG_REQ_REDIS_BITFIELD;
-                    break;
-                }
-
-                break;
-
-            case 9:
-                if (str9icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_PEXPIREAT;
-                    break;
-                }
-
-                if (str9icmp(m, 'r', 'p', 'o', 'p', 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_RPOPLPUSH;
-                    break;
-                }
-
-                if (str9icmp(m, 's', 'i', 's', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SISMEMBER;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGE;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'l', 'e', 'x', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_ZLEXCOUNT;
-                    break;
-                }
-
-                if (str9icmp(m, 'g', 'e', 'o', 's', 'e', 'a', 'r', 'c', 'h')) {
-                    r->type = MSG_REQ_REDIS_GEOSEARCH;
-                    break;
-                }
-
-                if (str9icmp(m, 'g', 'e', 'o', 'r', 'a', 'd', 'i', 'u', 's')) {
-                    r->type = MSG_REQ_REDIS_GEORADIUS;
-                    break;
-                }
-
-                break;
-
-            case 10:
-                if (str10icmp(m, 's', 'd', 'i', 'f', 'f', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SDIFFSTORE;
-                    break;
-                }
-
-                if (str10icmp(m, 'h', 'r', 'a', 'n', 'd', 'f', 'i', 'e', 'l', 'd')) {
-                    r->type = MSG_REQ_REDIS_HRANDFIELD;
-                    break;
-                }
-
-                if (str10icmp(m, 's', 'm', 'i', 's', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SMISMEMBER;
-                    break;
-                }
-
-                if (str10icmp(m, 'z', 'd', 'i', 'f', 'f', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZDIFFSTORE;
-                    break;
-                }
-
-
-                break;
-
-            case 11:
-                if (str11icmp(m, 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_INCRBYFLOAT;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'r', 'a', 'n', 'd', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SRANDMEMBER;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZRANGEBYLEX;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'r', 'a', 'n', 'd', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_ZRANDMEMBER;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGESTORE;
-                    break;
-                }
-
-                break;
-
-            case 12:
-                if (str12icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_HINCRBYFLOAT;
-                    break;
-                }
-
-
-                break;
-
-            case 13:
-                if (str13icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGEBYSCORE;
-                    break;
-                }
-
-                break;
-
-            case 14:
-                if (str14icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYLEX;
-                    break;
-                }
-
-                if (str14icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGEBYLEX;
-                    break;
-                }
-                if (str14icmp(m, 'g', 'e', 'o', 's', 'e', 'a', 'r', 'c', 'h', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_GEOSEARCHSTORE;
-                    break;
-                }
-
-
-                break;
-
-            case 15:
-                if (str15icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYRANK;
-                    break;
-                }
-
-                break;
-
-            case 16:
-                if (str16icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYSCORE;
-                    break;
-                }
-
-                if (str16icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGEBYSCORE;
-                    break;
-                }
-                break;
-
-            case 17:
-                if (str17icmp(m, 'g', 'e', 'o', 'r', 'a', 'd', 'i', 'u', 's', 'b', 'y', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_GEORADIUSBYMEMBER;
-                    break;
-                }
-
-            default:
-                break;
-            }
-
-            if (r->type == MSG_UNKNOWN) {
-                log_error("parsed unsupported command '%.*s'", (int)(p - m), m);
-                goto error;
-            }
-
-            log_debug(LOG_VERB, "parsed command '%.*s'", (int)(p - m), m);
-
-            state = SW_REQ_TYPE_LF;
-            break;
-
-        case SW_REQ_TYPE_LF:
-            switch (ch) {
-            case LF:
-                if (redis_argz(r)) {
-                    if (r->narg != 1) {
-                        /* It's an error to provide more than one argument. */
-                        goto error;
-                    }
-                    goto done;
-                } else if (redis_nokey(r)) {
-                    if (r->narg == 1) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else if (r->narg == 1) {
-                    goto error;
-                } else if (redis_argeval(r)) {
-                    state = SW_ARG1_LEN;
-                } else {
-                    state = SW_KEY_LEN;
-                }
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_KEY_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->token = p;
-                r->rlen = 0;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if (r->rlen >= mbuf_data_size()) {
-                    log_error("parsed bad req %"PRIu64" of type %d with key "
-                              "length %d that greater than or equal to maximum"
-                              " redis key length of %zu", r->id, r->type,
-                              r->rlen, mbuf_data_size());
-                    goto error;
-                }
-                if (r->rnarg == 0) {
-                    goto error;
-                }
-                r->rnarg--;
-                r->token = NULL;
-                state = SW_KEY_LEN_LF;
-            } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_KEY_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_KEY;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_KEY:
-            if (r->token == NULL) {
-                r->token = p;
-            }
-
-            m = r->token + r->rlen;
-            if (m >= b->last) {
-                m = b->last - 1;
-                p = m;
-                break;
-            }
-
-            if (*m != CR) {
-                goto error;
-            } else {        /* got a key */
-                struct keypos *kpos;
-
-                p = m;      /* move forward by rlen bytes */
-                r->rlen = 0;
-                m = r->token;
-                r->token = NULL;
-
-                kpos = array_push(r->keys);
-                if (kpos == NULL) {
-                    goto enomem;
-                }
-                kpos->start = m;
-                kpos->end = p;
-
-                state = SW_KEY_LF;
-            }
-
-            break;
+            break;
 
         case SW_KEY_LF:
             switch (ch) {
@@ -2083,6 +1675,12 @@ redis_parse_rsp(struct msg *r)
                         break;
                     }
 
+                    /* -ASK 3999 127.0.0.1:6381\r\n */
+                    if (str4cmp(m, '-', 'A', 'S', 'K')) {
+                        r->type = MSG_RSP_REDIS_ERROR_ASK;
+                        break;
+                    }
+
                     break;
 
                 case 5:
@@ -2094,6 +1692,15 @@ redis_parse_rsp(struct msg *r)
 
                     break;
 
+                case 6:
+                    /* -MOVED 3999 127.0.0.1:6381\r\n */
+                    if (str6cmp(m, '-', 'M', 'O', 'V', 'E', 'D')) {
+                        r->type = MSG_RSP_REDIS_ERROR_MOVED;
+                        break;
+                    }
+
+                    break;
+
                 case 7:
                     /* -NOAUTH Authentication required.\r\n */
                     if (str7cmp(m, '-', 'N', 'O', 'A', 'U', 'T', 'H')) {
@@ -2200,15 +1807,16 @@ redis_parse_rsp(struct msg *r)
             break;
 
         case SW_RUNTO_CRLF:
-            switch (ch) {
-            case CR:
-                state = SW_ALMOST_DONE;
-                break;
-
-            default:
+            /* jump to the CR that ends the line */
+            m = nc_memchr(p, CR, b->last - p);
+            if (m == NULL) {
+                p = b->last - 1;
                 break;
             }
 
+            p = m;
+            state = SW_ALMOST_DONE;
+
             break;
 
         case SW_ALMOST_DONE:
@@ -2556,6 +2164,93 @@ redis_failure(const struct msg *r)
     return false;
 }
 
+/*
+ * Return true, if the redis request only reads data, otherwise return
+ * false. Commands that can store their result, like SORT and GEORADIUS,
+ * are not read only.
+ */
+bool
+redis_readonly(const struct msg *r)
+{
+    ASSERT(r->request);
+
+    switch (r->type) {
+    case MSG_REQ_REDIS_EXISTS:
+    case MSG_REQ_REDIS_PTTL:
+    case MSG_REQ_REDIS_TTL:
+    case MSG_REQ_REDIS_TYPE:
+    case MSG_REQ_REDIS_BITCOUNT:
+    case MSG_REQ_REDIS_BITPOS:
+    case MSG_REQ_REDIS_DUMP:
+    case MSG_REQ_REDIS_GET:
+    case MSG_REQ_REDIS_GETBIT:
+    case MSG_REQ_REDIS_GETRANGE:
+    case MSG_REQ_REDIS_MGET:
+    case MSG_REQ_REDIS_STRLEN:
+    case MSG_REQ_REDIS_HEXISTS:
+    case MSG_REQ_REDIS_HGET:
+    case MSG_REQ_REDIS_HGETALL:
+    case MSG_REQ_REDIS_HKEYS:
+    case MSG_REQ_REDIS_HLEN:
+    case MSG_REQ_REDIS_HMGET:
+    case MSG_REQ_REDIS_HRANDFIELD:
+    case MSG_REQ_REDIS_HSCAN:
+    case MSG_REQ_REDIS_HSTRLEN:
+    case MSG_REQ_REDIS_HVALS:
+    case MSG_REQ_REDIS_LINDEX:
+    case MSG_REQ_REDIS_LLEN:
+    case MSG_REQ_REDIS_LPOS:
+    case MSG_REQ_REDIS_LRANGE:
+    case MSG_REQ_REDIS_PFCOUNT:
+    case MSG_REQ_REDIS_SCARD:
+    case MSG_REQ_REDIS_SDIFF:
+    case MSG_REQ_REDIS_SINTER:
+    case MSG_REQ_REDIS_SISMEMBER:
+    case MSG_REQ_REDIS_SMISMEMBER:
+    case MSG_REQ_REDIS_SMEMBERS:
+    case MSG_REQ_REDIS_SRANDMEMBER:
+    case MSG_REQ_REDIS_SUNION:
+    case MSG_REQ_REDIS_SSCAN:
+    case MSG_REQ_REDIS_ZCARD:
+    case MSG_REQ_REDIS_ZCOUNT:
+    case MSG_REQ_REDIS_ZDIFF:
+    case MSG_REQ_REDIS_ZINTER:
+    case MSG_REQ_REDIS_ZLEXCOUNT:
+    case MSG_REQ_REDIS_ZMSCORE:
+    case MSG_REQ_REDIS_ZRANDMEMBER:
+    case MSG_REQ_REDIS_ZRANGE:
+    case MSG_REQ_REDIS_ZRANGEBYLEX:
+    case MSG_REQ_REDIS_ZRANGEBYSCORE:
+    case MSG_REQ_REDIS_ZRANK:
+    case MSG_REQ_REDIS_ZREVRANGE:
+    case MSG_REQ_REDIS_ZREVRANGEBYLEX:
+    case MSG_REQ_REDIS_ZREVRANGEBYSCORE:
+    case MSG_REQ_REDIS_ZREVRANK:
+    case MSG_REQ_REDIS_ZUNION:
+    case MSG_REQ_REDIS_ZSCAN:
+    case MSG_REQ_REDIS_ZSCORE:
+    case MSG_REQ_REDIS_GEODIST:
+    case MSG_REQ_REDIS_GEOHASH:
+    case MSG_REQ_REDIS_GEOPOS:
+    case MSG_REQ_REDIS_GEOSEARCH:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+msg_family_t
+redis_family(const struct msg *r)
+{
+    ASSERT(r->request);
+    ASSERT(r->type < MSG_SENTINEL);
+
+    return redis_command_families[r->type];
+}
+
 /*
  * copy one bulk from src to dst
  *
@@ -2569,7 +2264,6 @@ redis_copy_bulk(struct msg *dst, struct msg *src)
     uint8_t *p;
     uint32_t len = 0;
     uint32_t bytes = 0;
-    rstatus_t status;
 
     for (mbuf = STAILQ_FIRST(&src->mhdr);
          mbuf && mbuf_empty(mbuf);
@@ -2615,10 +2309,12 @@ redis_copy_bulk(struct msg *dst, struct msg *src)
             mbuf = nbuf;
         } else {                             /* split it */
             if (dst != NULL) {
-                status = msg_append(dst, mbuf->pos, len);
-                if (status != NC_OK) {
-                    return status;
+                nbuf = mbuf_get();
+                if (nbuf == NULL) {
+                    return NC_ENOMEM;
                 }
+                mbuf_copy(nbuf, mbuf->pos, len);
+                mbuf_insert(&dst->mhdr, nbuf);
             }
             mbuf->pos += len;
             break;
@@ -2820,16 +2516,32 @@ redis_fragment_argx(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq,
 {
     struct mbuf *mbuf;
     struct msg **sub_msgs;
-    uint32_t i;
+    uint32_t *slots, nslot;
+    uint32_t i, nsub;
     rstatus_t status;
     struct array *keys = r->keys;
+    struct server_pool *pool = r->owner->owner;
 
     ASSERT(array_n(keys) == (r->narg - 1) / key_step);
 
-    sub_msgs = nc_zalloc(nserver * sizeof(*sub_msgs));
+    /*
+     * Redis cluster refuses multi-key commands whose keys hash to different
+     * slots, so for a redis_cluster pool keys are grouped by slot rather
+     * than by server. The slots seen so far are kept after the sub_msgs.
+     */
+    if (pool->dist_type == DIST_REDIS_CLUSTER) {
+        nsub = array_n(keys);
+        sub_msgs = nc_zalloc(nsub * (sizeof(*sub_msgs) + sizeof(*slots)));
+        slots = (uint32_t *)(sub_msgs + nsub);
+    } else {
+        nsub = nserver;
+        sub_msgs = nc_zalloc(nsub * sizeof(*sub_msgs));
+        slots = NULL;
+    }
     if (sub_msgs == NULL) {
         return NC_ENOMEM;
     }
+    nslot = 0;
 
     ASSERT(r->frag_seq == NULL);
     r->frag_seq = nc_alloc(array_n(keys) * sizeof(*r->frag_seq));
@@ -2862,8 +2574,24 @@ redis_fragment_argx(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq,
     for (i = 0; i < array_n(keys); i++) {        /* for each key */
         struct msg *sub_msg;
         struct keypos *kpos = array_get(keys, i);
-        uint32_t idx = msg_backend_idx(r, kpos->start, kpos->end - kpos->start);
-        ASSERT(idx < nserver);
+        uint32_t keylen = (uint32_t)(kpos->end - kpos->start);
+        uint32_t idx;
+
+        if (slots != NULL) {
+            uint32_t slot = server_pool_slot(pool, kpos->start, keylen);
+
+            for (idx = 0; idx < nslot; idx++) {
+                if (slots[idx] == slot) {
+                    break;
+                }
+            }
+            if (idx == nslot) {
+                slots[nslot++] = slot;
+            }
+        } else {
+            idx = msg_backend_idx(r, kpos->start, keylen);
+        }
+        ASSERT(idx < nsub);
 
         if (sub_msgs[idx] == NULL) {
             sub_msgs[idx] = msg_get(r->owner, r->request, r->redis);
@@ -2875,7 +2603,7 @@ redis_fragment_argx(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq,
         r->frag_seq[i] = sub_msg = sub_msgs[idx];
 
         sub_msg->narg++;
-        status = redis_append_key(sub_msg, kpos->start, kpos->end - kpos->start);
+        status = redis_append_key(sub_msg, kpos->start, keylen);
         if (status != NC_OK) {
             nc_free(sub_msgs);
             return status;
@@ -2904,7 +2632,7 @@ redis_fragment_argx(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq,
      * prepend mget header, and forward the command (command type+key(s)+suffix)
      * to the corresponding server(s)
      */
-    for (i = 0; i < nserver; i++) {
+    for (i = 0; i < nsub; i++) {
         struct msg *sub_msg = sub_msgs[i];
         if (sub_msg == NULL) {
             continue;
@@ -3047,45 +2775,118 @@ redis_post_coalesce_mget(struct msg *request)
         }
         status = redis_copy_bulk(response, sub_msg);
         if (status != NC_OK) {
-            response->owner->err = 1;
-            return;
+            response->owner->err = 1;
+            return;
+        }
+    }
+}
+
+/*
+ * Post-coalesce handler is invoked when the message is a response to
+ * the fragmented multi vector request - 'mget' or 'del' and all the
+ * responses to the fragmented request vector has been received and
+ * the fragmented request is consider to be done
+ */
+void
+redis_post_coalesce(struct msg *r)
+{
+    struct msg *pr = r->peer; /* peer response */
+
+    ASSERT(!pr->request);
+    ASSERT(r->request && (r->frag_owner == r));
+    if (r->error || r->ferror) {
+        /* do nothing, if msg is in error */
+        return;
+    }
+
+    switch (r->type) {
+    case MSG_REQ_REDIS_MGET:
+        return redis_post_coalesce_mget(r);
+
+    case MSG_REQ_REDIS_DEL:
+    case MSG_REQ_REDIS_TOUCH:
+    case MSG_REQ_REDIS_UNLINK:
+        return redis_post_coalesce_del_or_touch(r);
+
+    case MSG_REQ_REDIS_MSET:
+        return redis_post_coalesce_mset(r);
+
+    default:
+        NOT_REACHED();
+    }
+}
+
+/*
+ * Build batch r of the single key reads in r->frag_seq into an 'mget' of
+ * their keys, in the same order
+ */
+rstatus_t
+redis_batch(struct msg *r)
+{
+    rstatus_t status;
+    struct keypos *kpos;
+    uint32_t i;
+
+    ASSERT(r->request && r->is_batch);
+    ASSERT(r->type == MSG_REQ_REDIS_MGET);
+
+    for (i = 0; i < r->nfrag; i++) {
+        kpos = array_get(r->frag_seq[i]->keys, 0);
+
+        status = redis_append_key(r, kpos->start,
+                                  (uint32_t)(kpos->end - kpos->start));
+        if (status != NC_OK) {
+            return status;
         }
     }
+
+    status = msg_prepend_format(r, "*%d\r\n$4\r\nmget\r\n", r->nfrag + 1);
+    if (status != NC_OK) {
+        return status;
+    }
+    r->narg = r->nfrag + 1;
+
+    return NC_OK;
 }
 
 /*
- * Post-coalesce handler is invoked when the message is a response to
- * the fragmented multi vector request - 'mget' or 'del' and all the
- * responses to the fragmented request vector has been received and
- * the fragmented request is consider to be done
+ * Move the response to the idx-th read of batch r out of the response to
+ * r and into rsp. The reads are split in order, starting with idx 0, for
+ * which NC_ERROR is returned with nothing moved if the response to r is
+ * not a multi-bulk reply with a bulk for every read, like an error reply.
  */
-void
-redis_post_coalesce(struct msg *r)
+rstatus_t
+redis_unbatch(struct msg *r, uint32_t idx, struct msg *rsp)
 {
     struct msg *pr = r->peer; /* peer response */
+    struct mbuf *mbuf;
+    rstatus_t status;
 
-    ASSERT(!pr->request);
-    ASSERT(r->request && (r->frag_owner == r));
-    if (r->error || r->ferror) {
-        /* do nothing, if msg is in error */
-        return;
-    }
+    ASSERT(r->request && r->is_batch && idx < r->nfrag);
+    ASSERT(pr != NULL && !pr->request);
 
-    switch (r->type) {
-    case MSG_REQ_REDIS_MGET:
-        return redis_post_coalesce_mget(r);
+    if (idx == 0) {
+        if (pr->type != MSG_RSP_REDIS_MULTIBULK || pr->narg != r->nfrag) {
+            return NC_ERROR;
+        }
 
-    case MSG_REQ_REDIS_DEL:
-    case MSG_REQ_REDIS_TOUCH:
-    case MSG_REQ_REDIS_UNLINK:
-        return redis_post_coalesce_del_or_touch(r);
+        /* skip over the narg token, as for a response to a fragment */
+        mbuf = STAILQ_FIRST(&pr->mhdr);
+        ASSERT(pr->narg_start == mbuf->pos);
+        ASSERT(pr->narg_start < pr->narg_end);
 
-    case MSG_REQ_REDIS_MSET:
-        return redis_post_coalesce_mset(r);
+        pr->narg_end += CRLF_LEN;
+        pr->mlen -= (uint32_t)(pr->narg_end - pr->narg_start);
+        mbuf->pos = pr->narg_end;
+    }
 
-    default:
-        NOT_REACHED();
+    status = redis_copy_bulk(rsp, pr);
+    if (status != NC_OK) {
+        return status;
     }
+    rsp->type = MSG_RSP_REDIS_BULK;
+
+    return NC_OK;
 }
 
 static rstatus_t
@@ -3136,12 +2937,18 @@ redis_add_auth(struct context *ctx, struct conn *c_conn, struct conn *s_conn)
 {
     rstatus_t status;
     struct msg *msg;
+    struct server *server;
     struct server_pool *pool;
 
     ASSERT(!s_conn->client && !s_conn->proxy);
     ASSERT(!conn_authenticated(s_conn));
 
-    pool = c_conn->owner;
+    /*
+     * the password is that of the pool of the server, which is not the
+     * pool of the client for a mirrored request
+     */
+    server = s_conn->owner;
+    pool = server->owner;
 
     msg = msg_get(c_conn, true, c_conn->redis);
     if (msg == NULL) {
@@ -3163,6 +2970,234 @@ redis_add_auth(struct context *ctx, struct conn *c_conn, struct conn *s_conn)
     return NC_OK;
 }
 
+/*
+ * Queue a 'CLUSTER SLOTS' request on the server connection, unless the slot
+ * map of its pool was refreshed recently. The response is swallowed and
+ * loaded into the slot map by redis_swallow_msg()
+ */
+static void
+redis_cluster_refresh(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+    struct msg *msg;
+    int64_t now;
+
+    ASSERT(!conn->client && conn->connected);
+    ASSERT(pool->dist_type == DIST_REDIS_CLUSTER);
+
+    now = nc_usec_now();
+    if (now < pool->next_slots_refresh) {
+        return;
+    }
+    pool->next_slots_refresh = now + REDIS_CLUSTER_REFRESH;
+
+    msg = msg_get(conn, true, conn->redis);
+    if (msg == NULL) {
+        return;
+    }
+
+    status = msg_prepend_format(msg, "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n");
+    if (status != NC_OK) {
+        msg_put(msg);
+        return;
+    }
+    msg->type = MSG_REQ_REDIS_CLUSTER;
+    msg->result = MSG_PARSE_OK;
+    msg->swallow = 1;
+    msg->owner = NULL;
+
+    if (TAILQ_EMPTY(&conn->imsg_q)) {
+        status = event_add_out(ctx->evb, conn);
+        if (status != NC_OK) {
+            conn->err = errno;
+            msg_put(msg);
+            return;
+        }
+    }
+
+    conn->enqueue_inq(ctx, conn, msg);
+
+    log_debug(LOG_INFO, "sent 'CLUSTER SLOTS' to %s | %s", pool->name.data,
+              server->name.data);
+}
+
+/*
+ * Parse the RESP element of the given type ('*', '$' or ':') at *pos, store
+ * its length or value in num and advance *pos past its header line
+ */
+static rstatus_t
+redis_cluster_num(uint8_t **pos, uint8_t *end, uint8_t type, int64_t *num)
+{
+    uint8_t *p = *pos;
+    bool negative = false;
+    int64_t n = 0;
+
+    if (p >= end || *p != type) {
+        return NC_ERROR;
+    }
+    p++;
+
+    if (p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+
+    for (; p < end && isdigit(*p); p++) {
+        n = n * 10 + (*p - '0');
+    }
+
+    if ((size_t)(end - p) < CRLF_LEN || p[0] != CR || p[1] != LF) {
+        return NC_ERROR;
+    }
+
+    *pos = p + CRLF_LEN;
+    *num = negative ? -n : n;
+
+    return NC_OK;
+}
+
+static rstatus_t
+redis_cluster_bulk(uint8_t **pos, uint8_t *end, uint8_t **data, uint32_t *len)
+{
+    rstatus_t status;
+    int64_t n;
+
+    status = redis_cluster_num(pos, end, '$', &n);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    if (n < 0 || end - *pos < n + (int64_t)CRLF_LEN) {
+        return NC_ERROR;
+    }
+
+    *data = *pos;
+    *len = (uint32_t)n;
+    *pos += n + (int64_t)CRLF_LEN;
+
+    return NC_OK;
+}
+
+/* Skip over the RESP element at *pos, including any nested elements */
+static rstatus_t
+redis_cluster_skip(uint8_t **pos, uint8_t *end)
+{
+    rstatus_t status;
+    uint8_t *data;
+    uint32_t len;
+    int64_t i, n;
+
+    if (*pos >= end) {
+        return NC_ERROR;
+    }
+
+    switch (**pos) {
+    case '+':
+    case '-':
+    case ':':
+        data = nc_memchr(*pos, LF, (size_t)(end - *pos));
+        if (data == NULL) {
+            return NC_ERROR;
+        }
+        *pos = data + 1;
+        return NC_OK;
+
+    case '$':
+        return redis_cluster_bulk(pos, end, &data, &len);
+
+    case '*':
+        status = redis_cluster_num(pos, end, '*', &n);
+        if (status != NC_OK) {
+            return status;
+        }
+        for (i = 0; i < n; i++) {
+            status = redis_cluster_skip(pos, end);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+        return NC_OK;
+
+    default:
+        return NC_ERROR;
+    }
+}
+
+/*
+ * Load the 'CLUSTER SLOTS' reply in [p, end) from server into the slot map
+ * of its pool. Each element of the reply is an array of the first slot, the
+ * last slot, the master node and its replicas, where each node is an array
+ * that starts with the host and the port of the node. Masters that are not
+ * servers of the pool yet are added to it.
+ */
+static rstatus_t
+redis_cluster_slots(struct server *server, uint8_t *p, uint8_t *end)
+{
+    rstatus_t status;
+    struct server_pool *pool = server->owner;
+    int64_t i, j, nrange, nelem, nfield, first, last, port;
+    uint8_t *host;
+    uint32_t hostlen, idx;
+
+    status = redis_cluster_num(&p, end, '*', &nrange);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < nrange; i++) {
+        if (redis_cluster_num(&p, end, '*', &nelem) != NC_OK || nelem < 3 ||
+            redis_cluster_num(&p, end, ':', &first) != NC_OK ||
+            redis_cluster_num(&p, end, ':', &last) != NC_OK ||
+            redis_cluster_num(&p, end, '*', &nfield) != NC_OK || nfield < 2 ||
+            redis_cluster_bulk(&p, end, &host, &hostlen) != NC_OK ||
+            redis_cluster_num(&p, end, ':', &port) != NC_OK) {
+            return NC_ERROR;
+        }
+
+        for (j = 2; j < nfield; j++) {                  /* node id, ... */
+            status = redis_cluster_skip(&p, end);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        for (j = 3; j < nelem; j++) {                   /* replicas */
+            status = redis_cluster_skip(&p, end);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        if (first < 0 || first > last || last >= CLUSTER_NSLOT ||
+            port <= 0 || port > UINT16_MAX) {
+            return NC_ERROR;
+        }
+
+        /* an empty host stands for the node that we asked */
+        if (hostlen == 0) {
+            host = server->addrstr.data;
+            hostlen = server->addrstr.len;
+        }
+
+        idx = server_pool_find(pool, host, hostlen, (uint16_t)port);
+        if (idx == array_n(&pool->server)) {
+            idx = server_pool_add(pool, host, hostlen, (uint16_t)port);
+        }
+        if (idx == array_n(&pool->server)) {
+            log_warn("slots %"PRIi64"-%"PRIi64" of %s are on '%.*s:%"PRIi64"', "
+                     "which could not be added to the pool", first, last,
+                     pool->name.data, hostlen, host, port);
+            continue;
+        }
+
+        cluster_assign(pool, (uint32_t)first, (uint32_t)last, idx);
+    }
+
+    return NC_OK;
+}
+
 void
 redis_post_connect(struct context *ctx, struct conn *conn, struct server *server)
 {
@@ -3174,6 +3209,10 @@ redis_post_connect(struct context *ctx, struct conn *conn, struct server *server
     ASSERT(!conn->client && conn->connected);
     ASSERT(conn->redis);
 
+    if (pool->dist_type == DIST_REDIS_CLUSTER) {
+        redis_cluster_refresh(ctx, conn);
+    }
+
     /*
      * By default, every connection to redis uses the database DB 0. You
      * can select a different one on a per-connection basis by sending
@@ -3216,6 +3255,40 @@ redis_post_connect(struct context *ctx, struct conn *conn, struct server *server
 void
 redis_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg)
 {
+    if (pmsg != NULL && pmsg->type == MSG_REQ_REDIS_CLUSTER &&
+        msg != NULL && !redis_error(msg)) {
+        struct server *server = conn->owner;
+        struct server_pool *pool = server->owner;
+        struct mbuf *mbuf;
+        uint8_t *buf, *p;
+        rstatus_t status;
+
+        /* the reply can span many mbufs; parse it from a contiguous copy */
+        buf = nc_alloc(msg->mlen);
+        if (buf == NULL) {
+            return;
+        }
+
+        p = buf;
+        STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+            nc_memcpy(p, mbuf->pos, mbuf_length(mbuf));
+            p += mbuf_length(mbuf);
+        }
+
+        status = redis_cluster_slots(server, buf, p);
+        if (status != NC_OK) {
+            log_warn("invalid 'CLUSTER SLOTS' reply from %s | %s",
+                     pool->name.data, server->name.data);
+        } else {
+            log_debug(LOG_NOTICE, "refreshed slots of %s from %s",
+                      pool->name.data, server->name.data);
+            stats_pool_incr(pool->ctx, pool, slots_refresh);
+        }
+
+        nc_free(buf);
+        return;
+    }
+
     if (pmsg != NULL && pmsg->type == MSG_REQ_REDIS_SELECT &&
         msg != NULL && redis_error(msg)) {
         struct server* conn_server;
@@ -3241,3 +3314,167 @@ redis_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg)
                  conn_server->name.data, message);
     }
 }
+
+/*
+ * Parse the redirect response '-MOVED <slot> <host>:<port>\r\n' or
+ * '-ASK <slot> <host>:<port>\r\n' in [p, end)
+ */
+static rstatus_t
+redis_redirect_parse(uint8_t *p, uint8_t *end, uint32_t *slot, uint8_t **host,
+                     uint32_t *hostlen, uint16_t *port)
+{
+    uint8_t *q, *colon;
+    int n;
+
+    /* skip the error type */
+    p = nc_memchr(p, ' ', (size_t)(end - p));
+    if (p == NULL) {
+        return NC_ERROR;
+    }
+    p++;
+
+    q = nc_memchr(p, ' ', (size_t)(end - p));
+    if (q == NULL) {
+        return NC_ERROR;
+    }
+    n = nc_atoi(p, (q - p));
+    if (n < 0 || n >= CLUSTER_NSLOT) {
+        return NC_ERROR;
+    }
+    *slot = (uint32_t)n;
+    p = q + 1;
+
+    q = nc_memchr(p, CR, (size_t)(end - p));
+    if (q == NULL) {
+        return NC_ERROR;
+    }
+
+    /* split at the last ':', as the host can be an ipv6 address */
+    for (colon = q - 1; colon > p && *colon != ':'; colon--) {
+        /* void */
+    }
+    if (colon == p) {
+        return NC_ERROR;
+    }
+    n = nc_atoi(colon + 1, (q - colon - 1));
+    if (n <= 0 || n > UINT16_MAX) {
+        return NC_ERROR;
+    }
+    *port = (uint16_t)n;
+    *host = p;
+    *hostlen = (uint32_t)(colon - p);
+
+    return NC_OK;
+}
+
+/*
+ * Follow a MOVED or ASK redirect from a redis cluster node, by forwarding
+ * the request pmsg to the node named in the response msg. MOVED means that
+ * the slot has a new owner, so it is also updated in the slot map, whereas
+ * ASK only holds for this request and has to be preceded by ASKING. A node
+ * that is not a server of the pool yet is added to it.
+ *
+ * Return true if the request was redirected, in which case the response is
+ * consumed, otherwise false and the response is forwarded to the client
+ */
+bool
+redis_redirect(struct context *ctx, struct conn *s_conn, struct msg *pmsg,
+               struct msg *msg)
+{
+    rstatus_t status;
+    struct server *server = s_conn->owner;
+    struct server_pool *pool = server->owner;
+    struct server *target;
+    struct msg *asking;
+    struct mbuf *mbuf;
+    uint8_t line[512], *host;
+    uint32_t len, slot, hostlen, idx;
+    uint16_t port;
+
+    ASSERT(!s_conn->client && !s_conn->proxy);
+    ASSERT(pmsg->request && !msg->request);
+
+    if (pool->dist_type != DIST_REDIS_CLUSTER) {
+        return false;
+    }
+
+    if (msg->type != MSG_RSP_REDIS_ERROR_MOVED &&
+        msg->type != MSG_RSP_REDIS_ERROR_ASK) {
+        return false;
+    }
+
+    if (pmsg->nredirect >= REDIS_CLUSTER_REDIRECT) {
+        log_warn("req %"PRIu64" on %s was redirected %"PRIu32" times, giving "
+                 "up", pmsg->id, pool->name.data, pmsg->nredirect);
+        return false;
+    }
+
+    len = 0;
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        if (len + mbuf_length(mbuf) > sizeof(line)) {
+            return false;
+        }
+        nc_memcpy(line + len, mbuf->pos, mbuf_length(mbuf));
+        len += mbuf_length(mbuf);
+    }
+
+    status = redis_redirect_parse(line, line + len, &slot, &host, &hostlen,
+                                  &port);
+    if (status != NC_OK) {
+        log_warn("invalid redirect '%.*s' from %s | %s", len, line,
+                 pool->name.data, server->name.data);
+        return false;
+    }
+
+    idx = server_pool_find(pool, host, hostlen, port);
+    if (idx == array_n(&pool->server)) {
+        idx = server_pool_add(pool, host, hostlen, port);
+    }
+    if (idx == array_n(&pool->server)) {
+        log_warn("req %"PRIu64" redirected to '%.*s:%"PRIu16"', which could "
+                 "not be added to %s", pmsg->id, hostlen, host, port,
+                 pool->name.data);
+        return false;
+    }
+    target = array_get(&pool->server, idx);
+
+    if (msg->type == MSG_RSP_REDIS_ERROR_ASK) {
+        asking = msg_get(pmsg->owner, true, pmsg->redis);
+        if (asking == NULL) {
+            return false;
+        }
+
+        status = msg_prepend_format(asking, "*1\r\n$6\r\nASKING\r\n");
+        if (status != NC_OK) {
+            msg_put(asking);
+            return false;
+        }
+        asking->type = MSG_REQ_REDIS_ASKING;
+        asking->result = MSG_PARSE_OK;
+        asking->swallow = 1;
+        asking->owner = NULL;
+
+        stats_pool_incr(ctx, pool, redirect_ask);
+    } else {
+        asking = NULL;
+
+        cluster_assign(pool, slot, slot, idx);
+        redis_cluster_refresh(ctx, s_conn);
+
+        stats_pool_incr(ctx, pool, redirect_moved);
+    }
+
+    log_debug(LOG_INFO, "redirect req %"PRIu64" for slot %"PRIu32" from %s "
+              "to %s", pmsg->id, slot, server->name.data, target->name.data);
+
+    /* a redirect is a valid response; the node is healthy */
+    server_ok(ctx, s_conn);
+
+    s_conn->dequeue_outq(ctx, s_conn, pmsg);
+    rsp_put(msg);
+
+    pmsg->nredirect++;
+    req_redirect(ctx, pmsg, target, asking);
+
+    return true;
+}
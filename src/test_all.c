@@ -1,62 +1,2497 @@
 #include <nc_hashkit.h>
 #include <nc_conf.h>
 #include <nc_util.h>
+#include <nc_proxy.h>
+#include <nc_upgrade.h>
 #include <proto/nc_proto.h>
 #include <stdio.h>
+#include <sys/wait.h>
+
+/* benchmarks only run with BENCH_ENV set, so that make check stays fast */
+#define BENCH_ENV "NC_BENCH"
 
 static int failures = 0;
 static int successes = 0;
 
-static void expect_same_int(int expected, int actual, const char* message) {
-    if (expected != actual) {
-        printf("FAIL Expected %d, got %d (%s)\n", expected, actual, message);
+static void expect_same_int(int expected, int actual, const char* message) {
+    if (expected != actual) {
+        printf("FAIL Expected %d, got %d (%s)\n", expected, actual, message);
+        failures++;
+    } else {
+        /* printf("PASS (%s)\n", message); */
+        successes++;
+    }
+}
+
+static void expect_same_uint32_t(uint32_t expected, uint32_t actual, const char* message) {
+    if (expected != actual) {
+        printf("FAIL Expected %u, got %u (%s)\n", (unsigned int) expected,
+                (unsigned int) actual, message);
+        failures++;
+    } else {
+        /* printf("PASS (%s)\n", message); */
+        successes++;
+    }
+}
+
+static void expect_same_uint64_t(uint64_t expected, uint64_t actual, const char* message) {
+    if (expected != actual) {
+        printf("FAIL Expected %"PRIu64", got %"PRIu64" (%s)\n", expected, actual, message);
+        failures++;
+    } else {
+        /* printf("PASS (%s)\n", message); */
+        successes++;
+    }
+}
+
+static void expect_same_ptr(const void *expected, const void *actual, const char* message) {
+    if (expected != actual) {
+        printf("FAIL Expected %p, got %p (%s)\n", expected, actual, message);
+        failures++;
+    } else {
+        /* printf("PASS (%s)\n", message); */
+        successes++;
+    }
+}
+
+static void test_hash_algorithms(void) {
+    /* refer to libmemcached tests/hash_results.h */
+    expect_same_uint32_t(2297466611U, hash_one_at_a_time("apple", 5), "should have expected one_at_a_time hash for key \"apple\"");
+    expect_same_uint32_t(3195025439U, hash_md5("apple", 5), "should have expected md5 hash for key \"apple\"");
+
+    expect_same_uint32_t(3662830516U, hash_crc16("apple", 5), "should have expected crc16 hash for key \"apple\"");
+    expect_same_uint32_t(10542U,      hash_crc32("apple", 5), "should have expected crc32 hash for key \"apple\"");
+    expect_same_uint32_t(2838417488U, hash_crc32a("apple", 5), "should have expected crc32a hash for key \"apple\"");
+    expect_same_uint32_t(67176023U,   hash_fnv1_32("apple", 5), "should have expected fnv1_32 hash for key \"apple\"");
+    expect_same_uint32_t(280767167U,  hash_fnv1a_32("apple", 5), "should have expected fnv1a_32 hash for key \"apple\"");
+    expect_same_uint32_t(473199127U,  hash_fnv1_64("apple", 5), "should have expected fnv1_64 hash for key \"apple\"");
+    expect_same_uint32_t(1488911807U, hash_fnv1a_64("apple", 5), "should have expected fnv1a_64 hash for key \"apple\"");
+    expect_same_uint32_t(3738850110U, hash_hsieh("apple", 5), "should have expected hsieh hash for key \"apple\"");
+    expect_same_uint32_t(1442444624U, hash_jenkins("apple", 5), "should have expected jenkins hash for key \"apple\"");
+    expect_same_uint32_t(4142305122U, hash_murmur("apple", 5), "should have expected murmur hash for key \"apple\"");
+    /* The above have exactly the same result as libmemcached/tests/hash_results.h */
+
+    expect_same_uint32_t(3853726576U, ketama_hash("server1-8", strlen("server1-8"), 0), "should have expected ketama_hash for server1-8 index 0");
+    expect_same_uint32_t(2667054752U, ketama_hash("server1-8", strlen("server1-8"), 3), "should have expected ketama_hash for server1-8 index 3");
+
+    {
+        /* low 32 bits of XXH3_64bits() of the reference implementation */
+        static const struct {
+            size_t   len;
+            uint32_t hash;
+        } xxh3_results[] = {
+            { 0,    0x38d394c2 }, { 16,   0x7f0d9edf }, { 17,   0x7d2f5a11 },
+            { 128,  0xf6cddd17 }, { 129,  0x08fe27dc }, { 240,  0x0c6ccb68 },
+            { 241,  0x301a6a1d }, { 1024, 0x85b3164a }, { 1025, 0x61b8a761 },
+            { 2048, 0x3fbf91b6 }, { 3000, 0x7a77431e },
+        };
+        /* wyhash(key, len, seed) test vectors of the reference implementation */
+        static const struct {
+            const char *key;
+            uint64_t   hash;
+        } wyhash_results[] = {
+            { "", 0x93228a4de0eec5a2ULL },
+            { "a", 0xc5bac3db178713c4ULL },
+            { "abc", 0xa97f2f7b1d9b3314ULL },
+            { "message digest", 0x786d1f1df3801df4ULL },
+            { "abcdefghijklmnopqrstuvwxyz", 0xdca5a8138ad37c87ULL },
+            { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", 0xb9e734f117cfaf70ULL },
+            { "12345678901234567890123456789012345678901234567890123456789012345678901234567890", 0x6cc5eab49a92d617ULL },
+        };
+        char *key;
+        size_t i;
+
+        key = nc_alloc(4096);
+        memset(key, 'x', 4096);
+
+        expect_same_uint32_t(3474950656U, hash_xxh3("apple", 5), "should have expected xxh3 hash for key \"apple\"");
+        expect_same_uint32_t(0x892f3950, hash_xxh3("abc", 3), "should have expected xxh3 hash for key \"abc\"");
+        for (i = 0; i < NELEMS(xxh3_results); i++) {
+            expect_same_uint32_t(xxh3_results[i].hash, hash_xxh3(key, xxh3_results[i].len), "should have expected xxh3 hash for a key of repeated 'x'");
+        }
+
+        for (i = 0; i < NELEMS(wyhash_results); i++) {
+            expect_same_uint64_t(wyhash_results[i].hash, wyhash(wyhash_results[i].key, strlen(wyhash_results[i].key), i), "should have expected wyhash test vector");
+        }
+        expect_same_uint32_t((uint32_t)wyhash("apple", 5, 0), hash_wyhash("apple", 5), "should truncate wyhash with seed 0");
+
+        expect_same_uint32_t(0xe3069283, hash_crc32c("123456789", 9), "should have expected crc32c check value");
+        expect_same_uint32_t(2513123946U, hash_crc32c("apple", 5), "should have expected crc32c hash for key \"apple\"");
+        expect_same_uint32_t(0x187705fc, hash_crc32c(key + 1, 241), "should have expected crc32c hash for an unaligned key");
+
+        nc_free(key);
+    }
+}
+
+static void bench_hash_algorithms(void) {
+#define DEFINE_ACTION(_hash, _name) { #_name, hash_##_name },
+    static const struct {
+        const char *name;
+        hash_t     hash;
+    } hashes[] = {
+        HASH_CODEC( DEFINE_ACTION )
+    };
+#undef DEFINE_ACTION
+    const size_t lengths[] = { 8, 32, 80, 200, 1024 };
+    const size_t nbyte = 16 * 1024 * 1024;
+    char *key;
+    size_t i, l, n, nkey;
+    uint32_t sum;
+
+    key = nc_alloc(1024 + 64);
+    if (key == NULL) {
+        printf("FAIL could not allocate key\n");
+        failures++;
+        return;
+    }
+    for (i = 0; i < 1024 + 64; i++) {
+        key[i] = (char)('a' + i % 26);
+    }
+
+    for (l = 0; l < NELEMS(lengths); l++) {
+        char line[1024];
+        int len;
+
+        nkey = nbyte / lengths[l];
+        len = nc_snprintf(line, sizeof(line), "hash: %4zu byte keys MB/s:", lengths[l]);
+        sum = 0;
+        for (i = 0; i < NELEMS(hashes); i++) {
+            int64_t start, usec;
+
+            start = nc_usec_now();
+            for (n = 0; n < nkey; n++) {
+                sum += hashes[i].hash(key + n % 64, lengths[l]);
+            }
+            usec = MAX(nc_usec_now() - start, 1);
+
+            len += nc_snprintf(line + len, sizeof(line) - (size_t)len, " %s %"PRId64,
+                               hashes[i].name, (int64_t)(nkey * lengths[l]) / usec);
+        }
+        printf("%s [%"PRIu32"]\n", line, sum % 2);
+    }
+
+    nc_free(key);
+}
+
+static void test_redis_cluster_slots(void) {
+    struct server_pool pool;
+    uint32_t i;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.dist_type = DIST_REDIS_CLUSTER;
+    pool.key_hash = hash_crc16;
+    string_set_text(&pool.hash_tag, "{}");
+    array_init(&pool.server, 3, sizeof(struct server));
+    for (i = 0; i < 3; i++) {
+        struct server *server = array_push(&pool.server);
+        memset(server, 0, sizeof(*server));
+        server->idx = i;
+        server->owner = &pool;
+    }
+
+    /* crc16("123456789") is 0x31c3 in the XMODEM variant used by redis cluster */
+    expect_same_uint32_t(0x31c3, server_pool_slot(&pool, (const uint8_t *)"123456789", 9), "should have expected slot for key \"123456789\"");
+    expect_same_uint32_t(12182, server_pool_slot(&pool, (const uint8_t *)"foo", 3), "should have expected slot for key \"foo\"");
+    expect_same_uint32_t(server_pool_slot(&pool, (const uint8_t *)"user1000", 8),
+                         server_pool_slot(&pool, (const uint8_t *)"{user1000}.following", 20),
+                         "should only hash the hash tag of a key");
+
+    expect_same_int(NC_OK, cluster_update(&pool), "should build the slot map");
+    expect_same_uint32_t(CLUSTER_NSLOT, pool.ncontinuum, "should have one point per slot");
+    expect_same_uint32_t(0, cluster_dispatch(pool.continuum, pool.ncontinuum, 0), "should assign the first slot to the first server");
+    expect_same_uint32_t(2, cluster_dispatch(pool.continuum, pool.ncontinuum, CLUSTER_NSLOT - 1), "should assign the last slot to the last server");
+    expect_same_uint32_t(2, server_pool_idx(&pool, (const uint8_t *)"foo", 3), "should map key \"foo\" to the server of its slot");
+
+    cluster_assign(&pool, 12182, 12182, 0);
+    expect_same_uint32_t(0, server_pool_idx(&pool, (const uint8_t *)"foo", 3), "should map key \"foo\" to the new owner of its slot");
+    expect_same_uint32_t(2, cluster_dispatch(pool.continuum, pool.ncontinuum, 12183), "should not move neighbouring slots");
+
+    nc_free(pool.continuum);
+    while (array_n(&pool.server) > 0) {
+        array_pop(&pool.server);
+    }
+    array_deinit(&pool.server);
+}
+
+static void test_pool_init(struct server_pool *pool, dist_type_t dist_type, uint32_t nserver) {
+    uint32_t i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->dist_type = dist_type;
+    pool->key_hash = hash_fnv1a_64;
+    array_init(&pool->server, nserver, sizeof(struct server));
+    for (i = 0; i < nserver; i++) {
+        struct server *server = array_push(&pool->server);
+        char *name = nc_alloc(32);
+        memset(server, 0, sizeof(*server));
+        server->idx = i;
+        server->owner = pool;
+        server->weight = 1;
+        server->name.len = (uint32_t)nc_snprintf(name, 32, "10.0.%u.%u:6379:1", i / 256, i % 256);
+        server->name.data = (uint8_t *)name;
+    }
+}
+
+static void test_pool_deinit(struct server_pool *pool) {
+    if (pool->continuum != NULL) {
+        nc_free(pool->continuum);
+    }
+    if (pool->dist_data != NULL) {
+        if (pool->dist_type == DIST_KETAMA) {
+            ketama_free(pool->dist_data);
+        } else {
+            nc_free(pool->dist_data);
+        }
+    }
+    while (array_n(&pool->server) > 0) {
+        struct server *server = array_pop(&pool->server);
+        nc_free(server->name.data);
+    }
+    array_deinit(&pool->server);
+}
+
+static uint32_t test_key_hash(uint32_t i) {
+    char key[32];
+    int len = nc_snprintf(key, sizeof(key), "key:%u", i);
+    return hash_fnv1a_64(key, (size_t)len);
+}
+
+static void test_jump_distribution(void) {
+    const uint32_t nkey = 100000;
+    struct server_pool pool, grown;
+    uint32_t i, count[10], nmoved, nwrong, min, max;
+    struct server *server;
+
+    test_pool_init(&pool, DIST_JUMP, 10);
+    test_pool_init(&grown, DIST_JUMP, 11);
+    expect_same_int(NC_OK, jump_update(&pool), "should build the jump buckets");
+    expect_same_int(NC_OK, jump_update(&grown), "should build the jump buckets");
+    expect_same_uint32_t(10, pool.ncontinuum, "should have one bucket per server of weight 1");
+
+    memset(count, 0, sizeof(count));
+    nmoved = 0;
+    nwrong = 0;
+    for (i = 0; i < nkey; i++) {
+        uint32_t hash = test_key_hash(i);
+        uint32_t idx = jump_dispatch(pool.continuum, pool.ncontinuum, hash);
+        uint32_t gidx = jump_dispatch(grown.continuum, grown.ncontinuum, hash);
+        count[idx]++;
+        if (idx != gidx) {
+            nmoved++;
+            nwrong += gidx != 10;
+        }
+    }
+    min = max = count[0];
+    for (i = 1; i < 10; i++) {
+        min = MIN(min, count[i]);
+        max = MAX(max, count[i]);
+    }
+    expect_same_int(1, min > nkey / 10 * 95 / 100 && max < nkey / 10 * 105 / 100, "should spread keys evenly over jump buckets");
+    expect_same_int(1, nmoved > nkey / 11 * 9 / 10 && nmoved < nkey / 11 * 11 / 10, "should move 1/11 of the keys when adding an 11th server");
+    expect_same_uint32_t(0, nwrong, "should only move keys to the added server");
+
+    /* eject server 3 and keys of the other servers stay put */
+    pool.auto_eject_hosts = 1;
+    server = array_get(&pool.server, 3);
+    server->next_retry = nc_usec_now() + 60000000LL;
+    expect_same_int(NC_OK, jump_update(&pool), "should rebuild the jump buckets");
+    expect_same_uint32_t(9, pool.nlive_server, "should have 9 live servers");
+    expect_same_uint32_t(10, pool.ncontinuum, "should keep the buckets of ejected servers");
+    nmoved = 0;
+    nwrong = 0;
+    for (i = 0; i < nkey; i++) {
+        uint32_t hash = test_key_hash(i);
+        uint32_t idx = jump_dispatch(pool.continuum, pool.ncontinuum, hash);
+        uint32_t gidx = jump_dispatch(grown.continuum, grown.ncontinuum, hash);
+        nwrong += idx == 3;
+        nmoved += gidx != 10 && gidx != 3 && idx != gidx;
+    }
+    expect_same_uint32_t(0, nwrong, "should not dispatch to an ejected server");
+    expect_same_uint32_t(0, nmoved, "should only move keys of the ejected server");
+
+    test_pool_deinit(&grown);
+    test_pool_deinit(&pool);
+}
+
+static void test_maglev_distribution(void) {
+    struct server_pool pool;
+    struct continuum *table;
+    uint32_t i, count[10], nmoved, nwrong, min, max;
+    struct server *server;
+
+    test_pool_init(&pool, DIST_MAGLEV, 10);
+    server = array_get(&pool.server, 9);
+    server->weight = 2;
+    expect_same_int(NC_OK, maglev_update(&pool), "should build the maglev table");
+    expect_same_uint32_t(65537, pool.ncontinuum, "should have a prime sized maglev table");
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < pool.ncontinuum; i++) {
+        count[pool.continuum[i].index]++;
+    }
+    min = max = count[0];
+    for (i = 1; i < 9; i++) {
+        min = MIN(min, count[i]);
+        max = MAX(max, count[i]);
+    }
+    expect_same_int(1, max - min < pool.ncontinuum / 11 / 100, "should spread maglev entries evenly");
+    expect_same_int(1, count[9] > 2 * min * 99 / 100 && count[9] < 2 * max * 101 / 100, "should give a server of weight 2 twice the entries");
+
+    table = nc_alloc(sizeof(*table) * pool.ncontinuum);
+    memcpy(table, pool.continuum, sizeof(*table) * pool.ncontinuum);
+
+    /* eject server 3 and entries of the other servers stay put */
+    pool.auto_eject_hosts = 1;
+    server = array_get(&pool.server, 3);
+    server->next_retry = nc_usec_now() + 60000000LL;
+    expect_same_int(NC_OK, maglev_update(&pool), "should update the maglev table");
+    expect_same_uint32_t(9, pool.nlive_server, "should have 9 live servers");
+    nmoved = 0;
+    nwrong = 0;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < pool.ncontinuum; i++) {
+        count[pool.continuum[i].index]++;
+        nwrong += pool.continuum[i].index == 3;
+        nmoved += table[i].index != 3 && table[i].index != pool.continuum[i].index;
+    }
+    expect_same_uint32_t(0, nwrong, "should not dispatch to an ejected server");
+    expect_same_uint32_t(0, nmoved, "should only move entries of the ejected server");
+    expect_same_int(1, count[0] > count[9] / 2 * 98 / 100 && count[0] < count[9] / 2 * 102 / 100, "should share entries of the ejected server by weight");
+
+    /* server 3 is back with the entries it had */
+    server->next_retry = 0LL;
+    expect_same_int(NC_OK, maglev_update(&pool), "should rebuild the maglev table");
+    expect_same_int(0, memcmp(table, pool.continuum, sizeof(*table) * pool.ncontinuum), "should restore the maglev table when the server is back");
+
+    nc_free(table);
+    test_pool_deinit(&pool);
+}
+
+/*
+ * Build the ketama continuum of a pool with the servers of pool that are
+ * live from scratch, and count the points in which it differs from the
+ * continuum of pool
+ */
+static uint32_t test_ketama_compare(struct server_pool *pool) {
+    struct server_pool fresh;
+    uint32_t i, nmismatch;
+
+    test_pool_init(&fresh, DIST_KETAMA, array_n(&pool->server));
+    fresh.auto_eject_hosts = 1;
+    for (i = 0; i < array_n(&pool->server); i++) {
+        struct server *server = array_get(&pool->server, i);
+        struct server *fserver = array_get(&fresh.server, i);
+        fserver->weight = server->weight;
+        fserver->next_retry = server->next_retry;
+    }
+    ketama_update(&fresh);
+
+    nmismatch = fresh.ncontinuum != pool->ncontinuum;
+    for (i = 0; i < MIN(fresh.ncontinuum, pool->ncontinuum); i++) {
+        nmismatch += fresh.continuum[i].index != pool->continuum[i].index ||
+                     fresh.continuum[i].value != pool->continuum[i].value;
+    }
+    for (i = 0; i < 10000; i++) {
+        nmismatch += ketama_lookup(fresh.dist_data, test_key_hash(i)) !=
+                     ketama_lookup(pool->dist_data, test_key_hash(i));
+    }
+
+    test_pool_deinit(&fresh);
+
+    return nmismatch;
+}
+
+static void test_ketama_update(void) {
+    const int64_t ejected = INT64_MAX / 2;
+    struct server_pool pool;
+    struct server *server;
+    uint32_t i;
+
+    test_pool_init(&pool, DIST_KETAMA, 50);
+    pool.auto_eject_hosts = 1;
+    expect_same_int(NC_OK, ketama_update(&pool), "should build the ketama continuum");
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should build the same continuum as from scratch");
+
+    ((struct server *)array_get(&pool.server, 3))->next_retry = ejected;
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should take the points of an ejected server out in place");
+
+    ((struct server *)array_get(&pool.server, 0))->next_retry = ejected;
+    ((struct server *)array_get(&pool.server, 49))->next_retry = ejected;
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should take the points of ejected servers out in place");
+
+    ((struct server *)array_get(&pool.server, 3))->next_retry = 0;
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should merge the points of a revived server in place");
+
+    for (i = 0; i < 40; i++) {
+        ((struct server *)array_get(&pool.server, i))->next_retry = ejected;
+    }
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should take most servers out in place");
+    for (i = 0; i < 50; i++) {
+        ((struct server *)array_get(&pool.server, i))->next_retry = 0;
+    }
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should rebuild when reviving many servers");
+    test_pool_deinit(&pool);
+
+    /* with weights, the other servers get a different number of points */
+    test_pool_init(&pool, DIST_KETAMA, 20);
+    pool.auto_eject_hosts = 1;
+    for (i = 0; i < 20; i++) {
+        server = array_get(&pool.server, i);
+        server->weight = 1 + i % 3;
+    }
+    ketama_update(&pool);
+    ((struct server *)array_get(&pool.server, 7))->next_retry = ejected;
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should rebuild weighted servers on ejection");
+    ((struct server *)array_get(&pool.server, 7))->next_retry = 0;
+    ketama_update(&pool);
+    expect_same_uint32_t(0, test_ketama_compare(&pool), "should rebuild weighted servers on revival");
+    test_pool_deinit(&pool);
+}
+
+/*
+ * Time the ketama rebuilds of a pool of 1000 servers, which stall the event
+ * loop, from scratch and on ejection and revival of a server
+ */
+static void bench_ketama_update(void) {
+    struct server_pool pool;
+    struct server *server;
+    int64_t start, build_usec, eject_usec, revive_usec, full_usec;
+
+    test_pool_init(&pool, DIST_KETAMA, 1000);
+    pool.auto_eject_hosts = 1;
+
+    start = nc_usec_now();
+    ketama_update(&pool);
+    build_usec = nc_usec_now() - start;
+
+    server = array_get(&pool.server, 500);
+    server->next_retry = INT64_MAX / 2;
+    start = nc_usec_now();
+    ketama_update(&pool);
+    eject_usec = nc_usec_now() - start;
+
+    server->next_retry = 0;
+    start = nc_usec_now();
+    ketama_update(&pool);
+    revive_usec = nc_usec_now() - start;
+
+    /* what every ejection used to cost: rehash and sort all the servers */
+    ketama_free(pool.dist_data);
+    pool.dist_data = NULL;
+    pool.nserver_continuum = 0;
+    start = nc_usec_now();
+    ketama_update(&pool);
+    full_usec = nc_usec_now() - start;
+
+    printf("ketama update: 1000 servers build %"PRId64" usec eject %"PRId64" usec "
+           "revive %"PRId64" usec (from scratch %"PRId64" usec)\n", build_usec,
+           eject_usec, revive_usec, full_usec);
+
+    test_pool_deinit(&pool);
+}
+
+static void test_ketama_load_bound(void) {
+    const uint32_t nreq = 20000, nserver = 8;
+    struct server_pool pool;
+    uint32_t ring[64], i, idx, bidx, nmismatch, ndisplaced, nover, max;
+    struct server *server;
+    char key[32];
+    int len;
+
+    test_pool_init(&pool, DIST_KETAMA, nserver);
+    expect_same_int(NC_OK, ketama_update(&pool), "should build the ketama continuum");
+    pool.load_bound = 125;
+
+    nmismatch = 0;
+    for (i = 0; i < 1000; i++) {
+        len = nc_snprintf(key, sizeof(key), "key:%u", i);
+        idx = server_pool_idx(&pool, (uint8_t *)key, (uint32_t)len);
+        nmismatch += server_pool_bound(&pool, (uint8_t *)key, (uint32_t)len, idx) != idx;
+    }
+    expect_same_uint32_t(0, nmismatch, "should not displace keys off idle servers");
+
+    /* half of the requests are for one hot key, with 64 requests in flight */
+    ndisplaced = nover = max = 0;
+    for (i = 0; i < nreq; i++) {
+        if (i >= NELEMS(ring)) {
+            server = array_get(&pool.server, ring[i % NELEMS(ring)]);
+            server->nqueue--;
+            pool.nqueue--;
+        }
+
+        len = nc_snprintf(key, sizeof(key), "key:%u", i % 2 == 0 ? 0 : i);
+        idx = server_pool_idx(&pool, (uint8_t *)key, (uint32_t)len);
+        bidx = server_pool_bound(&pool, (uint8_t *)key, (uint32_t)len, idx);
+        ndisplaced += bidx != idx;
+
+        server = array_get(&pool.server, bidx);
+        /* at most ceil(1.25 * (nqueue + 1) / nserver) after queueing */
+        nover += (server->nqueue + 1) * nserver * 100 > 125 * (pool.nqueue + 1) + nserver * 100 - 1;
+        server->nqueue++;
+        pool.nqueue++;
+        max = MAX(max, server->nqueue);
+        ring[i % NELEMS(ring)] = bidx;
+    }
+    expect_same_uint32_t(0, nover, "should keep every server under the load bound");
+    expect_same_uint32_t(10, max, "should queue at most ceil(1.25 * 64 / 8) requests on a server");
+    expect_same_int(1, ndisplaced >= nreq / 4, "should displace the excess of the hot key");
+
+    test_pool_deinit(&pool);
+}
+
+static void test_replica_read(void) {
+    struct server_pool pool;
+    struct server *master, replica[2];
+    uint32_t i, count[2];
+
+    test_pool_init(&pool, DIST_KETAMA, 1);
+    master = array_get(&pool.server, 0);
+    expect_same_ptr(master, server_read(master), "should read from a server without replicas");
+
+    memset(replica, 0, sizeof(replica));
+    for (i = 0; i < NELEMS(replica); i++) {
+        replica[i].idx = 1 + i;
+        replica[i].owner = &pool;
+        replica[i].is_replica = 1;
+    }
+    master->replica = replica;
+    master->nreplica = NELEMS(replica);
+
+    count[0] = count[1] = 0;
+    for (i = 0; i < 100; i++) {
+        struct server *server = server_read(master);
+
+        expect_same_int(1, server == &replica[0] || server == &replica[1], "should read from a replica");
+        count[server - replica]++;
+    }
+    expect_same_int(1, count[0] > 20 && count[1] > 20, "should spread reads over replicas with the same score");
+
+    replica[0].latency = 1000;
+    replica[1].latency = 100;
+    expect_same_ptr(&replica[1], server_read(master), "should read from the faster replica");
+    replica[1].nqueue = 20;
+    expect_same_ptr(&replica[0], server_read(master), "should read from the less loaded replica");
+    replica[1].nqueue = 0;
+
+    replica[0].next_retry = INT64_MAX;
+    for (i = 0; i < 4; i++) {
+        expect_same_ptr(&replica[1], server_read(master), "should skip an ejected replica");
+    }
+
+    replica[1].next_retry = INT64_MAX;
+    expect_same_ptr(master, server_read(master), "should fall back to the master without live replicas");
+
+    replica[0].next_retry = 1;
+    expect_same_ptr(&replica[0], server_read(master), "should read from a replica past its retry time");
+
+    master->replica = NULL;
+    master->nreplica = 0;
+    test_pool_deinit(&pool);
+}
+
+static void test_replica_hedge(void) {
+    struct server_pool pool;
+    struct server *master, replica[2];
+    struct stats_histogram h;
+    uint32_t i;
+
+    test_pool_init(&pool, DIST_KETAMA, 1);
+    master = array_get(&pool.server, 0);
+    expect_same_ptr(NULL, server_hedge(&pool, master), "should not hedge a server without replicas");
+
+    memset(replica, 0, sizeof(replica));
+    for (i = 0; i < NELEMS(replica); i++) {
+        replica[i].idx = 1 + i;
+        replica[i].owner = &pool;
+        replica[i].is_replica = 1;
+    }
+    master->replica = replica;
+    master->nreplica = NELEMS(replica);
+
+    for (i = 0; i < 4; i++) {
+        expect_same_ptr(&replica[1], server_hedge(&pool, &replica[0]), "should hedge with the other replica");
+    }
+    replica[1].next_retry = INT64_MAX;
+    expect_same_ptr(master, server_hedge(&pool, &replica[0]), "should hedge with the master without other live replicas");
+    master->next_retry = INT64_MAX;
+    expect_same_ptr(NULL, server_hedge(&pool, &replica[0]), "should not hedge without another live server");
+    expect_same_ptr(&replica[0], server_hedge(&pool, master), "should hedge the master with a replica");
+
+    memset(&h, 0, sizeof(h));
+    pool.hedge_latency = &h;
+    pool.hedge_permille = 900;
+    pool.hedge_delay = 0;
+    for (i = 0; i < HEDGE_NSAMPLE - 1; i++) {
+        server_pool_hedge_latency(&pool, i % 100 < 95 ? 1000 : 20000);
+    }
+    expect_same_uint32_t(0, pool.hedge_delay, "should not hedge before enough reads");
+    server_pool_hedge_latency(&pool, 1000);
+    expect_same_uint32_t(1, pool.hedge_delay, "should hedge at p90 of the reads");
+    for (i = 0; i < HEDGE_NSAMPLE; i++) {
+        server_pool_hedge_latency(&pool, 20000);
+    }
+    expect_same_int(1, pool.hedge_delay >= 20 && pool.hedge_delay <= 22, "should follow the recent reads");
+
+    pool.hedge_latency = NULL;
+    master->replica = NULL;
+    master->nreplica = 0;
+    test_pool_deinit(&pool);
+}
+
+static void test_config_replicas(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  redis: true\n"
+        "  hedge_delay: p99.9\n"
+        "  servers:\n"
+        "   - 127.0.0.1:6379:1 shard1 127.0.0.1:6380  10.0.0.3:6381\n"
+        "   - 127.0.0.1:6382:1 shard2\n";
+    char fname[] = "/tmp/test_all.XXXXXX";
+    struct conf_pool *cp;
+    struct conf_server *cs, *r;
+    struct conf *conf;
+    FILE *fh;
+    int fd;
+
+    fd = mkstemp(fname);
+    fh = fd < 0 ? NULL : fdopen(fd, "w");
+    if (fh == NULL) {
+        printf("FAIL could not create %s\n", fname);
+        failures++;
+        return;
+    }
+    fputs(yml, fh);
+    fclose(fh);
+
+    conf = conf_create(fname);
+    unlink(fname);
+    if (conf == NULL) {
+        printf("FAIL could not parse servers with replicas\n");
+        failures++;
+        return;
+    }
+
+    cp = array_get(&conf->pool, 0);
+    expect_same_uint32_t(2, array_n(&cp->server), "should parse two servers");
+    expect_same_int(999, cp->hedge_delay.permille, "should parse a hedge delay percentile");
+    expect_same_int(10, cp->hedge_budget, "should default the hedge budget");
+
+    cs = array_get(&cp->server, 0);
+    expect_same_int(0, string_compare(&cs->name, &(struct string)string("shard1")), "should parse the name before the replicas");
+    expect_same_int(0, string_compare(&cs->pname, &(struct string)string("127.0.0.1:6379:1")), "should keep the replicas out of the server");
+    expect_same_uint32_t(2, array_n(&cs->replica), "should parse two replicas");
+
+    r = array_get(&cs->replica, 1);
+    expect_same_int(0, string_compare(&r->addrstr, &(struct string)string("10.0.0.3")), "should parse the replica host");
+    expect_same_int(6381, r->port, "should parse the replica port");
+    expect_same_int(0, string_compare(&r->name, &(struct string)string("10.0.0.3:6381")), "should name a replica by its address");
+
+    cs = array_get(&cp->server, 1);
+    expect_same_uint32_t(0, array_n(&cs->replica), "should parse a server without replicas");
+
+    conf_destroy(conf);
+}
+
+static struct conf *test_config_create(const char *yml) {
+    char fname[] = "/tmp/test_all.XXXXXX";
+    struct conf *conf;
+    FILE *fh;
+    int fd;
+
+    fd = mkstemp(fname);
+    fh = fd < 0 ? NULL : fdopen(fd, "w");
+    if (fh == NULL) {
+        return NULL;
+    }
+    fputs(yml, fh);
+    fclose(fh);
+
+    conf = conf_create(fname);
+    unlink(fname);
+
+    return conf;
+}
+
+static void test_config_mirror(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  mirror: beta\n"
+        "  mirror_commands: all\n"
+        "  servers:\n"
+        "   - 127.0.0.1:11211:1\n"
+        "beta:\n"
+        "  listen: 127.0.0.1:22122\n"
+        "  servers:\n"
+        "   - 127.0.0.1:11212:1\n";
+    static const char *invalid[] = {
+        /* no such pool */
+        "alpha:\n  listen: 127.0.0.1:22121\n  mirror: gamma\n  servers:\n   - 127.0.0.1:11211:1\n",
+        /* itself */
+        "alpha:\n  listen: 127.0.0.1:22121\n  mirror: alpha\n  servers:\n   - 127.0.0.1:11211:1\n",
+        /* another protocol */
+        "alpha:\n  listen: 127.0.0.1:22121\n  mirror: beta\n  servers:\n   - 127.0.0.1:11211:1\n"
+        "beta:\n  listen: 127.0.0.1:22122\n  redis: true\n  servers:\n   - 127.0.0.1:6379:1\n",
+        /* a sample rate without a mirror */
+        "alpha:\n  listen: 127.0.0.1:22121\n  mirror_sample_rate: 10\n  servers:\n   - 127.0.0.1:11211:1\n",
+        /* neither reads nor all */
+        "alpha:\n  listen: 127.0.0.1:22121\n  mirror: beta\n  mirror_commands: writes\n  servers:\n   - 127.0.0.1:11211:1\n"
+        "beta:\n  listen: 127.0.0.1:22122\n  servers:\n   - 127.0.0.1:11212:1\n",
+    };
+    struct conf_pool *cp;
+    struct conf *conf;
+    uint32_t i;
+
+    conf = test_config_create(yml);
+    if (conf == NULL) {
+        printf("FAIL could not parse pools with a mirror\n");
+        failures++;
+        return;
+    }
+
+    for (i = 0; i < array_n(&conf->pool); i++) {
+        cp = array_get(&conf->pool, i);
+        if (cp->mirror.len == 0) {
+            expect_same_int(0, cp->mirror_writes, "should default to mirror reads only");
+            continue;
+        }
+        expect_same_int(0, string_compare(&cp->mirror, &(struct string)string("beta")), "should parse the mirror pool");
+        expect_same_int(100, cp->mirror_sample_rate, "should default to mirror every request");
+        expect_same_int(1, cp->mirror_writes, "should parse mirror_commands: all");
+    }
+
+    conf_destroy(conf);
+
+    for (i = 0; i < NELEMS(invalid); i++) {
+        conf = test_config_create(invalid[i]);
+        expect_same_ptr(NULL, conf, "should reject an invalid mirror");
+        if (conf != NULL) {
+            conf_destroy(conf);
+        }
+    }
+}
+
+static void test_config_shared(void) {
+    const char *yml =
+        "alpha:\n  listen: 127.0.0.1:22121\n  servers:\n   - 127.0.0.1:11211:1\n";
+    struct context ctx;
+    struct array pool;
+    struct conf *conf;
+    struct server_pool *sp;
+
+    conf = test_config_create(yml);
+    if (conf == NULL) {
+        printf("FAIL could not parse a pool to share\n");
+        failures++;
+        return;
+    }
+    expect_same_ptr(conf, conf_ref(conf), "should share the conf");
+    expect_same_uint32_t(2, conf->nref, "should count the contexts sharing the conf");
+
+    /* a pool of the second context outlives the first reference */
+    memset(&ctx, 0, sizeof(ctx));
+    array_null(&pool);
+    expect_same_int(NC_OK, server_pool_init(&pool, &conf->pool, &ctx), "should init the pools");
+    conf_destroy(conf);
+    expect_same_uint32_t(1, conf->nref, "should keep the conf while shared");
+    sp = array_get(&pool, 0);
+    expect_same_int(0, string_compare(&sp->name, &(struct string)string("alpha")), "should keep the pool name");
+
+    server_pool_deinit(&pool);
+    conf_destroy(conf);
+}
+
+static void test_rendezvous_distribution(void) {
+    const uint32_t nkey = 120000;
+    struct server_pool pool;
+    uint32_t i, count[6], nmoved, nwrong, min, max;
+    uint32_t *before;
+    struct server *server;
+
+    test_pool_init(&pool, DIST_RENDEZVOUS, 6);
+    expect_same_int(NC_OK, rendezvous_update(&pool), "should build the rendezvous servers");
+
+    before = nc_alloc(sizeof(*before) * nkey);
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < nkey; i++) {
+        before[i] = rendezvous_dispatch(pool.dist_data, test_key_hash(i));
+        count[before[i]]++;
+    }
+    min = max = count[0];
+    for (i = 1; i < 6; i++) {
+        min = MIN(min, count[i]);
+        max = MAX(max, count[i]);
+    }
+    expect_same_int(1, min > nkey / 6 * 97 / 100 && max < nkey / 6 * 103 / 100, "should spread keys evenly over rendezvous servers");
+
+    /* eject server 2 and keys of the other servers stay put */
+    pool.auto_eject_hosts = 1;
+    server = array_get(&pool.server, 2);
+    server->next_retry = nc_usec_now() + 60000000LL;
+    expect_same_int(NC_OK, rendezvous_update(&pool), "should rebuild the rendezvous servers");
+    expect_same_uint32_t(5, pool.nlive_server, "should have 5 live servers");
+    nmoved = 0;
+    nwrong = 0;
+    for (i = 0; i < nkey; i++) {
+        uint32_t idx = rendezvous_dispatch(pool.dist_data, test_key_hash(i));
+        nwrong += idx == 2;
+        nmoved += before[i] != 2 && before[i] != idx;
+    }
+    expect_same_uint32_t(0, nwrong, "should not dispatch to an ejected server");
+    expect_same_uint32_t(0, nmoved, "should only move keys of the ejected server");
+
+    /* server 5 of weight 3 gets 3/8 of the keys */
+    server->next_retry = 0LL;
+    server = array_get(&pool.server, 5);
+    server->weight = 3;
+    expect_same_int(NC_OK, rendezvous_update(&pool), "should rebuild the rendezvous servers");
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < nkey; i++) {
+        count[rendezvous_dispatch(pool.dist_data, test_key_hash(i))]++;
+    }
+    expect_same_int(1, count[5] > nkey / 8 * 3 * 97 / 100 && count[5] < nkey / 8 * 3 * 103 / 100, "should give a server of weight 3 three times the keys");
+    expect_same_int(1, count[0] > nkey / 8 * 97 / 100 && count[0] < nkey / 8 * 103 / 100, "should give a server of weight 1 its share of the keys");
+
+    nc_free(before);
+    test_pool_deinit(&pool);
+}
+
+/*
+ * Time the dispatch of the hashes of nkey keys to 6 rendezvous servers, and
+ * compare the balance of their keys to that of ketama. Rendezvous hashes
+ * every server for every key, so it is only timed for few servers.
+ */
+static void bench_rendezvous(const uint32_t *hashes, uint32_t nkey) {
+    struct server_pool rendezvous, ketama;
+    uint32_t i, count[6], kcount[6], min, max, kmin, kmax;
+    int64_t start;
+
+    test_pool_init(&rendezvous, DIST_RENDEZVOUS, NELEMS(count));
+    test_pool_init(&ketama, DIST_KETAMA, NELEMS(kcount));
+    rendezvous_update(&rendezvous);
+    ketama_update(&ketama);
+
+    memset(count, 0, sizeof(count));
+    memset(kcount, 0, sizeof(kcount));
+    start = nc_usec_now();
+    for (i = 0; i < nkey; i++) {
+        count[rendezvous_dispatch(rendezvous.dist_data, hashes[i])]++;
+    }
+    start = nc_usec_now() - start;
+    for (i = 0; i < nkey; i++) {
+        kcount[ketama_lookup(ketama.dist_data, hashes[i])]++;
+    }
+    min = max = count[0];
+    kmin = kmax = kcount[0];
+    for (i = 1; i < NELEMS(count); i++) {
+        min = MIN(min, count[i]);
+        max = MAX(max, count[i]);
+        kmin = MIN(kmin, kcount[i]);
+        kmax = MAX(kmax, kcount[i]);
+    }
+    printf("rendezvous: %zu servers %"PRIu32" keys in %"PRId64" usec, max/min keys "
+           "rendezvous %.3f ketama %.3f\n", NELEMS(count), nkey, start,
+           (double)max / min, (double)kmax / kmin);
+
+    test_pool_deinit(&ketama);
+    test_pool_deinit(&rendezvous);
+}
+
+static void bench_dispatch(void) {
+    const uint32_t nkey = 1000000;
+    const uint32_t nservers[] = { 10, 100, 500, 1000 };
+    uint32_t *hashes, i, n, sum;
+
+    hashes = nc_alloc(sizeof(*hashes) * nkey);
+    if (hashes == NULL) {
+        printf("FAIL could not allocate %"PRIu32" hashes\n", nkey);
+        failures++;
+        return;
+    }
+    for (i = 0; i < nkey; i++) {
+        hashes[i] = test_key_hash(i);
+    }
+
+    for (n = 0; n < NELEMS(nservers); n++) {
+        struct server_pool ketama, jump, maglev;
+        int64_t start, ketama_update_usec, jump_update_usec, ketama_usec, jump_usec;
+        int64_t maglev_update_usec, maglev_usec, lookup_usec;
+        uint32_t nmismatch;
+
+        test_pool_init(&ketama, DIST_KETAMA, nservers[n]);
+        test_pool_init(&jump, DIST_JUMP, nservers[n]);
+        test_pool_init(&maglev, DIST_MAGLEV, nservers[n]);
+
+        start = nc_usec_now();
+        ketama_update(&ketama);
+        ketama_update_usec = nc_usec_now() - start;
+        start = nc_usec_now();
+        jump_update(&jump);
+        jump_update_usec = nc_usec_now() - start;
+        start = nc_usec_now();
+        maglev_update(&maglev);
+        maglev_update_usec = nc_usec_now() - start;
+
+        sum = 0;
+        start = nc_usec_now();
+        for (i = 0; i < nkey; i++) {
+            sum += ketama_dispatch(ketama.continuum, ketama.ncontinuum, hashes[i]);
+        }
+        ketama_usec = nc_usec_now() - start;
+        start = nc_usec_now();
+        for (i = 0; i < nkey; i++) {
+            sum += ketama_lookup(ketama.dist_data, hashes[i]);
+        }
+        lookup_usec = nc_usec_now() - start;
+        start = nc_usec_now();
+        for (i = 0; i < nkey; i++) {
+            sum += jump_dispatch(jump.continuum, jump.ncontinuum, hashes[i]);
+        }
+        jump_usec = nc_usec_now() - start;
+        start = nc_usec_now();
+        for (i = 0; i < nkey; i++) {
+            sum += maglev_dispatch(maglev.continuum, maglev.ncontinuum, hashes[i]);
+        }
+        maglev_usec = nc_usec_now() - start;
+
+        /* the search index must map every hash to the same server */
+        nmismatch = 0;
+        for (i = 0; i < nkey; i++) {
+            nmismatch += ketama_lookup(ketama.dist_data, hashes[i]) !=
+                         ketama_dispatch(ketama.continuum, ketama.ncontinuum, hashes[i]);
+        }
+        for (i = 0; i < ketama.ncontinuum; i++) {
+            uint32_t value = ketama.continuum[i].value;
+            nmismatch += ketama_lookup(ketama.dist_data, value) !=
+                         ketama_dispatch(ketama.continuum, ketama.ncontinuum, value);
+            nmismatch += ketama_lookup(ketama.dist_data, value + 1) !=
+                         ketama_dispatch(ketama.continuum, ketama.ncontinuum, value + 1);
+        }
+        nmismatch += ketama_lookup(ketama.dist_data, 0) !=
+                     ketama_dispatch(ketama.continuum, ketama.ncontinuum, 0);
+        nmismatch += ketama_lookup(ketama.dist_data, UINT32_MAX) !=
+                     ketama_dispatch(ketama.continuum, ketama.ncontinuum, UINT32_MAX);
+        expect_same_uint32_t(0, nmismatch, "should map keys to the same servers with the ketama search index");
+
+        printf("dispatch: %"PRIu32" servers %"PRIu32" keys ketama %"PRId64" usec "
+               "(indexed %"PRId64" usec, "
+               "update %"PRId64" usec, %"PRIu32" points) jump %"PRId64" usec "
+               "(update %"PRId64" usec, %"PRIu32" buckets) maglev %"PRId64" usec "
+               "(update %"PRId64" usec, %"PRIu32" entries) [%"PRIu32"]\n",
+               nservers[n], nkey, ketama_usec, lookup_usec, ketama_update_usec,
+               ketama.ncontinuum, jump_usec, jump_update_usec, jump.ncontinuum,
+               maglev_usec, maglev_update_usec, maglev.ncontinuum, sum % 2);
+
+        test_pool_deinit(&maglev);
+        test_pool_deinit(&jump);
+        test_pool_deinit(&ketama);
+    }
+
+    bench_rendezvous(hashes, nkey);
+
+    nc_free(hashes);
+}
+
+static void test_stats_histogram(void) {
+    struct stats_histogram h;
+    int64_t i;
+
+    memset(&h, 0, sizeof(h));
+    expect_same_int(0, (int)stats_histogram_percentile(&h, 500), "should have p50 of 0 for empty histogram");
+
+    /* values below 16 are exact */
+    for (i = 1; i <= 10; i++) {
+        stats_histogram_record(&h, i);
+    }
+    expect_same_int(5, (int)stats_histogram_percentile(&h, 500), "should have exact p50 for small values");
+    expect_same_int(9, (int)stats_histogram_percentile(&h, 900), "should have exact p90 for small values");
+    expect_same_int(10, (int)stats_histogram_percentile(&h, 999), "should have exact p999 for small values");
+
+    /* larger values are within 1/16 of their bucket */
+    memset(&h, 0, sizeof(h));
+    for (i = 1; i <= 100000; i++) {
+        stats_histogram_record(&h, i);
+    }
+    expect_same_int(100000, (int)h.count, "should count every value");
+    expect_same_int(100000, (int)h.max, "should track the max value");
+    expect_same_int(1, stats_histogram_percentile(&h, 500) >= 50000 &&
+                       stats_histogram_percentile(&h, 500) < 50000 + 50000 / 16,
+                    "should have p50 within the relative error");
+    expect_same_int(1, stats_histogram_percentile(&h, 990) >= 99000 &&
+                       stats_histogram_percentile(&h, 990) <= 100000,
+                    "should have p99 within the relative error and below max");
+
+    /* huge values end up in the last bucket */
+    stats_histogram_record(&h, 1LL << 40);
+    expect_same_int(1, stats_histogram_percentile(&h, 1000) == 1LL << 40, "should report max as p100");
+}
+
+static void test_hotkey(void) {
+    struct hotkey *hk;
+    struct stats_hotkey top[STATS_NHOTKEY];
+    char key[32];
+    int64_t now;
+    uint32_t i, n;
+
+    hk = hotkey_create(1);
+    if (hk == NULL) {
+        printf("FAIL could not allocate hot key detector\n");
+        failures++;
+        return;
+    }
+    now = hk->next_decay;
+
+    /* one hot key in a stream of 10k cold ones */
+    for (i = 0; i < 10000; i++) {
+        n = (uint32_t)snprintf(key, sizeof(key), "cold:%"PRIu32, i);
+        hotkey_record(hk, (uint8_t *)key, n, 1);
+        hotkey_record(hk, (uint8_t *)"hot", 3, 2);
+        if (i % 4 == 0) {
+            hotkey_record(hk, (uint8_t *)"warm", 4, 3);
+        }
+    }
+    n = hotkey_top(hk, top, STATS_NHOTKEY);
+    expect_same_uint32_t(STATS_NHOTKEY, n, "should report the most hot keys");
+    expect_same_int(1, top[0].keylen == 3 && memcmp(top[0].key, "hot", 3) == 0, "should rank the hot key first");
+    expect_same_uint32_t(2, top[0].server, "should report the server of the hot key");
+    expect_same_int(1, top[1].keylen == 4 && memcmp(top[1].key, "warm", 4) == 0, "should rank the warm key second");
+    expect_same_int(1, top[0].rate >= 5000 && top[0].rate <= 5500, "should estimate the rate of the hot key");
+    expect_same_int(1, top[2].rate < 100, "should not overestimate cold keys by much");
+
+    /* cold keys fade out after a few halvings, hot keys stay */
+    hotkey_decay(hk, now - 1);
+    n = hotkey_top(hk, top, STATS_NHOTKEY);
+    expect_same_int(1, top[0].rate >= 5000, "should not halve before the decay interval");
+    hotkey_decay(hk, now + 3 * HOTKEY_DECAY);
+    n = hotkey_top(hk, top, STATS_NHOTKEY);
+    expect_same_uint32_t(2, n, "should drop the cold keys after halving");
+    expect_same_int(1, top[0].rate >= 5000 / 16 && top[0].rate <= 5500 / 16, "should halve once per decay interval");
+    hotkey_decay(hk, now + 100 * HOTKEY_DECAY);
+    expect_same_uint32_t(0, hotkey_top(hk, top, STATS_NHOTKEY), "should forget all keys after a long idle time");
+
+    hotkey_destroy(hk);
+}
+
+/* Measure the cost of counting a sampled request in the hot key detector */
+static void bench_hotkey(void) {
+    const uint32_t nkey = 100000, nrecord = 1000000;
+    struct hotkey *hk;
+    char (*keys)[32];
+    uint32_t *keylen;
+    int64_t start, usec;
+    uint32_t i;
+
+    hk = hotkey_create(64);
+    keys = nc_alloc(sizeof(*keys) * nkey);
+    keylen = nc_alloc(sizeof(*keylen) * nkey);
+    if (hk == NULL || keys == NULL || keylen == NULL) {
+        printf("FAIL could not allocate %"PRIu32" keys\n", nkey);
+        failures++;
+        return;
+    }
+
+    for (i = 0; i < nkey; i++) {
+        keylen[i] = (uint32_t)snprintf(keys[i], sizeof(keys[i]), "user:session:%"PRIu32, i);
+    }
+
+    start = nc_usec_now();
+    for (i = 0; i < nrecord; i++) {
+        /* skew the keys so that a few of them are hot */
+        uint32_t k = (i & 1) ? i % 16 : (i * 2654435761u) % nkey;
+
+        hotkey_record(hk, (uint8_t *)keys[k], keylen[k], 0);
+    }
+    usec = nc_usec_now() - start;
+
+    printf("hot keys: %"PRIu32" samples in %"PRId64" usec, %"PRId64" nsec per sample, "
+           "%"PRId64" nsec per request at hotkey_sample: 64\n", nrecord, usec,
+           usec * 1000 / nrecord, usec * 1000 / nrecord / 64);
+    expect_same_int(1, usec * 1000 / nrecord < 10000, "should count a sample in less than 10 usec");
+
+    nc_free(keylen);
+    nc_free(keys);
+    hotkey_destroy(hk);
+}
+
+/* Return a redis response with data, over as many mbufs as it takes */
+static struct msg *test_near_cache_rsp(struct conn *conn, const uint8_t *data, uint32_t len) {
+    struct msg *rsp = msg_get(conn, 0, 1);
+    uint32_t off, n;
+
+    for (off = 0; off < len; off += n) {
+        n = MIN(len - off, (uint32_t)mbuf_data_size());
+        msg_append(rsp, data + off, n);
+    }
+
+    return rsp;
+}
+
+static bool test_near_cache_same(const struct msg *rsp, const uint8_t *data, uint32_t len) {
+    const struct mbuf *mbuf;
+    uint32_t off = 0;
+
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        uint32_t n = (uint32_t)(mbuf->last - mbuf->pos);
+
+        if (off + n > len || memcmp(mbuf->pos, data + off, n) != 0) {
+            return false;
+        }
+        off += n;
+    }
+
+    return off == len && rsp->mlen == len;
+}
+
+static void test_near_cache(void) {
+    static const uint8_t v1[] = "$2\r\nv1\r\n", v2[] = "$2\r\nv2\r\n";
+    struct string pattern;
+    struct conn fake_client = {0};
+    struct nearcache *cache;
+    struct nearcache_entry *e;
+    struct msg *rsp, *reply;
+    uint8_t *big;
+    uint32_t version, i, nevict, biglen;
+    int64_t now = 1000;
+    char key[16];
+
+    string_set_text(&pattern, "user:*:name");
+    expect_same_int(1, nearcache_match(&pattern, (uint8_t *)"user:42:name", 12), "should match a run of bytes for '*'");
+    expect_same_int(1, nearcache_match(&pattern, (uint8_t *)"user::name", 10), "should match no bytes for '*'");
+    expect_same_int(0, nearcache_match(&pattern, (uint8_t *)"user:42:names", 13), "should match the whole key");
+    expect_same_int(0, nearcache_match(&pattern, (uint8_t *)"users:42", 8), "should not match another prefix");
+    string_set_text(&pattern, "k?y*");
+    expect_same_int(1, nearcache_match(&pattern, (uint8_t *)"key", 3), "should match any byte for '?'");
+    expect_same_int(0, nearcache_match(&pattern, (uint8_t *)"ky", 2), "should match exactly one byte for '?'");
+
+    biglen = (uint32_t)mbuf_data_size() * 2 + 10;
+    cache = nearcache_create((size_t)biglen * 16, 100);
+    big = nc_alloc(biglen * 3);
+    if (cache == NULL || big == NULL) {
+        printf("FAIL could not allocate near cache\n");
+        failures++;
+        return;
+    }
+
+    /* a read caches its response until the ttl expires */
+    expect_same_ptr(NULL, nearcache_get(cache, (uint8_t *)"k", 1, now), "should miss an empty cache");
+    version = nearcache_version(cache, (uint8_t *)"k", 1);
+    rsp = test_near_cache_rsp(&fake_client, v1, sizeof(v1) - 1);
+    nearcache_set(cache, (uint8_t *)"k", 1, version, rsp, now);
+    msg_put(rsp);
+    e = nearcache_get(cache, (uint8_t *)"k", 1, now + 99);
+    expect_same_int(1, e != NULL && e->vlen == sizeof(v1) - 1 && memcmp(e->value, v1, e->vlen) == 0, "should hit the cached response");
+    expect_same_ptr(NULL, nearcache_get(cache, (uint8_t *)"k", 1, now + 100), "should miss once the ttl expired");
+    expect_same_uint32_t(0, (uint32_t)cache->used, "should drop the expired entry");
+
+    /* a write that races with a read keeps its response out */
+    version = nearcache_version(cache, (uint8_t *)"k", 1);
+    expect_same_int(0, nearcache_invalidate(cache, (uint8_t *)"k", 1), "should have nothing to invalidate");
+    rsp = test_near_cache_rsp(&fake_client, v1, sizeof(v1) - 1);
+    nearcache_set(cache, (uint8_t *)"k", 1, version, rsp, now);
+    msg_put(rsp);
+    expect_same_ptr(NULL, nearcache_get(cache, (uint8_t *)"k", 1, now), "should not cache a read that raced with a write");
+
+    /* a write drops the cached response */
+    version = nearcache_version(cache, (uint8_t *)"k", 1);
+    rsp = test_near_cache_rsp(&fake_client, v2, sizeof(v2) - 1);
+    nearcache_set(cache, (uint8_t *)"k", 1, version, rsp, now);
+    msg_put(rsp);
+    expect_same_int(1, nearcache_invalidate(cache, (uint8_t *)"k", 1), "should invalidate the cached response");
+    expect_same_ptr(NULL, nearcache_get(cache, (uint8_t *)"k", 1, now), "should miss after a write");
+
+    /* a response over several mbufs is replayed as is */
+    for (i = 0; i < biglen * 3; i++) {
+        big[i] = (uint8_t)('a' + i % 26);
+    }
+    version = nearcache_version(cache, (uint8_t *)"big", 3);
+    rsp = test_near_cache_rsp(&fake_client, big, biglen);
+    nearcache_set(cache, (uint8_t *)"big", 3, version, rsp, now);
+    msg_put(rsp);
+    e = nearcache_get(cache, (uint8_t *)"big", 3, now);
+    expect_same_int(1, e != NULL, "should cache a response over several mbufs");
+    if (e != NULL) {
+        reply = msg_get(&fake_client, 0, 1);
+        expect_same_int(NC_OK, nearcache_reply(e, reply), "should reply from the cache");
+        expect_same_int(1, test_near_cache_same(reply, big, biglen), "should reply with the cached response");
+        msg_put(reply);
+    }
+
+    /* the least recently used responses make room for new ones */
+    nevict = 0;
+    for (i = 0; i < 64; i++) {
+        snprintf(key, sizeof(key), "key%"PRIu32, i);
+        version = nearcache_version(cache, (uint8_t *)key, (uint32_t)strlen(key));
+        rsp = test_near_cache_rsp(&fake_client, big, biglen / 4);
+        nevict += nearcache_set(cache, (uint8_t *)key, (uint32_t)strlen(key), version, rsp, now);
+        msg_put(rsp);
+        nearcache_get(cache, (uint8_t *)"big", 3, now);
+    }
+    expect_same_int(1, nevict > 0, "should evict to stay within size");
+    expect_same_int(1, cache->used <= cache->size, "should stay within size");
+    expect_same_int(1, nearcache_get(cache, (uint8_t *)"big", 3, now) != NULL, "should keep the recently used response");
+    expect_same_ptr(NULL, nearcache_get(cache, (uint8_t *)"key0", 4, now), "should evict the least recently used response");
+
+    version = nearcache_version(cache, (uint8_t *)"huge", 4);
+    rsp = test_near_cache_rsp(&fake_client, big, biglen * 3);
+    nearcache_set(cache, (uint8_t *)"huge", 4, version, rsp, now);
+    msg_put(rsp);
+    expect_same_ptr(NULL, nearcache_get(cache, (uint8_t *)"huge", 4, now), "should not cache a response over 1/8 of the size");
+
+    nc_free(big);
+    nearcache_destroy(cache);
+}
+
+static void test_mbuf_share(void) {
+    struct conn fake_client = {0};
+    struct msg *src, *dst1, *dst2;
+    struct mbuf *base, *mbuf;
+    uint8_t *big;
+    uint32_t i, biglen;
+
+    biglen = (uint32_t)mbuf_data_size() * 2 + 10;
+    big = nc_alloc(biglen + 1);
+    if (big == NULL) {
+        printf("FAIL could not allocate shared data\n");
+        failures++;
+        return;
+    }
+    for (i = 0; i < biglen + 1; i++) {
+        big[i] = (uint8_t)('a' + i % 26);
+    }
+
+    src = test_near_cache_rsp(&fake_client, big, biglen);
+    base = STAILQ_FIRST(&src->mhdr);
+    dst1 = msg_get(&fake_client, 0, 1);
+    expect_same_int(NC_OK, msg_share_msg(dst1, src), "should share a response over several mbufs");
+    expect_same_int(1, test_near_cache_same(dst1, big, biglen), "should share the data of the response");
+    expect_same_ptr(base->pos, STAILQ_FIRST(&dst1->mhdr)->pos, "should not copy the shared data");
+    expect_same_uint32_t(2, base->refcount, "should count the mbufs holding the data");
+
+    /* the data outlives the msg it was shared from */
+    msg_put(src);
+    mbuf = mbuf_get();
+    expect_same_int(1, mbuf != base, "should not recycle an mbuf that is still shared");
+    mbuf_put(mbuf);
+
+    dst2 = msg_get(&fake_client, 0, 1);
+    expect_same_int(NC_OK, msg_share_msg(dst2, dst1), "should share a shared response");
+    expect_same_ptr(base, STAILQ_FIRST(&dst2->mhdr)->shared, "should share the data from the first mbuf");
+    msg_put(dst1);
+    expect_same_uint32_t(1, base->refcount, "should hold the data until the last mbuf is put");
+
+    expect_same_int(NC_OK, msg_append(dst2, big + biglen, 1), "should append to a shared response");
+    expect_same_int(1, test_near_cache_same(dst2, big, biglen + 1), "should append after the shared data");
+    msg_put(dst2);
+    expect_same_uint32_t(0, base->refcount, "should recycle an mbuf once it is no longer shared");
+
+    nc_free(big);
+}
+
+static struct msg *test_batch_rsp(struct conn *conn, const char *data, int redis) {
+    struct msg *rsp = msg_get(conn, 0, redis);
+
+    msg_append(rsp, (const uint8_t *)data, (uint32_t)strlen(data));
+    rsp->pos = STAILQ_FIRST(&rsp->mhdr)->pos;
+    if (redis) {
+        redis_parse_rsp(rsp);
+    } else {
+        memcache_parse_rsp(rsp);
+    }
+
+    return rsp;
+}
+
+static bool test_batch_unbatch(struct msg *batch, uint32_t idx, const char *expected) {
+    struct conn fake_client = {0};
+    struct msg *rsp = msg_get(&fake_client, 0, batch->redis);
+    bool same;
+
+    same = batch->unbatch(batch, idx, rsp) == NC_OK &&
+           test_near_cache_same(rsp, (const uint8_t *)expected, (uint32_t)strlen(expected));
+    msg_put(rsp);
+
+    return same;
+}
+
+static void test_batch_case(int redis, const char *request, const char *response, const char **expected) {
+    static const char *keys[] = { "a", "bb", "c" };
+    struct conn fake_client = {0};
+    struct msg *batch, *rsp;
+    uint32_t i;
+
+    batch = msg_get(&fake_client, 1, redis);
+    batch->is_batch = 1;
+    batch->type = redis ? MSG_REQ_REDIS_MGET : MSG_REQ_MC_GET;
+    batch->frag_seq = nc_alloc(3 * sizeof(*batch->frag_seq));
+    for (i = 0; i < 3; i++) {
+        struct msg *msg = msg_get(&fake_client, 1, redis);
+        struct keypos *kpos = array_push(msg->keys);
+
+        kpos->start = (uint8_t *)keys[i];
+        kpos->end = kpos->start + strlen(keys[i]);
+        batch->frag_seq[batch->nfrag++] = msg;
+    }
+
+    expect_same_int(NC_OK, batch->batch(batch), "should build the batch");
+    expect_same_int(1, test_near_cache_same(batch, (const uint8_t *)request, (uint32_t)strlen(request)), "should read every key in one request");
+
+    rsp = test_batch_rsp(&fake_client, response, redis);
+    batch->peer = rsp;
+    for (i = 0; i < 3; i++) {
+        expect_same_int(1, test_batch_unbatch(batch, i, expected[i]), "should split out the response to each read");
+    }
+    msg_put(rsp);
+
+    rsp = test_batch_rsp(&fake_client, redis ? "-ERR oops\r\n" : "SERVER_ERROR oops\r\n", redis);
+    batch->peer = rsp;
+    expect_same_int(0, test_batch_unbatch(batch, 0, ""), "should not split an error response");
+    msg_put(rsp);
+
+    batch->peer = NULL;
+    for (i = 0; i < 3; i++) {
+        msg_put(batch->frag_seq[i]);
+    }
+    msg_put(batch);
+}
+
+static void test_batch(void) {
+    static const char *redis_expected[] = { "$1\r\nx\r\n", "$-1\r\n", "$2\r\nyz\r\n" };
+    static const char *memcache_expected[] = { "VALUE a 0 1\r\nx\r\nEND\r\n", "END\r\n", "VALUE c 0 2\r\nyz\r\nEND\r\n" };
+
+    test_batch_case(1, "*4\r\n$4\r\nmget\r\n$1\r\na\r\n$2\r\nbb\r\n$1\r\nc\r\n",
+                    "*3\r\n$1\r\nx\r\n$-1\r\n$2\r\nyz\r\n", redis_expected);
+    test_batch_case(0, "get a bb c \r\n",
+                    "VALUE a 0 1\r\nx\r\nVALUE c 0 2\r\nyz\r\nEND\r\n", memcache_expected);
+}
+
+static int test_event_cb(void *arg, uint32_t events) {
+    return NC_OK;
+}
+
+/* Listen on a free port of 127.0.0.1 for a test server, which never accepts */
+static int test_listen(uint16_t *port) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int sd;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1;
+    }
+    if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(sd, 64) < 0 ||
+        getsockname(sd, (struct sockaddr *)&sin, &len) < 0) {
+        close(sd);
+        return -1;
+    }
+    *port = ntohs(sin.sin_port);
+
+    return sd;
+}
+
+/*
+ * Create a context for the pools of yml, whose servers are all the test
+ * server on port. Requests and responses are passed in by hand, so there
+ * are no proxies and the event loop never runs.
+ */
+static struct context *test_ctx_create(const char *yml, uint16_t port) {
+    char buf[1024];
+    struct context *ctx;
+
+    snprintf(buf, sizeof(buf), yml, port, port);
+
+    ctx = nc_zalloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    array_null(&ctx->pool);
+    array_null(&ctx->worker);
+    array_null(&ctx->drain);
+    ctx->tid = (pthread_t) -1;
+    ctx->max_timeout = STATS_INTERVAL;
+    ctx->timeout = ctx->max_timeout;
+
+    ctx->cf = test_config_create(buf);
+    if (ctx->cf == NULL) {
+        nc_free(ctx);
+        return NULL;
+    }
+
+    if (server_pool_init(&ctx->pool, &ctx->cf->pool, ctx) != NC_OK) {
+        conf_destroy(ctx->cf);
+        nc_free(ctx);
+        return NULL;
+    }
+
+    ctx->stats = stats_create(0, "127.0.0.1", STATS_INTERVAL, STATS_FORMAT, "test", &ctx->pool);
+    ctx->evb = ctx->stats == NULL ? NULL : event_base_create(64, test_event_cb);
+    if (ctx->evb == NULL) {
+        if (ctx->stats != NULL) {
+            stats_destroy(ctx->stats);
+        }
+        server_pool_deinit(&ctx->pool);
+        conf_destroy(ctx->cf);
+        nc_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static void test_ctx_destroy(struct context *ctx) {
+    uint32_t i;
+
+    for (i = 0; i < array_n(&ctx->pool); i++) {
+        struct server_pool *pool = array_get(&ctx->pool, i);
+
+        while (!TAILQ_EMPTY(&pool->c_conn_q)) {
+            struct conn *conn = TAILQ_FIRST(&pool->c_conn_q);
+            conn->close(ctx, conn);
+        }
+    }
+    server_pool_disconnect(ctx);
+
+    event_base_destroy(ctx->evb);
+    stats_destroy(ctx->stats);
+    server_pool_deinit(&ctx->pool);
+    conf_destroy(ctx->cf);
+    nc_free(ctx);
+}
+
+/* Return a client connection to pool idx of ctx */
+static struct conn *test_client(struct context *ctx, uint32_t idx) {
+    struct server_pool *pool = array_get(&ctx->pool, idx);
+    struct conn *conn;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return NULL;
+    }
+    close(sv[1]);
+
+    conn = conn_get(pool, true, pool->redis);
+    if (conn == NULL) {
+        close(sv[0]);
+        return NULL;
+    }
+    conn->sd = sv[0];
+    event_add_conn(ctx->evb, conn);
+
+    return conn;
+}
+
+static struct msg *test_parse(struct conn *conn, bool request, const char *data) {
+    struct msg *msg = msg_get(conn, request, conn->redis);
+
+    msg_append(msg, (const uint8_t *)data, strlen(data));
+    msg->pos = STAILQ_FIRST(&msg->mhdr)->pos;
+    msg->parser(msg);
+    if (msg->result != MSG_PARSE_OK) {
+        printf("FAIL could not parse %s\n", data);
+        failures++;
+    }
+
+    return msg;
+}
+
+/* Have client connection conn receive request data */
+static struct msg *test_recv_req(struct context *ctx, struct conn *conn, const char *data) {
+    struct msg *msg = test_parse(conn, true, data);
+
+    conn->rmsg = msg;
+    req_recv_done(ctx, conn, msg, NULL);
+
+    return msg;
+}
+
+/* Have server connection conn send the requests queued on it */
+static void test_send_reqs(struct context *ctx, struct conn *conn) {
+    if (conn->connecting) {
+        server_connected(ctx, conn);
+    }
+    while (!TAILQ_EMPTY(&conn->imsg_q)) {
+        req_send_done(ctx, conn, TAILQ_FIRST(&conn->imsg_q));
+    }
+}
+
+/* Have server connection conn receive response data */
+static void test_recv_rsp(struct context *ctx, struct conn *conn, const char *data) {
+    struct msg *msg = test_parse(conn, false, data);
+
+    conn->rmsg = msg;
+    rsp_recv_done(ctx, conn, msg, NULL);
+}
+
+/* Return the connection to the first server of pool idx of ctx, if any */
+static struct conn *test_server_conn(struct context *ctx, uint32_t idx) {
+    struct server_pool *pool = array_get(&ctx->pool, idx);
+    struct server *server = array_get(&pool->server, 0);
+
+    return TAILQ_FIRST(&server->s_conn_q);
+}
+
+static uint32_t test_nqueued(const struct conn *conn) {
+    const struct msg *msg;
+    uint32_t n = 0;
+
+    if (conn == NULL) {
+        return 0;
+    }
+    TAILQ_FOREACH(msg, &conn->imsg_q, s_tqe) {
+        n++;
+    }
+    TAILQ_FOREACH(msg, &conn->omsg_q, s_tqe) {
+        n++;
+    }
+
+    return n;
+}
+
+/* Return true if request msg was answered with response data */
+static bool test_answered(const struct msg *msg, const char *data) {
+    return msg->done && !msg->error && msg->peer != NULL &&
+           test_near_cache_same(msg->peer, (const uint8_t *)data, (uint32_t)strlen(data));
+}
+
+/* Drop the requests that client connection conn has answered */
+static void test_client_drain(struct context *ctx, struct conn *conn) {
+    while (!TAILQ_EMPTY(&conn->omsg_q) && TAILQ_FIRST(&conn->omsg_q)->done) {
+        struct msg *msg = TAILQ_FIRST(&conn->omsg_q);
+
+        conn->dequeue_outq(ctx, conn, msg);
+        req_put(msg);
+    }
+}
+
+static void test_coalesce(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  redis: true\n"
+        "  coalesce_reads: true\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    static const char get_k[] = "*2\r\n$3\r\nget\r\n$1\r\nk\r\n";
+    struct context *ctx;
+    struct conn *c[3], *s_conn;
+    struct msg *m1, *m2, *r[4], *w;
+    uint16_t port;
+    uint32_t i;
+    int sd;
+
+    sd = test_listen(&port);
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, port);
+    for (i = 0; ctx != NULL && i < NELEMS(c); i++) {
+        c[i] = test_client(ctx, 0);
+    }
+    if (ctx == NULL || c[0] == NULL || c[1] == NULL || c[2] == NULL) {
+        printf("FAIL could not create a context to coalesce reads\n");
+        failures++;
+        return;
+    }
+
+    /* reads are identical when they are made of the same bytes */
+    m1 = test_parse(c[0], true, get_k);
+    m2 = test_parse(c[1], true, get_k);
+    expect_same_int(1, req_same(m1, m2), "should find identical reads the same");
+    msg_put(m2);
+    m2 = test_parse(c[1], true, "*2\r\n$3\r\nGET\r\n$1\r\nk\r\n");
+    expect_same_int(0, req_same(m1, m2), "should not find reads of other bytes the same");
+    msg_put(m2);
+    m2 = test_parse(c[1], true, "*2\r\n$3\r\nget\r\n$1\r\nj\r\n");
+    expect_same_int(0, req_same(m1, m2), "should not find reads of another key the same");
+    msg_put(m2);
+    msg_put(m1);
+
+    /* identical reads wait on the first one and share its response */
+    for (i = 0; i < 3; i++) {
+        r[i] = test_recv_req(ctx, c[i], get_k);
+    }
+    s_conn = test_server_conn(ctx, 0);
+    expect_same_uint32_t(1, test_nqueued(s_conn), "should only forward the first of identical reads");
+    expect_same_int(1, r[0]->leader, "should have identical reads wait on the first one");
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, "$1\r\nv\r\n");
+    for (i = 0; i < 3; i++) {
+        expect_same_int(1, test_answered(r[i], "$1\r\nv\r\n"), "should answer every identical read");
+    }
+    expect_same_int(0, r[0]->leader, "should take a read that is done off the reads in flight");
+    expect_same_int(1, STAILQ_FIRST(&r[1]->peer->mhdr)->shared != NULL, "should share the response with the waiting reads");
+    for (i = 0; i < 3; i++) {
+        test_client_drain(ctx, c[i]);
+    }
+
+    /* the reads waiting on a failed read fail with it */
+    r[0] = test_recv_req(ctx, c[0], get_k);
+    r[1] = test_recv_req(ctx, c[1], get_k);
+    s_conn = test_server_conn(ctx, 0);
+    s_conn->err = ECONNRESET;
+    s_conn->close(ctx, s_conn);
+    for (i = 0; i < 2; i++) {
+        expect_same_int(1, r[i]->done && r[i]->error, "should fail the reads waiting on a failed read");
+        expect_same_int(ECONNRESET, r[i]->err, "should fail the waiting reads with the error of the read");
+        test_client_drain(ctx, c[i]);
+    }
+
+    /* a read does not wait on a read sent before a write to its key */
+    r[0] = test_recv_req(ctx, c[0], get_k);
+    w = test_recv_req(ctx, c[1], "*3\r\n$3\r\nset\r\n$1\r\nk\r\n$1\r\nw\r\n");
+    expect_same_int(1, r[0]->stale, "should mark a read of a key that is written as stale");
+    r[1] = test_recv_req(ctx, c[2], get_k);
+    s_conn = test_server_conn(ctx, 0);
+    expect_same_uint32_t(3, test_nqueued(s_conn), "should not wait on a read sent before a write to its key");
+    r[2] = test_recv_req(ctx, c[0], get_k);
+    expect_same_uint32_t(3, test_nqueued(s_conn), "should wait on a read sent after a write to its key");
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, "$1\r\nv\r\n");
+    test_recv_rsp(ctx, s_conn, "+OK\r\n");
+    test_recv_rsp(ctx, s_conn, "$1\r\nw\r\n");
+    expect_same_int(1, test_answered(r[0], "$1\r\nv\r\n"), "should answer the read sent before the write");
+    expect_same_int(1, test_answered(w, "+OK\r\n"), "should answer the write");
+    expect_same_int(1, test_answered(r[1], "$1\r\nw\r\n"), "should answer the read sent after the write");
+    expect_same_int(1, test_answered(r[2], "$1\r\nw\r\n"), "should answer the read waiting on the read sent after the write");
+
+    test_ctx_destroy(ctx);
+    close(sd);
+}
+
+static void test_batch_forward(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  redis: true\n"
+        "  batch_size: 3\n"
+        "  batch_delay: 100\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    static const char *get[] = {
+        "*2\r\n$3\r\nget\r\n$1\r\na\r\n",
+        "*2\r\n$3\r\nget\r\n$2\r\nbb\r\n",
+        "*2\r\n$3\r\nget\r\n$1\r\nc\r\n",
+    };
+    static const char *expected[] = { "$1\r\nx\r\n", "$-1\r\n", "$2\r\nyz\r\n" };
+    struct context *ctx;
+    struct conn *c[3], *s_conn;
+    struct msg *r[3];
+    uint16_t port;
+    uint32_t i;
+    int sd;
+
+    sd = test_listen(&port);
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, port);
+    for (i = 0; ctx != NULL && i < NELEMS(c); i++) {
+        c[i] = test_client(ctx, 0);
+    }
+    if (ctx == NULL || c[0] == NULL || c[1] == NULL || c[2] == NULL) {
+        printf("FAIL could not create a context to batch reads\n");
+        failures++;
+        return;
+    }
+
+    /* a batch is sent once it is full, and its response is split by read */
+    r[0] = test_recv_req(ctx, c[0], get[0]);
+    r[1] = test_recv_req(ctx, c[1], get[1]);
+    s_conn = test_server_conn(ctx, 0);
+    expect_same_uint32_t(0, test_nqueued(s_conn), "should hold the reads of a batch that is not full");
+    r[2] = test_recv_req(ctx, c[2], get[2]);
+    expect_same_uint32_t(1, test_nqueued(s_conn), "should send a full batch as one request");
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, "*3\r\n$1\r\nx\r\n$-1\r\n$2\r\nyz\r\n");
+    for (i = 0; i < 3; i++) {
+        expect_same_int(1, test_answered(r[i], expected[i]), "should answer every read of a batch");
+        test_client_drain(ctx, c[i]);
+    }
+
+    /* an error reply to a batch answers every read of it */
+    for (i = 0; i < 3; i++) {
+        r[i] = test_recv_req(ctx, c[i], get[i]);
+    }
+    s_conn = test_server_conn(ctx, 0);
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, "-ERR busy\r\n");
+    for (i = 0; i < 3; i++) {
+        expect_same_int(1, test_answered(r[i], "-ERR busy\r\n"), "should answer every read of a batch with an error reply");
+        expect_same_int(1, STAILQ_FIRST(&r[i]->peer->mhdr)->shared != NULL, "should share an error reply among the reads of a batch");
+        test_client_drain(ctx, c[i]);
+    }
+
+    /* the reads of a batch that was not sent fail when its server goes away */
+    r[0] = test_recv_req(ctx, c[0], get[0]);
+    r[1] = test_recv_req(ctx, c[1], get[1]);
+    s_conn = test_server_conn(ctx, 0);
+    s_conn->err = ECONNRESET;
+    s_conn->close(ctx, s_conn);
+    for (i = 0; i < 2; i++) {
+        expect_same_int(1, r[i]->done && r[i]->error, "should fail the reads of a batch that was not sent");
+        expect_same_int(ECONNRESET, r[i]->err, "should fail the reads of a batch that was not sent with the error");
+        test_client_drain(ctx, c[i]);
+    }
+
+    /* and so do the reads of a batch that was sent */
+    for (i = 0; i < 3; i++) {
+        r[i] = test_recv_req(ctx, c[i], get[i]);
+    }
+    s_conn = test_server_conn(ctx, 0);
+    test_send_reqs(ctx, s_conn);
+    s_conn->err = ECONNRESET;
+    s_conn->close(ctx, s_conn);
+    for (i = 0; i < 3; i++) {
+        expect_same_int(1, r[i]->done && r[i]->error, "should fail the reads of a batch that was sent");
+        expect_same_int(ECONNRESET, r[i]->err, "should fail the reads of a batch that was sent with the error");
+        test_client_drain(ctx, c[i]);
+    }
+
+    test_ctx_destroy(ctx);
+    close(sd);
+}
+
+static struct stats_metric *test_pool_metric(struct context *ctx, uint32_t idx, stats_pool_field_t fidx) {
+    struct stats_pool *stp = array_get(&ctx->stats->current, idx);
+
+    return array_get(&stp->metric, fidx);
+}
+
+static void test_mirror(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  redis: true\n"
+        "  mirror: bravo\n"
+        "  mirror_queue_size: 30\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n"
+        "bravo:\n"
+        "  listen: 127.0.0.1:22122\n"
+        "  redis: true\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    static const char get_k[] = "*2\r\n$3\r\nget\r\n$1\r\nk\r\n";
+    struct context *ctx;
+    struct server_pool *alpha, *bravo;
+    struct conn *c[2], *s_conn, *m_conn;
+    struct msg *r[2], *w;
+    uint16_t port;
+    uint32_t i;
+    int sd;
+
+    sd = test_listen(&port);
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, port);
+    for (i = 0; ctx != NULL && i < NELEMS(c); i++) {
+        c[i] = test_client(ctx, 0);
+    }
+    if (ctx == NULL || c[0] == NULL || c[1] == NULL) {
+        printf("FAIL could not create a context to mirror requests\n");
+        failures++;
+        return;
+    }
+    alpha = array_get(&ctx->pool, 0);
+    bravo = array_get(&ctx->pool, 1);
+    expect_same_ptr(bravo, alpha->mirror, "should link a pool to its mirror pool");
+
+    /* only reads are mirrored by default */
+    w = test_recv_req(ctx, c[0], "*3\r\n$3\r\nset\r\n$1\r\nk\r\n$1\r\nw\r\n");
+    expect_same_uint32_t(0, test_nqueued(test_server_conn(ctx, 1)), "should not mirror a write");
+    expect_same_int(0, (int)test_pool_metric(ctx, 0, STATS_POOL_mirrored_requests)->value.counter,
+                    "should not count a write as mirrored");
+
+    /* a read is copied to the mirror pool until its queues are full */
+    r[0] = test_recv_req(ctx, c[0], get_k);
+    m_conn = test_server_conn(ctx, 1);
+    expect_same_uint32_t(1, test_nqueued(m_conn), "should mirror a read");
+    expect_same_uint32_t(sizeof(get_k) - 1, (uint32_t)bravo->nqueue_bytes, "should count the bytes queued on the mirror pool");
+    r[1] = test_recv_req(ctx, c[1], get_k);
+    expect_same_uint32_t(1, test_nqueued(m_conn), "should drop a copy over mirror_queue_size");
+    expect_same_int(1, (int)test_pool_metric(ctx, 0, STATS_POOL_mirrored_requests)->value.counter,
+                    "should count the mirrored reads");
+    expect_same_int(1, (int)test_pool_metric(ctx, 0, STATS_POOL_mirror_drops)->value.counter,
+                    "should count the dropped copies");
+
+    /* the response of the copy is swallowed, but timed for the mirror pool */
+    test_send_reqs(ctx, m_conn);
+    test_recv_rsp(ctx, m_conn, "$1\r\nv\r\n");
+    expect_same_uint32_t(0, test_nqueued(m_conn), "should swallow the response of the copy");
+    expect_same_uint32_t(0, (uint32_t)bravo->nqueue_bytes, "should count no bytes queued on the mirror pool once answered");
+    if (stats_enabled) {
+        expect_same_int(1, (int)test_pool_metric(ctx, 1, STATS_POOL_read_latency)->value.histogram->count,
+                        "should record the latency of the copy for the mirror pool");
+    }
+
+    s_conn = test_server_conn(ctx, 0);
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, "+OK\r\n");
+    test_recv_rsp(ctx, s_conn, "$1\r\nw\r\n");
+    test_recv_rsp(ctx, s_conn, "$1\r\nw\r\n");
+    expect_same_int(1, test_answered(w, "+OK\r\n"), "should answer the write");
+    expect_same_int(1, test_answered(r[0], "$1\r\nw\r\n") && test_answered(r[1], "$1\r\nw\r\n"),
+                    "should answer the mirrored reads");
+    expect_same_uint32_t(0, (uint32_t)alpha->nqueue_bytes, "should count no bytes queued once answered");
+
+    /* a request of many keys could span many mirror servers */
+    w = test_recv_req(ctx, c[0], "*3\r\n$4\r\nmget\r\n$1\r\na\r\n$1\r\nb\r\n");
+    expect_same_uint32_t(1, test_nqueued(s_conn), "should forward a request of many keys");
+    expect_same_uint32_t(0, test_nqueued(m_conn), "should not mirror a request of many keys");
+    expect_same_int(1, (int)test_pool_metric(ctx, 0, STATS_POOL_mirrored_requests)->value.counter,
+                    "should not count a request of many keys as mirrored");
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, "*2\r\n$1\r\nv\r\n$-1\r\n");
+    for (i = 0; i < NELEMS(c); i++) {
+        test_client_drain(ctx, c[i]);
+    }
+
+    test_ctx_destroy(ctx);
+    close(sd);
+}
+
+/* Return the connection to server sidx of pool idx of ctx, if any */
+static struct conn *test_server_conn_idx(struct context *ctx, uint32_t idx, uint32_t sidx) {
+    struct server_pool *pool = array_get(&ctx->pool, idx);
+    struct server *server = array_get(&pool->server, sidx);
+
+    return TAILQ_FIRST(&server->s_conn_q);
+}
+
+static void test_redis_cluster_redirect(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  redis: true\n"
+        "  distribution: redis_cluster\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    struct context *ctx;
+    struct server_pool *alpha;
+    struct conn *c, *a_conn, *b_conn;
+    struct msg *r;
+    char to_a[64], to_b[64], slots[256];
+    uint16_t port[2];
+    uint32_t i;
+    int sd[2];
+
+    sd[0] = test_listen(&port[0]);
+    sd[1] = test_listen(&port[1]);
+    ctx = sd[0] < 0 || sd[1] < 0 ? NULL : test_ctx_create(yml, port[0]);
+    c = ctx == NULL ? NULL : test_client(ctx, 0);
+    if (c == NULL) {
+        printf("FAIL could not create a context to redirect requests\n");
         failures++;
-    } else {
-        /* printf("PASS (%s)\n", message); */
-        successes++;
+        return;
+    }
+    alpha = array_get(&ctx->pool, 0);
+    snprintf(to_a, sizeof(to_a), "-MOVED 12182 127.0.0.1:%d\r\n", port[0]);
+    snprintf(to_b, sizeof(to_b), "-MOVED 12182 127.0.0.1:%d\r\n", port[1]);
+
+    /* a MOVED to a node that is not a server yet adds it and moves the slot */
+    r = test_recv_req(ctx, c, "*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n");
+    a_conn = test_server_conn_idx(ctx, 0, 0);
+    test_send_reqs(ctx, a_conn);
+    test_recv_rsp(ctx, a_conn, to_b);
+    expect_same_uint32_t(2, array_n(&alpha->server), "should add the node named by MOVED");
+    expect_same_uint32_t(1, server_pool_idx(alpha, (const uint8_t *)"foo", 3), "should move the slot to the node named by MOVED");
+    b_conn = test_server_conn_idx(ctx, 0, 1);
+    expect_same_uint32_t(1, test_nqueued(b_conn), "should forward the request again to the node named by MOVED");
+    expect_same_int(0, r->done, "should not answer a redirected request");
+
+    /* the slot map comes with the reply to the CLUSTER SLOTS sent on connect */
+    snprintf(slots, sizeof(slots),
+             "*2\r\n"
+             "*3\r\n:0\r\n:8191\r\n*2\r\n$9\r\n127.0.0.1\r\n:%d\r\n"
+             "*3\r\n:8192\r\n:16383\r\n*2\r\n$9\r\n127.0.0.3\r\n:%d\r\n", port[0], port[0]);
+    test_recv_rsp(ctx, a_conn, slots);
+    expect_same_uint32_t(3, array_n(&alpha->server), "should add the masters of CLUSTER SLOTS");
+    expect_same_uint32_t(2, server_pool_idx(alpha, (const uint8_t *)"foo", 3), "should load the slot map of CLUSTER SLOTS");
+    expect_same_uint32_t(0, test_nqueued(a_conn), "should swallow the reply to CLUSTER SLOTS");
+
+    /* an ASK is followed after ASKING, without moving the slot */
+    snprintf(slots, sizeof(slots), "-ASK 12182 127.0.0.1:%d\r\n", port[0]);
+    test_send_reqs(ctx, b_conn);
+    test_recv_rsp(ctx, b_conn, slots);
+    expect_same_uint32_t(2, test_nqueued(a_conn), "should forward the request again to the node named by ASK");
+    expect_same_int(MSG_REQ_REDIS_ASKING, TAILQ_FIRST(&a_conn->imsg_q)->type, "should send ASKING first");
+    expect_same_uint32_t(2, server_pool_idx(alpha, (const uint8_t *)"foo", 3), "should not move the slot on ASK");
+    test_send_reqs(ctx, a_conn);
+    test_recv_rsp(ctx, a_conn, "+OK\r\n");
+
+    /* a request bounced between the nodes is answered after 5 redirects */
+    for (i = 0; i < 3; i++) {
+        test_recv_rsp(ctx, i % 2 == 0 ? a_conn : b_conn, i % 2 == 0 ? to_b : to_a);
+        test_send_reqs(ctx, i % 2 == 0 ? b_conn : a_conn);
     }
+    expect_same_int(0, r->done, "should redirect a request 5 times");
+    test_recv_rsp(ctx, b_conn, to_a);
+    expect_same_int(1, test_answered(r, to_a), "should answer with the redirect after 5 redirects");
+    expect_same_uint32_t(0, test_nqueued(a_conn) + test_nqueued(b_conn), "should not redirect a request more than 5 times");
+
+    expect_same_int(4, (int)test_pool_metric(ctx, 0, STATS_POOL_redirect_moved)->value.counter,
+                    "should count the MOVED redirects");
+    expect_same_int(1, (int)test_pool_metric(ctx, 0, STATS_POOL_redirect_ask)->value.counter,
+                    "should count the ASK redirects");
+    expect_same_int(1, (int)test_pool_metric(ctx, 0, STATS_POOL_slots_refresh)->value.counter,
+                    "should count the slot map refreshes");
+
+    test_client_drain(ctx, c);
+    test_ctx_destroy(ctx);
+    close(sd[0]);
+    close(sd[1]);
 }
 
-static void expect_same_uint32_t(uint32_t expected, uint32_t actual, const char* message) {
-    if (expected != actual) {
-        printf("FAIL Expected %u, got %u (%s)\n", (unsigned int) expected,
-                (unsigned int) actual, message);
+static void test_stats_family(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:22121\n"
+        "  redis: true\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n"
+        "bravo:\n"
+        "  listen: 127.0.0.1:22122\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    static const struct {
+        uint32_t idx;
+        const char *data;
+        msg_family_t family;
+    } reqs[] = {
+        { 0, "*2\r\n$3\r\nget\r\n$1\r\nk\r\n", MSG_FAMILY_STRING },
+        { 0, "*3\r\n$5\r\npfadd\r\n$1\r\nk\r\n$1\r\nv\r\n", MSG_FAMILY_STRING },
+        { 0, "*3\r\n$6\r\nexpire\r\n$1\r\nk\r\n$1\r\n1\r\n", MSG_FAMILY_KEY },
+        { 0, "*4\r\n$4\r\nhset\r\n$1\r\nk\r\n$1\r\nf\r\n$1\r\nv\r\n", MSG_FAMILY_HASH },
+        { 0, "*3\r\n$5\r\nrpush\r\n$1\r\nk\r\n$1\r\nv\r\n", MSG_FAMILY_LIST },
+        { 0, "*3\r\n$4\r\nsadd\r\n$1\r\nk\r\n$1\r\nv\r\n", MSG_FAMILY_SET },
+        { 0, "*5\r\n$6\r\ngeoadd\r\n$1\r\nk\r\n$1\r\n0\r\n$1\r\n0\r\n$1\r\nv\r\n", MSG_FAMILY_ZSET },
+        { 0, "*4\r\n$7\r\nevalsha\r\n$1\r\ns\r\n$1\r\n1\r\n$1\r\nk\r\n", MSG_FAMILY_SCRIPT },
+        { 0, "*1\r\n$4\r\nping\r\n", MSG_FAMILY_NONE },
+        { 1, "get k\r\n", MSG_FAMILY_STRING },
+        { 1, "incr k 1\r\n", MSG_FAMILY_STRING },
+        { 1, "delete k\r\n", MSG_FAMILY_KEY },
+        { 1, "touch k 0\r\n", MSG_FAMILY_KEY },
+    };
+    struct context *ctx;
+    struct conn *c[2], *s_conn;
+    struct msg *msg;
+    uint16_t port;
+    uint32_t i;
+    int sd;
+
+    sd = test_listen(&port);
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, port);
+    for (i = 0; ctx != NULL && i < NELEMS(c); i++) {
+        c[i] = test_client(ctx, i);
+    }
+    if (ctx == NULL || c[0] == NULL || c[1] == NULL) {
+        printf("FAIL could not create a context to time command families\n");
         failures++;
-    } else {
-        /* printf("PASS (%s)\n", message); */
-        successes++;
+        return;
+    }
+
+    for (i = 0; i < NELEMS(reqs); i++) {
+        msg = test_parse(c[reqs[i].idx], true, reqs[i].data);
+        expect_same_int(reqs[i].family, msg->family(msg), "should put a command in its family");
+        msg_put(msg);
+    }
+
+    /* the latency of a request is recorded for its family */
+    msg = test_recv_req(ctx, c[0], "*4\r\n$4\r\nhset\r\n$1\r\nk\r\n$1\r\nf\r\n$1\r\nv\r\n");
+    s_conn = test_server_conn(ctx, 0);
+    test_send_reqs(ctx, s_conn);
+    test_recv_rsp(ctx, s_conn, ":1\r\n");
+    expect_same_int(1, test_answered(msg, ":1\r\n"), "should answer the hash request");
+    if (stats_enabled) {
+        expect_same_int(1, (int)test_pool_metric(ctx, 0, STATS_POOL_hash_latency)->value.histogram->count,
+                        "should record the latency of a request for its family");
+        expect_same_int(0, (int)test_pool_metric(ctx, 0, STATS_POOL_string_latency)->value.histogram->count,
+                        "should record no latency for other families");
+    }
+    test_client_drain(ctx, c[0]);
+
+    test_ctx_destroy(ctx);
+    close(sd);
+}
+
+static struct conn *test_event_conn;
+static uint32_t test_event_events;
+
+static int test_event_recv_cb(void *arg, uint32_t events) {
+    if (arg == test_event_conn) {
+        test_event_events |= events;
     }
+    return NC_OK;
 }
 
-static void expect_same_ptr(const void *expected, const void *actual, const char* message) {
-    if (expected != actual) {
-        printf("FAIL Expected %p, got %p (%s)\n", expected, actual, message);
+/* Wait for events on test_event_conn; return the events */
+static uint32_t test_event_recv_wait(struct context *ctx) {
+    int i;
+
+    test_event_events = 0;
+    for (i = 0; i < 10 && !(test_event_events & (EVENT_READ | EVENT_ERR)); i++) {
+        event_wait(ctx->evb, 100);
+    }
+
+    return test_event_events;
+}
+
+/*
+ * Receive on a client connection through the event base, which reads on
+ * the connection or copies out of the buffers it completed into
+ */
+static void test_event_recv(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:%d\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    static uint8_t out[20000], in[sizeof(out) + 1];
+    struct context *ctx;
+    struct conn *conn;
+    size_t i, nin;
+    ssize_t n;
+    uint16_t port;
+    int sd, sv[2], eof;
+
+    sd = test_listen(&port);
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, port);
+    if (ctx == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        printf("FAIL could not create a context to receive on\n");
         failures++;
-    } else {
-        /* printf("PASS (%s)\n", message); */
-        successes++;
+        return;
+    }
+    event_base_destroy(ctx->evb);
+    ctx->evb = event_base_create(64, test_event_recv_cb);
+
+    conn = conn_get(array_get(&ctx->pool, 0), true, false);
+    conn->sd = sv[0];
+    nc_set_nonblocking(conn->sd);
+    test_event_conn = conn;
+    expect_same_int(NC_OK, event_add_conn(ctx->evb, conn), "should add a connection to receive on");
+
+    for (i = 0; i < sizeof(out); i++) {
+        out[i] = (uint8_t)(i * 7);
+    }
+    expect_same_int((int)sizeof(out), (int)write(sv[1], out, sizeof(out)), "should send to the connection");
+
+    /* data spanning several reads is received in order, up to a short read */
+    for (nin = 0, eof = 0; nin < sizeof(out) && !eof; ) {
+        if (!(test_event_recv_wait(ctx) & EVENT_READ)) {
+            break;
+        }
+        conn->recv_ready = 1;
+        while (conn->recv_ready) {
+            n = conn_recv(conn, in + nin, MIN(4096, sizeof(in) - nin));
+            if (n > 0) {
+                nin += (size_t)n;
+            } else if (n == 0) {
+                eof = 1;
+            }
+        }
+    }
+    expect_same_int((int)sizeof(out), (int)nin, "should receive all data sent");
+    expect_same_int(0, memcmp(in, out, sizeof(out)), "should receive data in order");
+
+    conn->recv_ready = 1;
+    expect_same_int(NC_EAGAIN, (int)conn_recv(conn, in, sizeof(in)), "should not be ready once drained");
+    expect_same_int(0, conn->recv_ready, "should clear ready once drained");
+
+    /* eof is seen after the data */
+    expect_same_int(1, (int)write(sv[1], "x", 1), "should send to the connection");
+    close(sv[1]);
+    for (nin = 0, n = -1, i = 0; i < 10 && n != 0; i++) {
+        conn->recv_ready = 1;
+        n = conn_recv(conn, in, sizeof(in));
+        if (n > 0) {
+            nin += (size_t)n;
+        } else if (n != 0) {
+            test_event_recv_wait(ctx);
+        }
     }
+    expect_same_int(1, (int)nin, "should receive data before eof");
+    expect_same_int(0, (int)n, "should receive eof");
+    expect_same_int(1, conn->eof, "should mark eof");
+
+    test_event_conn = NULL;
+    test_ctx_destroy(ctx);
+    close(sd);
 }
 
-static void test_hash_algorithms(void) {
-    /* refer to libmemcached tests/hash_results.h */
-    expect_same_uint32_t(2297466611U, hash_one_at_a_time("apple", 5), "should have expected one_at_a_time hash for key \"apple\"");
-    expect_same_uint32_t(3195025439U, hash_md5("apple", 5), "should have expected md5 hash for key \"apple\"");
+/* Run as the new process of test_upgrade, which takes listener name */
+static int test_upgrade_child(const char *name) {
+    if (upgrade_init() != NC_OK || upgrade_listener(name) < 0) {
+        return 1;
+    }
 
-    expect_same_uint32_t(3662830516U, hash_crc16("apple", 5), "should have expected crc16 hash for key \"apple\"");
-    expect_same_uint32_t(10542U,      hash_crc32("apple", 5), "should have expected crc32 hash for key \"apple\"");
-    expect_same_uint32_t(2838417488U, hash_crc32a("apple", 5), "should have expected crc32a hash for key \"apple\"");
-    expect_same_uint32_t(67176023U,   hash_fnv1_32("apple", 5), "should have expected fnv1_32 hash for key \"apple\"");
-    expect_same_uint32_t(280767167U,  hash_fnv1a_32("apple", 5), "should have expected fnv1a_32 hash for key \"apple\"");
-    expect_same_uint32_t(473199127U,  hash_fnv1_64("apple", 5), "should have expected fnv1_64 hash for key \"apple\"");
-    expect_same_uint32_t(1488911807U, hash_fnv1a_64("apple", 5), "should have expected fnv1a_64 hash for key \"apple\"");
-    expect_same_uint32_t(3738850110U, hash_hsieh("apple", 5), "should have expected hsieh hash for key \"apple\"");
-    expect_same_uint32_t(1442444624U, hash_jenkins("apple", 5), "should have expected jenkins hash for key \"apple\"");
-    expect_same_uint32_t(4142305122U, hash_murmur("apple", 5), "should have expected murmur hash for key \"apple\"");
-    /* The above have exactly the same result as libmemcached/tests/hash_results.h */
+    return upgrade_done() == NC_OK ? 0 : 1;
+}
 
-    expect_same_uint32_t(3853726576U, ketama_hash("server1-8", strlen("server1-8"), 0), "should have expected ketama_hash for server1-8 index 0");
-    expect_same_uint32_t(2667054752U, ketama_hash("server1-8", strlen("server1-8"), 3), "should have expected ketama_hash for server1-8 index 3");
+static rstatus_t test_upgrade_wait(struct context *ctx) {
+    rstatus_t status;
+    int i;
+
+    for (i = 0, status = NC_EAGAIN; i < 100 && status == NC_EAGAIN; i++) {
+        event_wait(ctx->evb, 100);
+        status = upgrade_wait(ctx);
+    }
+
+    return status;
+}
+
+static void test_upgrade(const char *argv0) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:%d\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    char name[UPGRADE_NAMELEN], *argv[3];
+    struct instance nci;
+    struct context *ctx;
+    struct server_pool *pool;
+    uint16_t port;
+    int sd;
+
+    /* the pool listens on a free port, which its server is never on */
+    sd = test_listen(&port);
+    if (sd >= 0) {
+        close(sd);
+    }
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, port);
+    if (ctx == NULL) {
+        printf("FAIL could not create a context to upgrade\n");
+        failures++;
+        return;
+    }
+
+    /* the channel to the new process is read by the core */
+    event_base_destroy(ctx->evb);
+    ctx->evb = event_base_create(64, core_core);
+    if (ctx->evb == NULL || proxy_init(ctx) != NC_OK) {
+        printf("FAIL could not listen to upgrade\n");
+        failures++;
+        return;
+    }
+
+    memset(&nci, 0, sizeof(nci));
+    nci.argv = argv;
+    ctx->nci = &nci;
+
+    pool = array_get(&ctx->pool, 0);
+    nc_snprintf(name, sizeof(name), "pool %.*s", pool->addrstr.len, pool->addrstr.data);
+    argv[0] = (char *)argv0;
+    argv[1] = name;
+    argv[2] = NULL;
+
+    expect_same_int(NC_OK, upgrade_start(ctx), "should start the new process of an upgrade");
+    expect_same_int(NC_EAGAIN, upgrade_wait(ctx), "should not block on the new process of an upgrade");
+    expect_same_int(NC_OK, test_upgrade_wait(ctx), "should hand the listeners over to the new process");
+
+    /* the new process does not ack without the listener it wants */
+    argv[1] = "pool 127.0.0.1:1";
+    expect_same_int(NC_OK, upgrade_start(ctx), "should start the new process of another upgrade");
+    expect_same_int(NC_ERROR, test_upgrade_wait(ctx), "should fail an upgrade the new process does not ack");
+
+    while (waitpid(-1, NULL, 0) > 0) {
+    }
+
+    proxy_deinit(ctx);
+    test_ctx_destroy(ctx);
+}
+
+/* Connect to the stats server on port and send it data */
+static int test_stats_connect(uint16_t port, const char *data) {
+    struct sockaddr_in sin;
+    struct timeval tv = { 3, 0 };
+    int sd;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+
+    sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1;
+    }
+    if (connect(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        send(sd, data, strlen(data), MSG_NOSIGNAL) < 0) {
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+/* Read the response on sd until the stats server closes it */
+static size_t test_stats_recv(int sd, char *buf, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < size - 1 && (n = recv(sd, buf + len, size - 1 - len, 0)) > 0) {
+        len += (size_t)n;
+    }
+    buf[len] = '\0';
+    close(sd);
+
+    return len;
+}
+
+/*
+ * Create a context for the pools of yml, like test_ctx_create, whose stats
+ * and those of worker, if any, are served in the prometheus format by an
+ * aggregator thread on port
+ */
+static struct context *test_stats_start(const char *yml, const char *source, struct context *worker,
+                                        uint16_t *port) {
+    struct context *ctx;
+    int sd;
+
+    sd = test_listen(port);
+    if (sd >= 0) {
+        close(sd);
+    }
+    ctx = sd < 0 ? NULL : test_ctx_create(yml, *port);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    /* the stats server listens on another free port */
+    sd = test_listen(port);
+    if (sd >= 0) {
+        close(sd);
+    }
+    stats_destroy(ctx->stats);
+    ctx->stats = stats_create(*port, "127.0.0.1", 50, STATS_FORMAT_PROMETHEUS, source, &ctx->pool);
+    if (sd < 0 || ctx->stats == NULL ||
+        (worker != NULL && stats_add_worker(ctx->stats, worker->stats) != NC_OK) ||
+        stats_start_aggregator(ctx->stats) != NC_OK) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static void test_stats_stop(struct context *ctx) {
+    /* the aggregator thread quits the next time it wakes up */
+    stats_handoff(ctx->stats);
+    pthread_join(ctx->stats->tid, NULL);
+    test_ctx_destroy(ctx);
+}
+
+static void test_stats_http(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:%d\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1\n";
+    struct context *ctx;
+    char buf[65536];
+    uint16_t port;
+    int64_t start;
+    int sd, i;
+
+    if (!stats_enabled) {
+        return;
+    }
+
+    ctx = test_stats_start(yml, "test", NULL, &port);
+    if (ctx == NULL) {
+        printf("FAIL could not serve stats over http\n");
+        failures++;
+        return;
+    }
+
+    /* a request that arrives in pieces is read as they come */
+    buf[0] = '\0';
+    sd = test_stats_connect(port, "GET /metr");
+    usleep(100000);
+    if (sd >= 0) {
+        send(sd, "ics HTTP/1.0\r\n\r\n", 16, MSG_NOSIGNAL);
+        test_stats_recv(sd, buf, sizeof(buf));
+    }
+    expect_same_int(0, strncmp(buf, "HTTP/1.0 200 OK", 15), "should answer a GET of /metrics");
+    expect_same_int(1, strstr(buf, "nutcracker_pool_client_connections{pool=\"alpha\"") != NULL,
+                    "should expose the pool metrics");
+
+    buf[0] = '\0';
+    sd = test_stats_connect(port, "GET /other HTTP/1.0\r\n\r\n");
+    if (sd >= 0) {
+        test_stats_recv(sd, buf, sizeof(buf));
+    }
+    expect_same_int(0, strncmp(buf, "HTTP/1.0 404 Not Found", 22), "should not answer a GET of another path");
+
+    /* a client that trickles its request in is dropped at the deadline */
+    start = nc_msec_now();
+    sd = test_stats_connect(port, "G");
+    for (i = 0; sd >= 0 && i < 15; i++) {
+        usleep(200000);
+        if (send(sd, "E", 1, MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    if (sd >= 0) {
+        test_stats_recv(sd, buf, sizeof(buf));
+    }
+    expect_same_int(1, nc_msec_now() - start < 2 * STATS_HTTP_TIMEOUT,
+                    "should drop a slow http client at its deadline");
+
+    test_stats_stop(ctx);
+}
+
+static void test_stats_mean(void) {
+    static const char yml[] =
+        "alpha:\n"
+        "  listen: 127.0.0.1:%d\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1 beta\n";
+    struct context *ctx, *worker;
+    struct server_pool *pool;
+    char buf[65536];
+    uint16_t port;
+    int sd;
+
+    if (!stats_enabled) {
+        return;
+    }
+
+    sd = test_listen(&port);
+    if (sd >= 0) {
+        close(sd);
+    }
+    worker = sd < 0 ? NULL : test_ctx_create(yml, port);
+    ctx = worker == NULL ? NULL : test_stats_start(yml, "test", worker, &port);
+    if (ctx == NULL) {
+        printf("FAIL could not serve stats over http\n");
+        failures++;
+        if (worker != NULL) {
+            test_ctx_destroy(worker);
+        }
+        return;
+    }
+
+    /*
+     * the moving averages of the main context and its worker are averaged,
+     * but only over those that talk to the server
+     */
+    pool = array_get(&ctx->pool, 0);
+    stats_server_set_mean(ctx, array_get(&pool->server, 0), latency_ewma, 0, 100);
+    stats_server_set_mean(ctx, array_get(&pool->server, 0), read_score, 0, 400);
+    stats_server_set_mean(ctx, array_get(&pool->server, 0), read_score, 400, 500);
+    stats_server_incr_by(ctx, array_get(&pool->server, 0), requests, 1);
+    stats_swap(ctx->stats);
+    pool = array_get(&worker->pool, 0);
+    stats_server_set_mean(worker, array_get(&pool->server, 0), latency_ewma, 0, 300);
+    stats_server_incr_by(worker, array_get(&pool->server, 0), requests, 1);
+    stats_swap(worker->stats);
+    usleep(200000);
+
+    buf[0] = '\0';
+    sd = test_stats_connect(port, "GET /metrics HTTP/1.0\r\n\r\n");
+    if (sd >= 0) {
+        test_stats_recv(sd, buf, sizeof(buf));
+    }
+    expect_same_int(1, strstr(buf, "nutcracker_server_latency_ewma{pool=\"alpha\",server=\"beta\"} 200\n") != NULL,
+                    "should report the mean of a moving average over the workers");
+    expect_same_int(1, strstr(buf, "nutcracker_server_read_score{pool=\"alpha\",server=\"beta\"} 500\n") != NULL,
+                    "should not average in the workers that have no moving average");
+    expect_same_int(1, strstr(buf, "nutcracker_server_requests_total{pool=\"alpha\",server=\"beta\"} 2\n") != NULL,
+                    "should report the sum of a counter over the workers");
+
+    test_stats_stop(ctx);
+    test_ctx_destroy(worker);
+}
+
+static void test_stats_prometheus(void) {
+    static const char yml[] =
+        "\"al\\\\ph\\\"a\":\n"
+        "  listen: 127.0.0.1:%d\n"
+        "  servers:\n"
+        "   - 127.0.0.1:%d:1 \"be\\\"ta\"\n";
+    struct context *ctx;
+    struct hotkey *hk;
+    char buf[65536], key[STATS_HOTKEY_KEYLEN], *body, *line;
+    uint16_t port;
+    uint32_t i, n;
+    size_t len;
+    int sd;
+
+    if (!stats_enabled) {
+        return;
+    }
+
+    ctx = test_stats_start(yml, "te\"st\\\n", NULL, &port);
+    if (ctx == NULL) {
+        printf("FAIL could not serve stats over http\n");
+        failures++;
+        return;
+    }
+
+    /* hot keys whose text is the longest once escaped fill the buffer up */
+    hk = hotkey_create(1);
+    for (i = 0; hk != NULL && i < STATS_NHOTKEY; i++) {
+        memset(key, '\\', sizeof(key));
+        key[0] = (char)('0' + i);
+        hotkey_record(hk, (uint8_t *)key, sizeof(key), 0);
+    }
+    if (hk != NULL) {
+        stats_pool_set_hotkeys(ctx, array_get(&ctx->pool, 0), hot_keys, hk);
+        stats_swap(ctx->stats);
+        hotkey_destroy(hk);
+    }
+    usleep(200000);
+
+    buf[0] = '\0';
+    sd = test_stats_connect(port, "GET /metrics HTTP/1.0\r\n\r\n");
+    if (sd >= 0) {
+        test_stats_recv(sd, buf, sizeof(buf));
+    }
+    body = strstr(buf, CRLF CRLF);
+    expect_same_int(1, body != NULL && sscanf(buf, "HTTP/1.0 200 OK" CRLF "Content-Type: %*s %*s" CRLF
+                                                   "Content-Length: %zu", &len) == 1 &&
+                       len == strlen(body + 4),
+                    "should fit the prometheus text in the stats buffer");
+    body = body == NULL ? buf : body + 4;
+
+    /* label values escape backslash, double quote and line feed */
+    expect_same_int(1, strstr(body, "nutcracker_info{source=\"te\\\"st\\\\\\n\",") != NULL,
+                    "should escape the source label");
+    expect_same_int(1, strstr(body, "nutcracker_pool_client_eof_total{pool=\"al\\\\ph\\\"a\"} 0\n") != NULL,
+                    "should escape the pool label");
+    expect_same_int(1, strstr(body, ",server=\"\\\"be\\\\\\\"ta\\\"\"} 0\n") != NULL,
+                    "should escape the server label");
+    expect_same_int(1, strstr(body, ",key=\"9\\\\x5c\\\\x5c") != NULL, "should escape the hot key label");
+
+    /* counters are suffixed with _total and histograms are summaries */
+    expect_same_int(1, strstr(body, "# TYPE nutcracker_pool_client_eof_total counter\n") != NULL,
+                    "should suffix counters with _total");
+    expect_same_int(1, strstr(body, "# TYPE nutcracker_server_latency summary\n") != NULL &&
+                       strstr(body, ",quantile=\"0.99\"} ") != NULL &&
+                       strstr(body, "nutcracker_server_latency_count{") != NULL,
+                    "should export histograms as summaries");
+
+    /* every line is a comment on a family or a sample of it */
+    n = 0;
+    line = body;
+    while (*line != '\0') {
+        if (strncmp(line, "# HELP nutcracker_", 18) != 0 &&
+            strncmp(line, "# TYPE nutcracker_", 18) != 0 &&
+            strncmp(line, "nutcracker_", 11) != 0) {
+            break;
+        }
+        n += strncmp(line, "nutcracker_pool_hot_keys{", 25) == 0;
+        if (strchr(line, '\n') == NULL) {
+            break;
+        }
+        line = strchr(line, '\n') + 1;
+    }
+    expect_same_int('\0', *line, "should only have family comments and samples");
+    expect_same_uint32_t(STATS_NHOTKEY, n, "should have a sample for every hot key");
+
+    test_stats_stop(ctx);
 }
 
 static void test_config_parsing(void) {
@@ -73,6 +2508,120 @@ static void test_config_parsing(void) {
     }
 }
 
+static void test_timer_wheel(void) {
+    struct wheel wheel;
+    struct wheel_node nodes[4], *node;
+    int64_t now = 1000;
+    int i;
+
+    wheel_init(&wheel, now);
+    for (i = 0; i < 4; i++) {
+        wheel_node_init(&nodes[i]);
+    }
+    expect_same_int(-1, (int)wheel_next(&wheel), "should have no next expiry in empty wheel");
+
+    nodes[0].key = now + 10;        /* root wheel */
+    nodes[1].key = now + 300;       /* first upper wheel */
+    nodes[2].key = now + 100000;    /* second upper wheel */
+    nodes[3].key = now + 20;
+    for (i = 0; i < 4; i++) {
+        wheel_insert(&wheel, &nodes[i]);
+    }
+    expect_same_int((int)(now + 10), (int)wheel_next(&wheel), "should have next expiry of nearest node");
+
+    wheel_delete(&wheel, &nodes[3]);
+    expect_same_ptr(NULL, wheel_expire(&wheel, now + 9), "should not expire node before its key");
+    expect_same_ptr(&nodes[0], wheel_expire(&wheel, now + 10), "should expire node at its key");
+    wheel_delete(&wheel, &nodes[0]);
+    expect_same_ptr(NULL, wheel_expire(&wheel, now + 299), "should not expire cascaded node early");
+    expect_same_ptr(&nodes[1], wheel_expire(&wheel, now + 300), "should expire cascaded node at its key");
+    wheel_delete(&wheel, &nodes[1]);
+    expect_same_ptr(NULL, wheel_expire(&wheel, now + 99999), "should not expire node in second upper wheel early");
+    expect_same_ptr(&nodes[2], wheel_expire(&wheel, now + 100000), "should expire node in second upper wheel at its key");
+    wheel_delete(&wheel, &nodes[2]);
+
+    /* expired before insert */
+    nodes[0].key = now;
+    wheel_insert(&wheel, &nodes[0]);
+    node = wheel_expire(&wheel, now + 100000);
+    expect_same_ptr(&nodes[0], node, "should expire node inserted in the past");
+    wheel_delete(&wheel, &nodes[0]);
+    expect_same_int(-1, (int)wheel_next(&wheel), "should have no next expiry after all nodes are deleted");
+}
+
+/*
+ * Compare the timeout rbtree and wheel with 1M outstanding timers. Every
+ * timer is inserted and later deleted as on the request path, and then a
+ * second batch is left to expire.
+ */
+static void bench_timer_wheel(void) {
+    const int ntimer = 1000000;
+    struct rbtree tree;
+    struct rbnode sentinel, *rbnodes;
+    struct wheel *wheel;
+    struct wheel_node *wnodes;
+    int64_t now = 1000000, start, rbtree_usec, wheel_usec;
+    int i, nexpired;
+
+    rbnodes = nc_alloc(sizeof(*rbnodes) * (size_t)ntimer);
+    wnodes = nc_alloc(sizeof(*wnodes) * (size_t)ntimer);
+    wheel = nc_alloc(sizeof(*wheel));
+    if (rbnodes == NULL || wnodes == NULL || wheel == NULL) {
+        printf("FAIL could not allocate %d timers\n", ntimer);
+        failures++;
+        return;
+    }
+
+    rbtree_init(&tree, &sentinel);
+    start = nc_usec_now();
+    for (i = 0; i < ntimer; i++) {
+        rbtree_node_init(&rbnodes[i]);
+        rbnodes[i].key = now + (i % 5000);
+        rbtree_insert(&tree, &rbnodes[i]);
+    }
+    for (i = 0; i < ntimer; i++) {
+        rbtree_delete(&tree, &rbnodes[i]);
+    }
+    rbtree_usec = nc_usec_now() - start;
+
+    wheel_init(wheel, now);
+    start = nc_usec_now();
+    for (i = 0; i < ntimer; i++) {
+        wheel_node_init(&wnodes[i]);
+        wnodes[i].key = now + (i % 5000);
+        wheel_insert(wheel, &wnodes[i]);
+    }
+    for (i = 0; i < ntimer; i++) {
+        wheel_delete(wheel, &wnodes[i]);
+    }
+    wheel_usec = nc_usec_now() - start;
+
+    printf("timers: %d insert+delete rbtree %"PRId64" usec wheel %"PRId64" usec\n",
+           ntimer, rbtree_usec, wheel_usec);
+
+    for (i = 0; i < ntimer; i++) {
+        wnodes[i].key = now + (i % 5000);
+        wheel_insert(wheel, &wnodes[i]);
+    }
+    nexpired = 0;
+    start = nc_usec_now();
+    for (;;) {
+        struct wheel_node *node = wheel_expire(wheel, now + 5000);
+        if (node == NULL) {
+            break;
+        }
+        wheel_delete(wheel, node);
+        nexpired++;
+    }
+    wheel_usec = nc_usec_now() - start;
+    expect_same_int(ntimer, nexpired, "should expire all timers in the wheel");
+    printf("timers: %d expire wheel %"PRId64" usec\n", ntimer, wheel_usec);
+
+    nc_free(wheel);
+    nc_free(wnodes);
+    nc_free(rbnodes);
+}
+
 static void test_redis_parse_req_success_case(const char* data, int expected_type) {
     const int original_failures = failures;
     struct conn fake_client = {0};
@@ -125,6 +2674,7 @@ static void test_redis_parse_req_success(void) {
     test_redis_parse_req_success_case("*3\r\n$6\r\nexpire\r\n$3\r\nfoo\r\n$1\r\n0\r\n", MSG_REQ_REDIS_EXPIRE);
     test_redis_parse_req_success_case("*3\r\n$8\r\nexpireat\r\n$3\r\nfoo\r\n$10\r\n1282463464\r\n", MSG_REQ_REDIS_EXPIREAT);
     test_redis_parse_req_success_case("*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n", MSG_REQ_REDIS_GET);
+    test_redis_parse_req_success_case("*2\r\n$3\r\ngEt\r\n$3\r\nkey\r\n", MSG_REQ_REDIS_GET);
     test_redis_parse_req_success_case("*3\r\n$6\r\ngetbit\r\n$3\r\nfoo\r\n$1\r\n1\r\n", MSG_REQ_REDIS_GETBIT);
     test_redis_parse_req_success_case("*4\r\n$8\r\ngetrange\r\n$3\r\nfoo\r\n$1\r\n1\r\n$1\r\n2\r\n", MSG_REQ_REDIS_GETRANGE);
     test_redis_parse_req_success_case("*3\r\n$6\r\ngetset\r\n$3\r\nfoo\r\n$3\r\nbar\r\n", MSG_REQ_REDIS_GETSET);
@@ -229,6 +2779,98 @@ static void test_redis_parse_req_success(void) {
     test_redis_parse_req_success_case("*5\r\n$11\r\nzunionstore\r\n$7\r\n{zfoo}3\r\n$1\r\n2\r\n$6\r\n{zfoo}\r\n$7\r\n{zfoo}2\r\n", MSG_REQ_REDIS_ZUNIONSTORE);
 }
 
+static void test_redis_parse_req_failure_case(const char* data) {
+    int original_failures = failures;
+    struct conn fake_client = {0};
+    struct mbuf *m = mbuf_get();
+    const int SW_START = 0;  /* Same as SW_START in redis_parse_req */
+
+    struct msg *req = msg_get(&fake_client, 1, 1);
+    req->state = SW_START;
+    req->token = NULL;
+    const size_t datalen = strlen(data);
+
+    /* Copy data into the message */
+    mbuf_copy(m, (const uint8_t*)data, datalen);
+    /* Insert a single buffer into the message mbuf header */
+    STAILQ_INIT(&req->mhdr);
+    ASSERT(STAILQ_EMPTY(&req->mhdr));
+    mbuf_insert(&req->mhdr, m);
+    req->pos = m->start;
+    errno = 0;
+
+    redis_parse_req(req);
+    expect_same_int(MSG_PARSE_ERROR, req->result, "redis_parse_req: expected MSG_PARSE_ERROR");
+    expect_same_int(EINVAL, errno, "redis_parse_req: expected errno=EINVAL");
+
+    msg_put(req);
+    /* mbuf_put(m); */
+    if (failures > original_failures) {
+        fprintf(stderr, "test_redis_parse_req_failure_case failed for (%s)", data);
+    }
+}
+
+static void test_redis_parse_req_failure(void) {
+    /* unknown commands, including near misses of known ones */
+    test_redis_parse_req_failure_case("*2\r\n$2\r\nge\r\n$3\r\nfoo\r\n");
+    test_redis_parse_req_failure_case("*2\r\n$4\r\ngett\r\n$3\r\nfoo\r\n");
+    test_redis_parse_req_failure_case("*2\r\n$3\r\ng3t\r\n$3\r\nfoo\r\n");
+    test_redis_parse_req_failure_case("*2\r\n$17\r\ngeoradiusbymembex\r\n$3\r\nfoo\r\n");
+    test_redis_parse_req_failure_case("*2\r\n$18\r\ngeoradiusbymembers\r\n$3\r\nfoo\r\n");
+    test_redis_parse_req_failure_case("*2\r\n$30\r\nzrevrangebyscorezrevrangebysco\r\n$3\r\nfoo\r\n");
+}
+
+/*
+ * Measure redis_parse_req() throughput for commands from both ends of the
+ * command table.
+ */
+static void bench_redis_parse_req(void) {
+    static const struct {
+        const char *name;
+        const char *data;
+    } reqs[] = {
+        { "get", "*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n" },
+        { "set", "*3\r\n$3\r\nset\r\n$3\r\nfoo\r\n$3\r\nbar\r\n" },
+        { "MGET", "*3\r\n$4\r\nMGET\r\n$3\r\nfoo\r\n$3\r\nbar\r\n" },
+        { "type", "*2\r\n$4\r\ntype\r\n$3\r\nfoo\r\n" },
+        { "sismember", "*3\r\n$9\r\nsismember\r\n$3\r\nfoo\r\n$3\r\nbar\r\n" },
+        { "hincrbyfloat", "*4\r\n$12\r\nhincrbyfloat\r\n$3\r\nfoo\r\n$3\r\nbar\r\n$1\r\n1\r\n" },
+        { "zrevrangebyscore", "*4\r\n$16\r\nzrevrangebyscore\r\n$3\r\nfoo\r\n$1\r\n1\r\n$1\r\n0\r\n" },
+        { "georadiusbymember", "*5\r\n$17\r\ngeoradiusbymember\r\n$3\r\nfoo\r\n$3\r\nbar\r\n$1\r\n1\r\n$2\r\nkm\r\n" },
+    };
+    const int niter = 200000;
+    struct conn fake_client = {0};
+    int64_t start, usec;
+    size_t i;
+    int j;
+
+    for (i = 0; i < NELEMS(reqs); i++) {
+        const size_t datalen = strlen(reqs[i].data);
+        int nparsed = 0;
+
+        start = nc_usec_now();
+        for (j = 0; j < niter; j++) {
+            struct mbuf *m = mbuf_get();
+            struct msg *req = msg_get(&fake_client, 1, 1);
+
+            mbuf_copy(m, (const uint8_t *)reqs[i].data, datalen);
+            mbuf_insert(&req->mhdr, m);
+            req->pos = m->start;
+
+            redis_parse_req(req);
+            if (req->result == MSG_PARSE_OK) {
+                nparsed++;
+            }
+            msg_put(req);
+        }
+        usec = nc_usec_now() - start;
+
+        expect_same_int(niter, nparsed, "redis_parse_req: expected benchmark request to be parsed");
+        printf("redis_parse_req: %-17s %4"PRId64" nsec/req\n", reqs[i].name,
+               usec * 1000 / niter);
+    }
+}
+
 static void test_redis_parse_rsp_success_case(const char* data, int expected) {
     int original_failures = failures;
     struct conn fake_client = {0};
@@ -299,6 +2941,51 @@ static void test_redis_parse_rsp_success(void) {
             "*2\r\n"
             "+Foo\r\n"
             "-Bar\r\n", MSG_RSP_REDIS_MULTIBULK);  /* array of 2 arrays */
+    /* lines long enough to be scanned in several chunks */
+    test_redis_parse_rsp_success_case("+OK, this status line is a good deal longer than a few machine words\r\n",
+            MSG_RSP_REDIS_STATUS);
+    test_redis_parse_rsp_success_case("-ERR this error line is a good deal longer than a few machine words\r\n",
+            MSG_RSP_REDIS_ERROR_ERR);
+    /* redis cluster redirects */
+    test_redis_parse_rsp_success_case("-MOVED 3999 127.0.0.1:6381\r\n", MSG_RSP_REDIS_ERROR_MOVED);
+    test_redis_parse_rsp_success_case("-ASK 3999 127.0.0.1:6381\r\n", MSG_RSP_REDIS_ERROR_ASK);
+    /* reply to CLUSTER SLOTS */
+    test_redis_parse_rsp_success_case("*1\r\n"
+            "*4\r\n"
+            ":0\r\n"
+            ":5460\r\n"
+            "*3\r\n$9\r\n127.0.0.1\r\n:30001\r\n$4\r\nabcd\r\n"
+            "*3\r\n$9\r\n127.0.0.1\r\n:30004\r\n$4\r\nefgh\r\n", MSG_RSP_REDIS_MULTIBULK);
+}
+
+/* A line that is not complete yet is resumed where the last parse stopped */
+static void test_redis_parse_rsp_partial(void) {
+    const char *head = "+OK, this status line arrives in two parts ";
+    const char *tail = "and is only ended by the second one\r\n";
+    struct conn fake_client = {0};
+    struct mbuf *m = mbuf_get();
+    const int SW_START = 0;  /* Same as SW_START in redis_parse_rsp */
+
+    struct msg *rsp = msg_get(&fake_client, 0, 1);
+    rsp->state = SW_START;
+    rsp->token = NULL;
+
+    mbuf_copy(m, (const uint8_t*)head, strlen(head));
+    STAILQ_INIT(&rsp->mhdr);
+    mbuf_insert(&rsp->mhdr, m);
+    rsp->pos = m->start;
+
+    redis_parse_rsp(rsp);
+    expect_same_int(MSG_PARSE_AGAIN, rsp->result, "redis_parse_rsp: expected MSG_PARSE_AGAIN for partial line");
+    expect_same_ptr(m->last, rsp->pos, "redis_parse_rsp: expected rsp->pos to be m->last for partial line");
+
+    mbuf_copy(m, (const uint8_t*)tail, strlen(tail));
+    redis_parse_rsp(rsp);
+    expect_same_int(MSG_PARSE_OK, rsp->result, "redis_parse_rsp: expected MSG_PARSE_OK once line is complete");
+    expect_same_ptr(m->last, rsp->pos, "redis_parse_rsp: expected rsp->pos to be m->last once line is complete");
+    expect_same_int(MSG_RSP_REDIS_STATUS, rsp->type, "redis_parse_rsp: expected status reply");
+
+    msg_put(rsp);
 }
 
 static void test_redis_parse_rsp_failure_case(const char* data) {
@@ -404,6 +3091,8 @@ static void test_memcache_parse_rsp_success(void) {
     test_memcache_parse_rsp_success_case("VALUE key 0 2\r\nab\r\nEND\r\n", MSG_RSP_MC_END);
     test_memcache_parse_rsp_success_case("VALUE key 0 2\r\nab\r\nVALUE key2 0 2\r\ncd\r\nEND\r\n", MSG_RSP_MC_END);
     test_memcache_parse_rsp_success_case("VERSION 1.5.22\r\n", MSG_RSP_MC_VERSION);
+    test_memcache_parse_rsp_success_case("SERVER_ERROR out of memory storing object of a fairly long name\r\n",
+            MSG_RSP_MC_SERVER_ERROR);
 }
 
 static void test_memcache_parse_rsp_failure_case(const char* data) {
@@ -585,20 +3274,65 @@ int main(int argc, char **argv) {
     nci.mbuf_chunk_size = MBUF_SIZE;
     mbuf_init(&nci);
     msg_init();
+    conn_init();
     log_init(7, NULL);
+    redis_init();
+
+    if (argc == 2 && getenv(UPGRADE_ENV) != NULL) {
+        return test_upgrade_child(argv[1]);
+    }
 
     test_hash_algorithms();
+    test_redis_cluster_slots();
+    test_jump_distribution();
+    test_maglev_distribution();
+    test_ketama_update();
+    test_ketama_load_bound();
+    test_replica_read();
+    test_replica_hedge();
+    test_rendezvous_distribution();
+    test_stats_histogram();
+    test_stats_family();
+    test_hotkey();
+    test_near_cache();
+    test_mbuf_share();
+    test_batch();
     test_config_parsing();
+    test_config_replicas();
+    test_config_mirror();
+    test_config_shared();
+    test_coalesce();
+    test_batch_forward();
+    test_mirror();
+    test_redis_cluster_redirect();
+    test_event_recv();
+    test_upgrade(argv[0]);
+    test_stats_http();
+    test_stats_mean();
+    test_stats_prometheus();
+    test_timer_wheel();
     test_redis_parse_rsp_success();
+    test_redis_parse_rsp_partial();
     test_redis_parse_req_success();
+    test_redis_parse_req_failure();
     test_memcache_parse_rsp_success();
     test_memcache_parse_req_success();
     printf("Starting tests of request/response parsing failures\n");
     test_memcache_parse_rsp_failure();
     test_memcache_parse_req_failure();
     test_redis_parse_rsp_failure();
+    if (getenv(BENCH_ENV) != NULL) {
+        printf("Starting benchmarks\n");
+        bench_hash_algorithms();
+        bench_ketama_update();
+        bench_dispatch();
+        bench_hotkey();
+        bench_timer_wheel();
+        bench_redis_parse_req();
+    }
     printf("%d successes, %d failures\n", successes, failures);
 
+    conn_deinit();
     msg_deinit();
     mbuf_deinit();
     log_deinit();
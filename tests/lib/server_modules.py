@@ -367,7 +367,7 @@ $cluster_name:
         self._run(cmd)
 
     def reload(self):
-        self.signal('USR1')
+        self.signal('HUP')
 
     def set_config(self, content):
         fout = open(TT('$path/conf/nutcracker.conf', self.args), 'w+')
@@ -18,14 +18,15 @@ from server_modules import *
 from utils import *
 from nose import with_setup
 
-# Reload support with SIGUSR1 was at one planned to be added in 0.4.2 of twitter/twemproxy but has not actually been added.
-VERSION_SUPPORTING_RELOAD = '99.99.99'
+# Reload of the configuration on SIGHUP was added in 0.5.0
+VERSION_SUPPORTING_RELOAD = '0.5.0'
 CLUSTER_NAME = 'ntest'
 nc_verbose = int(getenv('T_VERBOSE', 5))
 mbuf = int(getenv('T_MBUF', 512))
 large = int(getenv('T_LARGE', 1000))
 
-T_RELOAD_DELAY = 3 + 1
+T_RELOAD_DELAY = 1
+T_STATS_DELAY = 1 + 1
 
 all_redis = [
         RedisServer('127.0.0.1', 2100, '/tmp/r/redis-2100/', CLUSTER_NAME, 'redis-2100'),
@@ -64,39 +65,26 @@ def test_reload_with_old_conf():
         print('Ignore test_reload for version %s' % nc.version())
         return
     pid = nc.pid()
-    # print 'old pid:', pid
     r = redis.Redis(nc.host(), nc.port())
     r.set('k', 'v')
 
     conn = get_tcp_conn(nc.host(), nc.port())
-    send_cmd(conn, '*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', '$1\r\nv\r\n')
+    send_cmd(conn, b'*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', b'$1\r\nv\r\n')
 
-    # nc.reload() is same as nc.stop() and nc.start()
+    # the configuration is reloaded in place
     nc.reload()
-    time.sleep(.01)  #it need time for the old process fork new process.
-
-    # the old connection is still ok in T_RELOAD_DELAY seconds
-    send_cmd(conn, '*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', '$1\r\nv\r\n')
-
-    # conn2 should connect to new instance
-    conn2 = get_tcp_conn(nc.host(), nc.port())
-    send_cmd(conn2, '*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', '$1\r\nv\r\n')
-
-    # the old connection is still ok in T_RELOAD_DELAY seconds
-    send_cmd(conn, '*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', '$1\r\nv\r\n')
-
     time.sleep(T_RELOAD_DELAY)
-    assert(pid != nc.pid())
+    assert(pid == nc.pid())
 
-    # assert the old connection is closed.
-    send_cmd(conn, '*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', '')
+    # the old connection survives the reload
+    send_cmd(conn, b'*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', b'$1\r\nv\r\n')
 
-    # conn2 should survive
-    send_cmd(conn2, '*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', '$1\r\nv\r\n')
+    conn2 = get_tcp_conn(nc.host(), nc.port())
+    send_cmd(conn2, b'*2\r\n$3\r\nGET\r\n$1\r\nk\r\n', b'$1\r\nv\r\n')
 
     r = redis.Redis(nc.host(), nc.port())
     rst = r.set('k', 'v')
-    assert(r.get('k') == 'v')
+    assert(r.get('k') == b'v')
 
 @with_setup(_setup, _teardown)
 def test_new_port():
@@ -125,7 +113,7 @@ reload_test:
     r2 = redis.Redis(nc.host(), 4101)
 
     assert_fail('Connection refused', r1.get, 'k')
-    assert(r2.get('k') == 'v')
+    assert(r2.get('k') == b'v')
 
 @with_setup(_setup, _teardown)
 def test_pool_add_del():
@@ -162,8 +150,8 @@ reload_test2:
     r1 = redis.Redis(nc.host(), nc.port())
     r2 = redis.Redis(nc.host(), 4101)
 
-    assert(r1.get('k') == 'v')
-    assert(r2.get('k') == 'v')
+    assert(r1.get('k') == b'v')
+    assert(r2.get('k') == b'v')
 
     content = '''
 reload_test:
@@ -185,10 +173,63 @@ reload_test:
 
     assert_fail('Connection refused', r1.get, 'k')
     assert_fail('Connection refused', r2.get, 'k')
-    assert(r3.get('k') == 'v')
+    assert(r3.get('k') == b'v')
 
     fds = system('ls -l /proc/%s/fd/' % pid)
     sockets = [s for s in fds.split('\n') if strstr(s, 'socket:') ]
     # pool + stat + 2 backend + 1 client
     assert(len(sockets) == 5)
 
+@with_setup(_setup, _teardown)
+def test_server_add_del():
+    if nc.version() < VERSION_SUPPORTING_RELOAD:
+        print('Ignore test_reload for version %s' % nc.version())
+        return
+    pid = nc.pid()
+
+    content = '''
+%s:
+  listen: 0.0.0.0:4100
+  hash: fnv1a_64
+  distribution: modula
+  redis: true
+  preconnect: true
+  servers:
+''' % CLUSTER_NAME
+
+    # the pool keeps its name, listen address and protocol across reloads
+    nc.set_config(content + '    - 127.0.0.1:2100:1 redis-2100\n')
+    time.sleep(T_RELOAD_DELAY)
+
+    r = redis.Redis(nc.host(), nc.port())
+    for i in range(10):
+        r.set('k%d' % i, 'v')
+    time.sleep(T_STATS_DELAY)
+
+    info = nc._info_dict()
+    assert(info[CLUSTER_NAME]['redis-2100']['requests'] >= 10)
+    assert('redis-2101' not in info[CLUSTER_NAME])
+
+    # an added server has stats of its own, and the survivor keeps its own
+    nc.set_config(content + '    - 127.0.0.1:2100:1 redis-2100\n'
+                          '    - 127.0.0.1:2101:1 redis-2101\n')
+    time.sleep(T_RELOAD_DELAY)
+    for i in range(10):
+        assert(r.get('k%d' % i) in (b'v', None))
+    time.sleep(T_STATS_DELAY)
+
+    info = nc._info_dict()
+    assert(info[CLUSTER_NAME]['redis-2100']['requests'] >= 10)
+    assert(info[CLUSTER_NAME]['redis-2101']['requests'] > 0)
+    assert(info[CLUSTER_NAME]['redis-2101']['server_connections'] == 1)
+
+    # a removed server loses its stats, and its connection is closed
+    nc.set_config(content + '    - 127.0.0.1:2101:1 redis-2101\n')
+    time.sleep(T_RELOAD_DELAY)
+    assert(r.get('k0') in (b'v', None))
+    time.sleep(T_STATS_DELAY)
+
+    info = nc._info_dict()
+    assert('redis-2100' not in info[CLUSTER_NAME])
+    assert(info[CLUSTER_NAME]['redis-2101']['server_connections'] == 1)
+    assert(pid == nc.pid())